@@ -11,6 +11,7 @@
 #include <errno.h>      // Para perror (diagnóstico de erros)
 
 #define BUFFER_SIZE 4096 // Tamanho do buffer para ler respostas e dados
+#define PROGRESS_STEP (1024 * 1024) // Atualiza o progresso a cada MiB, não a cada recv
 
 // Função para enviar um comando e opcionalmente receber uma resposta
 // Retorna o código de resposta do servidor FTP ou -1 em erro de socket
@@ -223,13 +224,17 @@ int main(int argc, char *argv[]) {
     char file_buffer[BUFFER_SIZE];
     int bytes_read_data;
     long total_bytes_received = 0;
+    long next_progress = PROGRESS_STEP;
     while ((bytes_read_data = recv(data_sockfd, file_buffer, BUFFER_SIZE, 0)) > 0) {
         fwrite(file_buffer, 1, bytes_read_data, output_file);
         total_bytes_received += bytes_read_data;
-        printf("\rRecebidos: %ld bytes", total_bytes_received);
-        fflush(stdout);
+        if (total_bytes_received >= next_progress) { // printf + fflush em cada recv custava mais que o recv
+            printf("\rRecebidos: %ld bytes", total_bytes_received);
+            fflush(stdout);
+            next_progress = total_bytes_received + PROGRESS_STEP;
+        }
     }
-    printf("\n");
+    printf("\rRecebidos: %ld bytes\n", total_bytes_received);
 
     if (bytes_read_data < 0) {
         perror("Erro ao receber dados do arquivo");
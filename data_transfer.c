@@ -0,0 +1,757 @@
+#define _GNU_SOURCE     // For splice, F_SETPIPE_SZ, O_DIRECT, fallocate, sync_file_range
+#include "data_transfer.h"
+#include "ftp_utils.h"
+#include "transfer_uring.h"
+#include "transfer_rate.h"
+#include "ftp_tls.h"
+#include "ftp_log.h"
+#include "ftp_progress.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h> // For TCP_INFO
+#include <zlib.h>        // For --gunzip
+
+static int stdout_fd = STDOUT_FILENO; // Payload stdout once transfer_redirect_stdout() ran
+
+double monotonic_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double transfer_socket_rtt(int sockfd) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(sockfd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0 || info.tcpi_rtt == 0) {
+        return 0;
+    }
+    return info.tcpi_rtt / 1e6; // Microseconds
+}
+
+// Adaptive receive sizing state (TransferOptions.adaptive)
+typedef struct {
+    int enabled;
+    int data_sockfd;
+    double rtt;
+    int rcvbuf;              // Value last passed to SO_RCVBUF
+    size_t chunk;            // Current read size
+    int growing;             // Cleared once a growth step stops paying off
+    double interval;         // Seconds between throughput samples
+    double sample_start;
+    long long sample_bytes;
+    double last_rate;        // Bytes/s of the previous sample
+} Tuner;
+
+static size_t clamp_size(double value, size_t lo, size_t hi) {
+    if (value < lo) return lo;
+    if (value > hi) return hi;
+    return (size_t) value;
+}
+
+static void tuner_apply(Tuner* t) {
+    if (setsockopt(t->data_sockfd, SOL_SOCKET, SO_RCVBUF, &t->rcvbuf, sizeof(t->rcvbuf)) < 0) {
+        ftp_log_perror("setsockopt SO_RCVBUF");
+    }
+    // Reads of about a quarter of the window keep syscalls few without starving the window
+    t->chunk = clamp_size(t->rcvbuf / 4.0, TRANSFER_TUNE_MIN_CHUNK, TRANSFER_TUNE_MAX_CHUNK);
+}
+
+static void tuner_init(Tuner* t, int data_sockfd, const TransferOptions* opts) {
+    memset(t, 0, sizeof(*t));
+    if (!opts || !opts->adaptive) return;
+    t->enabled = 1;
+    t->data_sockfd = data_sockfd;
+    t->rtt = opts->rtt > 0 ? opts->rtt : transfer_socket_rtt(data_sockfd);
+    t->rcvbuf = (int) clamp_size(2 * t->rtt * TRANSFER_TUNE_START_RATE, TRANSFER_TUNE_MIN_RCVBUF,
+                                 TRANSFER_TUNE_MAX_RCVBUF);
+    t->growing = 1;
+    t->interval = 4 * t->rtt > TRANSFER_TUNE_MIN_INTERVAL ? 4 * t->rtt : TRANSFER_TUNE_MIN_INTERVAL;
+    t->sample_start = monotonic_seconds();
+    tuner_apply(t);
+    ftp_log("Tuning: RTT %.3f ms, initial SO_RCVBUF %d, read size %zu.\n", t->rtt * 1000, t->rcvbuf, t->chunk);
+}
+
+// Counts received bytes; at the end of each sample interval doubles the buffer if
+// throughput went up since the last sample, and stops growing once it does not.
+static void tuner_update(Tuner* t, long long bytes) {
+    if (!t->enabled || !t->growing) return;
+    t->sample_bytes += bytes;
+    double now = monotonic_seconds();
+    double elapsed = now - t->sample_start;
+    if (elapsed < t->interval) return;
+
+    double rate = t->sample_bytes / elapsed;
+    if (t->last_rate > 0 && rate < t->last_rate * 1.05) {
+        t->growing = 0; // Plateau: a bigger window no longer helps
+    } else if (t->rcvbuf < TRANSFER_TUNE_MAX_RCVBUF) {
+        t->rcvbuf = (int) clamp_size(t->rcvbuf * 2.0, TRANSFER_TUNE_MIN_RCVBUF, TRANSFER_TUNE_MAX_RCVBUF);
+        tuner_apply(t);
+    } else {
+        t->growing = 0;
+    }
+    t->last_rate = rate;
+    t->sample_start = now;
+    t->sample_bytes = 0;
+}
+
+// `untuned_reads`: the loop did not read in the tuner's chunk (splice, io_uring)
+static void tuner_report(const Tuner* t, TransferStats* stats, int untuned_reads) {
+    if (!t->enabled) return;
+    int actual = 0;
+    socklen_t len = sizeof(actual);
+    if (getsockopt(t->data_sockfd, SOL_SOCKET, SO_RCVBUF, &actual, &len) < 0) actual = t->rcvbuf;
+    stats->rtt = t->rtt;
+    stats->rcvbuf = actual;
+    stats->read_size = untuned_reads ? 0 : t->chunk;
+}
+
+// Stall watchdog and control keepalive (TransferOptions.stall_timeout / keepalive)
+typedef struct {
+    int enabled;
+    double stall_timeout;
+    long long min_rate;
+    double keepalive;
+    FtpConn* control;
+    double last_byte;        // When payload last arrived
+    double window_start;     // Start of the current min_rate window
+    long long window_bytes;
+    double last_noop;
+    int keepalives;
+    int stalled;
+} Watchdog;
+
+static void watchdog_init(Watchdog* w, int data_sockfd, const TransferOptions* opts) {
+    memset(w, 0, sizeof(*w));
+    if (!opts || (opts->stall_timeout <= 0 && opts->keepalive <= 0)) return;
+    w->enabled = 1;
+    w->stall_timeout = opts->stall_timeout;
+    w->min_rate = opts->min_rate;
+    w->keepalive = opts->control ? opts->keepalive : 0;
+    w->control = opts->control;
+    w->last_byte = w->window_start = w->last_noop = monotonic_seconds();
+
+    // A blocked receive wakes up at least this often to look at the clocks
+    double tick = w->stall_timeout > 0 ? w->stall_timeout : w->keepalive;
+    if (w->keepalive > 0 && w->keepalive < tick) tick = w->keepalive;
+    if (tick < TRANSFER_WATCH_MIN_TICK) tick = TRANSFER_WATCH_MIN_TICK;
+    struct timeval tv;
+    tv.tv_sec = (time_t) tick;
+    tv.tv_usec = (suseconds_t) ((tick - tv.tv_sec) * 1e6);
+    if (setsockopt(data_sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+        ftp_log_perror("setsockopt SO_RCVTIMEO");
+    }
+}
+
+// Called with every received chunk, and with 0 when a receive timed out. Sends
+// a NOOP when one is due. Returns 0 to go on, -1 (errno ETIMEDOUT) if the
+// transfer stalled.
+static int watchdog_update(Watchdog* w, long long bytes) {
+    if (!w->enabled) return bytes > 0 ? 0 : -1;
+    double now = monotonic_seconds();
+    if (bytes > 0) {
+        w->last_byte = now;
+        w->window_bytes += bytes;
+    }
+    if (w->keepalive > 0 && now - w->last_noop >= w->keepalive) {
+        // The reply is read after the transfer (see ftp_retrieve_file)
+        if (send_ftp_command(w->control, "NOOP", NULL) == 0) w->keepalives++;
+        w->last_noop = now;
+    }
+    if (w->stall_timeout <= 0) return 0;
+    if (now - w->last_byte >= w->stall_timeout) {
+        ftp_log_error("Stalled: no data for %.1f s.\n", now - w->last_byte);
+        w->stalled = 1;
+    } else if (now - w->window_start >= w->stall_timeout) {
+        double rate = w->window_bytes / (now - w->window_start);
+        if (w->min_rate > 0 && rate < w->min_rate) {
+            ftp_log_error("Stalled: %.0f bytes/s over the last %.1f s, below the minimum of %lld.\n", rate,
+                          now - w->window_start, w->min_rate);
+            w->stalled = 1;
+        }
+        w->window_start = now;
+        w->window_bytes = 0;
+    }
+    if (w->stalled) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return 0;
+}
+
+// Writes the whole buffer, at *offset if offset is non-NULL (advancing it).
+static int write_all(int out_fd, const char* buf, size_t len, long long* offset) {
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = offset ? pwrite(out_fd, buf + written, len - written, *offset)
+                           : write(out_fd, buf + written, len - written);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            ftp_log_perror("write to local file");
+            return -1;
+        }
+        written += n;
+        if (offset) *offset += n;
+    }
+    return 0;
+}
+
+// Hands received payload to opts->sink if there is one, else writes it like write_all().
+static int write_output(const TransferOptions* opts, int out_fd, const char* buf, size_t len, long long* offset) {
+    if (opts && opts->sink) return opts->sink(opts->sink_ctx, buf, len);
+    return write_all(out_fd, buf, len, offset);
+}
+
+// Plain read/write loop. Returns 0 on success, -1 on failure.
+static int copy_read_write(int data_sockfd, FtpDataTls* tls, int out_fd, long long* offset, long long length,
+                           size_t buf_size, long long* total, double* first_byte_at, Tuner* tuner,
+                           TransferHash* hash, TransferFlow* flow, Watchdog* watch, const TransferOptions* opts) {
+    if (tuner->enabled && buf_size < TRANSFER_TUNE_MAX_CHUNK) {
+        buf_size = TRANSFER_TUNE_MAX_CHUNK; // Room for the chunk to grow into
+    }
+    char* buffer = malloc(buf_size);
+    ssize_t bytes_received = 0;
+
+    if (!buffer) {
+        ftp_log_perror("malloc transfer buffer");
+        return -1;
+    }
+    while (length < 0 || *total < length) {
+        size_t want = tuner->enabled ? tuner->chunk : buf_size;
+        if (length >= 0 && (long long)want > length - *total) {
+            want = (size_t)(length - *total);
+        }
+        want = transfer_rate_acquire(flow, want);
+        bytes_received = ftp_tls_recv(tls, data_sockfd, buffer, want);
+        transfer_rate_charge(flow, want, bytes_received > 0 ? (size_t) bytes_received : 0);
+        if (bytes_received < 0 && errno == EINTR) continue;
+        if (bytes_received < 0 && errno == EAGAIN && watchdog_update(watch, 0) == 0) continue;
+        if (bytes_received <= 0) break;
+        if (*first_byte_at == 0) *first_byte_at = monotonic_seconds();
+        transfer_hash_update(hash, buffer, bytes_received);
+        if (write_output(opts, out_fd, buffer, bytes_received, offset) < 0) {
+            free(buffer);
+            return -1;
+        }
+        *total += bytes_received;
+        ftp_progress_add(bytes_received);
+        tuner_update(tuner, bytes_received);
+        if (watchdog_update(watch, bytes_received) < 0) {
+            bytes_received = -1;
+            break;
+        }
+    }
+    free(buffer);
+    if (bytes_received < 0) {
+        ftp_log_perror("read from data socket");
+        return -1;
+    }
+    return 0;
+}
+
+int transfer_redirect_stdout(void) {
+    int fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+    if (fd < 0) {
+        ftp_log_perror("dup stdout");
+        return -1;
+    }
+    fflush(stdout);
+    if (dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+        ftp_log_perror("dup2 stderr to stdout");
+        close(fd);
+        return -1;
+    }
+    stdout_fd = fd;
+    return 0;
+}
+
+static int open_output(const char* path, int flags, long long expected_size, const TransferOptions* opts) {
+    int fd = -1;
+
+    if (strcmp(path, TRANSFER_STDOUT_NAME) == 0) {
+        fd = dup(stdout_fd);
+        if (fd < 0) ftp_log_perror("dup stdout");
+        return fd;
+    }
+
+    if (opts && opts->block_writer && opts->direct_io) {
+        fd = open(path, flags | O_DIRECT, 0644);
+        if (fd < 0 && errno == EINVAL) {
+            ftp_log_error("O_DIRECT not supported for '%s', writing through the page cache.\n", path);
+        }
+    }
+    if (fd < 0) fd = open(path, flags, 0644);
+    if (fd < 0) {
+        ftp_log_perror("open local file for writing");
+        return -1;
+    }
+    if (opts && opts->block_writer && expected_size > 0) {
+        // KEEP_SIZE: blocks are reserved in one extent, but the file only grows as
+        // data lands, so a failed download still looks partial to --continue
+        if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, expected_size) < 0 && errno != EOPNOTSUPP) {
+            ftp_log_perror("fallocate local file");
+        }
+    }
+    return fd;
+}
+
+int transfer_open_output(const char* path, long long expected_size, const TransferOptions* opts) {
+    return open_output(path, O_WRONLY | O_CREAT | O_TRUNC, expected_size, opts);
+}
+
+int transfer_open_existing(const char* path, long long expected_size, const TransferOptions* opts) {
+    return open_output(path, O_WRONLY | O_CREAT, expected_size, opts);
+}
+
+static double thread_cpu_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Inflate loop: gzip (concatenated members, trailing zero padding) or, with `zlib`, one zlib
+// stream (MODE Z). A gzip file is hashed as it crosses the wire, since that is
+// what the server digests; a MODE Z transfer is hashed after inflating. Returns 0
+// on success, -1 on failure, including a payload that ends in the middle of a stream.
+static int copy_inflate(int data_sockfd, FtpDataTls* tls, int out_fd, long long* offset, long long length, int zlib,
+                        long long* total, long long* out_total, double* cpu, double* first_byte_at,
+                        Tuner* tuner, TransferHash* hash, TransferFlow* flow, Watchdog* watch,
+                        const TransferOptions* opts) {
+    const char* name = zlib ? "MODE Z" : "gunzip";
+    z_stream zs;
+    char* in = malloc(TRANSFER_LARGE_BUF_SIZE);
+    char* out = malloc(TRANSFER_LARGE_BUF_SIZE);
+    int ended = 0; // At a member boundary: more input starts a new member
+    int status = 0;
+    ssize_t n = 0;
+
+    memset(&zs, 0, sizeof(zs));
+    // 16: expect a gzip header; plain MAX_WBITS: a zlib header
+    if (!in || !out || inflateInit2(&zs, zlib ? MAX_WBITS : 16 + MAX_WBITS) != Z_OK) {
+        ftp_log_error("%s: cannot set up zlib.\n", name);
+        free(in);
+        free(out);
+        return -1;
+    }
+    while (status == 0 && (length < 0 || *total < length)) {
+        size_t want = TRANSFER_LARGE_BUF_SIZE;
+        if (length >= 0 && (long long) want > length - *total) want = (size_t) (length - *total);
+        want = transfer_rate_acquire(flow, want);
+        n = ftp_tls_recv(tls, data_sockfd, in, want);
+        transfer_rate_charge(flow, want, n > 0 ? (size_t) n : 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN && watchdog_update(watch, 0) == 0) continue;
+        if (n <= 0) break;
+        if (*first_byte_at == 0) *first_byte_at = monotonic_seconds();
+        *total += n;
+        ftp_progress_add(n);
+        tuner_update(tuner, n);
+        if (watchdog_update(watch, n) < 0) {
+            n = -1;
+            break;
+        }
+        if (!zlib) transfer_hash_update(hash, in, n);
+
+        zs.next_in = (Bytef*) in;
+        zs.avail_in = (uInt) n;
+        do {
+            if (ended) {
+                if (zlib) {
+                    ftp_log_error("MODE Z: data after the end of the compressed stream.\n");
+                    status = -1;
+                    break;
+                }
+                // Zero padding after the last member (tape blocks, some servers) is
+                // not a member, as gzip -d agrees; stay at the boundary until data
+                while (zs.avail_in > 0 && *zs.next_in == 0) {
+                    zs.next_in++;
+                    zs.avail_in--;
+                }
+                if (zs.avail_in == 0) break;
+                inflateReset(&zs);
+                ended = 0;
+            }
+            zs.next_out = (Bytef*) out;
+            zs.avail_out = TRANSFER_LARGE_BUF_SIZE;
+            double cpu_start = thread_cpu_seconds();
+            int ret = inflate(&zs, Z_NO_FLUSH);
+            *cpu += thread_cpu_seconds() - cpu_start;
+            if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                ftp_log_error("%s: %s\n", name, zs.msg ? zs.msg : "corrupt input");
+                status = -1;
+                break;
+            }
+            size_t produced = TRANSFER_LARGE_BUF_SIZE - zs.avail_out;
+            if (zlib) transfer_hash_update(hash, out, produced);
+            if (produced > 0 && write_output(opts, out_fd, out, produced, offset) < 0) {
+                status = -1;
+                break;
+            }
+            *out_total += produced;
+            if (ret == Z_STREAM_END) ended = 1;
+        } while (zs.avail_in > 0 || zs.avail_out == 0);
+    }
+    if (n < 0) {
+        ftp_log_perror("read from data socket");
+        status = -1;
+    } else if (status == 0 && !ended) {
+        ftp_log_error("%s: payload ends in the middle of a compressed stream.\n", name);
+        status = -1;
+    }
+    inflateEnd(&zs);
+    free(in);
+    free(out);
+    return status;
+}
+
+// Moves whatever is left in the pipe to the output with read/write.
+static int drain_pipe(int pipe_rd, int out_fd, long long* offset, size_t pending) {
+    char buffer[FTP_FILE_BUF_SIZE];
+    while (pending > 0) {
+        ssize_t n = read(pipe_rd, buffer, pending < sizeof(buffer) ? pending : sizeof(buffer));
+        if (n <= 0) {
+            ftp_log_perror("read from splice pipe");
+            return -1;
+        }
+        if (write_all(out_fd, buffer, n, offset) < 0) return -1;
+        pending -= n;
+    }
+    return 0;
+}
+
+// splice() loop. Returns 0 on success, 1 if splice is not usable and the caller
+// should continue with read/write, -1 on failure.
+static int copy_splice(int data_sockfd, int out_fd, long long* offset, long long length,
+                       long long* total, double* first_byte_at, Tuner* tuner, TransferFlow* flow,
+                       Watchdog* watch) {
+    int pipefd[2];
+    int status = 0;
+
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
+        ftp_log_perror("pipe2");
+        return 1;
+    }
+    long pipe_size = fcntl(pipefd[1], F_SETPIPE_SZ, TRANSFER_PIPE_SIZE);
+    if (pipe_size <= 0) {
+        pipe_size = fcntl(pipefd[1], F_GETPIPE_SZ);
+    }
+    if (pipe_size <= 0) pipe_size = 64 * 1024;
+
+    while (length < 0 || *total < length) {
+        size_t want = (size_t) pipe_size;
+        if (length >= 0 && (long long)want > length - *total) {
+            want = (size_t)(length - *total);
+        }
+        want = transfer_rate_acquire(flow, want);
+        ssize_t in = splice(data_sockfd, NULL, pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+        transfer_rate_charge(flow, want, in > 0 ? (size_t) in : 0);
+        if (in < 0 && errno == EINTR) continue;
+        if (in < 0 && errno == EAGAIN && watchdog_update(watch, 0) == 0) continue;
+        if (in == 0) break; // Server closed the data connection
+        if (in < 0) {
+            if (errno == EINVAL || errno == ENOSYS) {
+                status = 1; // Socket side not spliceable: nothing is stuck in the pipe
+            } else {
+                ftp_log_perror("splice from data socket");
+                status = -1;
+            }
+            break;
+        }
+        if (*first_byte_at == 0) *first_byte_at = monotonic_seconds();
+
+        size_t pending = (size_t) in;
+        while (pending > 0) {
+            loff_t off = offset ? (loff_t) *offset : 0;
+            ssize_t out = splice(pipefd[0], NULL, out_fd, offset ? &off : NULL, pending, SPLICE_F_MOVE);
+            if (out < 0 && errno == EINTR) continue;
+            if (out <= 0) {
+                if (out < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                    // Output not spliceable (e.g. O_APPEND or a terminal): flush the pipe by hand
+                    status = drain_pipe(pipefd[0], out_fd, offset, pending) < 0 ? -1 : 1;
+                } else {
+                    ftp_log_perror("splice to local file");
+                    status = -1;
+                }
+                break;
+            }
+            pending -= out;
+            if (offset) *offset = off;
+        }
+        *total += in;
+        ftp_progress_add(in);
+        tuner_update(tuner, in);
+        if (status != 0) break;
+        if (watchdog_update(watch, in) < 0) {
+            ftp_log_perror("splice from data socket");
+            status = -1;
+            break;
+        }
+    }
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return status;
+}
+
+// Without O_DIRECT, written blocks are pushed to disk and evicted right behind
+// the transfer, so a bulk download does not push the rest of the machine out of
+// the page cache: writeback of a block starts as soon as it is written ...
+static void start_writeback(int out_fd, long long off, size_t len) {
+    sync_file_range(out_fd, off, len, SYNC_FILE_RANGE_WRITE);
+}
+
+// ... and one block later it is waited for and dropped (DONTNEED skips dirty pages).
+static void drop_cached(int out_fd, long long off, size_t len) {
+    sync_file_range(out_fd, off, len, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(out_fd, off, len, POSIX_FADV_DONTNEED);
+}
+
+// Block writer loop. Returns 0 on success, -1 on failure.
+static int copy_blocks(int data_sockfd, FtpDataTls* tls, int out_fd, long long* offset, long long length,
+                       long long* total, double* first_byte_at, Tuner* tuner, TransferHash* hash,
+                       TransferFlow* flow, Watchdog* watch, int* direct_out) {
+    long long file_off = offset ? *offset : (long long) lseek(out_fd, 0, SEEK_CUR);
+    long long prev_off = 0;
+    size_t prev_len = 0, fill = 0;
+    int flags = fcntl(out_fd, F_GETFL);
+    int direct = flags >= 0 && (flags & O_DIRECT);
+    int status = 0;
+    void* mem;
+
+    if (file_off < 0) file_off = 0;
+    if (direct && file_off % TRANSFER_BLOCK_ALIGN != 0) {
+        // O_DIRECT needs aligned offsets (e.g. REST at an odd byte): use the cache
+        fcntl(out_fd, F_SETFL, flags & ~O_DIRECT);
+        direct = 0;
+    }
+    if (posix_memalign(&mem, TRANSFER_BLOCK_ALIGN, TRANSFER_BLOCK_SIZE) != 0) {
+        ftp_log_error("posix_memalign: cannot allocate the write block.\n");
+        return -1;
+    }
+    char* block = mem;
+    *direct_out = direct;
+
+    for (;;) {
+        int eof = length >= 0 && *total >= length;
+        if (!eof) {
+            size_t want = TRANSFER_BLOCK_SIZE - fill;
+            if (length >= 0 && (long long) want > length - *total) want = (size_t) (length - *total);
+            want = transfer_rate_acquire(flow, want);
+            ssize_t n = ftp_tls_recv(tls, data_sockfd, block + fill, want);
+            transfer_rate_charge(flow, want, n > 0 ? (size_t) n : 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && errno == EAGAIN && watchdog_update(watch, 0) == 0) continue;
+            if (n < 0) {
+                // Write out what did arrive, so a resume can start right after it
+                ftp_log_perror("read from data socket");
+                status = -1;
+                eof = 1;
+            } else if (n == 0) {
+                eof = 1;
+            } else {
+                if (*first_byte_at == 0) *first_byte_at = monotonic_seconds();
+                transfer_hash_update(hash, block + fill, n);
+                fill += n;
+                *total += n;
+                ftp_progress_add(n);
+                tuner_update(tuner, n);
+                if (watchdog_update(watch, n) < 0) {
+                    ftp_log_perror("read from data socket");
+                    status = -1;
+                    eof = 1;
+                }
+            }
+        }
+        if (status < 0 && direct && fill > 0) {
+            // Padding a partial block would truncate whatever follows it in the file
+            *total -= fill;
+            fill = 0;
+        }
+        if (fill == TRANSFER_BLOCK_SIZE || (eof && fill > 0)) {
+            // O_DIRECT lengths must be aligned too: pad the tail and truncate it off below
+            size_t len = direct ? (fill + TRANSFER_BLOCK_ALIGN - 1) / TRANSFER_BLOCK_ALIGN * TRANSFER_BLOCK_ALIGN : fill;
+            long long off = file_off;
+            if (len > fill) memset(block + fill, 0, len - fill);
+            if (write_all(out_fd, block, len, &off) < 0) {
+                status = -1;
+                break;
+            }
+            if (len > fill && ftruncate(out_fd, file_off + fill) < 0) {
+                ftp_log_perror("ftruncate local file");
+                status = -1;
+                break;
+            }
+            if (!direct) {
+                start_writeback(out_fd, file_off, fill);
+                if (prev_len > 0) drop_cached(out_fd, prev_off, prev_len);
+            }
+            prev_off = file_off;
+            prev_len = fill;
+            file_off += fill;
+            fill = 0;
+        }
+        if (eof) break;
+    }
+    if (status == 0 && !direct && prev_len > 0) drop_cached(out_fd, prev_off, prev_len);
+    if (offset) *offset = file_off;
+    else if (lseek(out_fd, file_off, SEEK_SET) < 0) ftp_log_perror("lseek local file");
+    free(mem);
+    return status;
+}
+
+// What the io_uring loop reports each received buffer to
+typedef struct {
+    Tuner* tuner;
+    TransferHash* hash;
+} UringSink;
+
+static void uring_on_bytes(void* ctx, const char* data, long long bytes) {
+    UringSink* sink = ctx;
+    tuner_update(sink->tuner, bytes);
+    transfer_hash_update(sink->hash, data, bytes);
+}
+
+// io_uring loop. Returns 0 on success, 1 if io_uring cannot be used and the
+// caller should continue with read/write, -1 on failure.
+static int copy_uring(int data_sockfd, int out_fd, long long* offset, long long length,
+                      long long* total, double* first_byte_at, Tuner* tuner, TransferHash* hash) {
+    UringSink sink = {tuner, hash};
+    long long file_off = offset ? *offset : (long long) lseek(out_fd, 0, SEEK_CUR);
+    if (file_off < 0) return 1; // Pipe or terminal: writes need explicit offsets
+    int status = transfer_uring_copy(data_sockfd, out_fd, &file_off, length, total, first_byte_at,
+                                     uring_on_bytes, &sink);
+    if (status == 1) return 1;
+    if (offset) *offset = file_off;
+    else if (lseek(out_fd, file_off, SEEK_SET) < 0) ftp_log_perror("lseek local file");
+    return status;
+}
+
+int transfer_stream(int data_sockfd, int out_fd, long long offset, long long length,
+                    const TransferOptions* opts, TransferStats* stats) {
+    long long total = 0;
+    long long output_total = -1; // Set by loops whose output differs from the input
+    long long* offp = offset >= 0 ? &offset : NULL;
+    const char* method = "read/write";
+    size_t buf_size = (opts && opts->buf_size) ? opts->buf_size : FTP_FILE_BUF_SIZE;
+    double start = monotonic_seconds();
+    double first_byte_at = 0;
+    double inflate_cpu = 0;
+    int status = 1;
+    int spliced = 0;
+    int uring_reads = 0; // Fixed TRANSFER_URING_BUF_SIZE receives, no tuned read chunk
+    Tuner tuner;
+    Watchdog watch;
+    TransferHash hash;
+
+    tuner_init(&tuner, data_sockfd, opts);
+    watchdog_init(&watch, data_sockfd, opts);
+    if (transfer_hash_init(&hash, opts ? opts->hash_alg : TRANSFER_HASH_NONE) < 0) return -1;
+    long long expected = length >= 0 ? length : (opts && opts->size_hint > 0 ? opts->size_hint : -1);
+    TransferFlow* flow = transfer_rate_join(data_sockfd, expected);
+    FtpProgressSlot* progress = ftp_progress_begin(expected);
+    FtpDataTls* data_tls = opts ? opts->data_tls : NULL;
+    int tls = ftp_tls_data_mode(data_tls);
+
+    if (opts && (opts->gunzip || opts->inflate_zlib)) {
+        method = opts->inflate_zlib ? "MODE Z" : "gunzip";
+        output_total = 0;
+        status = copy_inflate(data_sockfd, data_tls, out_fd, offp, length, opts->inflate_zlib, &total, &output_total,
+                              &inflate_cpu, &first_byte_at, &tuner, &hash, flow, &watch, opts);
+    } else if (opts && opts->sink) {
+        method = "callback"; // The bytes must reach user space; no file to splice or write blocks to
+        if (!opts->buf_size) buf_size = TRANSFER_LARGE_BUF_SIZE;
+    } else if (opts && opts->block_writer) {
+        int direct = 0;
+        status = copy_blocks(data_sockfd, data_tls, out_fd, offp, length, &total, &first_byte_at, &tuner, &hash, flow,
+                             &watch, &direct);
+        method = direct ? "block+O_DIRECT" : "block";
+    } else if (opts && opts->use_uring && (flow || tls != FTP_TLS_NONE || watch.enabled)) {
+        // Receives queued ahead cannot wait for rate-cap tokens, skip TLS control records or time out
+        method = "read/write";
+        if (!opts->buf_size) buf_size = TRANSFER_LARGE_BUF_SIZE;
+    } else if (opts && opts->use_uring) {
+        method = "io_uring";
+        status = copy_uring(data_sockfd, out_fd, offp, length, &total, &first_byte_at, &tuner, &hash);
+        uring_reads = (status != 1);
+        if (status == 1) {
+            ftp_log_error("io_uring not usable here, continuing with read/write.\n");
+            method = "io_uring+read/write";
+            if (!opts->buf_size) buf_size = TRANSFER_LARGE_BUF_SIZE;
+        }
+    } else if (opts && opts->use_splice && (hash.alg != TRANSFER_HASH_NONE || tls == FTP_TLS_USER)) {
+        method = "read/write"; // Hashing and user-space TLS need the bytes in user space
+        if (!opts->buf_size) buf_size = TRANSFER_LARGE_BUF_SIZE;
+    } else if (opts && opts->use_splice) {
+        method = "splice";
+        status = copy_splice(data_sockfd, out_fd, offp, length, &total, &first_byte_at, &tuner, flow, &watch);
+        spliced = (status != 1);
+        if (status == 1) {
+            ftp_log_error("splice() not usable here, continuing with read/write.\n");
+            method = "splice+read/write";
+            if (!opts->buf_size) buf_size = TRANSFER_LARGE_BUF_SIZE;
+        }
+    }
+    if (status == 1) {
+        status = copy_read_write(data_sockfd, data_tls, out_fd, offp, length, buf_size, &total, &first_byte_at, &tuner,
+                                 &hash, flow, &watch, opts);
+    }
+    double throttled = 0;
+    transfer_rate_leave(flow, &throttled);
+    ftp_progress_end(progress);
+
+    if (stats) {
+        stats->bytes = total;
+        stats->output_bytes = output_total >= 0 ? output_total : total;
+        stats->finished_at = monotonic_seconds();
+        stats->seconds = stats->finished_at - start;
+        stats->method = method;
+        stats->first_byte_at = first_byte_at;
+        stats->ttfb = -1;
+        stats->rtt = 0;
+        stats->rcvbuf = 0;
+        stats->read_size = 0;
+        tuner_report(&tuner, stats, spliced || uring_reads);
+        stats->throttled = throttled;
+        stats->inflate_cpu = inflate_cpu;
+        stats->tls = tls;
+        stats->stalled = watch.stalled;
+        stats->keepalives = watch.keepalives;
+        stats->retries = 0;
+        stats->hash_alg = TRANSFER_HASH_NONE;
+        stats->digest[0] = '\0';
+        stats->digest_verified = 0;
+        if (status == 0 && hash.alg != TRANSFER_HASH_NONE &&
+            transfer_hash_final(&hash, stats->digest, sizeof(stats->digest)) == 0) {
+            stats->hash_alg = hash.alg;
+        }
+    }
+    transfer_hash_free(&hash);
+    return status;
+}
+
+void transfer_print_stats(const TransferStats* stats) {
+    double mb_per_s = stats->seconds > 0 ? stats->bytes / stats->seconds / 1e6 : 0.0;
+    ftp_log("Downloaded %lld bytes in %.3f s (%.2f MB/s, %s", stats->bytes, stats->seconds, mb_per_s, stats->method);
+    if (stats->output_bytes > 0 && stats->output_bytes != stats->bytes) ftp_log(", %lld bytes written", stats->output_bytes);
+    if (stats->inflate_cpu > 0 && stats->bytes > 0) {
+        ftp_log("; ratio %.2f:1, inflate %.1f ms CPU", (double) stats->output_bytes / stats->bytes,
+               stats->inflate_cpu * 1000);
+    }
+    if (stats->rcvbuf > 0) {
+        ftp_log("; RTT %.3f ms, SO_RCVBUF %d", stats->rtt * 1000, stats->rcvbuf);
+        if (stats->read_size > 0) ftp_log(", read size %zu", stats->read_size);
+    }
+    if (stats->tls != FTP_TLS_NONE) ftp_log("; %s", stats->tls == FTP_TLS_KTLS ? "kTLS" : "TLS in user space");
+    if (stats->throttled > 0.0005) ftp_log("; %.3f s waiting for rate caps", stats->throttled);
+    if (stats->keepalives > 0) ftp_log("; %d keepalive NOOP%s", stats->keepalives, stats->keepalives == 1 ? "" : "s");
+    ftp_log(").\n");
+    if (stats->hash_alg != TRANSFER_HASH_NONE) {
+        ftp_log("%s: %s\n", transfer_hash_name(stats->hash_alg), stats->digest);
+    }
+}
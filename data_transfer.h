@@ -0,0 +1,183 @@
+#ifndef DATA_TRANSFER_H
+#define DATA_TRANSFER_H
+
+#include <stddef.h> // For size_t
+#include "transfer_hash.h"
+
+struct FtpConn;    // ftp_utils.h
+struct FtpDataTls; // ftp_tls.h
+
+#define TRANSFER_LARGE_BUF_SIZE (256 * 1024) // read/write chunk when splice() is unavailable
+#define TRANSFER_PIPE_SIZE (1024 * 1024)     // Requested capacity of the splice() pipe
+#define TRANSFER_STDOUT_NAME "-"             // Output name that streams to stdout (-o -)
+
+// Block writer (--prealloc / --direct)
+#define TRANSFER_BLOCK_SIZE (4 * 1024 * 1024) // Bytes per write; a multiple of TRANSFER_BLOCK_ALIGN
+#define TRANSFER_BLOCK_ALIGN 4096             // Buffer, offset and length alignment O_DIRECT needs
+
+// Adaptive (--tune) receive sizing
+#define TRANSFER_TUNE_START_RATE (12.5e6)           // Assumed bandwidth for the first BDP guess (100 Mbit/s)
+#define TRANSFER_TUNE_MIN_RCVBUF (64 * 1024)
+#define TRANSFER_TUNE_MAX_RCVBUF (32 * 1024 * 1024)
+#define TRANSFER_TUNE_MIN_CHUNK (16 * 1024)
+#define TRANSFER_TUNE_MAX_CHUNK (1024 * 1024)
+#define TRANSFER_TUNE_MIN_INTERVAL 0.05             // Seconds between throughput samples (at least 4 RTTs)
+
+// Stall watchdog (--stall-timeout / --min-rate) and control keepalive (--keepalive)
+#define TRANSFER_STALL_DEFAULT_TIMEOUT 30.0 // Window for --min-rate when no --stall-timeout is given
+#define TRANSFER_WATCH_MIN_TICK 0.1         // Shortest SO_RCVTIMEO used to wake up a blocked receive
+
+/**
+ * Takes payload in place of the output file (TransferOptions.sink).
+ * @return 0 to go on, -1 to fail the transfer.
+ */
+typedef int (*TransferSinkFn)(void* ctx, const void* data, size_t len);
+
+// How the data connection is drained into the local file
+typedef struct {
+    int use_splice;   // Move bytes socket -> pipe -> file with splice(), no user-space copy
+    size_t buf_size;  // Chunk size of the read/write loop (0 = FTP_FILE_BUF_SIZE)
+    int adaptive;     // Size SO_RCVBUF and the read chunk from the RTT, grow them while throughput rises
+    double rtt;       // Round-trip time for `adaptive`, in seconds (filled in by the RETR helpers)
+    int block_writer; // SIZE + fallocate, then TRANSFER_BLOCK_SIZE aligned writes with the cache dropped behind
+    int direct_io;    // With block_writer: write with O_DIRECT instead of through the page cache
+    int use_uring;    // Keep several receives and file writes in flight with io_uring (see transfer_uring.h)
+    int gunzip;       // Inflate a gzip payload on the way to the output (user-space copy; no splice/uring/blocks)
+    TransferHashAlg hash_alg; // Digest the received bytes as they stream (disables splice)
+    int verify_hash;  // ftp_retrieve_file: compare with the server's HASH/XCRC/XMD5 digest, fail on mismatch
+    long long size_hint; // Expected bytes of an open-ended transfer, for rate-cap fair shares (0 = unknown)
+    int mode_z;       // ftp_retrieve_file: use MODE Z for files ftp_mode_z_worthwhile() picks, if offered
+    int inflate_zlib; // The payload is a zlib stream (MODE Z): inflate it, hash the inflated bytes
+    double stall_timeout; // Fail a transfer that receives nothing for this many seconds (0 = wait forever)
+    long long min_rate;   // Also fail it if fewer bytes/s than this arrive over a stall_timeout window
+    double keepalive;     // Send NOOP on the control connection this often while data flows (0 = never)
+    struct FtpConn* control;       // Control connection for `keepalive` (filled in by the RETR helpers)
+    struct FtpDataTls* data_tls;   // The data connection's TLS under PROT P (filled in by the RETR helpers)
+    int retries;          // Reconnect and resume (REST) a stalled or dropped transfer up to this many times
+    TransferSinkFn sink;  // Hand the payload to this instead of writing out_fd (read/write or inflate loop only)
+    void* sink_ctx;       // Passed to sink
+} TransferOptions;
+
+// What a transfer did, for the throughput report
+typedef struct {
+    long long bytes;      // Payload bytes received on the data connection
+    long long output_bytes; // Bytes written to the output (differs from `bytes` when inflating)
+    double seconds;       // Wall-clock time from first read to EOF
+    const char* method;   // "splice", "io_uring", "read/write", ...
+    double first_byte_at; // monotonic_seconds() when the first payload byte arrived (0 if none)
+    double finished_at;   // monotonic_seconds() at EOF
+    double ttfb;          // RETR sent -> first payload byte, set by the RETR helpers (-1 if unknown)
+    double rtt;           // RTT the adaptive sizing started from (0 if not adaptive)
+    int rcvbuf;           // Final SO_RCVBUF as reported by the kernel (0 if not adaptive)
+    size_t read_size;     // Final read chunk of the read/write loop (0 if not adaptive or spliced)
+    TransferHashAlg hash_alg;             // Digest that was computed (TRANSFER_HASH_NONE if none)
+    char digest[TRANSFER_HASH_HEX_MAX];   // Its lowercase hex value
+    int digest_verified;                  // Set by ftp_retrieve_file when the server's digest matched
+    double throttled;     // Seconds spent waiting for rate-cap tokens (see transfer_rate.h)
+    double inflate_cpu;   // Thread CPU seconds spent in inflate() (gunzip / MODE Z, 0 otherwise)
+    int tls;              // FTP_TLS_NONE, FTP_TLS_USER or FTP_TLS_KTLS (see ftp_tls.h)
+    int stalled;          // The watchdog gave up on the data connection
+    int keepalives;       // NOOPs sent on the control connection during the transfer
+    int retries;          // Reconnects it took to finish (set by the recovering downloaders)
+} TransferStats;
+
+/**
+ * Copies the data connection into a file descriptor until EOF or `length` bytes.
+ * With opts->use_splice the bytes go through a pipe with splice(); if the kernel
+ * refuses (e.g. the output does not support it) the remainder falls back to a
+ * read/write loop with a TRANSFER_LARGE_BUF_SIZE buffer. With opts->adaptive,
+ * SO_RCVBUF starts at twice the bandwidth-delay product for opts->rtt and
+ * TRANSFER_TUNE_START_RATE, and it and the read chunk double every sample
+ * interval for as long as the measured throughput keeps rising. With
+ * opts->block_writer the data is read straight into an aligned
+ * TRANSFER_BLOCK_SIZE buffer and written a block at a time at explicit offsets;
+ * written blocks are flushed and dropped from the page cache behind the
+ * transfer (or bypass it entirely if out_fd is O_DIRECT). splice is not used then.
+ * With opts->use_uring (and no block writer) the copy runs on io_uring with
+ * registered buffers; if the ring cannot be set up or out_fd is not seekable it
+ * falls back to the read/write loop like splice does. With opts->gunzip the
+ * payload is inflated as it arrives (concatenated gzip members included) and
+ * only the decompressed bytes are written; that takes precedence over the other
+ * copy loops. opts->inflate_zlib does the same for a zlib stream (MODE Z).
+ * With opts->hash_alg every received (wire) byte is also fed to the digest as
+ * it arrives, so no second pass over the file is needed; splice is skipped
+ * then because the bytes never reach user space. When rate caps are
+ * configured (transfer_rate_configure()) every receive first waits for its
+ * fair share of tokens; io_uring is replaced by the read/write loop then.
+ * A data connection secured with ftp_tls_secure_data() (opts->data_tls) is
+ * read through ftp_tls_recv(): with kTLS only io_uring is replaced, with
+ * user-space TLS splice is too. With opts->stall_timeout or opts->keepalive
+ * the data socket gets an SO_RCVTIMEO, so a silent connection wakes the loop
+ * up: NOOPs go out on opts->control every opts->keepalive seconds
+ * (stats->keepalives, their replies are for the caller to read), and the
+ * transfer fails with stats->stalled set when nothing arrives for
+ * opts->stall_timeout seconds or less than opts->min_rate bytes/s arrive over
+ * such a window. io_uring is replaced by the read/write loop then, since its
+ * receives ignore SO_RCVTIMEO.
+ * With opts->sink the payload goes to the callback instead of out_fd, through
+ * the read/write (or inflate) loop, so the watchdog, rate caps and hashing
+ * still apply; out_fd and offset are not used then.
+ * On failure `stats` still counts the bytes written, so the caller can resume.
+ * @param data_sockfd The data connection socket.
+ * @param out_fd The output file descriptor.
+ * @param offset Output offset to write at, or -1 to write at the current position.
+ * @param length Number of bytes to copy, or -1 to copy until the server closes.
+ * @param opts Transfer options (NULL for the default read/write loop).
+ * @param stats Filled with byte count, elapsed time and method used (may be NULL).
+ * @return 0 on success, -1 on failure.
+ */
+int transfer_stream(int data_sockfd, int out_fd, long long offset, long long length,
+                    const TransferOptions* opts, TransferStats* stats);
+
+/**
+ * Opens (and truncates) a local file for a download. With opts->block_writer the
+ * space for `expected_size` bytes is reserved with fallocate() up front (keeping
+ * the visible size at zero, so an interrupted file still looks partial), and with
+ * opts->direct_io the file is opened O_DIRECT where the file system allows it.
+ * TRANSFER_STDOUT_NAME returns a duplicate of the stdout saved by
+ * transfer_redirect_stdout() (or of fd 1 if it was not called).
+ * @param path The local file name.
+ * @param expected_size Size announced by SIZE, or -1 if unknown.
+ * @param opts Transfer options (may be NULL).
+ * @return The file descriptor on success, -1 on failure.
+ */
+int transfer_open_output(const char* path, long long expected_size, const TransferOptions* opts);
+
+/**
+ * transfer_open_output() without the truncation, for writing the rest of a
+ * partial file (the O_DIRECT writer falls back to the page cache if the
+ * resume offset is not block-aligned).
+ * @param path The local file name.
+ * @param expected_size Size of the complete file, or -1 if unknown.
+ * @param opts Transfer options (may be NULL).
+ * @return The file descriptor on success, -1 on failure.
+ */
+int transfer_open_existing(const char* path, long long expected_size, const TransferOptions* opts);
+
+/**
+ * Points file descriptor 1 at stderr so progress output cannot mix with the
+ * payload, keeping the original stdout for transfer_open_output(TRANSFER_STDOUT_NAME).
+ * Call once, before anything is printed.
+ * @return 0 on success, -1 on failure.
+ */
+int transfer_redirect_stdout(void);
+
+/**
+ * Returns the kernel's smoothed RTT estimate for a connected TCP socket.
+ * @param sockfd The socket (normally the control connection).
+ * @return The RTT in seconds, or 0 if it is not available.
+ */
+double transfer_socket_rtt(int sockfd);
+
+/**
+ * Returns a CLOCK_MONOTONIC timestamp in seconds, for measuring durations.
+ */
+double monotonic_seconds(void);
+
+/**
+ * Prints a one-line byte count and throughput report.
+ * @param stats Statistics of a finished transfer.
+ */
+void transfer_print_stats(const TransferStats* stats);
+
+#endif // DATA_TRANSFER_H
@@ -0,0 +1,139 @@
+#include "ftp_batch.h"
+#include "ftp_session.h"
+#include "ftp_utils.h"
+#include "ftp_resume.h"
+#include "ftp_stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h> // For close()
+
+int ftp_same_login(const ParsedUrl* a, const ParsedUrl* b) {
+    return a->port == b->port && strcmp(a->host, b->host) == 0 && strcmp(a->user, b->user) == 0 &&
+           strcmp(a->pass, b->pass) == 0;
+}
+
+int ftp_read_url_list(FILE* list, ParsedUrl** urls_out) {
+    ParsedUrl* urls = NULL;
+    int count = 0, capacity = 0;
+    char line[FTP_BATCH_LINE_LEN];
+    int line_no = 0;
+
+    while (fgets(line, sizeof(line), list)) {
+        line_no++;
+        line[strcspn(line, "\r\n")] = '\0';
+        char* url = line + strspn(line, " \t");
+        if (*url == '\0' || *url == '#') continue;
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            ParsedUrl* grown = realloc(urls, capacity * sizeof(ParsedUrl));
+            if (!grown) {
+                perror("realloc URL list");
+                free(urls);
+                return -1;
+            }
+            urls = grown;
+        }
+        if (parse_ftp_url(url, &urls[count]) < 0) {
+            fprintf(stderr, "Skipping line %d: %s\n", line_no, url);
+            continue;
+        }
+        count++;
+    }
+    *urls_out = urls;
+    return count;
+}
+
+int ftp_batch_download(const ParsedUrl* urls, int count, int resume, const TransferOptions* opts) {
+    int succeeded = 0, sessions = 0;
+    long long total_bytes = 0;
+    int* group = malloc(count * sizeof(int));
+    int num_groups = 0;
+
+    if (!group) {
+        perror("malloc batch groups");
+        return -1;
+    }
+    // Groups are numbered in order of first appearance
+    for (int i = 0; i < count; i++) {
+        group[i] = -1;
+        for (int j = 0; j < i; j++) {
+            if (ftp_same_login(&urls[j], &urls[i])) {
+                group[i] = group[j];
+                break;
+            }
+        }
+        if (group[i] < 0) {
+            group[i] = num_groups++;
+        }
+    }
+    printf("Batch: %d URL(s) in %d session group(s).\n", count, num_groups);
+
+    double start = monotonic_seconds();
+    for (int g = 0; g < num_groups; g++) {
+        FtpConn* control = NULL;
+
+        for (int i = 0; i < count; i++) {
+            if (group[i] != g) continue;
+            const ParsedUrl* url = &urls[i];
+
+            if (!control) {
+                control = ftp_session_open(url);
+                if (!control) {
+                    fprintf(stderr, "Batch: cannot open session for '%s'.\n", url->path);
+                    FtpPhaseTimes times;
+                    ftp_phase_take(&times);
+                    ftp_stats_emit("batch", url, url->path, ftp_local_name(url->path), -1, &times, NULL);
+                    continue;
+                }
+                sessions++;
+            }
+
+            // Only PASV + RETR per file on the shared control connection
+            int status = -1;
+            TransferStats stats = {0};
+            FtpPhaseTimes times;
+            stats.ttfb = -1;
+            if (resume) {
+                status = ftp_resume_download(control, url->path, ftp_local_name(url->path), opts, &stats);
+            } else {
+                int data_sockfd = ftp_open_data_connection(control);
+                if (data_sockfd >= 0) {
+                    status = ftp_retrieve_file(control, data_sockfd, url->path,
+                                               ftp_local_name(url->path), opts, &stats);
+                    close(data_sockfd);
+                }
+            }
+            ftp_phase_take(&times); // Session phases only count for the first file of a session
+            ftp_stats_emit(resume ? "batch-resume" : "batch", url, url->path, ftp_local_name(url->path), status,
+                           &times, &stats);
+            if (status == 0) {
+                succeeded++;
+                total_bytes += stats.bytes;
+            } else {
+                fprintf(stderr, "Batch: download failed for '%s'.\n", url->path);
+                // Keep the session if it still answers NOOP in sync, else start over
+                if (ftp_noop(control) < 0) {
+                    ftp_session_close(control);
+                    control = NULL;
+                }
+            }
+        }
+        if (control) {
+            ftp_session_close(control);
+        }
+    }
+    double elapsed = monotonic_seconds() - start;
+
+    printf("Batch summary: %d/%d files, %lld bytes in %.3f s over %d control connection(s)",
+           succeeded, count, total_bytes, elapsed, sessions);
+    if (elapsed > 0) {
+        printf(" (%.1f files/s, %.2f MB/s)", succeeded / elapsed, total_bytes / elapsed / 1e6);
+    }
+    printf(".\n");
+
+    free(group);
+    return succeeded == count ? 0 : -1;
+}
@@ -0,0 +1,37 @@
+#ifndef FTP_BATCH_H
+#define FTP_BATCH_H
+
+#include <stdio.h> // For FILE*
+#include "data_transfer.h"
+#include "url_parser.h"
+
+#define FTP_BATCH_LINE_LEN 2048
+
+/**
+ * Reads a URL list (one per line; blank lines and lines starting with '#' are
+ * skipped, unparsable URLs are reported and skipped).
+ * @param list Stream to read the URLs from (a file or stdin).
+ * @param urls_out Pointer to store the malloc'ed array of parsed URLs.
+ * @return The number of URLs read, or -1 on failure.
+ */
+int ftp_read_url_list(FILE* list, ParsedUrl** urls_out);
+
+/**
+ * Returns non-zero if two URLs can share a logged-in control connection
+ * (same host, port, user and password).
+ */
+int ftp_same_login(const ParsedUrl* a, const ParsedUrl* b);
+
+/**
+ * Downloads a list of URLs sequentially. URLs are grouped by (host, port, user)
+ * and each group shares one logged-in control connection, so every file after
+ * the first costs only PASV+RETR. Prints a files/s and bytes/s summary at the end.
+ * @param urls The URLs to download.
+ * @param count Number of URLs.
+ * @param resume Non-zero to continue partial local files (see ftp_resume_download).
+ * @param opts How to drain each data connection (may be NULL).
+ * @return 0 if every file was downloaded, -1 otherwise.
+ */
+int ftp_batch_download(const ParsedUrl* urls, int count, int resume, const TransferOptions* opts);
+
+#endif // FTP_BATCH_H
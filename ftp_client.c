@@ -0,0 +1,229 @@
+#include "ftp_client.h"
+#include "url_parser.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h> // For close()
+
+struct FtpSession {
+    ParsedUrl url;
+    FtpClientOptions opts;
+    FtpConn* control;         // NULL once the connection broke; reopened on the next call
+    int use_list;             // Server refused MLSD
+    FtpClientStats stats;
+    int last_code;            // Reply kept across a dropped connection
+    int keep_reply;           // last_reply explains the failure; the NOOP after it does not
+    char last_reply[FTP_LAST_REPLY_SIZE];
+};
+
+// Protocol text goes to the handle's callback while one of its calls runs
+static FtpLogSink ftp_client_enter(FtpSession* s) {
+    FtpLogSink sink = {s->opts.log, s->opts.log_ctx, s->opts.log == NULL};
+    FtpPhaseTimes stale;
+    ftp_phase_take(&stale); // Phases other code on this thread left behind
+    s->keep_reply = 0;
+    return ftp_log_swap(sink);
+}
+
+static void ftp_client_save_reply(FtpSession* s) {
+    char text[FTP_LAST_REPLY_SIZE];
+    if (s->keep_reply) return;
+    int code = s->control ? ftp_last_reply(s->control, text, sizeof(text)) : 0;
+    if (code > 0) {
+        s->last_code = code;
+        memcpy(s->last_reply, text, sizeof(text));
+    }
+}
+
+static void ftp_client_leave(FtpSession* s, FtpLogSink previous) {
+    ftp_client_save_reply(s);
+    ftp_phase_take(&s->stats.phases);
+    ftp_log_swap(previous);
+}
+
+static void ftp_client_drop(FtpSession* s) {
+    if (!s->control) return;
+    ftp_client_save_reply(s);
+    ftp_conn_close(s->control);
+    s->control = NULL;
+}
+
+// Reopens the control connection if an earlier call lost it
+static int ftp_client_connected(FtpSession* s) {
+    if (s->control) return 0;
+    s->control = ftp_session_open_with(&s->url, &s->opts.session);
+    if (!s->control) return -1;
+    s->stats.reconnects++;
+    return 0;
+}
+
+// After a failed command: a refused file leaves a usable connection, a broken
+// one is dropped so the next call starts over
+static void ftp_client_check(FtpSession* s) {
+    ftp_client_save_reply(s);
+    s->keep_reply = 1;
+    if (s->control && ftp_noop(s->control) < 0) {
+        ftp_client_drop(s);
+    }
+}
+
+FtpSession* ftp_client_open(const char* url, const FtpClientOptions* opts) {
+    FtpSession* s = calloc(1, sizeof(FtpSession));
+    if (!s) {
+        ftp_log_perror("calloc FTP session");
+        return NULL;
+    }
+    if (opts) s->opts = *opts;
+    s->control = NULL;
+    if (parse_ftp_url(url, &s->url) < 0) {
+        free(s);
+        return NULL;
+    }
+
+    FtpLogSink previous = ftp_client_enter(s);
+    int status = ftp_client_connected(s);
+    ftp_client_leave(s, previous);
+    if (status < 0) {
+        ftp_client_close(s);
+        return NULL;
+    }
+    s->stats.reconnects = 0; // The first connection is not a reconnect
+    return s;
+}
+
+int ftp_client_fetch(FtpSession* s, const char* remote_path, long long offset,
+                     FtpSinkFn sink, void* sink_ctx, TransferStats* stats) {
+    TransferStats transfer_stats;
+    TransferOptions sink_opts = s->opts.transfer;
+    int status = -1;
+
+    memset(&transfer_stats, 0, sizeof(transfer_stats));
+    transfer_stats.ttfb = -1;
+    sink_opts.sink = sink;
+    sink_opts.sink_ctx = sink_ctx;
+    FtpLogSink previous = ftp_client_enter(s);
+    if (ftp_client_connected(s) == 0) {
+        int data_sockfd = ftp_open_data_connection(s->control);
+        if (data_sockfd < 0) {
+            // A NOOP tells a dead control connection from a refused PASV; retry once on a new one
+            ftp_client_check(s);
+            if (!s->control && ftp_client_connected(s) == 0) {
+                data_sockfd = ftp_open_data_connection(s->control);
+            }
+        }
+        if (data_sockfd >= 0) {
+            // The shared copy loop: stall watchdog, keepalives, rate caps and hashing apply
+            status = ftp_retrieve_range(s->control, data_sockfd, remote_path, -1, offset, -1, 1, &sink_opts,
+                                        &transfer_stats);
+            close(data_sockfd);
+            if (status < 0) ftp_client_check(s); // A transfer cut short leaves it out of step: dropped
+        }
+    }
+    if (status == 0) {
+        s->stats.files++;
+        s->stats.bytes += transfer_stats.bytes;
+        s->stats.seconds += transfer_stats.seconds;
+    }
+    ftp_client_leave(s, previous);
+    if (transfer_stats.ttfb >= 0) ftp_phase_add_to(&s->stats.phases, FTP_PHASE_TTFB, transfer_stats.ttfb);
+    if (transfer_stats.bytes > 0) ftp_phase_add_to(&s->stats.phases, FTP_PHASE_TRANSFER, transfer_stats.seconds);
+    if (stats) *stats = transfer_stats;
+    return status;
+}
+
+int ftp_client_fetch_file(FtpSession* s, const char* remote_path, const char* local_path, TransferStats* stats) {
+    TransferStats transfer_stats;
+    int status = -1;
+
+    memset(&transfer_stats, 0, sizeof(transfer_stats));
+    transfer_stats.ttfb = -1;
+    FtpLogSink previous = ftp_client_enter(s);
+    if (ftp_client_connected(s) == 0) {
+        int data_sockfd = ftp_open_data_connection(s->control);
+        if (data_sockfd >= 0) {
+            status = ftp_retrieve_file(s->control, data_sockfd, remote_path, local_path,
+                                       &s->opts.transfer, &transfer_stats);
+            close(data_sockfd);
+        }
+        if (status < 0) ftp_client_check(s);
+    }
+    if (status == 0) {
+        s->stats.files++;
+        s->stats.bytes += transfer_stats.bytes;
+        s->stats.seconds += transfer_stats.seconds;
+    }
+    ftp_client_leave(s, previous);
+    if (transfer_stats.ttfb >= 0) ftp_phase_add_to(&s->stats.phases, FTP_PHASE_TTFB, transfer_stats.ttfb);
+    if (transfer_stats.bytes > 0) ftp_phase_add_to(&s->stats.phases, FTP_PHASE_TRANSFER, transfer_stats.seconds);
+    if (stats) *stats = transfer_stats;
+    return status;
+}
+
+int ftp_client_list(FtpSession* s, const char* path, char** listing, size_t* listing_len, int* is_mlsd) {
+    int status = -1;
+
+    *listing = NULL;
+    *listing_len = 0;
+    FtpLogSink previous = ftp_client_enter(s);
+    if (ftp_client_connected(s) == 0 && (!s->opts.transfer.mode_z || ftp_select_mode_z(s->control, 1) >= 0)) {
+        for (int attempt = 0; attempt < 2 && status < 0; attempt++) {
+            int ftp_code = 0;
+            int data_sockfd = ftp_open_data_connection(s->control);
+            if (data_sockfd < 0) break;
+            status = ftp_list_directory(s->control, data_sockfd, s->use_list ? "LIST" : "MLSD", path,
+                                        listing, listing_len, &ftp_code);
+            close(data_sockfd);
+            if (status < 0 && !s->use_list && (ftp_code == 500 || ftp_code == 502 || ftp_code == 504)) {
+                s->use_list = 1;
+                continue;
+            }
+            break;
+        }
+        if (status < 0) ftp_client_check(s);
+    }
+    if (is_mlsd) *is_mlsd = !s->use_list;
+    ftp_client_leave(s, previous);
+    return status;
+}
+
+int ftp_client_size(FtpSession* s, const char* remote_path, long long* size) {
+    int status = -1;
+    FtpLogSink previous = ftp_client_enter(s);
+    if (ftp_client_connected(s) == 0) {
+        status = ftp_get_size(s->control, remote_path, size);
+        if (status < 0) ftp_client_check(s);
+    }
+    ftp_client_leave(s, previous);
+    return status;
+}
+
+int ftp_client_features(FtpSession* s, FtpFeatures* features) {
+    int status = -1;
+    FtpLogSink previous = ftp_client_enter(s);
+    if (ftp_client_connected(s) == 0) {
+        status = ftp_get_features(s->control, features);
+        if (status < 0) ftp_client_drop(s); // FEAT itself never fails on a live connection
+    }
+    ftp_client_leave(s, previous);
+    return status;
+}
+
+const FtpClientStats* ftp_client_stats(const FtpSession* s) {
+    return &s->stats;
+}
+
+int ftp_client_last_reply(const FtpSession* s, char* text, size_t text_len) {
+    if (text_len > 0) snprintf(text, text_len, "%s", s->last_code > 0 ? s->last_reply : "");
+    return s->last_code;
+}
+
+void ftp_client_close(FtpSession* s) {
+    if (!s) return;
+    if (s->control) {
+        FtpLogSink previous = ftp_client_enter(s);
+        ftp_session_close(s->control);
+        ftp_log_swap(previous);
+    }
+    free(s);
+}
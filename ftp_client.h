@@ -0,0 +1,122 @@
+#ifndef FTP_CLIENT_H
+#define FTP_CLIENT_H
+
+#include <stddef.h> // For size_t
+#include "ftp_session.h"
+#include "ftp_utils.h"
+#include "ftp_stats.h"
+#include "ftp_log.h"
+#include "data_transfer.h"
+
+// Embeddable client (libftpclient.a): one handle per logged-in control
+// connection, reused for any number of transfers. Nothing is printed while
+// its calls run; the protocol text and error messages go to the handle's log
+// callback, if any.
+
+// One logged-in control connection with its settings and counters
+typedef struct FtpSession FtpSession;
+
+/**
+ * Receives payload as it arrives on the data connection.
+ * @param ctx The pointer given to ftp_client_fetch().
+ * @param data The bytes received.
+ * @param len Number of bytes.
+ * @return 0 to go on, -1 to abort the transfer.
+ */
+typedef int (*FtpSinkFn)(void* ctx, const void* data, size_t len);
+
+typedef struct {
+    FtpSessionOptions session; // pipeline, disable_epsv, tls (tls needs ftp_tls_init() first)
+    TransferOptions transfer;  // Copy loop for ftp_client_fetch_file(); sink fetches use its watchdog,
+                               // keepalive, rate, hash and gunzip settings
+    FtpLogFn log;              // Protocol text ("C: ...", "S: ...", reports) and errors; NULL drops them
+    void* log_ctx;             // Passed to log
+} FtpClientOptions;
+
+typedef struct {
+    long long files;           // Transfers completed
+    long long bytes;           // Payload bytes they received
+    double seconds;            // Time spent receiving payload
+    int reconnects;            // Control connections reopened after one broke
+    FtpPhaseTimes phases;      // Phases of the most recent operation (login, PASV, TTFB, ...)
+} FtpClientStats;
+
+/**
+ * Connects, logs in and sets TYPE I. Host, port, user and password come from
+ * the URL; its path is ignored.
+ * @param url "ftp://[user:pass@]host[:port]/" (the trailing path may be empty).
+ * @param opts Options to copy (NULL for defaults: lock-step login, EPSV, no TLS).
+ * @return The handle, or NULL on failure.
+ */
+FtpSession* ftp_client_open(const char* url, const FtpClientOptions* opts);
+
+/**
+ * Downloads a file into a callback. If the control connection turned out to
+ * be dead, it is reopened once before the RETR. The payload goes through the
+ * read/write loop of transfer_stream(), so a stall_timeout or min_rate fails a
+ * silent transfer and keepalive NOOPs go out while it runs.
+ * @param s The session.
+ * @param remote_path The path of the file on the server.
+ * @param offset Byte to start from (REST), 0 for the whole file.
+ * @param sink Called for every chunk received, in order.
+ * @param sink_ctx Passed to sink.
+ * @param stats Filled with the transfer's byte count, duration and digest (may be NULL).
+ * @return 0 on success, -1 on failure (see ftp_client_last_reply()).
+ */
+int ftp_client_fetch(FtpSession* s, const char* remote_path, long long offset,
+                     FtpSinkFn sink, void* sink_ctx, TransferStats* stats);
+
+/**
+ * Downloads a file into a local file with the handle's TransferOptions (splice,
+ * io_uring, block writer, --verify, ...), like the download program does.
+ * @param s The session.
+ * @param remote_path The path of the file on the server.
+ * @param local_path Where to write it.
+ * @param stats Filled with the transfer statistics (may be NULL).
+ * @return 0 on success, -1 on failure.
+ */
+int ftp_client_fetch_file(FtpSession* s, const char* remote_path, const char* local_path, TransferStats* stats);
+
+/**
+ * Lists a directory (MLSD, LIST if the server does not know MLSD).
+ * @param s The session.
+ * @param path The directory on the server.
+ * @param listing Pointer to store the malloc'ed, NUL-terminated listing.
+ * @param listing_len Pointer to store its length.
+ * @param is_mlsd Set to 1 if the listing is in MLSD format, 0 for LIST (may be NULL).
+ * @return 0 on success, -1 on failure.
+ */
+int ftp_client_list(FtpSession* s, const char* path, char** listing, size_t* listing_len, int* is_mlsd);
+
+/**
+ * Asks for a file's size (SIZE).
+ * @return 0 on success, -1 on failure.
+ */
+int ftp_client_size(FtpSession* s, const char* remote_path, long long* size);
+
+/**
+ * Returns the extensions the server advertised in FEAT (asked once per connection).
+ * @return 0 on success, -1 on failure.
+ */
+int ftp_client_features(FtpSession* s, FtpFeatures* features);
+
+/**
+ * Returns the session's counters.
+ */
+const FtpClientStats* ftp_client_stats(const FtpSession* s);
+
+/**
+ * Returns the most recent server reply, to explain a failure.
+ * @param s The session.
+ * @param text Buffer for its first line.
+ * @param text_len Size of text.
+ * @return The reply code, or 0 if there is none.
+ */
+int ftp_client_last_reply(const FtpSession* s, char* text, size_t text_len);
+
+/**
+ * Sends QUIT, closes the connection and frees the handle (NULL is ignored).
+ */
+void ftp_client_close(FtpSession* s);
+
+#endif // FTP_CLIENT_H
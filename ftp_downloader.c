@@ -1,117 +1,540 @@
 #include "url_parser.h"
 #include "socket_utils.h"
 #include "ftp_utils.h"
+#include "ftp_session.h"
+#include "ftp_segmented.h"
+#include "ftp_multi.h"
+#include "ftp_batch.h"
+#include "ftp_engine.h"
+#include "ftp_resume.h"
+#include "ftp_mirror.h"
+#include "ftp_stats.h"
+#include "ftp_sync.h"
+#include "transfer_rate.h"
+#include "ftp_tls.h"
+#include "ftp_progress.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h> // For close()
+#include <getopt.h>
 
-int main(int argc, char** argv) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s ftp://[user:pass@]host[:port]/path/to/file\n", argv[0]);
-        return 1;
-    }
+static void print_usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [-j N] ftp://[user:pass@]host[:port]/path/to/file\n", prog);
+    fprintf(stderr, "       (IPv6 literals go in brackets: ftp://[::1]:2121/file)\n");
+    fprintf(stderr, "       %s -i FILE|-   (one URL per line, '-' for stdin)\n", prog);
+    fprintf(stderr, "       %s -m [-j N] ftp://host/dir/   (recursive mirror)\n", prog);
+    fprintf(stderr, "       %s [-j N] URL URL...   (one file from several mirrors at once, -j connections each)\n", prog);
+    fprintf(stderr, "  -o, --output FILE  local name for a single download ('-' streams to stdout, logs go to stderr)\n");
+    fprintf(stderr, "  -j, --segments N   download over N parallel connections (1..%d; per mirror with several URLs)\n", FTP_MAX_SEGMENTS);
+    fprintf(stderr, "  -i, --input FILE   batch mode, reusing one login per (host, port, user)\n");
+    fprintf(stderr, "  -e, --engine N     with -i: run up to N sessions at once on one epoll thread\n");
+    fprintf(stderr, "  -m, --mirror       mirror a directory tree (MLSD, LIST fallback); -j sets the pool size\n");
+    fprintf(stderr, "      --sync[=FILE]  with a URL, -i or -m: fetch only files whose size/mtime changed since the\n"
+                    "                     manifest FILE (default %s) was written, and update it\n", FTP_SYNC_DEFAULT_MANIFEST);
+    fprintf(stderr, "  -c, --continue     resume a partial local file with REST (checked against SIZE/MDTM)\n");
+    fprintf(stderr, "      --pipeline     send USER, PASS, TYPE I and EPSV in one round trip\n");
+    fprintf(stderr, "      --no-epsv      use PASV only for data connections (IPv4)\n");
+    fprintf(stderr, "      --stats-json FILE  append one JSON line of phase timings per file ('-' for stdout)\n");
+    fprintf(stderr, "      --tune         size SO_RCVBUF and reads from the RTT, growing them while throughput rises\n");
+    fprintf(stderr, "      --prealloc     SIZE + fallocate, 4 MiB aligned writes, page cache dropped behind\n");
+    fprintf(stderr, "      --direct       like --prealloc, but write with O_DIRECT (not with -j ranges or several URLs)\n");
+    fprintf(stderr, "      --splice       zero-copy socket-to-file path (large read/write buffer as fallback)\n");
+    fprintf(stderr, "      --hash ALG     digest the payload while it streams (crc32c, crc32, md5, sha1, sha256)\n");
+    fprintf(stderr, "      --verify       compare with the server's HASH/XCRC/XMD5 digest and fail on a mismatch\n");
+    fprintf(stderr, "      --gunzip       decompress a gzip payload on the fly (single download; drops a .gz suffix)\n");
+    fprintf(stderr, "      --ftps         explicit FTPS: AUTH TLS, then PBSZ 0 / PROT P for encrypted data connections\n");
+    fprintf(stderr, "      --tls-ca FILE  trust the certificates in FILE (PEM) instead of the system store\n");
+    fprintf(stderr, "      --tls-insecure skip the server certificate and host name check\n");
+    fprintf(stderr, "      --no-ktls      decrypt data in user space instead of handing it to kernel TLS\n");
+    fprintf(stderr, "      --mode-z       compressed transfers (MODE Z) for listings and files likely to shrink, if offered\n");
+    fprintf(stderr, "      --io-uring     io_uring data path, several receives and writes in flight (read/write as fallback)\n");
+    fprintf(stderr, "      --limit-rate RATE  cap all transfers together at RATE bytes/s (K, M, G suffixes)\n");
+    fprintf(stderr, "      --host-limit RATE  cap the transfers from each server address at RATE bytes/s\n"
+                    "                     (capped bandwidth is shared with priority for files that are nearly done)\n");
+    fprintf(stderr, "      --stall-timeout SECS  give up on a data connection that delivers nothing for SECS\n");
+    fprintf(stderr, "      --min-rate RATE    ... or less than RATE bytes/s over such a window (default %.0f s)\n",
+            TRANSFER_STALL_DEFAULT_TIMEOUT);
+    fprintf(stderr, "      --keepalive SECS   send NOOP on the control connection every SECS while data flows\n");
+    fprintf(stderr, "      --retries N        reconnect and resume (REST) a stalled or dropped single, -c, -j or\n"
+                    "                     multi-mirror download up to N times (default 0, or %d with\n"
+                    "                     --stall-timeout, --min-rate or --keepalive)\n", FTP_RETRY_DEFAULT);
+    fprintf(stderr, "      --progress     redraw a progress line (bytes, rate, ETA, active transfers) on stderr\n");
+    fprintf(stderr, "      --metrics FILE     keep a Prometheus text snapshot of the live counters in FILE\n");
+    fprintf(stderr, "      --metrics-json FILE  ... or a JSON one\n");
+    fprintf(stderr, "      --metrics-interval SECS  how often the progress line and snapshots are refreshed\n"
+                    "                     (default %.0f s)\n", FTP_PROGRESS_DEFAULT_INTERVAL);
+}
 
-    ParsedUrl url_components;
-    char ip_addr_str[INET_ADDRSTRLEN];
-    int control_sockfd = -1, data_sockfd = -1;
-    char response_buf[FTP_RESPONSE_BUF_SIZE];
-    int ftp_code;
-    char data_ip_str[INET_ADDRSTRLEN];
-    int data_port;
+// Long-only options
+enum {
+    OPT_SPLICE = 256,
+    OPT_PIPELINE,
+    OPT_NO_EPSV,
+    OPT_STATS_JSON,
+    OPT_TUNE,
+    OPT_PREALLOC,
+    OPT_DIRECT,
+    OPT_IO_URING,
+    OPT_GUNZIP,
+    OPT_HASH,
+    OPT_VERIFY,
+    OPT_SYNC,
+    OPT_LIMIT_RATE,
+    OPT_HOST_LIMIT,
+    OPT_MODE_Z,
+    OPT_FTPS,
+    OPT_TLS_CA,
+    OPT_TLS_INSECURE,
+    OPT_NO_KTLS,
+    OPT_STALL_TIMEOUT,
+    OPT_MIN_RATE,
+    OPT_KEEPALIVE,
+    OPT_RETRIES,
+    OPT_PROGRESS,
+    OPT_METRICS,
+    OPT_METRICS_JSON,
+    OPT_METRICS_INTERVAL,
+};
 
-    // 1. Parse URL
-    if (parse_ftp_url(argv[1], &url_components) < 0) {
+int main(int argc, char** argv) {
+    static const struct option long_options[] = {
+        {"output",   required_argument, NULL, 'o'},
+        {"segments", required_argument, NULL, 'j'},
+        {"input",    required_argument, NULL, 'i'},
+        {"engine",   required_argument, NULL, 'e'},
+        {"continue", no_argument,       NULL, 'c'},
+        {"mirror",   no_argument,       NULL, 'm'},
+        {"splice",   no_argument,       NULL, OPT_SPLICE},
+        {"pipeline", no_argument,       NULL, OPT_PIPELINE},
+        {"no-epsv",  no_argument,       NULL, OPT_NO_EPSV},
+        {"stats-json", required_argument, NULL, OPT_STATS_JSON},
+        {"tune",     no_argument,       NULL, OPT_TUNE},
+        {"prealloc", no_argument,       NULL, OPT_PREALLOC},
+        {"direct",   no_argument,       NULL, OPT_DIRECT},
+        {"io-uring", no_argument,       NULL, OPT_IO_URING},
+        {"gunzip",   no_argument,       NULL, OPT_GUNZIP},
+        {"hash",     required_argument, NULL, OPT_HASH},
+        {"verify",   no_argument,       NULL, OPT_VERIFY},
+        {"sync",     optional_argument, NULL, OPT_SYNC},
+        {"limit-rate", required_argument, NULL, OPT_LIMIT_RATE},
+        {"host-limit", required_argument, NULL, OPT_HOST_LIMIT},
+        {"mode-z",   no_argument,       NULL, OPT_MODE_Z},
+        {"ftps",     no_argument,       NULL, OPT_FTPS},
+        {"tls-ca",   required_argument, NULL, OPT_TLS_CA},
+        {"tls-insecure", no_argument,   NULL, OPT_TLS_INSECURE},
+        {"no-ktls",  no_argument,       NULL, OPT_NO_KTLS},
+        {"stall-timeout", required_argument, NULL, OPT_STALL_TIMEOUT},
+        {"min-rate", required_argument, NULL, OPT_MIN_RATE},
+        {"keepalive", required_argument, NULL, OPT_KEEPALIVE},
+        {"retries",  required_argument, NULL, OPT_RETRIES},
+        {"progress", no_argument,       NULL, OPT_PROGRESS},
+        {"metrics",  required_argument, NULL, OPT_METRICS},
+        {"metrics-json", required_argument, NULL, OPT_METRICS_JSON},
+        {"metrics-interval", required_argument, NULL, OPT_METRICS_INTERVAL},
+        {"help",     no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    int num_segments = 1;
+    const char* input_list = NULL;
+    const char* output_name = NULL;
+    const char* sync_manifest = NULL;
+    FtpManifest manifest;
+    int engine_sessions = 0;
+    long long global_rate = 0, host_rate = 0;
+    const char* tls_ca = NULL;
+    int tls_verify = 1, tls_offload = 1;
+    int show_progress = 0;
+    const char* metrics_prom = NULL;
+    const char* metrics_json = NULL;
+    double metrics_interval = 0;
+    int resume = 0;
+    int mirror = 0;
+    TransferOptions transfer_opts = {0};
+    FtpSessionOptions session_opts = {0};
+    int opt;
+
+    transfer_opts.retries = -1; // Not given
+    while ((opt = getopt_long(argc, argv, "o:j:i:e:cmh", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'o':
+            output_name = optarg;
+            break;
+        case 'j':
+            num_segments = atoi(optarg);
+            if (num_segments < 1 || num_segments > FTP_MAX_SEGMENTS) {
+                fprintf(stderr, "Error: -j expects a value between 1 and %d.\n", FTP_MAX_SEGMENTS);
+                return 1;
+            }
+            break;
+        case 'i':
+            input_list = optarg;
+            break;
+        case 'e':
+            engine_sessions = atoi(optarg);
+            if (engine_sessions < 1 || engine_sessions > FTP_ENGINE_MAX_SESSIONS) {
+                fprintf(stderr, "Error: -e expects a value between 1 and %d.\n", FTP_ENGINE_MAX_SESSIONS);
+                return 1;
+            }
+            break;
+        case 'c':
+            resume = 1;
+            break;
+        case 'm':
+            mirror = 1;
+            break;
+        case OPT_SPLICE:
+            transfer_opts.use_splice = 1;
+            break;
+        case OPT_PIPELINE:
+            session_opts.pipeline = 1;
+            break;
+        case OPT_NO_EPSV:
+            session_opts.disable_epsv = 1;
+            break;
+        case OPT_FTPS:
+            session_opts.tls = 1;
+            break;
+        case OPT_TLS_CA:
+            tls_ca = optarg;
+            break;
+        case OPT_TLS_INSECURE:
+            tls_verify = 0;
+            break;
+        case OPT_NO_KTLS:
+            tls_offload = 0;
+            break;
+        case OPT_DIRECT:
+            transfer_opts.direct_io = 1;
+            // Fall through: O_DIRECT needs the aligned block writer
+        case OPT_PREALLOC:
+            transfer_opts.block_writer = 1;
+            break;
+        case OPT_IO_URING:
+            transfer_opts.use_uring = 1;
+            break;
+        case OPT_GUNZIP:
+            transfer_opts.gunzip = 1;
+            break;
+        case OPT_MODE_Z:
+            transfer_opts.mode_z = 1;
+            break;
+        case OPT_HASH:
+            transfer_opts.hash_alg = transfer_hash_parse(optarg);
+            if (transfer_opts.hash_alg == TRANSFER_HASH_NONE) {
+                fprintf(stderr, "Error: unknown hash '%s' (crc32c, crc32, md5, sha1, sha256).\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_VERIFY:
+            transfer_opts.verify_hash = 1;
+            break;
+        case OPT_SYNC:
+            sync_manifest = optarg ? optarg : FTP_SYNC_DEFAULT_MANIFEST;
+            break;
+        case OPT_LIMIT_RATE:
+        case OPT_HOST_LIMIT: {
+            long long rate = transfer_parse_rate(optarg);
+            if (rate <= 0) {
+                fprintf(stderr, "Error: invalid rate '%s' (e.g. 500K, 2M).\n", optarg);
+                return 1;
+            }
+            if (opt == OPT_LIMIT_RATE) global_rate = rate;
+            else host_rate = rate;
+            break;
+        }
+        case OPT_STALL_TIMEOUT:
+        case OPT_KEEPALIVE:
+        case OPT_METRICS_INTERVAL: {
+            char* end;
+            double seconds = strtod(optarg, &end);
+            if (end == optarg || *end != '\0' || seconds <= 0) {
+                fprintf(stderr, "Error: expected a number of seconds, got '%s'.\n", optarg);
+                return 1;
+            }
+            if (opt == OPT_STALL_TIMEOUT) transfer_opts.stall_timeout = seconds;
+            else if (opt == OPT_KEEPALIVE) transfer_opts.keepalive = seconds;
+            else metrics_interval = seconds;
+            break;
+        }
+        case OPT_MIN_RATE:
+            transfer_opts.min_rate = transfer_parse_rate(optarg);
+            if (transfer_opts.min_rate <= 0) {
+                fprintf(stderr, "Error: invalid rate '%s' (e.g. 500K, 2M).\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_RETRIES:
+            transfer_opts.retries = atoi(optarg);
+            if (transfer_opts.retries < 0) {
+                fprintf(stderr, "Error: --retries expects a value of 0 or more.\n");
+                return 1;
+            }
+            break;
+        case OPT_TUNE:
+            transfer_opts.adaptive = 1;
+            break;
+        case OPT_PROGRESS:
+            show_progress = 1;
+            break;
+        case OPT_METRICS:
+            metrics_prom = optarg;
+            break;
+        case OPT_METRICS_JSON:
+            metrics_json = optarg;
+            break;
+        case OPT_STATS_JSON:
+            if (ftp_stats_open(optarg) < 0) return 1;
+            break;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (transfer_opts.min_rate > 0 && transfer_opts.stall_timeout <= 0) {
+        transfer_opts.stall_timeout = TRANSFER_STALL_DEFAULT_TIMEOUT; // The window the rate is measured over
+    }
+    if (transfer_opts.retries < 0) {
+        // A watchdog that cuts a transfer short is only useful with a resume after it
+        int watched = transfer_opts.stall_timeout > 0 || transfer_opts.keepalive > 0;
+        transfer_opts.retries = watched ? FTP_RETRY_DEFAULT : 0;
+    }
+    if (engine_sessions > 0 && (transfer_opts.stall_timeout > 0 || transfer_opts.keepalive > 0)) {
+        fprintf(stderr, "Error: --stall-timeout, --min-rate and --keepalive cannot be combined with -e.\n");
         return 1;
     }
-    printf("Parsed URL:\n  Host: %s\n  Port: %d\n  User: %s\n  Path: %s\n",
-           url_components.host, url_components.port, url_components.user, url_components.path);
-    // Note: Password is in url_components.pass, not printed for security.
-
-    // 2. Resolve hostname
-    if (resolve_hostname(url_components.host, ip_addr_str, sizeof(ip_addr_str)) < 0) {
+    if (engine_sessions > 0 && (transfer_opts.use_uring || transfer_opts.use_splice || transfer_opts.adaptive ||
+                                transfer_opts.block_writer)) {
+        // The engine drains every data connection with its own non-blocking reads
+        fprintf(stderr, "Error: --io-uring, --splice, --tune, --prealloc and --direct cannot be combined with -e.\n");
         return 1;
     }
-    printf("Resolved IP Address: %s\n", ip_addr_str);
+    if (session_opts.tls) {
+        if (engine_sessions > 0) {
+            fprintf(stderr, "Error: --ftps cannot be combined with -e.\n");
+            return 1;
+        }
+        if (ftp_tls_init(tls_ca, tls_verify, tls_offload) < 0) return 1;
+    }
+    ftp_session_set_options(&session_opts);
+    if (global_rate > 0 || host_rate > 0) {
+        if (engine_sessions > 0) {
+            fprintf(stderr, "Error: --limit-rate and --host-limit cannot be combined with -e.\n");
+            return 1;
+        }
+        transfer_rate_configure(global_rate, host_rate);
+        atexit(transfer_rate_print_summary);
+    }
+    if (show_progress || metrics_prom || metrics_json) {
+        // The reporter thread samples the transfer counters; nothing is printed per chunk
+        if (ftp_progress_start(show_progress, metrics_prom, metrics_json, metrics_interval) < 0) return 1;
+        atexit(ftp_progress_stop); // Runs before the rate summary, which was registered first
+    }
 
-    // 3. Create and connect control socket
-    control_sockfd = create_tcp_socket();
-    if (control_sockfd < 0) {
+    // Several URLs: the same file on different servers
+    int num_mirrors = argc - optind;
+    if (transfer_opts.direct_io && ((num_segments > 1 && !mirror) || num_mirrors > 1)) {
+        // Ranges share one file, and O_DIRECT pads a range's last partial block over the next one
+        fprintf(stderr, "Error: --direct cannot be combined with -j (except with -m) or several URLs; "
+                        "use --prealloc.\n");
         return 1;
     }
-    if (connect_to_server(control_sockfd, ip_addr_str, url_components.port) < 0) {
-        close(control_sockfd);
+    if (num_mirrors > 1) {
+        if (input_list || mirror || resume || engine_sessions > 0 || sync_manifest || transfer_opts.gunzip ||
+            (output_name && strcmp(output_name, TRANSFER_STDOUT_NAME) == 0)) {
+            fprintf(stderr, "Error: several URLs cannot be combined with -i, -m, -c, -e, --sync, --gunzip or -o -.\n");
+            return 1;
+        }
+        if (num_mirrors > FTP_MULTI_MAX_MIRRORS) {
+            fprintf(stderr, "Error: at most %d mirrors.\n", FTP_MULTI_MAX_MIRRORS);
+            return 1;
+        }
+        ParsedUrl mirror_urls[FTP_MULTI_MAX_MIRRORS];
+        for (int m = 0; m < num_mirrors; m++) {
+            if (parse_ftp_url(argv[optind + m], &mirror_urls[m]) < 0) return 1;
+        }
+        const char* mirror_local = output_name ? output_name : ftp_local_name(mirror_urls[0].path);
+        int multi_status = ftp_multi_download(mirror_urls, num_mirrors, mirror_local, num_segments, &transfer_opts);
+        ftp_stats_close();
+        if (multi_status == 0) {
+            printf("File '%s' downloaded successfully as '%s'.\n", mirror_urls[0].path, mirror_local);
+            return 0;
+        }
+        printf("File download failed for '%s'.\n", mirror_urls[0].path);
         return 1;
     }
-    printf("Control connection established to %s:%d.\n", ip_addr_str, url_components.port);
 
-    // 4. Read initial welcome message(s) from server
-    if (read_ftp_response(control_sockfd, response_buf, sizeof(response_buf), &ftp_code) < 0) {
-        fprintf(stderr, "Failed to read welcome message.\n");
-        close(control_sockfd);
+    if ((output_name || transfer_opts.gunzip) && (input_list || mirror || num_segments > 1 || resume)) {
+        fprintf(stderr, "Error: -o and --gunzip apply to a single sequential download (no -i, -m, -j or -c).\n");
         return 1;
     }
-    if (ftp_code != 220) {
-        fprintf(stderr, "Server did not send 220 welcome. Got %d: %s\n", ftp_code, response_buf);
-        close(control_sockfd);
-        return 1;
+    if (output_name && strcmp(output_name, TRANSFER_STDOUT_NAME) == 0) {
+        if (transfer_opts.block_writer) {
+            fprintf(stderr, "Error: --prealloc and --direct need a regular output file.\n");
+            return 1;
+        }
+        if (transfer_redirect_stdout() < 0) return 1;
     }
-    printf("FTP Server Welcome OK (Code %d).\n", ftp_code);
 
-    // 5. Login
-    if (ftp_login(control_sockfd, url_components.user, url_components.pass) < 0) {
-        close(control_sockfd);
+    if ((transfer_opts.hash_alg || transfer_opts.verify_hash) && (num_segments > 1 || resume || engine_sessions > 0)) {
+        fprintf(stderr, "Error: --hash and --verify need whole-file transfers (no -j, -c or -e).\n");
         return 1;
     }
-
-    // 6. Set transfer type to Image (Binary)
-    if (ftp_set_type_image(control_sockfd) < 0) {
-        // This might be a warning for some servers, but generally required for files
-        fprintf(stderr, "Warning: Could not set TYPE I. File transfer might be corrupted.\n");
+    if (sync_manifest) {
+        // -j is the pool size in a mirror, but would split single files into ranges
+        if (resume || engine_sessions > 0 || output_name || transfer_opts.gunzip || (num_segments > 1 && !mirror)) {
+            fprintf(stderr, "Error: --sync cannot be combined with -c, -e, -o, --gunzip or -j (except with -m).\n");
+            return 1;
+        }
+        if (ftp_manifest_load(&manifest, sync_manifest) < 0) return 1;
     }
 
-    // 7. Enter Passive Mode
-    if (ftp_enter_passive_mode(control_sockfd, data_ip_str, sizeof(data_ip_str), &data_port) < 0) {
-        close(control_sockfd);
+    if (input_list) {
+        if (optind != argc || num_segments > 1 || mirror || (resume && engine_sessions > 0)) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        FILE* list = strcmp(input_list, "-") == 0 ? stdin : fopen(input_list, "r");
+        if (!list) {
+            perror("fopen URL list");
+            return 1;
+        }
+        ParsedUrl* urls;
+        int count = ftp_read_url_list(list, &urls);
+        if (list != stdin) fclose(list);
+        if (count <= 0) {
+            fprintf(stderr, "No URLs to download.\n");
+            if (count == 0) free(urls);
+            return 1;
+        }
+        int batch_status;
+        if (sync_manifest) {
+            batch_status = ftp_sync_download(urls, count, &manifest, &transfer_opts);
+            if (ftp_manifest_save(&manifest) < 0) batch_status = -1;
+            ftp_manifest_free(&manifest);
+        } else {
+            batch_status = engine_sessions > 0 ? ftp_engine_download(urls, count, engine_sessions)
+                                               : ftp_batch_download(urls, count, resume, &transfer_opts);
+        }
+        free(urls);
+        ftp_stats_close();
+        return batch_status == 0 ? 0 : 1;
+    }
+    if (engine_sessions > 0) {
+        fprintf(stderr, "Error: -e needs a URL list (-i).\n");
         return 1;
     }
 
-    // 8. Create and connect data socket
-    data_sockfd = create_tcp_socket();
-    if (data_sockfd < 0) {
-        close(control_sockfd);
+    if (optind != argc - 1) {
+        print_usage(argv[0]);
         return 1;
     }
-    if (connect_to_server(data_sockfd, data_ip_str, data_port) < 0) {
-        close(control_sockfd);
-        close(data_sockfd);
+
+    ParsedUrl url_components;
+    FtpConn* control = NULL;
+    int data_sockfd = -1;
+
+    // 1. Parse URL
+    if (parse_ftp_url(argv[optind], &url_components) < 0) {
         return 1;
     }
-    printf("Data connection established to %s:%d.\n", data_ip_str, data_port);
+    printf("Parsed URL:\n  Host: %s\n  Port: %d\n  User: %s\n  Path: %s\n",
+           url_components.host, url_components.port, url_components.user, url_components.path);
+    // Note: Password is in url_components.pass, not printed for security.
 
-    // 9. Retrieve the file
-    char* local_filename = strrchr(url_components.path, '/');
-    if (local_filename) {
-        local_filename++; // Point after the slash
-    } else {
-        local_filename = url_components.path; // Use the whole path if no slash
+    if (mirror) {
+        if (resume) {
+            fprintf(stderr, "Error: -c cannot be combined with -m.\n");
+            return 1;
+        }
+        // -j defaults to 1 for single files; a mirror wants a pool unless told otherwise
+        int workers = num_segments > 1 ? num_segments : FTP_MIRROR_DEFAULT_WORKERS;
+        int mirror_status = ftp_mirror(&url_components, workers, &transfer_opts, sync_manifest ? &manifest : NULL);
+        if (sync_manifest) {
+            if (ftp_manifest_save(&manifest) < 0) mirror_status = -1;
+            ftp_manifest_free(&manifest);
+        }
+        ftp_stats_close();
+        return mirror_status == 0 ? 0 : 1;
+    }
+    if (sync_manifest) {
+        int sync_status = ftp_sync_download(&url_components, 1, &manifest, &transfer_opts);
+        if (ftp_manifest_save(&manifest) < 0) sync_status = -1;
+        ftp_manifest_free(&manifest);
+        ftp_stats_close();
+        return sync_status == 0 ? 0 : 1;
     }
-    if (strlen(local_filename) == 0) { // If path was just "/" or empty after slash
-        local_filename = "downloaded_file"; // Default filename
+
+    const char* local_filename = output_name ? output_name : ftp_local_name(url_components.path);
+    char unzipped_name[MAX_PATH_LEN];
+    size_t name_len = strlen(local_filename);
+    if (!output_name && transfer_opts.gunzip && name_len > 3 && name_len < sizeof(unzipped_name) &&
+        strcmp(local_filename + name_len - 3, ".gz") == 0) {
+        snprintf(unzipped_name, sizeof(unzipped_name), "%.*s", (int) (name_len - 3), local_filename);
+        local_filename = unzipped_name;
     }
+    int retrieve_status = -1;
+    TransferStats transfer_stats = {0};
+    FtpPhaseTimes phase_times;
+    transfer_stats.ttfb = -1;
+
+    if (num_segments > 1) {
+        // Segmented mode: every worker runs its own session (emits its own stats line)
+        retrieve_status = ftp_segmented_download(&url_components, local_filename, num_segments, &transfer_opts);
+    } else if (resume) {
+        control = ftp_session_open(&url_components);
+        if (control) {
+            // SIZE/MDTM checks, then PASV + REST + RETR
+            retrieve_status = ftp_resume_download(control, url_components.path, local_filename,
+                                                  &transfer_opts, &transfer_stats);
+            int retryable = retrieve_status < 0 && ftp_transfer_retryable(control, &transfer_stats);
+            ftp_session_close(control);
+            if (retryable) {
+                retrieve_status = ftp_resume_retry(&url_components, local_filename, &transfer_opts, &transfer_stats);
+            }
+        }
+        ftp_phase_take(&phase_times);
+        ftp_stats_emit("resume", &url_components, url_components.path, local_filename, retrieve_status,
+                       &phase_times, &transfer_stats);
+    } else {
+        // 2-6. Resolve, connect, read the welcome, login and set TYPE I
+        control = ftp_session_open(&url_components);
+
+        // 7-8. Enter passive mode and connect the data socket
+        if (control && (data_sockfd = ftp_open_data_connection(control)) < 0) {
+            ftp_conn_close(control);
+            control = NULL;
+        }
 
-    int retrieve_status = ftp_retrieve_file(control_sockfd, data_sockfd, url_components.path, local_filename);
-    // retrieve_status will be 0 on success, -1 on failure.
+        if (control) {
+            // 9. Retrieve the file
+            retrieve_status = ftp_retrieve_file(control, data_sockfd, url_components.path, local_filename,
+                                                &transfer_opts, &transfer_stats);
+            // retrieve_status will be 0 on success, -1 on failure.
 
-    close(data_sockfd); // Data socket should be closed after transfer
-    printf("Data socket closed.\n");
+            close(data_sockfd); // Data socket should be closed after transfer
+            printf("Data socket closed.\n");
 
+            // A stream, an inflated file or a running digest cannot pick up at the local size
+            int resumable = strcmp(local_filename, TRANSFER_STDOUT_NAME) != 0 && !transfer_opts.gunzip &&
+                            !transfer_opts.hash_alg && !transfer_opts.verify_hash;
+            int retryable = retrieve_status < 0 && resumable &&
+                            ftp_transfer_retryable(control, &transfer_stats);
 
-    // 10. Quit
-    ftp_quit(control_sockfd); // Send QUIT, attempt to read reply
-    close(control_sockfd);    // Ensure control socket is closed
-    printf("Control socket closed.\n");
+            // 10. Quit
+            ftp_session_close(control);
+
+            // 11. Stalled or dropped: reconnect and continue with REST from the last byte written
+            if (retryable) {
+                retrieve_status = ftp_resume_retry(&url_components, local_filename, &transfer_opts, &transfer_stats);
+            }
+        }
+        ftp_phase_take(&phase_times);
+        ftp_stats_emit("single", &url_components, url_components.path, local_filename, retrieve_status,
+                       &phase_times, &transfer_stats);
+    }
+    ftp_stats_close();
 
     if (retrieve_status == 0) {
         printf("File '%s' downloaded successfully as '%s'.\n", url_components.path, local_filename);
@@ -122,4 +545,4 @@ int main(int argc, char** argv) {
         // remove(local_filename);
         return 1;
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,616 @@
+#include "ftp_engine.h"
+#include "ftp_utils.h"
+#include "ftp_batch.h"      // For ftp_same_login
+#include "ftp_session.h"    // For ftp_local_name
+#include "socket_utils.h"
+#include "data_transfer.h"  // For monotonic_seconds
+#include "ftp_stats.h"
+#include "ftp_progress.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h> // For send
+
+#define ENGINE_MAX_EVENTS 256
+
+typedef enum {
+    ENGINE_CONNECTING,  // Waiting for the control connect to complete
+    ENGINE_BANNER,      // Waiting for 220
+    ENGINE_USER,        // Waiting for the USER reply (331 or 230)
+    ENGINE_PASS,        // Waiting for 230
+    ENGINE_TYPE,        // Waiting for the TYPE I reply
+    ENGINE_EPSV,        // Waiting for 229
+    ENGINE_PASV,        // Waiting for 227
+    ENGINE_RETR,        // Waiting for 150/125
+    ENGINE_TRANSFER,    // Data flowing; waiting for EOF and 226
+    ENGINE_QUIT         // Waiting for 221
+} EngineState;
+
+typedef enum {
+    URL_PENDING,
+    URL_ACTIVE,
+    URL_DONE,
+    URL_FAILED
+} UrlStatus;
+
+typedef struct {
+    int in_use;
+    int control_fd;
+    int data_fd;
+    int data_connected;
+    int data_eof;
+    int out_fd;
+    FtpProgressSlot* progress; // Live byte count while out_fd is open
+    EngineState state;
+    int entry;              // Index of the URL being fetched
+    int transfer_code;      // Final RETR reply code, 0 while still pending
+    int epsv_refused;       // Server does not do EPSV: use PASV
+    char peer_ip[INET6_ADDRSTRLEN];
+    long long bytes;
+    double last_activity;
+    FtpPhaseTimes times;    // Phases of the current file (session phases only for the first)
+    double phase_start;     // When the phase in progress started
+    double retr_sent;
+    double first_byte_at;
+    double eof_at;
+    char inbuf[FTP_READER_BUF_SIZE];
+    size_t inlen;
+    char outbuf[1024];
+    size_t outlen;
+} EngineSession;
+
+typedef struct {
+    char host[MAX_HOST_LEN];
+    char ip[INET6_ADDRSTRLEN];
+} EngineDnsEntry;
+
+typedef struct {
+    const ParsedUrl* urls;
+    int count;
+    UrlStatus* status;
+    int next_pending;       // No URL before this index is pending
+    EngineSession* sessions;
+    int max_sessions;
+    int active;
+    int epoll_fd;
+    char* data_buf;
+    EngineDnsEntry* dns;
+    int dns_count;
+    int succeeded;
+    long long total_bytes;
+} Engine;
+
+static uint64_t engine_key(int idx, int is_data) {
+    return ((uint64_t) idx << 1) | (uint64_t) is_data;
+}
+
+// Closes the phase that started at s->phase_start and starts the next one.
+static void engine_phase_done(EngineSession* s, FtpPhase phase) {
+    double now = monotonic_seconds();
+    ftp_phase_add_to(&s->times, phase, now - s->phase_start);
+    s->phase_start = now;
+}
+
+static void engine_watch(Engine* e, int op, int fd, uint32_t events, uint64_t key) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.u64 = key;
+    if (epoll_ctl(e->epoll_fd, op, fd, &ev) < 0 && op != EPOLL_CTL_DEL) {
+        perror("epoll_ctl");
+    }
+}
+
+static void engine_update_control(Engine* e, int idx) {
+    EngineSession* s = &e->sessions[idx];
+    uint32_t events = EPOLLIN;
+    if (s->state == ENGINE_CONNECTING || s->outlen > 0) events |= EPOLLOUT;
+    engine_watch(e, EPOLL_CTL_MOD, s->control_fd, events, engine_key(idx, 0));
+}
+
+static void engine_update_data(Engine* e, int idx) {
+    EngineSession* s = &e->sessions[idx];
+    uint32_t events = 0;
+    if (!s->data_connected) {
+        events = EPOLLOUT;
+    } else if (s->out_fd >= 0 && !s->data_eof) {
+        events = EPOLLIN; // Only read once there is a file to write to (after 150)
+    }
+    engine_watch(e, EPOLL_CTL_MOD, s->data_fd, events, engine_key(idx, 1));
+}
+
+static const char* engine_resolve(Engine* e, const char* host) {
+    for (int i = 0; i < e->dns_count; i++) {
+        if (strcmp(e->dns[i].host, host) == 0) return e->dns[i].ip;
+    }
+    // Blocking, but done once per distinct host
+    EngineDnsEntry* entry = &e->dns[e->dns_count];
+    if (resolve_hostname(host, entry->ip, sizeof(entry->ip)) < 0) return NULL;
+    snprintf(entry->host, sizeof(entry->host), "%s", host);
+    e->dns_count++;
+    return entry->ip;
+}
+
+static void engine_close_data(Engine* e, EngineSession* s) {
+    if (s->data_fd >= 0) {
+        engine_watch(e, EPOLL_CTL_DEL, s->data_fd, 0, 0);
+        close(s->data_fd);
+        s->data_fd = -1;
+    }
+    if (s->out_fd >= 0) {
+        close(s->out_fd);
+        s->out_fd = -1;
+        ftp_progress_end(s->progress);
+        s->progress = NULL;
+    }
+}
+
+static void engine_close_session(Engine* e, int idx) {
+    EngineSession* s = &e->sessions[idx];
+    engine_close_data(e, s);
+    if (s->entry >= 0 && e->status[s->entry] == URL_ACTIVE) {
+        e->status[s->entry] = URL_FAILED;
+    }
+    engine_watch(e, EPOLL_CTL_DEL, s->control_fd, 0, 0);
+    close(s->control_fd);
+    s->in_use = 0;
+    e->active--;
+}
+
+// Writes the --stats-json line for the session's current file and starts a new record.
+static void engine_emit_stats(Engine* e, EngineSession* s, int status) {
+    const ParsedUrl* url = &e->urls[s->entry];
+    TransferStats stats = {0};
+    double now = s->eof_at > 0 ? s->eof_at : monotonic_seconds();
+
+    stats.bytes = s->bytes;
+    stats.method = "epoll";
+    stats.first_byte_at = s->first_byte_at;
+    stats.finished_at = now;
+    stats.seconds = s->first_byte_at > 0 ? now - s->first_byte_at : 0;
+    stats.ttfb = s->first_byte_at > 0 && s->retr_sent > 0 ? s->first_byte_at - s->retr_sent : -1;
+    if (stats.ttfb >= 0) {
+        ftp_progress_phase(FTP_PHASE_TTFB, stats.ttfb);
+        ftp_progress_phase(FTP_PHASE_TRANSFER, stats.seconds);
+    }
+    ftp_stats_emit("engine", url, url->path, ftp_local_name(url->path), status, &s->times, &stats);
+    ftp_phase_clear(&s->times);
+    s->retr_sent = 0;
+    s->first_byte_at = 0;
+    s->eof_at = 0;
+}
+
+static void engine_fail(Engine* e, int idx, const char* reason) {
+    EngineSession* s = &e->sessions[idx];
+    const char* path = s->entry >= 0 ? e->urls[s->entry].path : "-";
+    fprintf(stderr, "[%d] %s: %s\n", idx, path, reason);
+    if (s->entry >= 0) engine_emit_stats(e, s, -1);
+    engine_close_session(e, idx);
+}
+
+static int engine_flush(Engine* e, int idx) {
+    EngineSession* s = &e->sessions[idx];
+    while (s->outlen > 0) {
+        ssize_t n = send(s->control_fd, s->outbuf, s->outlen, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        memmove(s->outbuf, s->outbuf + n, s->outlen - n);
+        s->outlen -= n;
+    }
+    engine_update_control(e, idx);
+    return 0;
+}
+
+static int engine_send(Engine* e, int idx, const char* command, const char* arg) {
+    EngineSession* s = &e->sessions[idx];
+    int len = snprintf(s->outbuf + s->outlen, sizeof(s->outbuf) - s->outlen, "%s%s%s\r\n",
+                       command, arg ? " " : "", arg ? arg : "");
+    if (len < 0 || (size_t) len >= sizeof(s->outbuf) - s->outlen) {
+        fprintf(stderr, "Error: FTP command too long.\n");
+        return -1;
+    }
+    s->outlen += len;
+    return engine_flush(e, idx);
+}
+
+// Asks for a data port: EPSV unless the server refused it before.
+static void engine_request_data(Engine* e, int idx) {
+    EngineSession* s = &e->sessions[idx];
+    s->state = s->epsv_refused ? ENGINE_PASV : ENGINE_EPSV;
+    if (engine_send(e, idx, s->epsv_refused ? "PASV" : "EPSV", NULL) < 0) engine_fail(e, idx, "write failed");
+}
+
+// Moves the session to the next pending URL with the same login, or QUIT.
+static void engine_next_file(Engine* e, int idx) {
+    EngineSession* s = &e->sessions[idx];
+    const ParsedUrl* current = &e->urls[s->entry];
+
+    for (int i = e->next_pending; i < e->count; i++) {
+        if (e->status[i] == URL_PENDING && ftp_same_login(&e->urls[i], current)) {
+            e->status[i] = URL_ACTIVE;
+            s->entry = i;
+            s->phase_start = monotonic_seconds();
+            engine_request_data(e, idx);
+            return;
+        }
+    }
+    s->entry = -1;
+    s->state = ENGINE_QUIT;
+    if (engine_send(e, idx, "QUIT", NULL) < 0) engine_close_session(e, idx);
+}
+
+// Called when both the data EOF and the final RETR reply have been seen.
+static void engine_finish_file(Engine* e, int idx) {
+    EngineSession* s = &e->sessions[idx];
+    const char* path = e->urls[s->entry].path;
+
+    engine_close_data(e, s);
+    if (s->transfer_code == 226 || s->transfer_code == 250) {
+        e->status[s->entry] = URL_DONE;
+        e->succeeded++;
+        e->total_bytes += s->bytes;
+        printf("[%d] %s: %lld bytes (Code %d)\n", idx, path, s->bytes, s->transfer_code);
+        engine_emit_stats(e, s, 0);
+    } else {
+        e->status[s->entry] = URL_FAILED;
+        fprintf(stderr, "[%d] %s: transfer not confirmed (Code %d)\n", idx, path, s->transfer_code);
+        engine_emit_stats(e, s, -1);
+    }
+    engine_next_file(e, idx);
+}
+
+static void engine_start_data(Engine* e, int idx, const char* data_ip, int data_port) {
+    EngineSession* s = &e->sessions[idx];
+
+    s->data_fd = create_tcp_socket_for(data_ip);
+    if (s->data_fd < 0 || set_nonblocking(s->data_fd) < 0) {
+        engine_fail(e, idx, "cannot create data socket");
+        return;
+    }
+    int status = connect_to_server_nonblocking(s->data_fd, data_ip, data_port);
+    if (status < 0) {
+        engine_fail(e, idx, "data connection failed");
+        return;
+    }
+    s->data_connected = (status == 0);
+    s->data_eof = 0;
+    s->transfer_code = 0;
+    s->bytes = 0;
+    engine_watch(e, EPOLL_CTL_ADD, s->data_fd, s->data_connected ? 0 : EPOLLOUT, engine_key(idx, 1));
+
+    // The server waits for the data connection, so RETR can go out right away
+    // (the data connect therefore overlaps the TTFB phase rather than PASV here)
+    s->retr_sent = monotonic_seconds();
+    ftp_phase_add_to(&s->times, FTP_PHASE_PASV, s->retr_sent - s->phase_start);
+    s->state = ENGINE_RETR;
+    if (engine_send(e, idx, "RETR", e->urls[s->entry].path) < 0) engine_fail(e, idx, "write failed");
+}
+
+static void engine_on_reply(Engine* e, int idx, int code, const char* reply) {
+    EngineSession* s = &e->sessions[idx];
+    const ParsedUrl* url = &e->urls[s->entry >= 0 ? s->entry : 0];
+
+    switch (s->state) {
+    case ENGINE_BANNER:
+        if (code == 120) return; // Service ready in a few minutes
+        if (code != 220) { engine_fail(e, idx, "no 220 welcome"); return; }
+        engine_phase_done(s, FTP_PHASE_BANNER);
+        s->state = ENGINE_USER;
+        if (engine_send(e, idx, "USER", url->user) < 0) engine_fail(e, idx, "write failed");
+        return;
+    case ENGINE_USER:
+        if (code == 331) {
+            s->state = ENGINE_PASS;
+            if (engine_send(e, idx, "PASS", url->pass) < 0) engine_fail(e, idx, "write failed");
+            return;
+        }
+        // Fall through: 230 straight after USER is a valid login
+    case ENGINE_PASS:
+        if (code != 230 && code != 202) { engine_fail(e, idx, "login failed"); return; }
+        s->state = ENGINE_TYPE;
+        if (engine_send(e, idx, "TYPE", "I") < 0) engine_fail(e, idx, "write failed");
+        return;
+    case ENGINE_TYPE:
+        if (code != 200) fprintf(stderr, "[%d] Warning: TYPE I refused (Code %d)\n", idx, code);
+        engine_phase_done(s, FTP_PHASE_LOGIN);
+        engine_request_data(e, idx);
+        return;
+    case ENGINE_EPSV: {
+        int data_port;
+        if (code == 229 && ftp_parse_epsv_reply(reply, &data_port) == 0) {
+            engine_start_data(e, idx, s->peer_ip, data_port); // Same host as the control connection
+            return;
+        }
+        if (strchr(s->peer_ip, ':')) { engine_fail(e, idx, "EPSV refused on IPv6"); return; }
+        s->epsv_refused = 1;
+        engine_request_data(e, idx);
+        return;
+    }
+    case ENGINE_PASV: {
+        char data_ip[INET6_ADDRSTRLEN];
+        int data_port;
+        if (code != 227) { engine_fail(e, idx, "PASV refused"); return; }
+        if (ftp_parse_pasv_reply(reply, data_ip, sizeof(data_ip), &data_port) < 0) {
+            engine_fail(e, idx, "could not parse PASV reply");
+            return;
+        }
+        engine_start_data(e, idx, data_ip, data_port);
+        return;
+    }
+    case ENGINE_RETR:
+        if (code == 150 || code == 125) {
+            s->out_fd = open(ftp_local_name(e->urls[s->entry].path), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (s->out_fd < 0) {
+                perror("open local file for writing");
+                engine_fail(e, idx, "cannot create local file");
+                return;
+            }
+            s->progress = ftp_progress_begin(-1);
+            s->state = ENGINE_TRANSFER;
+            if (s->data_connected) engine_update_data(e, idx);
+            return;
+        }
+        // File-level failure (e.g. 550): the session itself is still usable
+        fprintf(stderr, "[%d] %s: RETR refused (Code %d)\n", idx, e->urls[s->entry].path, code);
+        engine_close_data(e, s);
+        e->status[s->entry] = URL_FAILED;
+        engine_emit_stats(e, s, -1);
+        engine_next_file(e, idx);
+        return;
+    case ENGINE_TRANSFER:
+        s->transfer_code = code;
+        if (s->data_eof) engine_finish_file(e, idx);
+        return;
+    case ENGINE_QUIT:
+        engine_close_session(e, idx);
+        return;
+    case ENGINE_CONNECTING:
+        return;
+    }
+}
+
+static void engine_on_control(Engine* e, int idx, uint32_t events) {
+    EngineSession* s = &e->sessions[idx];
+
+    if (s->state == ENGINE_CONNECTING) {
+        if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) return;
+        if (connect_result(s->control_fd) < 0) {
+            engine_fail(e, idx, "control connection failed");
+            return;
+        }
+        engine_phase_done(s, FTP_PHASE_CONNECT);
+        s->state = ENGINE_BANNER;
+        engine_update_control(e, idx);
+        return;
+    }
+    if ((events & EPOLLOUT) && engine_flush(e, idx) < 0) {
+        engine_fail(e, idx, "write failed");
+        return;
+    }
+    if (!(events & (EPOLLIN | EPOLLERR | EPOLLHUP))) return;
+
+    ssize_t n = read(s->control_fd, s->inbuf + s->inlen, sizeof(s->inbuf) - 1 - s->inlen);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+    if (n <= 0) {
+        if (s->state == ENGINE_QUIT) {
+            engine_close_session(e, idx); // Server closed after QUIT without 221
+        } else {
+            engine_fail(e, idx, "control connection closed");
+        }
+        return;
+    }
+    s->inlen += n;
+    s->last_activity = monotonic_seconds();
+
+    int code;
+    size_t reply_len;
+    while (s->in_use && ftp_parse_reply(s->inbuf, s->inlen, &code, &reply_len)) {
+        char reply[FTP_READER_BUF_SIZE];
+        memcpy(reply, s->inbuf, reply_len);
+        reply[reply_len] = '\0';
+        memmove(s->inbuf, s->inbuf + reply_len, s->inlen - reply_len);
+        s->inlen -= reply_len;
+        engine_on_reply(e, idx, code, reply);
+    }
+    if (s->in_use && s->inlen == sizeof(s->inbuf) - 1) {
+        engine_fail(e, idx, "reply too long");
+    }
+}
+
+static void engine_on_data(Engine* e, int idx, uint32_t events) {
+    EngineSession* s = &e->sessions[idx];
+
+    if (!s->data_connected) {
+        if (connect_result(s->data_fd) < 0) {
+            engine_fail(e, idx, "data connection failed");
+            return;
+        }
+        s->data_connected = 1;
+        engine_update_data(e, idx);
+        return;
+    }
+    if (s->out_fd < 0) return;
+
+    // One read per wakeup keeps the sessions fair
+    ssize_t n = read(s->data_fd, e->data_buf, FTP_ENGINE_DATA_BUF_SIZE);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+    if (n < 0) {
+        engine_fail(e, idx, "read from data socket failed");
+        return;
+    }
+    s->last_activity = monotonic_seconds();
+    if (n > 0 && s->first_byte_at == 0) s->first_byte_at = s->last_activity;
+    if (n == 0) {
+        s->data_eof = 1;
+        s->eof_at = s->last_activity;
+        engine_watch(e, EPOLL_CTL_DEL, s->data_fd, 0, 0);
+        close(s->data_fd);
+        s->data_fd = -1;
+        if (s->transfer_code) engine_finish_file(e, idx);
+        return;
+    }
+    ssize_t written = 0;
+    while (written < n) {
+        ssize_t w = write(s->out_fd, e->data_buf + written, n - written);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            perror("write to local file");
+            engine_fail(e, idx, "write to local file failed");
+            return;
+        }
+        written += w;
+    }
+    s->bytes += n;
+    ftp_progress_add_to(s->progress, n);
+}
+
+// Starts a new session for URL `entry`. Returns 0 on success, -1 on failure.
+static int engine_start(Engine* e, int entry) {
+    int idx;
+    for (idx = 0; idx < e->max_sessions && e->sessions[idx].in_use; idx++) {}
+    if (idx == e->max_sessions) return -1;
+
+    EngineSession* s = &e->sessions[idx];
+    const ParsedUrl* url = &e->urls[entry];
+    int cached = e->dns_count;
+    double resolve_start = monotonic_seconds();
+    const char* ip = engine_resolve(e, url->host);
+    if (!ip) return -1;
+    double connect_start = monotonic_seconds();
+
+    int fd = create_tcp_socket_for(ip);
+    if (fd < 0) return -1;
+    if (set_nonblocking(fd) < 0) {
+        close(fd);
+        return -1;
+    }
+    int status = connect_to_server_nonblocking(fd, ip, url->port);
+    if (status < 0) {
+        close(fd);
+        return -1;
+    }
+
+    memset(s, 0, sizeof(*s));
+    s->in_use = 1;
+    s->control_fd = fd;
+    s->data_fd = -1;
+    s->out_fd = -1;
+    s->entry = entry;
+    s->state = status == 0 ? ENGINE_BANNER : ENGINE_CONNECTING;
+    s->last_activity = monotonic_seconds();
+    ftp_phase_clear(&s->times);
+    if (e->dns_count > cached) {
+        s->times.seconds[FTP_PHASE_DNS] = connect_start - resolve_start; // Not cached: this session paid for it
+    }
+    s->phase_start = connect_start;
+    if (status == 0) engine_phase_done(s, FTP_PHASE_CONNECT);
+    snprintf(s->peer_ip, sizeof(s->peer_ip), "%s", ip);
+    e->status[entry] = URL_ACTIVE;
+    e->active++;
+    engine_watch(e, EPOLL_CTL_ADD, fd, EPOLLIN | (status ? EPOLLOUT : 0), engine_key(idx, 0));
+    return 0;
+}
+
+static void engine_check_timeouts(Engine* e, double now) {
+    for (int i = 0; i < e->max_sessions; i++) {
+        if (e->sessions[i].in_use && now - e->sessions[i].last_activity > FTP_ENGINE_IDLE_TIMEOUT) {
+            engine_fail(e, i, "timed out");
+        }
+    }
+}
+
+int ftp_engine_download(const ParsedUrl* urls, int count, int max_sessions) {
+    Engine e;
+    struct epoll_event events[ENGINE_MAX_EVENTS];
+
+    if (max_sessions < 1) max_sessions = 1;
+    if (max_sessions > FTP_ENGINE_MAX_SESSIONS) max_sessions = FTP_ENGINE_MAX_SESSIONS;
+
+    memset(&e, 0, sizeof(e));
+    e.urls = urls;
+    e.count = count;
+    e.max_sessions = max_sessions;
+    e.status = calloc(count, sizeof(UrlStatus));
+    e.sessions = calloc(max_sessions, sizeof(EngineSession));
+    e.dns = calloc(count, sizeof(EngineDnsEntry));
+    e.data_buf = malloc(FTP_ENGINE_DATA_BUF_SIZE);
+    e.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (!e.status || !e.sessions || !e.dns || !e.data_buf || e.epoll_fd < 0) {
+        perror("engine setup");
+        free(e.status);
+        free(e.sessions);
+        free(e.dns);
+        free(e.data_buf);
+        if (e.epoll_fd >= 0) close(e.epoll_fd);
+        return -1;
+    }
+    printf("Engine: %d URL(s), up to %d concurrent session(s).\n", count, max_sessions);
+
+    double start = monotonic_seconds();
+    double last_timeout_check = start;
+    for (;;) {
+        // Top up with new sessions for URLs nobody has picked up yet
+        while (e.active < e.max_sessions && e.next_pending < e.count) {
+            if (e.status[e.next_pending] != URL_PENDING) {
+                e.next_pending++;
+                continue;
+            }
+            if (engine_start(&e, e.next_pending) < 0) {
+                fprintf(stderr, "[-] %s: could not start session\n", urls[e.next_pending].path);
+                e.status[e.next_pending] = URL_FAILED;
+            }
+            e.next_pending++;
+        }
+        if (e.active == 0) break;
+
+        int n = epoll_wait(e.epoll_fd, events, ENGINE_MAX_EVENTS, 1000);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            int idx = (int)(events[i].data.u64 >> 1);
+            int is_data = (int)(events[i].data.u64 & 1);
+            EngineSession* s = &e.sessions[idx];
+            if (!s->in_use) continue; // Closed earlier in this batch of events
+            if (is_data) {
+                if (s->data_fd >= 0) engine_on_data(&e, idx, events[i].events);
+            } else {
+                engine_on_control(&e, idx, events[i].events);
+            }
+        }
+        double now = monotonic_seconds();
+        if (now - last_timeout_check >= 1.0) {
+            engine_check_timeouts(&e, now);
+            last_timeout_check = now;
+        }
+    }
+    // Anything left over (e.g. epoll failure) counts as failed
+    for (int i = 0; i < e.max_sessions; i++) {
+        if (e.sessions[i].in_use) engine_close_session(&e, i);
+    }
+    double elapsed = monotonic_seconds() - start;
+
+    printf("Engine summary: %d/%d files, %lld bytes in %.3f s", e.succeeded, count, e.total_bytes, elapsed);
+    if (elapsed > 0) {
+        printf(" (%.1f files/s, %.2f MB/s)", e.succeeded / elapsed, e.total_bytes / elapsed / 1e6);
+    }
+    printf(".\n");
+
+    int status = e.succeeded == count ? 0 : -1;
+    close(e.epoll_fd);
+    free(e.status);
+    free(e.sessions);
+    free(e.dns);
+    free(e.data_buf);
+    return status;
+}
@@ -0,0 +1,24 @@
+#ifndef FTP_ENGINE_H
+#define FTP_ENGINE_H
+
+#include "url_parser.h"
+
+#define FTP_ENGINE_DEFAULT_SESSIONS 64
+#define FTP_ENGINE_MAX_SESSIONS 1024
+#define FTP_ENGINE_IDLE_TIMEOUT 60        // Seconds without progress before a session is dropped
+#define FTP_ENGINE_DATA_BUF_SIZE (256 * 1024)
+
+/**
+ * Downloads many URLs concurrently from a single thread.
+ * Every session is a non-blocking state machine
+ * (connect -> 220 -> USER/PASS -> TYPE I -> EPSV/PASV -> RETR -> 226) driven by epoll.
+ * When a session finishes a file it picks the next queued URL with the same
+ * login and goes straight back to EPSV/PASV; otherwise it sends QUIT.
+ * @param urls The URLs to download.
+ * @param count Number of URLs.
+ * @param max_sessions Maximum number of sessions in flight (1..FTP_ENGINE_MAX_SESSIONS).
+ * @return 0 if every file was downloaded, -1 otherwise.
+ */
+int ftp_engine_download(const ParsedUrl* urls, int count, int max_sessions);
+
+#endif // FTP_ENGINE_H
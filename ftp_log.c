@@ -0,0 +1,53 @@
+#include "ftp_log.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h> // For strerror
+#include <errno.h>
+
+// Each thread drives its own sessions, so each can point its text elsewhere
+static __thread FtpLogSink current_sink;
+
+FtpLogSink ftp_log_swap(FtpLogSink sink) {
+    FtpLogSink previous = current_sink;
+    current_sink = sink;
+    return previous;
+}
+
+void ftp_log(const char* fmt, ...) {
+    char text[1024];
+    va_list ap;
+
+    if (current_sink.quiet) return;
+    va_start(ap, fmt);
+    if (!current_sink.fn) {
+        vprintf(fmt, ap);
+        va_end(ap);
+        return;
+    }
+    vsnprintf(text, sizeof(text), fmt, ap); // Longer text is cut; replies are logged line by line
+    va_end(ap);
+    current_sink.fn(current_sink.ctx, text);
+}
+
+void ftp_log_error(const char* fmt, ...) {
+    char text[1024];
+    va_list ap;
+
+    if (current_sink.quiet) return;
+    va_start(ap, fmt);
+    if (!current_sink.fn) {
+        vfprintf(stderr, fmt, ap);
+        va_end(ap);
+        return;
+    }
+    vsnprintf(text, sizeof(text), fmt, ap);
+    va_end(ap);
+    current_sink.fn(current_sink.ctx, text);
+}
+
+void ftp_log_perror(const char* what) {
+    int err = errno;
+    ftp_log_error("%s: %s\n", what, strerror(err));
+    errno = err;
+}
@@ -0,0 +1,42 @@
+#ifndef FTP_LOG_H
+#define FTP_LOG_H
+
+// Where the protocol and transfer code sends its progress text ("C: ...",
+// "S: ...", throughput reports) and its error messages. By default they go to
+// stdout and stderr like printf and perror; an embedding application can take
+// both over per thread.
+typedef void (*FtpLogFn)(void* ctx, const char* text);
+
+typedef struct {
+    FtpLogFn fn;    // NULL: write to stdout
+    void* ctx;      // Passed to fn
+    int quiet;      // Drop the text (fn is not called)
+} FtpLogSink;
+
+/**
+ * Installs the calling thread's sink and returns the previous one, so a
+ * caller can restore it when it is done.
+ * @param sink The new sink.
+ * @return The sink that was in effect.
+ */
+FtpLogSink ftp_log_swap(FtpLogSink sink);
+
+/**
+ * printf for progress text, sent to the calling thread's sink. Text is passed
+ * on as formatted; it is not necessarily a whole line.
+ */
+void ftp_log(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+
+/**
+ * fprintf(stderr, ...) for error and warning text: stderr by default, the
+ * calling thread's sink (fn, or nothing if quiet) once one was installed with
+ * ftp_log_swap(), so an embedding application sees no output of its own.
+ */
+void ftp_log_error(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+
+/**
+ * perror() through ftp_log_error(): "what: <strerror(errno)>\n".
+ */
+void ftp_log_perror(const char* what);
+
+#endif // FTP_LOG_H
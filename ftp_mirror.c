@@ -0,0 +1,357 @@
+#include "ftp_mirror.h"
+#include "ftp_session.h"
+#include "ftp_utils.h"
+#include "ftp_stats.h"
+#include "ftp_sync.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+typedef struct MirrorItem {
+    int is_dir;
+    long long size;          // From the MLSD facts, -1 if unknown
+    time_t mtime;            // From the MLSD facts, -1 if unknown
+    char remote[MAX_PATH_LEN];
+    char local[MAX_PATH_LEN];
+    struct MirrorItem* next;
+} MirrorItem;
+
+typedef struct {
+    const ParsedUrl* url;
+    const TransferOptions* opts;
+    FtpManifest* manifest;   // --sync: skip files it says are unchanged (NULL otherwise)
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    MirrorItem* head;        // FIFO, so the tree is walked breadth-first
+    MirrorItem* tail;
+    int in_progress;         // Items taken by a worker and not finished yet
+    int live_workers;
+    int files, dirs, failures, unchanged;
+    long long bytes;
+} MirrorQueue;
+
+typedef struct {
+    MirrorQueue* queue;
+    int index;
+    int use_list;            // Server refused MLSD: parse LIST output instead
+} MirrorWorker;
+
+static void mirror_push(MirrorQueue* q, int is_dir, const char* remote, const char* local, const FtpFacts* facts) {
+    MirrorItem* item = calloc(1, sizeof(MirrorItem));
+    if (!item) {
+        perror("calloc mirror item");
+        q->failures++;
+        return;
+    }
+    item->is_dir = is_dir;
+    item->size = facts ? facts->size : -1;
+    item->mtime = facts ? facts->mtime : -1;
+    snprintf(item->remote, sizeof(item->remote), "%s", remote);
+    snprintf(item->local, sizeof(item->local), "%s", local);
+    if (q->tail) q->tail->next = item;
+    else q->head = item;
+    q->tail = item;
+    pthread_cond_signal(&q->changed);
+}
+
+// Blocks until there is an item or the mirror is finished (returns NULL).
+static MirrorItem* mirror_pop(MirrorQueue* q) {
+    MirrorItem* item;
+    pthread_mutex_lock(&q->lock);
+    while (!q->head && q->in_progress > 0) {
+        pthread_cond_wait(&q->changed, &q->lock);
+    }
+    item = q->head;
+    if (item) {
+        q->head = item->next;
+        if (!q->head) q->tail = NULL;
+        q->in_progress++;
+    } else {
+        pthread_cond_broadcast(&q->changed); // Nothing queued and nothing running: done
+    }
+    pthread_mutex_unlock(&q->lock);
+    return item;
+}
+
+// status: 0 done, 1 skipped as unchanged, -1 failed
+static void mirror_done(MirrorQueue* q, MirrorItem* item, int status, long long bytes) {
+    pthread_mutex_lock(&q->lock);
+    q->in_progress--;
+    if (status < 0) q->failures++;
+    else if (item->is_dir) q->dirs++;
+    else if (status > 0) q->unchanged++;
+    else {
+        q->files++;
+        q->bytes += bytes;
+    }
+    pthread_cond_broadcast(&q->changed);
+    pthread_mutex_unlock(&q->lock);
+    free(item);
+}
+
+static int make_dirs(const char* path) {
+    char tmp[MAX_PATH_LEN];
+    snprintf(tmp, sizeof(tmp), "%s", path);
+    for (char* p = tmp + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            if (mkdir(tmp, 0755) < 0 && errno != EEXIST) return -1;
+            *p = '/';
+        }
+    }
+    if (mkdir(tmp, 0755) < 0 && errno != EEXIST) return -1;
+    return 0;
+}
+
+// Names that would escape the mirror root or are not real entries
+static int unsafe_name(const char* name) {
+    return name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || strchr(name, '/') != NULL;
+}
+
+// Parses one MLSD line ("type=file;size=12;modify=...; name"). Returns 1 for a file
+// or directory entry, 0 to skip the line.
+static int parse_mlsd_line(char* line, char** name, int* is_dir, FtpFacts* facts) {
+    char* space = strchr(line, ' ');
+    if (!space) return 0;
+    *space = '\0';
+    *name = space + 1;
+    ftp_parse_facts(line, facts);
+    if (facts->type == FTP_ENTRY_OTHER) return 0;
+    *is_dir = (facts->type == FTP_ENTRY_DIR);
+    return 1;
+}
+
+// Parses one LIST line, Unix ("drwxr-xr-x 2 u g 4096 Jan 01 12:00 name") or
+// DOS ("01-01-20 12:00PM <DIR> name") style. Returns 1 for a file or directory.
+static int parse_list_line(char* line, char** name, int* is_dir) {
+    char* fields[9];
+    char* p = line;
+    int count = 0;
+
+    if (line[0] == 'l') return 0; // Symbolic link
+    if (line[0] == 'd' || line[0] == '-') {
+        while (count < 8) {
+            while (*p == ' ' || *p == '\t') p++;
+            if (!*p) return 0;
+            fields[count++] = p;
+            while (*p && *p != ' ' && *p != '\t') p++;
+        }
+        while (*p == ' ' || *p == '\t') p++;
+        *name = p;
+        *is_dir = (line[0] == 'd');
+        return **name != '\0';
+    }
+    // DOS style: date, time, "<DIR>" or size, name
+    while (count < 3) {
+        while (*p == ' ') p++;
+        if (!*p) return 0;
+        fields[count++] = p;
+        while (*p && *p != ' ') p++;
+    }
+    while (*p == ' ') p++;
+    *name = p;
+    *is_dir = strncmp(fields[2], "<DIR>", 5) == 0;
+    return **name != '\0' && (line[0] >= '0' && line[0] <= '9');
+}
+
+static int mirror_list(MirrorWorker* w, FtpConn* control, MirrorItem* item) {
+    MirrorQueue* q = w->queue;
+    char* listing = NULL;
+    size_t listing_len;
+    int ftp_code = 0;
+    int status = -1;
+
+    if (make_dirs(item->local) < 0) {
+        perror("mkdir mirror directory");
+        return -1;
+    }
+    // Listings are text: always worth compressing
+    if (q->opts && q->opts->mode_z && ftp_select_mode_z(control, 1) < 0) return -1;
+    for (int attempt = 0; attempt < 2 && status < 0; attempt++) {
+        int data_sockfd = ftp_open_data_connection(control);
+        if (data_sockfd < 0) return -1;
+        status = ftp_list_directory(control, data_sockfd, w->use_list ? "LIST" : "MLSD", item->remote,
+                                    &listing, &listing_len, &ftp_code);
+        close(data_sockfd);
+        if (status < 0 && !w->use_list && (ftp_code == 500 || ftp_code == 502 || ftp_code == 504)) {
+            printf("Worker %d: MLSD not supported, falling back to LIST.\n", w->index);
+            w->use_list = 1;
+            continue;
+        }
+        break;
+    }
+    if (status < 0) return -1;
+
+    pthread_mutex_lock(&q->lock);
+    char* save = NULL;
+    for (char* line = strtok_r(listing, "\r\n", &save); line; line = strtok_r(NULL, "\r\n", &save)) {
+        char* name;
+        int is_dir;
+        char remote[MAX_PATH_LEN], local[MAX_PATH_LEN];
+        FtpFacts facts = {FTP_ENTRY_OTHER, -1, -1};
+        int ok = w->use_list ? parse_list_line(line, &name, &is_dir) : parse_mlsd_line(line, &name, &is_dir, &facts);
+        if (!ok || unsafe_name(name)) continue;
+        int remote_len = strcmp(item->remote, ".") == 0 ? snprintf(remote, sizeof(remote), "%s", name)
+                                                         : snprintf(remote, sizeof(remote), "%s/%s", item->remote, name);
+        int local_len = snprintf(local, sizeof(local), "%s/%s", item->local, name);
+        if (remote_len >= (int) sizeof(remote) || local_len >= (int) sizeof(local)) {
+            fprintf(stderr, "Worker %d: path too long, skipping '%s'.\n", w->index, name);
+            q->failures++;
+            continue;
+        }
+        mirror_push(q, is_dir, remote, local, &facts);
+    }
+    pthread_mutex_unlock(&q->lock);
+    free(listing);
+    return 0;
+}
+
+static void* mirror_worker_main(void* arg) {
+    MirrorWorker* w = (MirrorWorker*) arg;
+    MirrorQueue* q = w->queue;
+    FtpConn* control = ftp_session_open(q->url);
+    MirrorItem* item;
+
+    if (!control) {
+        fprintf(stderr, "Worker %d: could not open session.\n", w->index);
+        goto out;
+    }
+    while ((item = mirror_pop(q)) != NULL) {
+        TransferStats stats = {0};
+        FtpPhaseTimes times;
+        int status;
+
+        stats.ttfb = -1;
+        if (item->is_dir) {
+            status = mirror_list(w, control, item);
+        } else if (q->manifest &&
+                   ftp_manifest_unchanged(q->manifest, q->url, item->remote, item->size, item->mtime, item->local)) {
+            status = 1;
+        } else {
+            status = -1;
+            int data_sockfd = ftp_open_data_connection(control);
+            if (data_sockfd >= 0) {
+                // The listed size lets rate caps favour small files
+                TransferOptions item_opts = {0};
+                if (q->opts) item_opts = *q->opts;
+                if (item->size > 0) item_opts.size_hint = item->size;
+                status = ftp_retrieve_file(control, data_sockfd, item->remote, item->local, &item_opts, &stats);
+                close(data_sockfd);
+            }
+            if (status == 0 && q->manifest) {
+                ftp_manifest_record(q->manifest, q->url, item->remote, item->size >= 0 ? item->size : stats.bytes,
+                                    item->mtime, &stats);
+            }
+        }
+        if (status < 0) {
+            fprintf(stderr, "Worker %d: failed to mirror '%s'.\n", w->index, item->remote);
+        }
+        ftp_phase_take(&times);
+        if (!item->is_dir && status <= 0) {
+            ftp_stats_emit("mirror", q->url, item->remote, item->local, status, &times, &stats);
+        }
+        mirror_done(q, item, status, stats.bytes);
+
+        // A failure may have left the session unusable: reopen it before going on
+        if (status < 0 && ftp_noop(control) < 0) {
+            ftp_session_close(control);
+            control = ftp_session_open(q->url);
+            if (!control) {
+                fprintf(stderr, "Worker %d: could not reopen session.\n", w->index);
+                goto out;
+            }
+        }
+    }
+    ftp_session_close(control);
+out:
+    pthread_mutex_lock(&q->lock);
+    if (--q->live_workers == 0) {
+        // Last worker standing: whatever is still queued will not be fetched
+        while (q->head) {
+            MirrorItem* next = q->head->next;
+            q->failures++;
+            free(q->head);
+            q->head = next;
+        }
+        q->tail = NULL;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+int ftp_mirror(const ParsedUrl* url, int num_workers, const TransferOptions* opts, FtpManifest* manifest) {
+    MirrorQueue queue;
+    TransferOptions synced = {0};
+    MirrorWorker workers[FTP_MIRROR_MAX_WORKERS];
+    pthread_t threads[FTP_MIRROR_MAX_WORKERS];
+    char root_remote[MAX_PATH_LEN];
+    char root_local[MAX_PATH_LEN];
+    int started;
+
+    if (num_workers < 1) num_workers = 1;
+    if (num_workers > FTP_MIRROR_MAX_WORKERS) num_workers = FTP_MIRROR_MAX_WORKERS;
+
+    // "dir/" -> remote "dir", local "dir"; the server root is mirrored into "<host>"
+    snprintf(root_remote, sizeof(root_remote), "%s", url->path);
+    size_t len = strlen(root_remote);
+    while (len > 1 && root_remote[len - 1] == '/') root_remote[--len] = '\0';
+    const char* base = strrchr(root_remote, '/');
+    base = base ? base + 1 : root_remote;
+    snprintf(root_local, sizeof(root_local), "%s", (strcmp(base, ".") == 0 || *base == '\0') ? url->host : base);
+
+    memset(&queue, 0, sizeof(queue));
+    queue.url = url;
+    queue.opts = opts;
+    queue.manifest = manifest;
+    if (manifest) {
+        // Downloads are hashed for the manifest
+        if (opts) synced = *opts;
+        if (synced.hash_alg == TRANSFER_HASH_NONE) synced.hash_alg = TRANSFER_HASH_CRC32C;
+        queue.opts = &synced;
+    }
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.changed, NULL);
+    mirror_push(&queue, 1, root_remote, root_local, NULL);
+    printf("Mirroring '%s' into '%s' with %d worker(s).\n", root_remote, root_local, num_workers);
+
+    double start = monotonic_seconds();
+    queue.live_workers = num_workers;
+    for (started = 0; started < num_workers; started++) {
+        workers[started].queue = &queue;
+        workers[started].index = started;
+        workers[started].use_list = 0;
+        if (pthread_create(&threads[started], NULL, mirror_worker_main, &workers[started]) != 0) {
+            perror("pthread_create");
+            pthread_mutex_lock(&queue.lock);
+            queue.live_workers -= num_workers - started;
+            pthread_mutex_unlock(&queue.lock);
+            break;
+        }
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = monotonic_seconds() - start;
+
+    printf("Mirror summary: %d file(s), %d dir(s), %lld bytes in %.3f s, %d failure(s)",
+           queue.files, queue.dirs, queue.bytes, elapsed, queue.failures);
+    if (manifest) printf(", %d unchanged", queue.unchanged);
+    if (elapsed > 0) {
+        printf(" (%.1f files/s, %.2f MB/s)", queue.files / elapsed, queue.bytes / elapsed / 1e6);
+    }
+    printf(".\n");
+
+    while (queue.head) { // Only left if no worker could start
+        MirrorItem* next = queue.head->next;
+        free(queue.head);
+        queue.head = next;
+    }
+    pthread_mutex_destroy(&queue.lock);
+    pthread_cond_destroy(&queue.changed);
+    return (queue.failures == 0 && started > 0) ? 0 : -1;
+}
@@ -0,0 +1,28 @@
+#ifndef FTP_MIRROR_H
+#define FTP_MIRROR_H
+
+#include "url_parser.h"
+#include "data_transfer.h"
+#include "ftp_sync.h"
+
+#define FTP_MIRROR_DEFAULT_WORKERS 4
+#define FTP_MIRROR_MAX_WORKERS 32
+
+/**
+ * Mirrors a remote directory tree into a local directory named after it.
+ * A pool of worker threads, each with its own logged-in session, drains a
+ * shared queue: a directory item is listed with MLSD (or LIST if the server
+ * lacks MLSD) and its entries are queued, a file item is downloaded. So
+ * listing and downloading overlap as the tree is discovered. With a manifest,
+ * files whose MLSD size and modify facts match it (and whose local copy is
+ * intact) are skipped without a single extra command, and downloads are
+ * recorded in it.
+ * @param url The parsed URL of the remote directory.
+ * @param num_workers Number of parallel sessions (1..FTP_MIRROR_MAX_WORKERS).
+ * @param opts How to drain each data connection (may be NULL).
+ * @param manifest --sync manifest (NULL to download everything); the caller saves it.
+ * @return 0 if every file and directory was mirrored, -1 otherwise.
+ */
+int ftp_mirror(const ParsedUrl* url, int num_workers, const TransferOptions* opts, FtpManifest* manifest);
+
+#endif // FTP_MIRROR_H
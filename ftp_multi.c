@@ -0,0 +1,532 @@
+#include "ftp_multi.h"
+#include "ftp_segmented.h" // For FTP_MAX_SEGMENTS
+#include "ftp_session.h"
+#include "ftp_utils.h"
+#include "ftp_stats.h"
+#include "ftp_resume.h"
+#include "ftp_progress.h"
+#include "transfer_hash.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>     // For close, read, ftruncate
+#include <fcntl.h>      // For open, posix_fallocate
+#include <pthread.h>
+#include <sys/socket.h> // For shutdown
+
+#define FTP_MULTI_WAIT_MS 100 // How often an idle connection looks at the ranges still in flight
+
+typedef struct {
+    long long start;
+    long long end;      // Exclusive
+} MultiRange;
+
+typedef struct MultiWorker MultiWorker;
+
+// The ranges nobody has fetched yet, shared by every connection
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t changed; // A range was taken, finished or put back
+    MultiRange* holes;
+    int num_holes;
+    int cap_holes;
+    int lost;               // A range could not be put back (out of memory)
+    long long size;
+    MultiWorker* workers;
+    int num_workers;
+} MultiPool;
+
+struct MultiWorker {
+    MultiPool* pool;
+    const ParsedUrl* url;
+    const TransferOptions* opts;
+    int mirror;
+    FtpConn* control;    // Session kept across ranges, NULL between reconnects
+    int out_fd;
+    // Guarded by pool->lock
+    int busy;            // Has a range in flight
+    long long range_start;
+    long long range_end;
+    double range_since;  // monotonic_seconds() when the range was taken
+    int data_sockfd;     // Its data connection, -1 while there is none
+    int preempted;       // Another connection asked for the rest of it
+    double rate;         // Bytes/s of the last range (0 until one finished)
+    // Only touched by the worker's thread
+    int ranges;
+    int handed_off;
+    int retries;
+    TransferStats stats; // Bytes and NOOPs of all its ranges, TTFB of the first
+    FtpPhaseTimes times;
+};
+
+// Puts [start, end) back into the pool. Call with the lock held.
+static void pool_put(MultiPool* p, long long start, long long end) {
+    if (start >= end) return;
+    if (p->num_holes == p->cap_holes) {
+        int cap = p->cap_holes > 0 ? p->cap_holes * 2 : 8;
+        MultiRange* holes = realloc(p->holes, cap * sizeof(*holes));
+        if (!holes) {
+            p->lost = 1;
+            return;
+        }
+        p->holes = holes;
+        p->cap_holes = cap;
+    }
+    p->holes[p->num_holes].start = start;
+    p->holes[p->num_holes].end = end;
+    p->num_holes++;
+}
+
+// Takes about `want` bytes from the lowest hole (all of it if the rest would
+// be too small to bother with). Call with the lock held and num_holes > 0.
+static void pool_take(MultiPool* p, long long want, long long* start, long long* end) {
+    int lowest = 0;
+    for (int i = 1; i < p->num_holes; i++) {
+        if (p->holes[i].start < p->holes[lowest].start) lowest = i;
+    }
+    MultiRange* hole = &p->holes[lowest];
+    *start = hole->start;
+    *end = hole->end - hole->start - want < FTP_MULTI_MIN_CHUNK ? hole->end : hole->start + want;
+    hole->start = *end;
+    if (hole->start >= hole->end) p->holes[lowest] = p->holes[--p->num_holes];
+}
+
+static int pool_busy(const MultiPool* p) {
+    for (int i = 0; i < p->num_workers; i++) {
+        if (p->workers[i].busy) return 1;
+    }
+    return 0;
+}
+
+// Picks the range in flight that would finish much sooner if `self` fetched
+// what is left of it: at least FTP_MULTI_STEAL_SECONDS still to go at its
+// owner's rate, and more than twice what `self` would need. A range whose
+// owner has no rate yet is assumed to need as long again as it has taken so far.
+static MultiWorker* pool_slowest(MultiPool* p, const MultiWorker* self, double now) {
+    MultiWorker* victim = NULL;
+    double worst = FTP_MULTI_STEAL_SECONDS;
+
+    for (int i = 0; i < p->num_workers; i++) {
+        MultiWorker* w = &p->workers[i];
+        if (w == self || !w->busy || w->preempted) continue;
+        double elapsed = now - w->range_since;
+        long long left = w->range_end - w->range_start;
+        double eta = elapsed;
+        if (w->rate > 0) {
+            left -= (long long) (w->rate * elapsed);
+            eta = left / w->rate;
+        }
+        if (left < FTP_MULTI_MIN_CHUNK) continue;
+        if (eta > worst && eta > 2 * left / self->rate) {
+            worst = eta;
+            victim = w;
+        }
+    }
+    return victim;
+}
+
+// Waits for a range to fetch. Returns 0 with [*start, *end) taken, or -1 when
+// the pool is empty and no range is in flight any more.
+static int multi_next_range(MultiWorker* w, long long* start, long long* end) {
+    MultiPool* p = w->pool;
+    int status = -1;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        if (p->num_holes > 0) {
+            long long want = w->rate > 0 ? (long long) (w->rate * FTP_MULTI_CHUNK_SECONDS) : FTP_MULTI_FIRST_CHUNK;
+            if (want < FTP_MULTI_MIN_CHUNK) want = FTP_MULTI_MIN_CHUNK;
+            pool_take(p, want, start, end);
+            w->busy = 1;
+            w->preempted = 0;
+            w->range_start = *start;
+            w->range_end = *end;
+            w->range_since = monotonic_seconds();
+            pthread_cond_broadcast(&p->changed);
+            status = 0;
+            break;
+        }
+        if (!pool_busy(p)) break;
+        if (w->rate > 0) {
+            MultiWorker* victim = pool_slowest(p, w, monotonic_seconds());
+            if (victim) {
+                // The owner sees EOF, puts the rest back and goes on with a smaller range
+                printf("Mirror %d: cutting short bytes %lld-%lld on mirror %d, which is falling behind.\n",
+                       w->mirror, victim->range_start, victim->range_end - 1, victim->mirror);
+                victim->preempted = 1;
+                if (victim->data_sockfd >= 0) shutdown(victim->data_sockfd, SHUT_RD);
+            }
+        }
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += FTP_MULTI_WAIT_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&p->changed, &p->lock, &deadline);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return status;
+}
+
+// Adds one range's transfer to the worker's totals
+static void multi_add_stats(MultiWorker* w, const TransferStats* st) {
+    TransferStats* total = &w->stats;
+    if (st->first_byte_at > 0 && (total->first_byte_at == 0 || st->first_byte_at < total->first_byte_at)) {
+        total->first_byte_at = st->first_byte_at;
+        if (total->ttfb < 0) total->ttfb = st->ttfb;
+    }
+    if (st->finished_at > total->finished_at) total->finished_at = st->finished_at;
+    if (!total->method) {
+        total->method = st->method;
+        total->rtt = st->rtt;
+        total->rcvbuf = st->rcvbuf;
+        total->read_size = st->read_size;
+    }
+    total->bytes += st->bytes;
+    total->output_bytes += st->bytes;
+    total->seconds += st->seconds;
+    total->keepalives += st->keepalives;
+}
+
+static void* multi_worker_main(void* arg) {
+    MultiWorker* w = (MultiWorker*) arg;
+    MultiPool* p = w->pool;
+    int max_retries = w->opts ? w->opts->retries : 0;
+    int failures = 0; // In a row
+    long long start, end;
+
+    while (multi_next_range(w, &start, &end) == 0) {
+        int status = -1;
+        int retryable = 1;
+        int preempted;
+        TransferStats st;
+        memset(&st, 0, sizeof(st));
+        st.ttfb = -1;
+
+        if (!w->control) w->control = ftp_session_open(w->url);
+        if (!w->control) {
+            fprintf(stderr, "Mirror %d: could not open session.\n", w->mirror);
+            retryable = failures > 0; // Like ftp_resume_retry: only a reconnect is tried again
+        } else {
+            int data_sockfd = ftp_open_data_connection(w->control);
+            if (data_sockfd >= 0) {
+                pthread_mutex_lock(&p->lock);
+                preempted = w->preempted;
+                if (!preempted) w->data_sockfd = data_sockfd;
+                pthread_mutex_unlock(&p->lock);
+                if (!preempted) {
+                    printf("Mirror %d: bytes %lld-%lld\n", w->mirror, start, end - 1);
+                    status = ftp_retrieve_range(w->control, data_sockfd, w->url->path, w->out_fd,
+                                                start, end - start, end == p->size, w->opts, &st);
+                    pthread_mutex_lock(&p->lock);
+                    w->data_sockfd = -1;
+                    pthread_mutex_unlock(&p->lock);
+                }
+                close(data_sockfd);
+            }
+            if (status < 0) retryable = ftp_transfer_retryable(w->control, &st);
+        }
+
+        // Whatever did not arrive goes back for any connection to take
+        pthread_mutex_lock(&p->lock);
+        if (status < 0) pool_put(p, start + st.bytes, end);
+        if (st.bytes > 0 && st.seconds > 0) w->rate = st.bytes / st.seconds;
+        preempted = w->preempted;
+        w->busy = 0;
+        w->preempted = 0;
+        pthread_cond_broadcast(&p->changed);
+        pthread_mutex_unlock(&p->lock);
+        multi_add_stats(w, &st);
+
+        if (status == 0) {
+            w->ranges++;
+            failures = 0;
+            continue;
+        }
+        if (w->control) {
+            ftp_session_close(w->control); // The server may still be sending
+            w->control = NULL;
+        }
+        if (preempted) {
+            w->handed_off++;
+            printf("Mirror %d: stopped at byte %lld, the rest goes to a faster connection.\n", w->mirror,
+                   start + st.bytes);
+            continue;
+        }
+        if (!retryable || failures >= max_retries) {
+            fprintf(stderr, "Mirror %d (%s): giving up after %d retr%s.\n", w->mirror, w->url->host, failures,
+                    failures == 1 ? "y" : "ies");
+            break;
+        }
+        failures++;
+        w->retries++;
+        ftp_retry_wait(failures);
+    }
+
+    if (w->control) {
+        ftp_session_close(w->control);
+        w->control = NULL;
+    }
+    ftp_phase_take(&w->times);
+    return NULL;
+}
+
+// Digests a local file from the start, as the server's HASH/XCRC would
+static int multi_file_digest(const char* path, TransferHashAlg alg, char* hex, size_t hex_len) {
+    TransferHash hash;
+    char* buf = malloc(TRANSFER_LARGE_BUF_SIZE);
+    int fd = open(path, O_RDONLY);
+    int status = -1;
+
+    if (!buf || fd < 0 || transfer_hash_init(&hash, alg) < 0) {
+        if (fd < 0) perror("open local file for hashing");
+        free(buf);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    for (;;) {
+        ssize_t n = read(fd, buf, TRANSFER_LARGE_BUF_SIZE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            perror("read local file for hashing");
+            transfer_hash_free(&hash);
+            break;
+        }
+        if (n == 0) {
+            status = transfer_hash_final(&hash, hex, hex_len);
+            break;
+        }
+        transfer_hash_update(&hash, buf, (size_t) n);
+    }
+    free(buf);
+    close(fd);
+    return status;
+}
+
+// --hash / --verify over the assembled file. Returns 0, or -1 on a mismatch
+// or an error.
+static int multi_check_digest(const ParsedUrl* urls, const int* usable, int num_urls, const char* local_filename,
+                              const TransferOptions* opts, TransferStats* total) {
+    TransferHashAlg alg = opts->hash_alg;
+    char server_digest[TRANSFER_HASH_HEX_MAX];
+    int source = -1; // Mirror the server digest came from
+
+    for (int m = 0; opts->verify_hash && m < num_urls && source < 0; m++) {
+        FtpFeatures features;
+        if (!usable[m]) continue;
+        FtpConn* control = ftp_session_open(&urls[m]);
+        if (!control) continue;
+        if (ftp_get_features(control, &features) == 0) {
+            TransferHashAlg offered = ftp_digest_choice(&features, opts->hash_alg);
+            if (offered != TRANSFER_HASH_NONE &&
+                ftp_get_server_digest(control, urls[m].path, offered, server_digest, sizeof(server_digest)) == 0) {
+                alg = offered; // Hash what the server can check
+                source = m;
+            }
+        }
+        ftp_session_close(control);
+    }
+    if (opts->verify_hash && source < 0) {
+        fprintf(stderr, "No mirror reports a file digest (HASH/XCRC/XMD5); '%s' will not be verified.\n",
+                local_filename);
+    }
+    if (alg == TRANSFER_HASH_NONE) return 0;
+
+    total->hash_alg = alg;
+    if (multi_file_digest(local_filename, alg, total->digest, sizeof(total->digest)) < 0) return -1;
+    printf("%s: %s\n", transfer_hash_name(alg), total->digest);
+    if (source < 0) return 0;
+    if (strcmp(server_digest, total->digest) != 0) {
+        fprintf(stderr, "%s mismatch for '%s': mirror %d reports %s.\n", transfer_hash_name(alg), local_filename,
+                source, server_digest);
+        return -1;
+    }
+    printf("%s matches mirror %d's digest.\n", transfer_hash_name(alg), source);
+    total->digest_verified = 1;
+    return 0;
+}
+
+int ftp_multi_download(const ParsedUrl* urls, int num_urls, const char* local_filename, int per_mirror,
+                       const TransferOptions* opts) {
+    MultiWorker workers[FTP_MAX_SEGMENTS];
+    pthread_t threads[FTP_MAX_SEGMENTS];
+    FtpConn* probe[FTP_MULTI_MAX_MIRRORS];
+    int usable[FTP_MULTI_MAX_MIRRORS];
+    long long file_size = -1;
+    int num_usable = 0;
+    int out_fd;
+    int i, m, started, failed = 0;
+
+    if (num_urls > FTP_MULTI_MAX_MIRRORS) num_urls = FTP_MULTI_MAX_MIRRORS;
+    if (per_mirror < 1) per_mirror = 1;
+
+    // Every mirror must have the file, at the same size as the first one that answers
+    for (m = 0; m < num_urls; m++) {
+        long long size;
+        usable[m] = 0;
+        probe[m] = ftp_session_open(&urls[m]);
+        if (!probe[m]) {
+            fprintf(stderr, "Mirror %d (%s): unreachable, left out.\n", m, urls[m].host);
+            continue;
+        }
+        if (ftp_get_size(probe[m], urls[m].path, &size) < 0) {
+            fprintf(stderr, "Mirror %d (%s): no SIZE for '%s', left out.\n", m, urls[m].host, urls[m].path);
+        } else if (file_size >= 0 && size != file_size) {
+            fprintf(stderr, "Mirror %d (%s): size %lld differs from %lld, left out.\n", m, urls[m].host, size,
+                    file_size);
+        } else {
+            file_size = size;
+            usable[m] = 1;
+            num_usable++;
+            printf("Mirror %d (%s:%d): %lld bytes.\n", m, urls[m].host, urls[m].port, size);
+            continue;
+        }
+        ftp_session_close(probe[m]);
+        probe[m] = NULL;
+    }
+    if (num_usable == 0) {
+        FtpPhaseTimes times;
+        fprintf(stderr, "No mirror can serve '%s'.\n", urls[0].path);
+        ftp_phase_take(&times);
+        ftp_stats_emit("multi", &urls[0], urls[0].path, local_filename, -1, &times, NULL);
+        return -1;
+    }
+
+    out_fd = open(local_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        perror("open local file for writing");
+        failed = 1;
+    } else if (file_size > 0 && posix_fallocate(out_fd, 0, file_size) != 0 && ftruncate(out_fd, file_size) < 0) {
+        // Not all file systems support preallocation; a sparse file works too.
+        perror("ftruncate local file");
+        failed = 1;
+    }
+    if (failed) {
+        if (out_fd >= 0) close(out_fd);
+        for (m = 0; m < num_urls; m++) {
+            if (probe[m]) ftp_session_close(probe[m]);
+        }
+        return -1;
+    }
+
+    // Range transfers only write; the digest is taken over the whole file at the end
+    TransferOptions range_opts;
+    if (opts) {
+        range_opts = *opts;
+        range_opts.hash_alg = TRANSFER_HASH_NONE;
+        range_opts.verify_hash = 0;
+    }
+
+    MultiPool pool;
+    memset(&pool, 0, sizeof(pool));
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.changed, NULL);
+    pool.size = file_size;
+    pool.workers = workers;
+    pool_put(&pool, 0, file_size);
+
+    // Connections go round the mirrors, so a cap at FTP_MAX_SEGMENTS stays even;
+    // each mirror's first one reuses the SIZE session
+    int num_workers = 0;
+    for (i = 0; i < per_mirror; i++) {
+        for (m = 0; m < num_urls && num_workers < FTP_MAX_SEGMENTS; m++) {
+            if (!usable[m]) continue;
+            MultiWorker* w = &workers[num_workers++];
+            memset(w, 0, sizeof(*w));
+            w->pool = &pool;
+            w->url = &urls[m];
+            w->opts = opts ? &range_opts : NULL;
+            w->mirror = m;
+            w->control = i == 0 ? probe[m] : NULL;
+            w->out_fd = out_fd;
+            w->data_sockfd = -1;
+            w->stats.ttfb = -1;
+            ftp_phase_clear(&w->times);
+        }
+    }
+    pool.num_workers = num_workers;
+    printf("Downloading %lld bytes from %d mirror(s) over %d connection(s).\n", file_size, num_usable, num_workers);
+    ftp_progress_expect(file_size);
+
+    for (started = 0; started < num_workers; started++) {
+        if (pthread_create(&threads[started], NULL, multi_worker_main, &workers[started]) != 0) {
+            perror("pthread_create");
+            break;
+        }
+    }
+    // Sessions of workers that never started
+    for (i = started; i < num_workers; i++) {
+        if (workers[i].control) ftp_session_close(workers[i].control);
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    close(out_fd);
+    if (started == 0 || pool.num_holes > 0 || pool.lost) {
+        fprintf(stderr, "Not every mirror range of '%s' could be downloaded.\n", local_filename);
+        failed = 1;
+    }
+
+    // Who delivered what
+    for (m = 0; m < num_urls; m++) {
+        long long bytes = 0;
+        double seconds = 0;
+        int ranges = 0, handed_off = 0, retries = 0;
+        if (!usable[m]) continue;
+        for (i = 0; i < started; i++) {
+            if (workers[i].mirror != m) continue;
+            bytes += workers[i].stats.bytes;
+            seconds += workers[i].stats.seconds;
+            ranges += workers[i].ranges;
+            handed_off += workers[i].handed_off;
+            retries += workers[i].retries;
+        }
+        printf("Mirror %d (%s:%d): %lld bytes (%.0f%%) in %d range(s), %.2f MB/s per connection, "
+               "%d cut short, %d retr%s.\n", m, urls[m].host, urls[m].port, bytes,
+               file_size > 0 ? 100.0 * bytes / file_size : 0.0, ranges,
+               seconds > 0 ? bytes / seconds / (1024.0 * 1024.0) : 0.0, handed_off, retries,
+               retries == 1 ? "y" : "ies");
+    }
+
+    // One stats line for the file: the probe sessions' phases, the first
+    // connection's PASV/TTFB, and the transfer from the first byte to the last
+    FtpPhaseTimes times;
+    TransferStats total = {0};
+    ftp_phase_take(&times);
+    total.ttfb = -1;
+    for (i = 0; i < started; i++) {
+        const TransferStats* ws = &workers[i].stats;
+        total.bytes += ws->bytes;
+        total.keepalives += ws->keepalives;
+        total.retries += workers[i].retries;
+        if (ws->first_byte_at > 0 && (total.first_byte_at == 0 || ws->first_byte_at < total.first_byte_at)) {
+            total.first_byte_at = ws->first_byte_at;
+        }
+        if (ws->finished_at > total.finished_at) total.finished_at = ws->finished_at;
+    }
+    if (started > 0) {
+        times.seconds[FTP_PHASE_PASV] = workers[0].times.seconds[FTP_PHASE_PASV];
+        total.method = workers[0].stats.method;
+        total.ttfb = workers[0].stats.ttfb;
+        total.rtt = workers[0].stats.rtt;
+        total.rcvbuf = workers[0].stats.rcvbuf;
+        total.read_size = workers[0].stats.read_size;
+    }
+    total.output_bytes = total.bytes;
+    total.seconds = total.first_byte_at > 0 ? total.finished_at - total.first_byte_at : 0;
+    if (!failed && opts && (opts->hash_alg || opts->verify_hash) &&
+        multi_check_digest(urls, usable, num_urls, local_filename, opts, &total) < 0) {
+        failed = 1;
+    }
+    ftp_stats_emit("multi", &urls[0], urls[0].path, local_filename, failed ? -1 : 0, &times, &total);
+
+    free(pool.holes);
+    pthread_cond_destroy(&pool.changed);
+    pthread_mutex_destroy(&pool.lock);
+    return failed ? -1 : 0;
+}
@@ -0,0 +1,37 @@
+#ifndef FTP_MULTI_H
+#define FTP_MULTI_H
+
+#include "url_parser.h"
+#include "data_transfer.h"
+
+#define FTP_MULTI_MAX_MIRRORS 16
+#define FTP_MULTI_FIRST_CHUNK (1024 * 1024) // Range a connection starts with, before its rate is known
+#define FTP_MULTI_MIN_CHUNK (256 * 1024)    // Smaller ranges are not worth a REST+RETR+ABOR
+#define FTP_MULTI_CHUNK_SECONDS 2.0         // Later ranges last about this long at the connection's rate
+#define FTP_MULTI_STEAL_SECONDS 4.0         // Only a range with more left than this is taken from a slow mirror
+
+/**
+ * Downloads one file from several mirrors at once. Every mirror is asked for
+ * SIZE first; one that is unreachable or reports another size than the first
+ * is left out. The file is preallocated and handed out in byte ranges: each
+ * connection fetches a range with REST+RETR on its own session, then takes the
+ * next one, sized to last about FTP_MULTI_CHUNK_SECONDS at its measured rate,
+ * so fast mirrors take most of the file. When nothing is left to hand out, an
+ * idle connection cuts short a range a much slower one would still need more
+ * than FTP_MULTI_STEAL_SECONDS for, and the unfinished part goes back to the
+ * pool. A range that fails is put back too, and its connection reconnects up
+ * to opts->retries times. With opts->hash_alg the assembled file is digested;
+ * with opts->verify_hash the digest is compared with the first mirror that
+ * can report one (HASH/XCRC/XMD5) and a mismatch fails the download.
+ * @param urls The parsed URLs of the same file on each mirror.
+ * @param num_urls Number of mirrors (1..FTP_MULTI_MAX_MIRRORS).
+ * @param local_filename The name to save the file as locally.
+ * @param per_mirror Parallel connections to each mirror (mirrors times this is
+ *        capped at FTP_MAX_SEGMENTS).
+ * @param opts How each connection drains its data connection (may be NULL).
+ * @return 0 on success, -1 on failure.
+ */
+int ftp_multi_download(const ParsedUrl* urls, int num_urls, const char* local_filename, int per_mirror,
+                       const TransferOptions* opts);
+
+#endif // FTP_MULTI_H
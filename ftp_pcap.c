@@ -0,0 +1,891 @@
+// Offline FTP latency analyzer for pcapng captures (make analyze).
+//
+// Reads a capture, rebuilds every TCP connection and, for FTP control
+// connections (port 21, or any connection whose server speaks first with a
+// 220 banner), the command/reply dialogue. Data connections are matched to
+// the PASV/EPSV/PORT/EPRT exchange that announced them and to the transfer
+// command that used them. Reported per connection:
+//   - handshake cost (SYN -> SYN/ACK -> ACK),
+//   - per-command RTT (command -> first reply byte) and, for transfers, the
+//     time-to-first-byte on the data connection and until the final reply,
+//   - data throughput over time in fixed buckets,
+//   - retransmitted (or reordered) segments per direction.
+// Traffic that is not TCP is only counted, so a capture without FTP still
+// says what it does contain.
+//
+// Usage: ftp_pcap [-i MS] [-q] FILE.pcapng...
+//   -i MS  throughput bucket width (default 100 ms)
+//   -q     no per-bucket throughput lines
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>       // For pow
+#include <unistd.h>     // For getopt
+#include <strings.h>    // For strcasecmp
+#include <arpa/inet.h>  // For inet_ntop
+
+#define PCAP_MAX_INTERFACES 64
+#define PCAP_MAX_BLOCK (64 * 1024 * 1024)
+#define PCAP_LINE_LEN 1024
+#define PCAP_ADDR_LEN 46            // INET6_ADDRSTRLEN
+#define PCAP_DEFAULT_BUCKET_MS 100
+#define PCAP_BAR_WIDTH 40
+
+// pcapng block types
+#define BLOCK_SECTION 0x0A0D0D0A
+#define BLOCK_INTERFACE 1
+#define BLOCK_SIMPLE_PACKET 3
+#define BLOCK_ENHANCED_PACKET 6
+
+// Link types
+#define LINK_NULL 0
+#define LINK_ETHERNET 1
+#define LINK_RAW 101
+#define LINK_LINUX_SLL 113
+#define LINK_LINUX_SLL2 276
+
+#define TCP_SYN 0x02
+#define TCP_ACK 0x10
+
+// Wrap-safe sequence number comparisons
+#define SEQ_LT(a, b) ((int32_t) ((uint32_t) (a) - (uint32_t) (b)) < 0)
+#define SEQ_LEQ(a, b) ((int32_t) ((uint32_t) (a) - (uint32_t) (b)) <= 0)
+
+typedef struct {
+    int link_type;
+    double ts_unit;   // Seconds per timestamp tick (if_tsresol)
+    double ts_offset; // if_tsoffset
+} Interface;
+
+// Everything the analysis needs from one captured TCP segment
+typedef struct {
+    double ts;
+    int family;
+    unsigned char src[16], dst[16];
+    uint16_t sport, dport;
+    uint32_t seq;
+    uint8_t flags;
+    const unsigned char* payload;
+    size_t payload_len;
+} Segment;
+
+typedef struct FtpCommand FtpCommand;
+typedef struct TcpFlow TcpFlow;
+
+// A data connection announced on a control connection (PASV/EPSV reply or PORT/EPRT command)
+typedef struct Expectation {
+    int family;
+    unsigned char addr[16];
+    uint16_t port;
+    TcpFlow* control;
+    TcpFlow* data;               // The connection that matched, once seen
+    FtpCommand* used_by;         // Transfer command that used it
+    struct Expectation* next;
+} Expectation;
+
+struct FtpCommand {
+    char text[128];              // Verb and argument (PASS hidden)
+    double sent_at;
+    double first_reply_at;       // First reply byte (0 = none seen)
+    int first_code;
+    double final_at;             // Final (2xx-5xx) reply
+    int final_code;
+    Expectation* data;           // Data connection of a transfer command
+    FtpCommand* next;
+};
+
+// One direction of a TCP connection
+typedef struct {
+    int seen;                    // A segment with payload or SYN has set next_seq
+    uint32_t next_seq;           // Highest sequence number sent so far + 1
+    long long bytes;             // Payload bytes, first transmissions only
+    long long packets;
+    long long retrans_packets;
+    long long retrans_bytes;
+    double first_payload_at;
+    double last_payload_at;
+    char line[PCAP_LINE_LEN];    // Partial FTP line (control connections)
+    size_t line_len;
+} FlowDirection;
+
+struct TcpFlow {
+    int family;
+    unsigned char client[16], server[16]; // client: the side that sent the SYN
+    uint16_t client_port, server_port;
+    double first_at, last_at;
+    double syn_at, synack_at, ack_at;     // Handshake (0 = not seen)
+    int syn_count;
+    FlowDirection up, down;               // client->server, server->client
+    int is_control;
+    int encrypted;                        // After AUTH TLS: the dialogue is no longer readable
+    double banner_at;
+    int reply_code;                       // Code of a multi-line reply in progress (0 = none)
+    int reply_started;                    // The current reply's first line was seen
+    FtpCommand* commands;
+    FtpCommand* last_command;
+    FtpCommand* awaiting;                 // Oldest command without a final reply
+    Expectation* pending;                 // Last announced data connection not yet used
+    Expectation* expect;                  // For a data connection: what announced it
+    long long* buckets;                   // Payload bytes per bucket, both directions
+    size_t bucket_count;
+    TcpFlow* next;
+};
+
+typedef struct {
+    long long packets, tcp, udp, icmp, arp, ipv6, llc, other, undecoded;
+} TrafficCounts;
+
+static double bucket_seconds = PCAP_DEFAULT_BUCKET_MS / 1000.0;
+static int quiet;
+static Interface interfaces[PCAP_MAX_INTERFACES];
+static int interface_count;
+static TcpFlow* flows;
+static Expectation* expectations;
+static TrafficCounts counts;
+static double capture_start = -1;
+
+static uint16_t get16(const unsigned char* p, int swap) {
+    return swap ? (uint16_t) (p[0] << 8 | p[1]) : (uint16_t) (p[1] << 8 | p[0]);
+}
+
+static uint32_t get32(const unsigned char* p, int swap) {
+    return swap ? (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3]
+                : (uint32_t) p[3] << 24 | (uint32_t) p[2] << 16 | (uint32_t) p[1] << 8 | p[0];
+}
+
+static uint16_t be16(const unsigned char* p) {
+    return (uint16_t) (p[0] << 8 | p[1]);
+}
+
+static uint32_t be32(const unsigned char* p) {
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+static const char* addr_text(int family, const unsigned char* addr, char* buf) {
+    inet_ntop(family, addr, buf, PCAP_ADDR_LEN);
+    return buf;
+}
+
+static double ms(double seconds) {
+    return seconds * 1000.0;
+}
+
+static double rel(double ts) {
+    return ts - capture_start;
+}
+
+// --- Dialogue --------------------------------------------------------------
+
+// Parses "227 Entering Passive Mode (h1,h2,h3,h4,p1,p2)".
+static int parse_pasv(const char* line, unsigned char* addr, uint16_t* port) {
+    unsigned h[4], p[2];
+    const char* s = strchr(line, '(');
+    if (!s) {
+        for (s = line + 4; *s && !isdigit((unsigned char) *s); s++) {
+        }
+    } else {
+        s++;
+    }
+    if (sscanf(s, "%u,%u,%u,%u,%u,%u", &h[0], &h[1], &h[2], &h[3], &p[0], &p[1]) != 6) return -1;
+    for (int i = 0; i < 4; i++) addr[i] = (unsigned char) h[i];
+    *port = (uint16_t) (p[0] << 8 | p[1]);
+    return 0;
+}
+
+// Parses the port out of "229 Entering Extended Passive Mode (|||port|)".
+static int parse_epsv(const char* line, uint16_t* port) {
+    const char* s = strchr(line, '(');
+    unsigned p;
+    if (!s || !s[1] || !s[2] || !s[3] || s[2] != s[1] || s[3] != s[1]) return -1;
+    if (sscanf(s + 4, "%u", &p) != 1 || p > 65535) return -1;
+    *port = (uint16_t) p;
+    return 0;
+}
+
+// Parses "EPRT |1|addr|port|" or "EPRT |2|addr|port|".
+static int parse_eprt(const char* arg, int* family, unsigned char* addr, uint16_t* port) {
+    char d = arg[0], host[PCAP_ADDR_LEN];
+    unsigned proto, p;
+    char fmt[32];
+    if (!d) return -1;
+    snprintf(fmt, sizeof(fmt), "%c%%u%c%%45[^%c]%c%%u", d, d, d, d);
+    if (sscanf(arg, fmt, &proto, host, &p) != 3 || p > 65535) return -1;
+    *family = proto == 2 ? AF_INET6 : AF_INET;
+    if (inet_pton(*family, host, addr) != 1) return -1;
+    *port = (uint16_t) p;
+    return 0;
+}
+
+static void expect_data(TcpFlow* control, int family, const unsigned char* addr, uint16_t port) {
+    Expectation* e = calloc(1, sizeof(*e));
+    if (!e) return;
+    e->family = family;
+    memcpy(e->addr, addr, family == AF_INET ? 4 : 16);
+    e->port = port;
+    e->control = control;
+    e->next = expectations;
+    expectations = e;
+    control->pending = e;
+}
+
+static int is_transfer_command(const char* verb) {
+    static const char* verbs[] = {"RETR", "STOR", "STOU", "APPE", "LIST", "NLST", "MLSD"};
+    for (size_t i = 0; i < sizeof(verbs) / sizeof(verbs[0]); i++) {
+        if (strcasecmp(verb, verbs[i]) == 0) return 1;
+    }
+    return 0;
+}
+
+static void on_command(TcpFlow* f, const char* line, double ts) {
+    FtpCommand* c = calloc(1, sizeof(*c));
+    char verb[16] = "";
+    const char* arg = strchr(line, ' ');
+    if (!c) return;
+
+    sscanf(line, "%15s", verb);
+    arg = arg ? arg + 1 : "";
+    if (strcasecmp(verb, "PASS") == 0) snprintf(c->text, sizeof(c->text), "PASS ********");
+    else snprintf(c->text, sizeof(c->text), "%s", line);
+    c->sent_at = ts;
+    if (f->last_command) f->last_command->next = c;
+    else f->commands = c;
+    f->last_command = c;
+    if (!f->awaiting) f->awaiting = c;
+
+    if (strcasecmp(verb, "PORT") == 0) {
+        unsigned h[4], p[2];
+        unsigned char addr[4];
+        if (sscanf(arg, "%u,%u,%u,%u,%u,%u", &h[0], &h[1], &h[2], &h[3], &p[0], &p[1]) == 6) {
+            for (int i = 0; i < 4; i++) addr[i] = (unsigned char) h[i];
+            expect_data(f, AF_INET, addr, (uint16_t) (p[0] << 8 | p[1]));
+        }
+    } else if (strcasecmp(verb, "EPRT") == 0) {
+        unsigned char addr[16];
+        uint16_t port;
+        int family;
+        if (parse_eprt(arg, &family, addr, &port) == 0) expect_data(f, family, addr, port);
+    } else if (is_transfer_command(verb) && f->pending) {
+        c->data = f->pending;
+        f->pending->used_by = c;
+        f->pending = NULL;
+    }
+}
+
+static void on_reply_line(TcpFlow* f, const char* line, double ts) {
+    int code = 0;
+    int has_code = strlen(line) >= 3 && isdigit((unsigned char) line[0]) && isdigit((unsigned char) line[1]) &&
+                   isdigit((unsigned char) line[2]);
+    if (has_code) code = (line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0');
+
+    // Lines inside a multi-line reply only matter when they end it ("DDD ")
+    if (f->reply_code && !(code == f->reply_code && line[3] == ' ')) return;
+    if (!f->reply_code && !has_code) return;
+
+    FtpCommand* c = f->awaiting;
+    if (!f->reply_started) {
+        f->reply_started = 1;
+        if (c && !c->first_reply_at) {
+            c->first_reply_at = ts;
+            c->first_code = code;
+        } else if (!c && code == 220 && !f->banner_at) {
+            f->banner_at = ts;
+        }
+    }
+    if (!f->reply_code && line[3] == '-') {
+        f->reply_code = code; // Multi-line reply: wait for its last line
+        return;
+    }
+    f->reply_code = 0;
+    f->reply_started = 0;
+    if (code < 200) return; // Preliminary: the final reply follows
+
+    if (c) {
+        c->final_at = ts;
+        c->final_code = code;
+        f->awaiting = c->next;
+    }
+    if (code == 227) {
+        unsigned char addr[4];
+        uint16_t port;
+        if (parse_pasv(line, addr, &port) == 0) expect_data(f, AF_INET, addr, port);
+    } else if (code == 229) {
+        uint16_t port;
+        if (parse_epsv(line, &port) == 0) expect_data(f, f->family, f->server, port);
+    } else if (code == 234) {
+        f->encrypted = 1; // AUTH TLS accepted: the rest is ciphertext
+    }
+}
+
+// Splits in-order control payload into lines.
+static void feed_lines(TcpFlow* f, FlowDirection* d, int from_client, const unsigned char* data, size_t len, double ts) {
+    for (size_t i = 0; i < len && !f->encrypted; i++) {
+        char ch = (char) data[i];
+        if (ch == '\n') {
+            if (d->line_len > 0 && d->line[d->line_len - 1] == '\r') d->line_len--;
+            d->line[d->line_len] = '\0';
+            if (from_client) on_command(f, d->line, ts);
+            else on_reply_line(f, d->line, ts);
+            d->line_len = 0;
+        } else if (d->line_len < sizeof(d->line) - 1) {
+            d->line[d->line_len++] = ch;
+        }
+    }
+}
+
+// --- TCP -------------------------------------------------------------------
+
+static int flow_matches(const TcpFlow* f, const Segment* s, int* from_client) {
+    size_t n = s->family == AF_INET ? 4 : 16;
+    if (f->family != s->family) return 0;
+    if (f->client_port == s->sport && f->server_port == s->dport && memcmp(f->client, s->src, n) == 0 &&
+        memcmp(f->server, s->dst, n) == 0) {
+        *from_client = 1;
+        return 1;
+    }
+    if (f->client_port == s->dport && f->server_port == s->sport && memcmp(f->client, s->dst, n) == 0 &&
+        memcmp(f->server, s->src, n) == 0) {
+        *from_client = 0;
+        return 1;
+    }
+    return 0;
+}
+
+// Finds the announced data connection a new flow belongs to.
+static Expectation* match_expectation(const TcpFlow* f) {
+    size_t n = f->family == AF_INET ? 4 : 16;
+    for (Expectation* e = expectations; e; e = e->next) {
+        if (e->data || e->family != f->family) continue;
+        if ((e->port == f->server_port && memcmp(e->addr, f->server, n) == 0) ||
+            (e->port == f->client_port && memcmp(e->addr, f->client, n) == 0)) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static TcpFlow* flow_for(const Segment* s, int* from_client) {
+    TcpFlow* last = NULL;
+    for (TcpFlow* f = flows; f; f = f->next) {
+        if (flow_matches(f, s, from_client)) {
+            // A new SYN on a finished 4-tuple starts a new connection
+            if (!((s->flags & TCP_SYN) && !(s->flags & TCP_ACK) && f->synack_at)) return f;
+        }
+        last = f;
+    }
+
+    TcpFlow* f = calloc(1, sizeof(*f));
+    if (!f) return NULL;
+    size_t n = s->family == AF_INET ? 4 : 16;
+    f->family = s->family;
+    // The SYN sender is the client; without one, guess from the well-known port
+    int src_is_client = (s->flags & TCP_SYN) ? !(s->flags & TCP_ACK) : (s->dport == 21 || s->sport > s->dport);
+    memcpy(f->client, src_is_client ? s->src : s->dst, n);
+    memcpy(f->server, src_is_client ? s->dst : s->src, n);
+    f->client_port = src_is_client ? s->sport : s->dport;
+    f->server_port = src_is_client ? s->dport : s->sport;
+    f->first_at = s->ts;
+    f->is_control = f->server_port == 21;
+    f->expect = match_expectation(f);
+    if (f->expect) {
+        f->expect->data = f;
+        f->is_control = 0;
+    }
+    if (last) last->next = f;
+    else flows = f;
+    *from_client = src_is_client;
+    return f;
+}
+
+static void add_to_bucket(TcpFlow* f, double ts, size_t len) {
+    size_t i = (size_t) ((ts - f->first_at) / bucket_seconds);
+    if (i >= f->bucket_count) {
+        size_t count = i + 1 > f->bucket_count * 2 ? i + 1 : f->bucket_count * 2;
+        long long* grown = realloc(f->buckets, count * sizeof(*grown));
+        if (!grown) return;
+        memset(grown + f->bucket_count, 0, (count - f->bucket_count) * sizeof(*grown));
+        f->buckets = grown;
+        f->bucket_count = count;
+    }
+    f->buckets[i] += (long long) len;
+}
+
+static void on_segment(const Segment* s) {
+    int from_client;
+    TcpFlow* f = flow_for(s, &from_client);
+    if (!f) return;
+    FlowDirection* d = from_client ? &f->up : &f->down;
+
+    f->last_at = s->ts;
+    d->packets++;
+    if (s->flags & TCP_SYN) {
+        if (!(s->flags & TCP_ACK)) {
+            if (!f->syn_at) f->syn_at = s->ts;
+            f->syn_count++;
+        } else if (!f->synack_at) {
+            f->synack_at = s->ts;
+        }
+        d->seen = 1;
+        d->next_seq = s->seq + 1;
+        return;
+    }
+    if (f->synack_at && !f->ack_at && from_client && (s->flags & TCP_ACK)) f->ack_at = s->ts;
+    if (s->payload_len == 0) return;
+
+    uint32_t end = s->seq + (uint32_t) s->payload_len;
+    if (d->seen && SEQ_LEQ(end, d->next_seq)) {
+        d->retrans_packets++; // Everything in it was sent before
+        d->retrans_bytes += (long long) s->payload_len;
+        return;
+    }
+    size_t skip = 0;
+    if (d->seen && SEQ_LT(s->seq, d->next_seq)) {
+        skip = d->next_seq - s->seq; // Partly old
+        d->retrans_packets++;
+        d->retrans_bytes += (long long) skip;
+    }
+    // A gap (seq beyond next_seq) is a lost segment: its retransmission shows up later as old data
+    if (!d->seen || SEQ_LT(d->next_seq, end)) d->next_seq = end;
+    d->seen = 1;
+
+    size_t len = s->payload_len - skip;
+    if (!d->first_payload_at) d->first_payload_at = s->ts;
+    d->last_payload_at = s->ts;
+    d->bytes += (long long) len;
+    add_to_bucket(f, s->ts, len);
+
+    // A server that greets first with 220 is FTP whatever its port
+    if (!f->is_control && !f->expect && !from_client && f->down.bytes == (long long) len && !f->up.bytes &&
+        len >= 4 && memcmp(s->payload + skip, "220", 3) == 0) {
+        f->is_control = 1;
+    }
+    if (f->is_control) feed_lines(f, d, from_client, s->payload + skip, len, s->ts);
+}
+
+// --- Packet decoding ---------------------------------------------------------
+
+static void decode_tcp(int family, const unsigned char* src, const unsigned char* dst, const unsigned char* p,
+                       size_t len, double ts) {
+    Segment s;
+    if (len < 20) {
+        counts.undecoded++;
+        return;
+    }
+    size_t header = (size_t) (p[12] >> 4) * 4;
+    if (header < 20 || header > len) {
+        counts.undecoded++;
+        return;
+    }
+    memset(&s, 0, sizeof(s));
+    s.ts = ts;
+    s.family = family;
+    memcpy(s.src, src, family == AF_INET ? 4 : 16);
+    memcpy(s.dst, dst, family == AF_INET ? 4 : 16);
+    s.sport = be16(p);
+    s.dport = be16(p + 2);
+    s.seq = be32(p + 4);
+    s.flags = p[13];
+    s.payload = p + header;
+    s.payload_len = len - header;
+    counts.tcp++;
+    on_segment(&s);
+}
+
+static void decode_transport(int family, int proto, const unsigned char* src, const unsigned char* dst,
+                             const unsigned char* p, size_t len, double ts) {
+    switch (proto) {
+    case 6: decode_tcp(family, src, dst, p, len, ts); break;
+    case 17: counts.udp++; break;
+    case 1: case 58: counts.icmp++; break;
+    default: counts.other++; break;
+    }
+}
+
+static void decode_ipv4(const unsigned char* p, size_t len, double ts) {
+    if (len < 20 || (p[0] >> 4) != 4) {
+        counts.undecoded++;
+        return;
+    }
+    size_t header = (size_t) (p[0] & 0x0f) * 4;
+    size_t total = be16(p + 2);
+    if (total > len || total < header) total = len; // Snapped, or TSO-sized on the sender
+    if (header < 20 || header > total) {
+        counts.undecoded++; // IHL runs past the packet
+        return;
+    }
+    if (be16(p + 6) & 0x1fff) {
+        counts.other++; // Non-first fragment
+        return;
+    }
+    decode_transport(AF_INET, p[9], p + 12, p + 16, p + header, total - header, ts);
+}
+
+static void decode_ipv6(const unsigned char* p, size_t len, double ts) {
+    if (len < 40 || (p[0] >> 4) != 6) {
+        counts.undecoded++;
+        return;
+    }
+    int next = p[6];
+    size_t off = 40;
+    size_t end = 40 + (size_t) be16(p + 4);
+    if (end > len || end == 40) end = len;
+    // Hop-by-hop, routing, destination options: skip to the transport header
+    while ((next == 0 || next == 43 || next == 60) && off + 8 <= end) {
+        next = p[off];
+        off += ((size_t) p[off + 1] + 1) * 8;
+    }
+    if (next == 44 || off > end) {
+        counts.other++;
+        return;
+    }
+    if (next == 6 || next == 17) counts.ipv6++;
+    decode_transport(AF_INET6, next, p + 8, p + 24, p + off, end - off, ts);
+}
+
+static void decode_ethertype(int type, const unsigned char* p, size_t len, double ts) {
+    switch (type) {
+    case 0x0800: decode_ipv4(p, len, ts); break;
+    case 0x86dd: decode_ipv6(p, len, ts); break;
+    case 0x0806: counts.arp++; break;
+    default:
+        if (type < 0x0600) counts.llc++; // 802.3 length field: LLC (STP, ...)
+        else counts.other++;
+        break;
+    }
+}
+
+static void decode_packet(int link_type, const unsigned char* p, size_t len, double ts) {
+    counts.packets++;
+    if (capture_start < 0 || ts < capture_start) capture_start = ts;
+    switch (link_type) {
+    case LINK_ETHERNET: {
+        if (len < 14) break;
+        size_t off = 12;
+        int type = be16(p + off);
+        while ((type == 0x8100 || type == 0x88a8) && off + 6 <= len) { // VLAN tags
+            off += 4;
+            type = be16(p + off);
+        }
+        decode_ethertype(type, p + off + 2, len - off - 2, ts);
+        return;
+    }
+    case LINK_LINUX_SLL:
+        if (len < 16) break;
+        decode_ethertype(be16(p + 14), p + 16, len - 16, ts);
+        return;
+    case LINK_LINUX_SLL2:
+        if (len < 20) break;
+        decode_ethertype(be16(p), p + 20, len - 20, ts);
+        return;
+    case LINK_RAW:
+        if (len < 1) break;
+        if ((p[0] >> 4) == 6) decode_ipv6(p, len, ts);
+        else decode_ipv4(p, len, ts);
+        return;
+    case LINK_NULL: {
+        if (len < 4) break;
+        uint32_t family = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24; // Host order of the capturer
+        if (family > 0xffff) family = be32(p);
+        if (family == 2) decode_ipv4(p + 4, len - 4, ts);
+        else if (family == 10 || family == 24 || family == 28 || family == 30) decode_ipv6(p + 4, len - 4, ts);
+        else counts.other++;
+        return;
+    }
+    default:
+        break;
+    }
+    counts.undecoded++;
+}
+
+// Reads if_tsresol (9) and if_tsoffset (14) from an interface description block body.
+static void parse_interface(const unsigned char* body, size_t len, int swap) {
+    Interface* i;
+    if (interface_count >= PCAP_MAX_INTERFACES || len < 8) return;
+    i = &interfaces[interface_count++];
+    i->link_type = get16(body, swap);
+    i->ts_unit = 1e-6;
+    i->ts_offset = 0;
+    for (size_t off = 8; off + 4 <= len;) {
+        uint16_t code = get16(body + off, swap), olen = get16(body + off + 2, swap);
+        const unsigned char* value = body + off + 4;
+        if (code == 0 || off + 4 + olen > len) break;
+        if (code == 9 && olen >= 1) {
+            int exp = value[0] & 0x7f;
+            i->ts_unit = (value[0] & 0x80) ? pow(2.0, -exp) : pow(10.0, -exp);
+        } else if (code == 14 && olen >= 8) {
+            uint64_t offset = swap ? (uint64_t) get32(value, swap) << 32 | get32(value + 4, swap)
+                                   : (uint64_t) get32(value + 4, swap) << 32 | get32(value, swap);
+            i->ts_offset = (double) (int64_t) offset;
+        }
+        off += 4 + ((olen + 3u) & ~3u);
+    }
+}
+
+// Reads every block of a pcapng file. Returns 0, or -1 if it is not pcapng or is damaged.
+static int read_capture(FILE* in, const char* name) {
+    unsigned char head[8];
+    unsigned char* body = NULL;
+    int swap = 0, status = 0, blocks = 0;
+
+    while (fread(head, 1, 8, in) == 8) {
+        uint32_t type = get32(head, 0);
+        if (type == BLOCK_SECTION) {
+            unsigned char magic[4];
+            if (fread(magic, 1, 4, in) != 4) break;
+            if (get32(magic, 0) == 0x1A2B3C4D) swap = 0;
+            else if (get32(magic, 1) == 0x1A2B3C4D) swap = 1;
+            else break;
+            interface_count = 0; // Interface ids restart in every section
+            if (fseek(in, -4, SEEK_CUR) != 0) break;
+        } else if (blocks == 0) {
+            fprintf(stderr, "%s: not a pcapng file.\n", name);
+            return -1;
+        }
+        uint32_t total = get32(head + 4, swap);
+        if (total < 12 || total > PCAP_MAX_BLOCK || total % 4) {
+            fprintf(stderr, "%s: damaged block at byte %ld.\n", name, ftell(in) - 8);
+            status = -1;
+            break;
+        }
+        size_t len = total - 12;
+        unsigned char* grown = realloc(body, len + 4);
+        if (!grown) {
+            perror("realloc failed");
+            status = -1;
+            break;
+        }
+        body = grown;
+        if (fread(body, 1, len + 4, in) != len + 4) {
+            fprintf(stderr, "%s: truncated block at the end.\n", name);
+            break; // Keep what was read: a capture cut short is still useful
+        }
+        blocks++;
+
+        if (type == BLOCK_INTERFACE) {
+            parse_interface(body, len, swap);
+        } else if (type == BLOCK_ENHANCED_PACKET && len >= 20) {
+            uint32_t id = get32(body, swap);
+            uint64_t ticks = (uint64_t) get32(body + 4, swap) << 32 | get32(body + 8, swap);
+            uint32_t captured = get32(body + 12, swap);
+            if (id >= (uint32_t) interface_count || captured > len - 20) {
+                counts.undecoded++;
+                continue;
+            }
+            Interface* i = &interfaces[id];
+            decode_packet(i->link_type, body + 20, captured, i->ts_offset + (double) ticks * i->ts_unit);
+        } else if (type == BLOCK_SIMPLE_PACKET) {
+            counts.packets++;
+            counts.undecoded++; // No timestamp: useless for timing
+        }
+    }
+    free(body);
+    return status;
+}
+
+// --- Report ------------------------------------------------------------------
+
+static void print_endpoints(const TcpFlow* f) {
+    char client[PCAP_ADDR_LEN], server[PCAP_ADDR_LEN];
+    printf("%s:%u -> %s:%u", addr_text(f->family, f->client, client), f->client_port,
+           addr_text(f->family, f->server, server), f->server_port);
+}
+
+static double handshake_seconds(const TcpFlow* f) {
+    return f->syn_at && f->ack_at ? f->ack_at - f->syn_at : -1;
+}
+
+static void print_handshake(const TcpFlow* f) {
+    if (!f->syn_at || !f->synack_at) {
+        printf("  Handshake: not captured\n");
+        return;
+    }
+    printf("  Handshake: SYN -> SYN/ACK %.3f ms", ms(f->synack_at - f->syn_at));
+    if (f->ack_at) printf(", ACK after %.3f ms", ms(f->ack_at - f->synack_at));
+    if (f->syn_count > 1) printf(" (%d SYNs sent)", f->syn_count);
+    printf("\n");
+}
+
+static void print_retransmissions(const TcpFlow* f, const char* up, const char* down) {
+    if (!f->up.retrans_packets && !f->down.retrans_packets) {
+        printf("  Retransmissions: none\n");
+        return;
+    }
+    printf("  Retransmissions: %s %lld segments (%lld bytes), %s %lld segments (%lld bytes)\n", up,
+           f->up.retrans_packets, f->up.retrans_bytes, down, f->down.retrans_packets, f->down.retrans_bytes);
+}
+
+static void print_throughput(const TcpFlow* f) {
+    const FlowDirection* d = f->down.bytes >= f->up.bytes ? &f->down : &f->up;
+    double seconds = d->last_payload_at - d->first_payload_at;
+    long long peak = 0;
+
+    printf("  %lld bytes in %.3f s", d->bytes, seconds);
+    if (seconds > 0) printf(" (%.2f MB/s)", d->bytes / seconds / (1024.0 * 1024.0));
+    printf("\n");
+    if (quiet || f->bucket_count < 2) return;
+    for (size_t i = 0; i < f->bucket_count; i++) {
+        if (f->buckets[i] > peak) peak = f->buckets[i];
+    }
+    size_t last = f->bucket_count;
+    while (last > 0 && f->buckets[last - 1] == 0) last--;
+    for (size_t i = 0; i < last; i++) {
+        int bar = peak ? (int) (f->buckets[i] * PCAP_BAR_WIDTH / peak) : 0;
+        printf("    +%7.3f s %9.2f MB/s |%.*s\n", i * bucket_seconds,
+               f->buckets[i] / bucket_seconds / (1024.0 * 1024.0), bar, "########################################");
+    }
+}
+
+static const char* data_label(const TcpFlow* f) {
+    return f->expect && f->expect->used_by ? f->expect->used_by->text : "unused";
+}
+
+static void print_control(const TcpFlow* f) {
+    int replies = 0, round_trips = 0;
+    double waiting = 0, handshakes = 0, covered = 0;
+
+    printf("\nFTP control ");
+    print_endpoints(f);
+    printf(" at +%.3f s\n", rel(f->first_at));
+    print_handshake(f);
+    if (f->banner_at) printf("  Banner: %.3f ms after the first packet\n", ms(f->banner_at - f->first_at));
+    if (handshake_seconds(f) >= 0) handshakes += handshake_seconds(f);
+
+    for (const FtpCommand* c = f->commands; c; c = c->next) {
+        printf("  +%8.3f s  %-28.28s", rel(c->sent_at), c->text);
+        if (c->first_reply_at) {
+            printf(" %d after %8.3f ms", c->first_code, ms(c->first_reply_at - c->sent_at));
+            replies++;
+            // Pipelined commands share a wait: count wall time with any command outstanding
+            if (c->sent_at >= covered) {
+                round_trips++;
+                waiting += c->first_reply_at - c->sent_at;
+            } else if (c->first_reply_at > covered) {
+                waiting += c->first_reply_at - covered;
+            }
+            if (c->first_reply_at > covered) covered = c->first_reply_at;
+        } else {
+            printf(" (no reply captured)");
+        }
+        if (c->final_at && c->final_code != c->first_code) {
+            printf(", %d after %.3f ms", c->final_code, ms(c->final_at - c->sent_at));
+        }
+        if (c->data && c->data->data) {
+            const TcpFlow* d = c->data->data;
+            const FlowDirection* dir = d->down.bytes >= d->up.bytes ? &d->down : &d->up;
+            if (dir->first_payload_at) printf("; data TTFB %.3f ms", ms(dir->first_payload_at - c->sent_at));
+            if (handshake_seconds(d) >= 0) handshakes += handshake_seconds(d);
+        }
+        printf("\n");
+    }
+    if (f->encrypted) printf("  (dialogue encrypted after AUTH TLS)\n");
+    printf("  %d replies in %d round trips: %.3f ms waiting for the server; %.3f ms in TCP handshakes\n", replies,
+           round_trips, ms(waiting), ms(handshakes));
+    print_retransmissions(f, "client", "server");
+}
+
+static void print_flow(const TcpFlow* f) {
+    if (f->expect) {
+        printf("\nFTP data (%s) ", data_label(f));
+    } else {
+        printf("\nTCP ");
+    }
+    print_endpoints(f);
+    printf(" at +%.3f s\n", rel(f->first_at));
+    print_handshake(f);
+    print_throughput(f);
+    print_retransmissions(f, "client", "server");
+}
+
+static void print_counts(void) {
+    printf("%lld packets: %lld TCP, %lld UDP, %lld ICMP, %lld ARP, %lld LLC/STP, %lld other", counts.packets,
+           counts.tcp, counts.udp, counts.icmp, counts.arp, counts.llc, counts.other);
+    if (counts.ipv6) printf(" (%lld TCP/UDP over IPv6)", counts.ipv6);
+    if (counts.undecoded) printf(", %lld undecoded", counts.undecoded);
+    printf("\n");
+}
+
+static void free_state(void) {
+    while (flows) {
+        TcpFlow* f = flows;
+        flows = f->next;
+        while (f->commands) {
+            FtpCommand* c = f->commands;
+            f->commands = c->next;
+            free(c);
+        }
+        free(f->buckets);
+        free(f);
+    }
+    while (expectations) {
+        Expectation* e = expectations;
+        expectations = e->next;
+        free(e);
+    }
+    memset(&counts, 0, sizeof(counts));
+    interface_count = 0;
+    capture_start = -1;
+}
+
+static int analyze(const char* name) {
+    FILE* in = fopen(name, "rb");
+    int controls = 0;
+
+    if (!in) {
+        perror(name);
+        return -1;
+    }
+    int status = read_capture(in, name);
+    fclose(in);
+
+    printf("== %s ==\n", name);
+    print_counts();
+    for (const TcpFlow* f = flows; f; f = f->next) {
+        if (!f->is_control) continue;
+        controls++;
+        print_control(f);
+        for (const TcpFlow* d = flows; d; d = d->next) {
+            if (d->expect && d->expect->control == f) print_flow(d);
+        }
+    }
+    for (const TcpFlow* f = flows; f; f = f->next) {
+        if (!f->is_control && !f->expect) print_flow(f);
+    }
+    if (!controls) printf("No FTP control connection in this capture.\n");
+    printf("\n");
+    free_state();
+    return status;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [-i MS] [-q] FILE.pcapng...\n", prog);
+}
+
+int main(int argc, char** argv) {
+    int opt, status = 0;
+
+    while ((opt = getopt(argc, argv, "i:qh")) != -1) {
+        switch (opt) {
+        case 'i':
+            bucket_seconds = atof(optarg) / 1000.0;
+            if (bucket_seconds <= 0) {
+                fprintf(stderr, "Invalid bucket width '%s'.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'q': quiet = 1; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    for (int i = optind; i < argc; i++) {
+        if (analyze(argv[i]) < 0) status = 1;
+    }
+    return status;
+}
@@ -0,0 +1,352 @@
+#include "ftp_progress.h"
+#include "data_transfer.h" // For monotonic_seconds
+#include "ftp_log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+// Life of a slot: the owner claims a free one, fills it in and publishes it
+// as live; when it ends, the reporter folds its bytes into the totals and
+// frees it. Only the owner writes `bytes`, so counting is a plain store.
+enum {
+    SLOT_FREE,
+    SLOT_CLAIMED,
+    SLOT_LIVE,
+    SLOT_DONE
+};
+
+struct FtpProgressSlot {
+    int state;          // SLOT_*, changed with atomics
+    long long bytes;
+    long long expected; // -1 if unknown
+};
+
+static const char* const phase_labels[FTP_PHASE_COUNT] = {
+    "dns", "connect", "banner", "login", "pasv", "ttfb", "transfer"
+};
+
+static FtpProgressSlot slots[FTP_PROGRESS_SLOTS];
+static FtpProgressSlot overflow_slot;  // Shared by transfers that found no free slot (atomic adds)
+static int overflow_active;
+static long long overflow_finished;
+static int progress_on;
+static long long goal_bytes;
+static long long retry_count;
+static long long phase_usec[FTP_PHASE_COUNT];
+static long long phase_count[FTP_PHASE_COUNT];
+static __thread FtpProgressSlot* current_slot;
+
+// Reporter state: its thread only (and ftp_progress_stop() after the join)
+static pthread_t reporter;
+static pthread_mutex_t reporter_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reporter_wake = PTHREAD_COND_INITIALIZER;
+static int reporter_stop;
+static int show_bar;
+static char* prom_path;
+static char* json_path;
+static double interval;
+static double started_at;
+static long long folded_bytes;   // Bytes of transfers that ended
+static long long finished;       // Transfers that ended
+static long long last_bytes;
+static double last_at;
+static int bar_len;              // Length of the progress line on screen
+static int write_warned;
+
+typedef struct {
+    double elapsed;
+    long long bytes;
+    long long expected;  // -1 if unknown
+    double rate;         // Bytes/s since the previous sample (whole run for the last one)
+    int active;
+    long long finished;
+    long long retries;
+} ProgressSample;
+
+static void progress_sample(ProgressSample* s, int last) {
+    double now = monotonic_seconds();
+    long long live = 0, live_expected = 0;
+    int unknown = 0;
+
+    s->active = 0;
+    for (int i = 0; i < FTP_PROGRESS_SLOTS; i++) {
+        FtpProgressSlot* slot = &slots[i];
+        int state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+        if (state != SLOT_LIVE && state != SLOT_DONE) continue;
+        long long bytes = __atomic_load_n(&slot->bytes, __ATOMIC_RELAXED);
+        if (state == SLOT_DONE) {
+            folded_bytes += bytes;
+            finished++;
+            __atomic_store_n(&slot->state, SLOT_FREE, __ATOMIC_RELEASE);
+            continue;
+        }
+        s->active++;
+        live += bytes;
+        if (slot->expected < 0) unknown = 1;
+        else live_expected += slot->expected > bytes ? slot->expected : bytes;
+    }
+    int overflow = __atomic_load_n(&overflow_active, __ATOMIC_RELAXED);
+    long long overflow_bytes = __atomic_load_n(&overflow_slot.bytes, __ATOMIC_RELAXED);
+    long long goal = __atomic_load_n(&goal_bytes, __ATOMIC_RELAXED);
+
+    s->active += overflow;
+    s->bytes = folded_bytes + overflow_bytes + live;
+    s->finished = finished + __atomic_load_n(&overflow_finished, __ATOMIC_RELAXED);
+    s->retries = __atomic_load_n(&retry_count, __ATOMIC_RELAXED);
+    if (goal > 0) s->expected = goal;
+    else if (unknown || overflow_bytes > 0 || s->bytes + live_expected == 0) s->expected = -1;
+    else s->expected = folded_bytes + live_expected;
+    s->elapsed = now - started_at;
+    if (last) s->rate = s->elapsed > 0 ? s->bytes / s->elapsed : 0;
+    else s->rate = now > last_at ? (s->bytes - last_bytes) / (now - last_at) : 0;
+    last_bytes = s->bytes;
+    last_at = now;
+}
+
+// "12.3 MiB" and the like
+static void format_bytes(double bytes, char* buf, size_t buf_len) {
+    static const char* const units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    int unit = 0;
+    while (bytes >= 1024 && unit < 4) {
+        bytes /= 1024;
+        unit++;
+    }
+    snprintf(buf, buf_len, unit == 0 ? "%.0f %s" : "%.1f %s", bytes, units[unit]);
+}
+
+static void progress_draw(const ProgressSample* s) {
+    char line[256], done[32], total[32], rate[32];
+    int len;
+
+    format_bytes(s->bytes, done, sizeof(done));
+    format_bytes(s->rate, rate, sizeof(rate));
+    if (s->expected > 0) {
+        char bar[FTP_PROGRESS_BAR_WIDTH + 1];
+        double frac = s->bytes >= s->expected ? 1.0 : (double) s->bytes / s->expected;
+        int fill = (int) (frac * FTP_PROGRESS_BAR_WIDTH);
+        for (int i = 0; i < FTP_PROGRESS_BAR_WIDTH; i++) {
+            bar[i] = i < fill ? '=' : (i == fill ? '>' : ' ');
+        }
+        bar[FTP_PROGRESS_BAR_WIDTH] = '\0';
+        format_bytes(s->expected, total, sizeof(total));
+        len = snprintf(line, sizeof(line), "[%s] %3.0f%%  %s / %s  %s/s", bar, frac * 100, done, total, rate);
+        if (s->rate > 0 && s->expected > s->bytes && len < (int) sizeof(line)) {
+            long eta = (long) ((s->expected - s->bytes) / s->rate + 0.5);
+            len += snprintf(line + len, sizeof(line) - len, "  ETA %ld:%02ld:%02ld", eta / 3600, eta / 60 % 60,
+                            eta % 60);
+        }
+    } else {
+        len = snprintf(line, sizeof(line), "%s  %s/s", done, rate);
+    }
+    if (len < (int) sizeof(line)) {
+        len += snprintf(line + len, sizeof(line) - len, "  %d active", s->active);
+    }
+    if (s->retries > 0 && len < (int) sizeof(line)) {
+        len += snprintf(line + len, sizeof(line) - len, "  %lld retr%s", s->retries, s->retries == 1 ? "y" : "ies");
+    }
+    if (len >= (int) sizeof(line)) len = sizeof(line) - 1;
+    // Blank out what is left of a longer previous line
+    fprintf(stderr, "\r%s%*s", line, bar_len > len ? bar_len - len : 0, "");
+    fflush(stderr);
+    bar_len = len;
+}
+
+static void write_prometheus(FILE* out, const ProgressSample* s) {
+    fprintf(out, "# HELP ftp_download_received_bytes_total Payload bytes received on data connections.\n"
+                 "# TYPE ftp_download_received_bytes_total counter\n"
+                 "ftp_download_received_bytes_total %lld\n", s->bytes);
+    fprintf(out, "# HELP ftp_download_expected_bytes Bytes the run is expected to receive (-1 if unknown).\n"
+                 "# TYPE ftp_download_expected_bytes gauge\n"
+                 "ftp_download_expected_bytes %lld\n", s->expected);
+    fprintf(out, "# HELP ftp_download_rate_bytes_per_second Receive rate over the last sample interval.\n"
+                 "# TYPE ftp_download_rate_bytes_per_second gauge\n"
+                 "ftp_download_rate_bytes_per_second %.0f\n", s->rate);
+    fprintf(out, "# HELP ftp_download_active_transfers Data transfers in progress.\n"
+                 "# TYPE ftp_download_active_transfers gauge\n"
+                 "ftp_download_active_transfers %d\n", s->active);
+    fprintf(out, "# HELP ftp_download_transfers_total Data transfers that ended, successfully or not.\n"
+                 "# TYPE ftp_download_transfers_total counter\n"
+                 "ftp_download_transfers_total %lld\n", s->finished);
+    fprintf(out, "# HELP ftp_download_retries_total Reconnects made to resume a transfer.\n"
+                 "# TYPE ftp_download_retries_total counter\n"
+                 "ftp_download_retries_total %lld\n", s->retries);
+    fprintf(out, "# HELP ftp_download_phase_seconds Time spent in each protocol phase.\n"
+                 "# TYPE ftp_download_phase_seconds summary\n");
+    for (int i = 0; i < FTP_PHASE_COUNT; i++) {
+        fprintf(out, "ftp_download_phase_seconds_sum{phase=\"%s\"} %.6f\n", phase_labels[i],
+                __atomic_load_n(&phase_usec[i], __ATOMIC_RELAXED) / 1e6);
+        fprintf(out, "ftp_download_phase_seconds_count{phase=\"%s\"} %lld\n", phase_labels[i],
+                __atomic_load_n(&phase_count[i], __ATOMIC_RELAXED));
+    }
+    fprintf(out, "# HELP ftp_download_uptime_seconds Seconds since the reporter started.\n"
+                 "# TYPE ftp_download_uptime_seconds gauge\n"
+                 "ftp_download_uptime_seconds %.3f\n", s->elapsed);
+}
+
+static void write_json(FILE* out, const ProgressSample* s) {
+    fprintf(out, "{\"time\":%lld,\"uptime\":%.3f,\"bytes\":%lld,\"expected\":%lld,\"rate\":%.0f,"
+                 "\"active\":%d,\"transfers\":%lld,\"retries\":%lld,\"phases\":{",
+            (long long) time(NULL), s->elapsed, s->bytes, s->expected, s->rate, s->active, s->finished, s->retries);
+    for (int i = 0; i < FTP_PHASE_COUNT; i++) {
+        fprintf(out, "%s\"%s\":{\"seconds\":%.6f,\"count\":%lld}", i > 0 ? "," : "", phase_labels[i],
+                __atomic_load_n(&phase_usec[i], __ATOMIC_RELAXED) / 1e6,
+                __atomic_load_n(&phase_count[i], __ATOMIC_RELAXED));
+    }
+    fprintf(out, "}}\n");
+}
+
+// Replaces `path` with a fresh snapshot, through a rename so a scraper never
+// reads half a file.
+static void write_snapshot(const char* path, const ProgressSample* s, int json) {
+    size_t len = strlen(path) + sizeof(".tmp");
+    char* tmp = malloc(len);
+    FILE* out = NULL;
+
+    if (tmp) {
+        snprintf(tmp, len, "%s.tmp", path);
+        out = fopen(tmp, "w");
+    }
+    if (out) {
+        if (json) write_json(out, s);
+        else write_prometheus(out, s);
+        if (fclose(out) == 0 && rename(tmp, path) == 0) {
+            free(tmp);
+            return;
+        }
+        unlink(tmp);
+    }
+    if (!write_warned) {
+        ftp_log_perror("write metrics snapshot");
+        write_warned = 1;
+    }
+    free(tmp);
+}
+
+static void progress_report(int last) {
+    ProgressSample s;
+    progress_sample(&s, last);
+    if (show_bar) progress_draw(&s);
+    if (prom_path) write_snapshot(prom_path, &s, 0);
+    if (json_path) write_snapshot(json_path, &s, 1);
+}
+
+static void* progress_main(void* arg) {
+    (void) arg;
+    pthread_mutex_lock(&reporter_lock);
+    while (!reporter_stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += (time_t) interval;
+        deadline.tv_nsec += (long) ((interval - (time_t) interval) * 1e9);
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (!reporter_stop && pthread_cond_timedwait(&reporter_wake, &reporter_lock, &deadline) == 0) {
+        }
+        if (reporter_stop) break;
+        pthread_mutex_unlock(&reporter_lock);
+        progress_report(0);
+        pthread_mutex_lock(&reporter_lock);
+    }
+    pthread_mutex_unlock(&reporter_lock);
+    return NULL;
+}
+
+int ftp_progress_start(int bar, const char* prom, const char* json, double seconds) {
+    if (progress_on) return 0;
+    show_bar = bar;
+    prom_path = prom ? strdup(prom) : NULL;
+    json_path = json ? strdup(json) : NULL;
+    if ((prom && !prom_path) || (json && !json_path)) {
+        ftp_log_perror("strdup");
+        return -1;
+    }
+    interval = seconds > 0 ? seconds : FTP_PROGRESS_DEFAULT_INTERVAL;
+    started_at = last_at = monotonic_seconds();
+    reporter_stop = 0;
+    __atomic_store_n(&progress_on, 1, __ATOMIC_RELEASE);
+    if (pthread_create(&reporter, NULL, progress_main, NULL) != 0) {
+        ftp_log_perror("pthread_create progress reporter");
+        __atomic_store_n(&progress_on, 0, __ATOMIC_RELEASE);
+        return -1;
+    }
+    return 0;
+}
+
+void ftp_progress_stop(void) {
+    if (!__atomic_load_n(&progress_on, __ATOMIC_ACQUIRE)) return;
+    pthread_mutex_lock(&reporter_lock);
+    reporter_stop = 1;
+    pthread_cond_signal(&reporter_wake);
+    pthread_mutex_unlock(&reporter_lock);
+    pthread_join(reporter, NULL);
+    progress_report(1);
+    if (show_bar) fputc('\n', stderr);
+    __atomic_store_n(&progress_on, 0, __ATOMIC_RELEASE);
+    free(prom_path);
+    free(json_path);
+    prom_path = json_path = NULL;
+}
+
+int ftp_progress_enabled(void) {
+    return __atomic_load_n(&progress_on, __ATOMIC_RELAXED);
+}
+
+void ftp_progress_expect(long long bytes) {
+    __atomic_store_n(&goal_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+FtpProgressSlot* ftp_progress_begin(long long expected) {
+    current_slot = NULL;
+    if (!__atomic_load_n(&progress_on, __ATOMIC_ACQUIRE)) return NULL;
+    for (int i = 0; i < FTP_PROGRESS_SLOTS; i++) {
+        FtpProgressSlot* slot = &slots[i];
+        int state = SLOT_FREE;
+        if (__atomic_compare_exchange_n(&slot->state, &state, SLOT_CLAIMED, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            slot->bytes = 0;
+            slot->expected = expected;
+            __atomic_store_n(&slot->state, SLOT_LIVE, __ATOMIC_RELEASE);
+            current_slot = slot;
+            return slot;
+        }
+    }
+    __atomic_fetch_add(&overflow_active, 1, __ATOMIC_RELAXED);
+    current_slot = &overflow_slot;
+    return current_slot;
+}
+
+void ftp_progress_add_to(FtpProgressSlot* slot, long long bytes) {
+    if (!slot) return;
+    if (slot == &overflow_slot) __atomic_fetch_add(&slot->bytes, bytes, __ATOMIC_RELAXED);
+    else __atomic_store_n(&slot->bytes, slot->bytes + bytes, __ATOMIC_RELAXED);
+}
+
+void ftp_progress_add(long long bytes) {
+    ftp_progress_add_to(current_slot, bytes);
+}
+
+void ftp_progress_end(FtpProgressSlot* slot) {
+    if (!slot) return;
+    if (current_slot == slot) current_slot = NULL;
+    if (slot == &overflow_slot) {
+        __atomic_fetch_sub(&overflow_active, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&overflow_finished, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    __atomic_store_n(&slot->state, SLOT_DONE, __ATOMIC_RELEASE);
+}
+
+void ftp_progress_retry(void) {
+    __atomic_fetch_add(&retry_count, 1, __ATOMIC_RELAXED);
+}
+
+void ftp_progress_phase(FtpPhase phase, double seconds) {
+    if (seconds < 0) return;
+    __atomic_fetch_add(&phase_usec[phase], (long long) (seconds * 1e6), __ATOMIC_RELAXED);
+    __atomic_fetch_add(&phase_count[phase], 1, __ATOMIC_RELAXED);
+}
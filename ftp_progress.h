@@ -0,0 +1,78 @@
+#ifndef FTP_PROGRESS_H
+#define FTP_PROGRESS_H
+
+#include "ftp_stats.h" // For FtpPhase
+
+#define FTP_PROGRESS_SLOTS 64               // Transfers tracked one by one; more still count in the totals
+#define FTP_PROGRESS_DEFAULT_INTERVAL 1.0   // Seconds between reporter samples
+#define FTP_PROGRESS_BAR_WIDTH 30           // Characters of the terminal bar
+
+// Live counters of one transfer: written only by the thread that runs it,
+// read by the reporter thread without locks
+typedef struct FtpProgressSlot FtpProgressSlot;
+
+/**
+ * Starts the reporter thread, which samples the counters every `interval`
+ * seconds. Nothing is counted per transfer until it runs.
+ * @param show_bar Redraw a progress line (bytes, rate, ETA, active transfers) on stderr.
+ * @param prom_path Write a Prometheus text snapshot here (NULL for none).
+ * @param json_path Write a JSON snapshot here (NULL for none).
+ * @param interval Seconds between samples (<= 0 for FTP_PROGRESS_DEFAULT_INTERVAL).
+ * @return 0 on success, -1 on failure.
+ */
+int ftp_progress_start(int show_bar, const char* prom_path, const char* json_path, double interval);
+
+/**
+ * Takes a last sample, ends the progress line and stops the reporter.
+ * Does nothing if it is not running; safe to register with atexit().
+ */
+void ftp_progress_stop(void);
+
+/**
+ * Returns non-zero while the reporter runs.
+ */
+int ftp_progress_enabled(void);
+
+/**
+ * Announces the bytes the whole run is expected to receive (e.g. the SIZE of
+ * a file split over several connections), for the percentage and ETA.
+ * Without it they come from the transfers seen so far.
+ */
+void ftp_progress_expect(long long bytes);
+
+/**
+ * Registers a transfer and makes it the calling thread's current one.
+ * @param expected Bytes it will receive, or -1 if unknown.
+ * @return Its slot, or NULL if the reporter is not running (all calls accept NULL).
+ */
+FtpProgressSlot* ftp_progress_begin(long long expected);
+
+/**
+ * Counts bytes received by the calling thread's current transfer: one
+ * relaxed store, no lock and no system call.
+ */
+void ftp_progress_add(long long bytes);
+
+/**
+ * Counts bytes received by an explicit transfer (for code that multiplexes
+ * many transfers on one thread, like the epoll engine).
+ */
+void ftp_progress_add_to(FtpProgressSlot* slot, long long bytes);
+
+/**
+ * Unregisters a transfer; its bytes move into the totals at the next sample.
+ * Clears the calling thread's current transfer if it is this one.
+ */
+void ftp_progress_end(FtpProgressSlot* slot);
+
+/**
+ * Counts a reconnect made to resume a transfer.
+ */
+void ftp_progress_retry(void);
+
+/**
+ * Adds a phase duration to the per-phase totals (called by ftp_phase_add_to()).
+ */
+void ftp_progress_phase(FtpPhase phase, double seconds);
+
+#endif // FTP_PROGRESS_H
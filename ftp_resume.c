@@ -0,0 +1,149 @@
+#include "ftp_resume.h"
+#include "ftp_utils.h"
+#include "ftp_session.h"
+#include "ftp_progress.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+int ftp_resume_download(FtpConn* control, const char* remote_path, const char* local_filename,
+                        const TransferOptions* opts, TransferStats* stats) {
+    long long remote_size = -1;
+    time_t remote_mtime = (time_t) -1;
+    long long offset = 0;
+    struct stat st;
+
+    if (stats) {
+        memset(stats, 0, sizeof(*stats));
+        stats->ttfb = -1;
+    }
+    if (ftp_get_size(control, remote_path, &remote_size) < 0) {
+        fprintf(stderr, "Warning: SIZE unavailable, the download cannot be verified.\n");
+        remote_size = -1;
+    }
+    if (ftp_get_mdtm(control, remote_path, &remote_mtime) < 0) {
+        fprintf(stderr, "Warning: MDTM unavailable, only the size can be checked.\n");
+        remote_mtime = (time_t) -1;
+    }
+
+    if (stat(local_filename, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        int unchanged = remote_mtime == (time_t) -1 || st.st_mtime >= remote_mtime;
+        if (remote_size < 0) {
+            printf("Resume: remote size unknown, restarting '%s' from byte 0.\n", local_filename);
+        } else if (!unchanged) {
+            printf("Resume: remote file changed after the local copy was written, restarting.\n");
+        } else if (st.st_size > remote_size) {
+            printf("Resume: local file is larger than the remote one, restarting.\n");
+        } else if (st.st_size == remote_size) {
+            printf("Resume: '%s' is already complete (%lld bytes).\n", local_filename, remote_size);
+            return 0;
+        } else {
+            offset = st.st_size;
+            printf("Resume: continuing '%s' at byte %lld of %lld.\n", local_filename, offset, remote_size);
+        }
+    }
+
+    int local_fd = transfer_open_existing(local_filename, remote_size, opts);
+    if (local_fd < 0) return -1;
+    if (ftruncate(local_fd, offset) < 0) { // Drops a stale prefix when restarting
+        perror("ftruncate local file");
+        close(local_fd);
+        return -1;
+    }
+
+    int status = -1;
+    int data_sockfd = ftp_open_data_connection(control);
+    if (data_sockfd >= 0) {
+        long long length = remote_size >= 0 ? remote_size - offset : -1;
+        status = ftp_retrieve_range(control, data_sockfd, remote_path, local_fd, offset, length, 1,
+                                    opts, stats);
+        close(data_sockfd);
+    }
+    if (status < 0) {
+        // Keep the partial file: the next --continue run picks it up
+        close(local_fd);
+        return -1;
+    }
+
+    if (fstat(local_fd, &st) < 0) {
+        perror("fstat local file");
+        close(local_fd);
+        return -1;
+    }
+    if (remote_size >= 0 && st.st_size != remote_size) {
+        fprintf(stderr, "Size mismatch: local %lld bytes, remote %lld bytes.\n", (long long) st.st_size, remote_size);
+        close(local_fd);
+        return -1;
+    }
+    if (remote_mtime != (time_t) -1) {
+        time_t final_mtime;
+        if (ftp_get_mdtm(control, remote_path, &final_mtime) == 0 && final_mtime != remote_mtime) {
+            fprintf(stderr, "Remote file changed during the transfer; discarding the local copy.\n");
+            if (ftruncate(local_fd, 0) < 0) perror("ftruncate local file");
+            close(local_fd);
+            return -1;
+        }
+        // Stamp the remote time so later runs can tell a complete copy from a stale one
+        struct timespec times[2];
+        times[0].tv_sec = remote_mtime;
+        times[0].tv_nsec = 0;
+        times[1] = times[0];
+        if (futimens(local_fd, times) < 0) perror("futimens local file");
+    }
+    close(local_fd);
+    printf("Verified '%s': %lld bytes.\n", local_filename, (long long) st.st_size);
+    return 0;
+}
+
+int ftp_transfer_retryable(FtpConn* control, const TransferStats* stats) {
+    char text[FTP_LAST_REPLY_SIZE];
+    if (stats && stats->stalled) return 1;
+    // A 5xx (no such file, permission denied, ...) will not go away on a new connection
+    return ftp_last_reply(control, text, sizeof(text)) / 100 != 5;
+}
+
+void ftp_retry_wait(int attempt) {
+    ftp_progress_retry();
+    long delay_ms = FTP_RETRY_BACKOFF_MS;
+    for (int i = 1; i < attempt && delay_ms < FTP_RETRY_BACKOFF_MAX_MS; i++) delay_ms *= 2;
+    if (delay_ms > FTP_RETRY_BACKOFF_MAX_MS) delay_ms = FTP_RETRY_BACKOFF_MAX_MS;
+    struct timespec pause = {delay_ms / 1000, (delay_ms % 1000) * 1000000L};
+    while (nanosleep(&pause, &pause) < 0 && errno == EINTR) {
+    }
+}
+
+int ftp_resume_retry(const ParsedUrl* url, const char* local_filename, const TransferOptions* opts,
+                     TransferStats* stats) {
+    for (int attempt = 1; opts && attempt <= opts->retries; attempt++) {
+        ftp_retry_wait(attempt);
+        printf("Reconnecting to resume '%s' (attempt %d of %d).\n", local_filename, attempt, opts->retries);
+        FtpConn* control = ftp_session_open(url);
+        if (!control) continue; // Server unreachable for now: back off and try again
+        TransferStats attempt_stats;
+        int status = ftp_resume_download(control, url->path, local_filename, opts, &attempt_stats);
+        int retryable = status < 0 && ftp_transfer_retryable(control, &attempt_stats);
+        ftp_session_close(control);
+
+        long long bytes = stats->bytes + attempt_stats.bytes;
+        double seconds = stats->seconds + attempt_stats.seconds;
+        int keepalives = stats->keepalives + attempt_stats.keepalives;
+        if (attempt_stats.bytes > 0 || status == 0) {
+            double ttfb = stats->ttfb;
+            *stats = attempt_stats;
+            if (ttfb >= 0) stats->ttfb = ttfb; // Time to the file's first byte, not the resumed one's
+        }
+        stats->bytes = bytes;
+        stats->output_bytes = bytes;
+        stats->seconds = seconds;
+        stats->keepalives = keepalives;
+        stats->retries = attempt;
+        if (status == 0) return 0;
+        if (!retryable) break;
+    }
+    return -1;
+}
@@ -0,0 +1,61 @@
+#ifndef FTP_RESUME_H
+#define FTP_RESUME_H
+
+#include "data_transfer.h"
+#include "url_parser.h"
+#include "ftp_utils.h" // For FtpConn
+
+#define FTP_RETRY_DEFAULT 3        // --retries when not given but a watchdog option is (0 otherwise)
+#define FTP_RETRY_BACKOFF_MS 250   // Wait before the first reconnect; doubles for each further one
+#define FTP_RETRY_BACKOFF_MAX_MS 4000
+
+/**
+ * Downloads a file, continuing an existing partial local copy when it is safe.
+ * Compares the local file with the remote SIZE and MDTM: the partial copy is
+ * kept (and RETR is preceded by REST <local size>) only if it is shorter than
+ * the remote file and was written after the remote file was last modified.
+ * Otherwise the download restarts from byte zero. On completion the local
+ * size is checked against SIZE, MDTM is asked again to catch a file that
+ * changed mid-transfer, and the local mtime is set to the remote one.
+ * @param control A logged-in control connection (TYPE I already set).
+ * @param remote_path The path of the file on the server.
+ * @param local_filename The name to save the file as locally.
+ * @param opts How to drain the data connection (may be NULL).
+ * @param stats Filled with the bytes fetched in this run (may be NULL).
+ * @return 0 on success (including "already complete"), -1 on failure.
+ */
+int ftp_resume_download(FtpConn* control, const char* remote_path, const char* local_filename,
+                        const TransferOptions* opts, TransferStats* stats);
+
+/**
+ * Whether a failed transfer is worth another attempt on a new connection: the
+ * watchdog declared it stalled, or the connection broke, rather than the
+ * server refusing the file with a permanent (5xx) reply.
+ * @param control The control connection the transfer ran on (still open).
+ * @param stats The failed transfer's statistics (may be NULL).
+ * @return 1 if it should be retried, 0 otherwise.
+ */
+int ftp_transfer_retryable(FtpConn* control, const TransferStats* stats);
+
+/**
+ * Sleeps before reconnect number `attempt` (1-based): FTP_RETRY_BACKOFF_MS,
+ * doubling for each further attempt up to FTP_RETRY_BACKOFF_MAX_MS.
+ */
+void ftp_retry_wait(int attempt);
+
+/**
+ * Recovers a download that failed part way: up to opts->retries times, waits
+ * (ftp_retry_wait()), opens a new session and runs
+ * ftp_resume_download(), which continues with REST from the last byte
+ * written. Stops early when a failure is not retryable.
+ * @param url The parsed URL.
+ * @param local_filename The partial local file.
+ * @param opts Transfer options (opts->retries is the number of attempts).
+ * @param stats Statistics of the failed transfer; the attempts' bytes and
+ *              time are added, and stats->retries counts the reconnects.
+ * @return 0 once an attempt succeeds, -1 if all of them failed.
+ */
+int ftp_resume_retry(const ParsedUrl* url, const char* local_filename, const TransferOptions* opts,
+                     TransferStats* stats);
+
+#endif // FTP_RESUME_H
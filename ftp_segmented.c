@@ -0,0 +1,191 @@
+#include "ftp_segmented.h"
+#include "ftp_session.h"
+#include "ftp_utils.h"
+#include "ftp_stats.h"
+#include "ftp_resume.h"
+#include "ftp_progress.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>     // For close, ftruncate
+#include <fcntl.h>      // For open, posix_fallocate
+#include <pthread.h>
+
+typedef struct {
+    const ParsedUrl* url;
+    const TransferOptions* opts;
+    FtpConn* control;   // Already-open session to reuse, or NULL to open a new one
+    int out_fd;
+    long long offset;
+    long long length;
+    int to_eof;
+    int index;
+    int status;         // 0 on success, -1 on failure
+    TransferStats stats;
+    FtpPhaseTimes times; // Phases run by this worker's thread
+} SegmentWorker;
+
+static void* segment_worker_main(void* arg) {
+    SegmentWorker* w = (SegmentWorker*) arg;
+    FtpConn* control = w->control;
+    long long done = 0; // Bytes of the range already written, by earlier attempts too
+    int retries = w->opts ? w->opts->retries : 0;
+
+    w->status = -1;
+    for (int attempt = 0;; attempt++) {
+        int retryable = 1;
+        TransferStats st;
+        memset(&st, 0, sizeof(st));
+        st.ttfb = -1;
+        if (attempt > 0) {
+            ftp_retry_wait(attempt);
+            printf("Segment %d: reconnecting to resume at byte %lld (attempt %d of %d).\n", w->index,
+                   w->offset + done, attempt, retries);
+            w->stats.retries = attempt;
+        }
+        if (!control) control = ftp_session_open(w->url);
+        if (!control) {
+            fprintf(stderr, "Segment %d: could not open session.\n", w->index);
+            retryable = attempt > 0; // Like ftp_resume_retry: only a reconnect is tried again
+        } else {
+            int data_sockfd = ftp_open_data_connection(control);
+            if (data_sockfd >= 0) {
+                long long offset = w->offset + done;
+                long long length = w->length < 0 ? -1 : w->length - done;
+                printf("Segment %d: bytes %lld-%lld\n", w->index, offset, offset + length - 1);
+                w->status = ftp_retrieve_range(control, data_sockfd, w->url->path, w->out_fd,
+                                               offset, length, w->to_eof, w->opts, &st);
+                close(data_sockfd);
+                done += st.bytes;
+                if (attempt == 0 || st.first_byte_at > 0) {
+                    // Keep the first attempt's TTFB and start; add up bytes and NOOPs
+                    TransferStats first = w->stats;
+                    w->stats = st;
+                    if (attempt > 0) {
+                        w->stats.ttfb = first.ttfb;
+                        if (first.first_byte_at > 0) w->stats.first_byte_at = first.first_byte_at;
+                        w->stats.keepalives += first.keepalives;
+                        w->stats.retries = first.retries;
+                    }
+                }
+                w->stats.bytes = done;
+                w->stats.output_bytes = done;
+            }
+            retryable = w->status < 0 && ftp_transfer_retryable(control, &st);
+            ftp_session_close(control);
+            control = NULL;
+        }
+        if (w->status == 0 || !retryable || attempt >= retries || (w->length >= 0 && done >= w->length)) break;
+    }
+    ftp_phase_take(&w->times);
+    return NULL;
+}
+
+int ftp_segmented_download(const ParsedUrl* url, const char* local_filename, int num_segments,
+                           const TransferOptions* opts) {
+    SegmentWorker workers[FTP_MAX_SEGMENTS];
+    pthread_t threads[FTP_MAX_SEGMENTS];
+    long long file_size;
+    FtpConn* control;
+    int out_fd;
+    int i, started, failed = 0;
+
+    if (num_segments < 1) num_segments = 1;
+    if (num_segments > FTP_MAX_SEGMENTS) num_segments = FTP_MAX_SEGMENTS;
+
+    control = ftp_session_open(url);
+    if (!control) {
+        FtpPhaseTimes times;
+        ftp_phase_take(&times);
+        ftp_stats_emit("segmented", url, url->path, local_filename, -1, &times, NULL);
+        return -1;
+    }
+    if (ftp_get_size(control, url->path, &file_size) < 0) {
+        fprintf(stderr, "Warning: size unknown, downloading over a single connection.\n");
+        file_size = -1;
+        num_segments = 1;
+    } else {
+        long long max_segments = file_size / FTP_MIN_SEGMENT_SIZE;
+        if (max_segments < 1) max_segments = 1;
+        if (num_segments > max_segments) num_segments = (int) max_segments;
+        printf("Remote size: %lld bytes, using %d segment(s).\n", file_size, num_segments);
+        ftp_progress_expect(file_size);
+    }
+
+    out_fd = open(local_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        perror("open local file for writing");
+        ftp_session_close(control);
+        return -1;
+    }
+    if (file_size > 0 && posix_fallocate(out_fd, 0, file_size) != 0) {
+        // Not all file systems support preallocation; a sparse file works too.
+        if (ftruncate(out_fd, file_size) < 0) {
+            perror("ftruncate local file");
+            close(out_fd);
+            ftp_session_close(control);
+            return -1;
+        }
+    }
+
+    long long segment_size = file_size > 0 ? file_size / num_segments : 0;
+    for (i = 0; i < num_segments; i++) {
+        workers[i].url = url;
+        workers[i].opts = opts;
+        workers[i].control = (i == 0) ? control : NULL; // Reuse the SIZE session
+        workers[i].out_fd = out_fd;
+        workers[i].offset = segment_size * i;
+        workers[i].to_eof = (i == num_segments - 1);
+        workers[i].length = workers[i].to_eof ? (file_size < 0 ? -1 : file_size - workers[i].offset)
+                                              : segment_size;
+        workers[i].index = i;
+        workers[i].status = -1;
+        memset(&workers[i].stats, 0, sizeof(workers[i].stats));
+        workers[i].stats.ttfb = -1;
+        ftp_phase_clear(&workers[i].times);
+    }
+    for (started = 0; started < num_segments; started++) {
+        if (pthread_create(&threads[started], NULL, segment_worker_main, &workers[started]) != 0) {
+            perror("pthread_create");
+            if (started == 0) ftp_session_close(control);
+            failed = 1;
+            break;
+        }
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        if (workers[i].status != 0) {
+            fprintf(stderr, "Segment %d (offset %lld) failed.\n", i, workers[i].offset);
+            failed = 1;
+        }
+    }
+    close(out_fd);
+
+    // One stats line for the whole file: the opening session's phases, worker 0's
+    // PASV/TTFB, and the transfer from the first byte of any range to the last EOF
+    FtpPhaseTimes times;
+    TransferStats total = {0};
+    ftp_phase_take(&times);
+    total.ttfb = -1;
+    total.method = started > 0 ? workers[0].stats.method : NULL;
+    for (i = 0; i < started; i++) {
+        const TransferStats* ws = &workers[i].stats;
+        total.bytes += ws->bytes;
+        total.keepalives += ws->keepalives;
+        total.retries += ws->retries;
+        if (ws->first_byte_at > 0 && (total.first_byte_at == 0 || ws->first_byte_at < total.first_byte_at)) {
+            total.first_byte_at = ws->first_byte_at;
+        }
+        if (ws->finished_at > total.finished_at) total.finished_at = ws->finished_at;
+    }
+    if (started > 0) {
+        times.seconds[FTP_PHASE_PASV] = workers[0].times.seconds[FTP_PHASE_PASV];
+        total.ttfb = workers[0].stats.ttfb;
+        total.rtt = workers[0].stats.rtt;
+        total.rcvbuf = workers[0].stats.rcvbuf;
+        total.read_size = workers[0].stats.read_size;
+    }
+    total.seconds = total.first_byte_at > 0 ? total.finished_at - total.first_byte_at : 0;
+    ftp_stats_emit("segmented", url, url->path, local_filename, failed ? -1 : 0, &times, &total);
+    return failed ? -1 : 0;
+}
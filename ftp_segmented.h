@@ -0,0 +1,24 @@
+#ifndef FTP_SEGMENTED_H
+#define FTP_SEGMENTED_H
+
+#include "url_parser.h"
+#include "data_transfer.h"
+
+#define FTP_MAX_SEGMENTS 32
+#define FTP_MIN_SEGMENT_SIZE (256 * 1024) // Smaller ranges are not worth a session
+
+/**
+ * Downloads a file over several parallel control+data session pairs.
+ * Asks for SIZE, preallocates the local file, splits it into byte ranges and
+ * has one worker thread per range fetch it with REST+RETR, writing in place.
+ * Falls back to a single range if the server does not answer SIZE.
+ * @param url The parsed URL of the file.
+ * @param local_filename The name to save the file as locally.
+ * @param num_segments Number of parallel sessions requested (1..FTP_MAX_SEGMENTS).
+ * @param opts How each worker drains its data connection (may be NULL).
+ * @return 0 on success, -1 on failure.
+ */
+int ftp_segmented_download(const ParsedUrl* url, const char* local_filename, int num_segments,
+                           const TransferOptions* opts);
+
+#endif // FTP_SEGMENTED_H
@@ -0,0 +1,162 @@
+#include "ftp_session.h"
+#include "socket_utils.h"
+#include "ftp_utils.h"
+#include "ftp_stats.h"
+#include "ftp_log.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h> // For close()
+
+static FtpSessionOptions session_options;
+
+void ftp_session_set_options(const FtpSessionOptions* opts) {
+    session_options = *opts;
+}
+
+FtpConn* ftp_session_open(const ParsedUrl* url) {
+    return ftp_session_open_with(url, &session_options);
+}
+
+FtpConn* ftp_session_open_with(const ParsedUrl* url, const FtpSessionOptions* opts) {
+    char ip_addr_str[INET6_ADDRSTRLEN];
+    char response_buf[FTP_RESPONSE_BUF_SIZE];
+    int ftp_code;
+    int control_sockfd;
+    FtpConn* control;
+
+    double dns_seconds = -1;
+    double mark = monotonic_seconds();
+
+    // Resolve every address and race the connections (IPv6 and IPv4)
+    control_sockfd = connect_to_host(url->host, url->port, ip_addr_str, sizeof(ip_addr_str), &dns_seconds);
+    double now = monotonic_seconds();
+    if (dns_seconds >= 0) {
+        ftp_phase_add(FTP_PHASE_DNS, dns_seconds);
+        if (control_sockfd >= 0) ftp_phase_add(FTP_PHASE_CONNECT, now - mark - dns_seconds);
+    }
+    mark = now;
+    if (control_sockfd < 0) {
+        return NULL;
+    }
+    ftp_log("Control connection established to %s:%d.\n", ip_addr_str, url->port);
+    control = ftp_conn_new(control_sockfd);
+    if (!control) return NULL;
+    control->epsv_refused = opts->disable_epsv != 0; // PASV only from the start
+
+    // Read initial welcome message(s) from server
+    if (read_ftp_response(control, response_buf, sizeof(response_buf), &ftp_code) < 0) {
+        ftp_log_error("Failed to read welcome message.\n");
+        ftp_conn_close(control);
+        return NULL;
+    }
+    if (ftp_code != 220) {
+        ftp_log_error("Server did not send 220 welcome. Got %d: %s\n", ftp_code, response_buf);
+        ftp_conn_close(control);
+        return NULL;
+    }
+    ftp_log("FTP Server Welcome OK (Code %d).\n", ftp_code);
+    now = monotonic_seconds();
+    ftp_phase_add(FTP_PHASE_BANNER, now - mark);
+    mark = now;
+
+    // The TLS handshake is counted as part of the login
+    if (opts->tls && ftp_auth_tls(control, url->host) < 0) {
+        ftp_conn_close(control);
+        return NULL;
+    }
+
+    if (opts->pipeline) {
+        // USER, PASS and TYPE I in one round trip
+        int login = ftp_login_pipelined(control, url->user, url->pass);
+        if (login == FTP_PIPELINE_DROPPED) {
+            // The replies are out of step for good on this connection
+            FtpSessionOptions lockstep = *opts;
+            lockstep.pipeline = 0;
+            ftp_conn_close(control);
+            ftp_log_error("Reconnecting to log in without pipelining.\n");
+            return ftp_session_open_with(url, &lockstep);
+        }
+        if (login < 0 || (opts->tls && ftp_protect_data(control) < 0)) {
+            ftp_conn_close(control);
+            return NULL;
+        }
+        ftp_phase_add(FTP_PHASE_LOGIN, monotonic_seconds() - mark);
+        return control;
+    }
+
+    if (ftp_login(control, url->user, url->pass) < 0 ||
+        (opts->tls && ftp_protect_data(control) < 0)) {
+        ftp_conn_close(control);
+        return NULL;
+    }
+
+    if (ftp_set_type_image(control) < 0) {
+        // This might be a warning for some servers, but generally required for files
+        ftp_log_error("Warning: Could not set TYPE I. File transfer might be corrupted.\n");
+    }
+    ftp_phase_add(FTP_PHASE_LOGIN, monotonic_seconds() - mark);
+    return control;
+}
+
+int ftp_open_data_connection(FtpConn* control) {
+    char data_ip_str[INET6_ADDRSTRLEN];
+    int data_port;
+    int data_sockfd;
+    double start = monotonic_seconds();
+    int use_epsv = !control->epsv_refused;
+
+    if (control->passive_port > 0) {
+        // The pipelined login's EPSV/PASV already opened one; it serves a single transfer
+        data_port = control->passive_port;
+        control->passive_port = 0;
+        if (control->passive_ip[0]) {
+            snprintf(data_ip_str, sizeof(data_ip_str), "%s", control->passive_ip);
+        } else if (get_peer_address(control->sockfd, data_ip_str, sizeof(data_ip_str)) < 0) {
+            return -1;
+        }
+    } else if (use_epsv && ftp_enter_extended_passive_mode(control, &data_port) == 0 &&
+               get_peer_address(control->sockfd, data_ip_str, sizeof(data_ip_str)) == 0) {
+        // EPSV: same host as the control connection, only the port comes from the server
+    } else {
+        if (use_epsv) {
+            control->epsv_refused = 1; // Don't ask again on this connection
+            ftp_log("Falling back to PASV.\n");
+        }
+        if (ftp_enter_passive_mode(control, data_ip_str, sizeof(data_ip_str), &data_port) < 0) {
+            return -1;
+        }
+    }
+
+    data_sockfd = create_tcp_socket_for(data_ip_str);
+    if (data_sockfd < 0) {
+        return -1;
+    }
+    if (connect_to_server(data_sockfd, data_ip_str, data_port) < 0) {
+        close(data_sockfd);
+        return -1;
+    }
+    ftp_log("Data connection established to %s:%d.\n", data_ip_str, data_port);
+    ftp_phase_add(FTP_PHASE_PASV, monotonic_seconds() - start);
+    return data_sockfd;
+}
+
+void ftp_session_close(FtpConn* control) {
+    if (!control) return;
+    ftp_quit(control);      // Send QUIT, attempt to read reply
+    ftp_conn_close(control); // Ensure control socket is closed
+    ftp_log("Control socket closed.\n");
+}
+
+const char* ftp_local_name(const char* remote_path) {
+    const char* local_filename = strrchr(remote_path, '/');
+    if (local_filename) {
+        local_filename++; // Point after the slash
+    } else {
+        local_filename = remote_path; // Use the whole path if no slash
+    }
+    if (strlen(local_filename) == 0) { // If path was just "/" or empty after slash
+        local_filename = "downloaded_file"; // Default filename
+    }
+    return local_filename;
+}
@@ -0,0 +1,64 @@
+#ifndef FTP_SESSION_H
+#define FTP_SESSION_H
+
+#include "url_parser.h"
+#include "ftp_utils.h" // For FtpConn
+
+// Process-wide settings for how sessions are opened
+typedef struct {
+    int pipeline;       // Send USER, PASS, TYPE I and EPSV in one write (see ftp_login_pipelined)
+    int disable_epsv;   // Use PASV only (EPSV is tried first by default)
+    int tls;            // Explicit FTPS: AUTH TLS before login, PBSZ 0 + PROT P after (ftp_tls_init() first)
+} FtpSessionOptions;
+
+/**
+ * Sets the options used by every later ftp_session_open() call.
+ * Call it before starting any worker threads.
+ * @param opts The options to copy.
+ */
+void ftp_session_set_options(const FtpSessionOptions* opts);
+
+/**
+ * Opens a logged-in control connection for a parsed URL.
+ * Resolves the host, races connections to its IPv6/IPv4 addresses (see
+ * connect_to_host), reads the 220 welcome, logs in and sets TYPE I. With
+ * the tls option the connection is upgraded with AUTH TLS before USER is
+ * sent, and data connections are protected (PROT P) after login.
+ * @param url The parsed URL (host, port, user and password are used).
+ * @return The control connection on success (close it with ftp_session_close()), NULL on failure.
+ */
+FtpConn* ftp_session_open(const ParsedUrl* url);
+
+/**
+ * ftp_session_open() with explicit options instead of the process-wide ones,
+ * for code that keeps its own settings per session (see ftp_client.h).
+ * @param url The parsed URL.
+ * @param opts The options for this connection (disable_epsv sticks to it).
+ * @return The control connection on success, NULL on failure.
+ */
+FtpConn* ftp_session_open_with(const ParsedUrl* url, const FtpSessionOptions* opts);
+
+/**
+ * Enters passive mode and connects a new data socket.
+ * Tries EPSV first and falls back to PASV (remembered per connection) if the
+ * server refuses it. The first call after a pipelined login uses the port its
+ * EPSV/PASV already got, without another round trip.
+ * @param control The control connection.
+ * @return The data socket file descriptor on success, -1 on failure.
+ */
+int ftp_open_data_connection(FtpConn* control);
+
+/**
+ * Sends QUIT, closes the control connection and frees it (NULL is ignored).
+ * @param control The control connection.
+ */
+void ftp_session_close(FtpConn* control);
+
+/**
+ * Derives the local file name from a remote path (its last component).
+ * @param remote_path The path of the file on the server.
+ * @return Pointer into remote_path, or "downloaded_file" if it has no name.
+ */
+const char* ftp_local_name(const char* remote_path);
+
+#endif // FTP_SESSION_H
@@ -0,0 +1,169 @@
+#include "ftp_stats.h"
+#include "ftp_tls.h" // For FTP_TLS_*
+#include "ftp_progress.h"
+#include "ftp_log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+static FILE* stats_out;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Each download thread drives one session at a time, so its phases go here
+static __thread FtpPhaseTimes current_phases;
+static __thread int current_phases_valid;
+
+static const char* const phase_names[FTP_PHASE_COUNT] = {
+    "dns_ms", "connect_ms", "banner_ms", "login_ms", "pasv_ms", "ttfb_ms", "transfer_ms"
+};
+
+int ftp_stats_open(const char* path) {
+    stats_out = strcmp(path, "-") == 0 ? stdout : fopen(path, "a");
+    if (!stats_out) {
+        ftp_log_perror("fopen stats file");
+        return -1;
+    }
+    return 0;
+}
+
+void ftp_stats_close(void) {
+    if (stats_out && stats_out != stdout) {
+        fclose(stats_out);
+    } else if (stats_out) {
+        fflush(stats_out);
+    }
+    stats_out = NULL;
+}
+
+void ftp_phase_clear(FtpPhaseTimes* times) {
+    for (int i = 0; i < FTP_PHASE_COUNT; i++) {
+        times->seconds[i] = -1.0;
+    }
+}
+
+void ftp_phase_add_to(FtpPhaseTimes* times, FtpPhase phase, double seconds) {
+    // TTFB and transfer are counted where the data arrives (records may copy them)
+    if (phase < FTP_PHASE_TTFB) ftp_progress_phase(phase, seconds);
+    // Accumulate: e.g. a refused EPSV followed by PASV is all one phase
+    if (times->seconds[phase] < 0) times->seconds[phase] = 0;
+    times->seconds[phase] += seconds;
+}
+
+void ftp_phase_add(FtpPhase phase, double seconds) {
+    if (!current_phases_valid) {
+        ftp_phase_clear(&current_phases);
+        current_phases_valid = 1;
+    }
+    ftp_phase_add_to(&current_phases, phase, seconds);
+}
+
+void ftp_phase_take(FtpPhaseTimes* times) {
+    if (current_phases_valid) {
+        *times = current_phases;
+    } else {
+        ftp_phase_clear(times);
+    }
+    current_phases_valid = 0;
+}
+
+// Writes a JSON string literal, escaping quotes, backslashes and control bytes.
+static void json_string(FILE* out, const char* s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char) *s;
+        if (c == '"' || c == '\\') fprintf(out, "\\%c", c);
+        else if (c < 0x20) fprintf(out, "\\u%04x", c);
+        else fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+void ftp_stats_emit(const char* mode, const ParsedUrl* url, const char* remote_path, const char* local_path,
+                    int status, const FtpPhaseTimes* times, const TransferStats* stats) {
+    FtpPhaseTimes phases;
+
+    if (!stats_out) return;
+    if (times) phases = *times;
+    else ftp_phase_clear(&phases);
+    if (stats && phases.seconds[FTP_PHASE_TTFB] < 0 && stats->ttfb >= 0) {
+        phases.seconds[FTP_PHASE_TTFB] = stats->ttfb;
+    }
+    if (stats && phases.seconds[FTP_PHASE_TRANSFER] < 0 && stats->first_byte_at > 0) {
+        phases.seconds[FTP_PHASE_TRANSFER] = stats->finished_at - stats->first_byte_at;
+    }
+
+    // Build the whole line first
+    char* text = NULL;
+    size_t text_len = 0;
+    FILE* line = open_memstream(&text, &text_len);
+    if (!line) {
+        ftp_log_perror("open_memstream");
+        return;
+    }
+    fprintf(line, "{\"time\":%lld,\"mode\":", (long long) time(NULL));
+    json_string(line, mode);
+    fprintf(line, ",\"host\":");
+    json_string(line, url->host);
+    fprintf(line, ",\"port\":%d,\"user\":", url->port);
+    json_string(line, url->user);
+    fprintf(line, ",\"path\":");
+    json_string(line, remote_path);
+    fprintf(line, ",\"local\":");
+    json_string(line, local_path);
+    fprintf(line, ",\"status\":\"%s\"", status == 0 ? "ok" : "failed");
+
+    double total = 0;
+    for (int i = 0; i < FTP_PHASE_COUNT; i++) {
+        if (phases.seconds[i] < 0) {
+            fprintf(line, ",\"%s\":null", phase_names[i]);
+        } else {
+            fprintf(line, ",\"%s\":%.3f", phase_names[i], phases.seconds[i] * 1000);
+            total += phases.seconds[i];
+        }
+    }
+    fprintf(line, ",\"total_ms\":%.3f", total * 1000);
+
+    long long bytes = stats ? stats->bytes : 0;
+    double seconds = stats ? stats->seconds : 0;
+    fprintf(line, ",\"bytes\":%lld,\"seconds\":%.6f,\"mb_per_s\":%.3f,\"method\":", bytes, seconds,
+            seconds > 0 ? bytes / seconds / 1e6 : 0.0);
+    json_string(line, stats && stats->method ? stats->method : "");
+    if (stats && stats->output_bytes > 0 && stats->output_bytes != stats->bytes) {
+        fprintf(line, ",\"output_bytes\":%lld", stats->output_bytes);
+    }
+    if (stats && stats->hash_alg != TRANSFER_HASH_NONE) {
+        fprintf(line, ",\"hash\":");
+        json_string(line, transfer_hash_name(stats->hash_alg));
+        fprintf(line, ",\"digest\":\"%s\",\"verified\":%s", stats->digest, stats->digest_verified ? "true" : "false");
+    }
+    if (stats && stats->inflate_cpu > 0 && stats->bytes > 0) {
+        fprintf(line, ",\"ratio\":%.3f,\"inflate_cpu_ms\":%.3f", (double) stats->output_bytes / stats->bytes,
+                stats->inflate_cpu * 1000);
+    }
+    if (stats && stats->tls != FTP_TLS_NONE) {
+        fprintf(line, ",\"tls\":\"%s\"", stats->tls == FTP_TLS_KTLS ? "ktls" : "user");
+    }
+    if (stats && stats->throttled > 0) {
+        fprintf(line, ",\"throttled_ms\":%.3f", stats->throttled * 1000);
+    }
+    if (stats && (stats->keepalives > 0 || stats->retries > 0 || stats->stalled)) {
+        fprintf(line, ",\"keepalives\":%d,\"retries\":%d,\"stalled\":%s", stats->keepalives, stats->retries,
+                stats->stalled ? "true" : "false");
+    }
+    if (stats && stats->rcvbuf > 0) {
+        fprintf(line, ",\"rtt_ms\":%.3f,\"rcvbuf\":%d,\"read_size\":%zu", stats->rtt * 1000, stats->rcvbuf,
+                stats->read_size);
+    }
+    fprintf(line, "}\n");
+    fclose(line);
+
+    // One fputs per record, so lines from several threads never interleave
+    pthread_mutex_lock(&stats_lock);
+    fputs(text, stats_out);
+    fflush(stats_out);
+    pthread_mutex_unlock(&stats_lock);
+    free(text);
+}
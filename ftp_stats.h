@@ -0,0 +1,75 @@
+#ifndef FTP_STATS_H
+#define FTP_STATS_H
+
+#include "url_parser.h"
+#include "data_transfer.h"
+
+// Phases of one download, in the order they happen
+typedef enum {
+    FTP_PHASE_DNS,        // Name resolution
+    FTP_PHASE_CONNECT,    // TCP connect of the control connection
+    FTP_PHASE_BANNER,     // Connected -> 220 welcome
+    FTP_PHASE_LOGIN,      // USER/PASS/TYPE I
+    FTP_PHASE_PASV,       // EPSV/PASV exchange and data connect
+    FTP_PHASE_TTFB,       // RETR sent -> first payload byte
+    FTP_PHASE_TRANSFER,   // First payload byte -> EOF
+    FTP_PHASE_COUNT
+} FtpPhase;
+
+// Phase durations in seconds; a negative value means the phase did not run
+// for this file (e.g. DNS/connect/login on a reused session)
+typedef struct {
+    double seconds[FTP_PHASE_COUNT];
+} FtpPhaseTimes;
+
+/**
+ * Starts writing one JSON line per downloaded file.
+ * @param path File to append the lines to, or "-" for stdout.
+ * @return 0 on success, -1 on failure.
+ */
+int ftp_stats_open(const char* path);
+
+/**
+ * Flushes and closes the JSON stats output, if any.
+ */
+void ftp_stats_close(void);
+
+/**
+ * Adds `seconds` to a phase of the calling thread's current record. Session
+ * code calls this as phases complete; ftp_phase_take() collects them per file.
+ */
+void ftp_phase_add(FtpPhase phase, double seconds);
+
+/**
+ * Adds `seconds` to a phase of an explicit record (for code that multiplexes
+ * many sessions on one thread, like the epoll engine).
+ */
+void ftp_phase_add_to(FtpPhaseTimes* times, FtpPhase phase, double seconds);
+
+/**
+ * Moves the calling thread's phase record into `times` and starts a new one.
+ * @param times Receives the phases recorded since the last call.
+ */
+void ftp_phase_take(FtpPhaseTimes* times);
+
+/**
+ * Marks every phase of `times` as not run.
+ */
+void ftp_phase_clear(FtpPhaseTimes* times);
+
+/**
+ * Writes one JSON line for a finished (or failed) file when --stats-json is on.
+ * TTFB and transfer time are taken from `stats` unless `times` has them.
+ * Safe to call from several threads.
+ * @param mode Which downloader produced it ("single", "batch", "engine", ...).
+ * @param url Host, port and user of the file (the password is never written).
+ * @param remote_path The path of the file on the server.
+ * @param local_path Where it was written.
+ * @param status 0 on success, -1 on failure.
+ * @param times Phase durations (may be NULL).
+ * @param stats Transfer statistics (may be NULL).
+ */
+void ftp_stats_emit(const char* mode, const ParsedUrl* url, const char* remote_path, const char* local_path,
+                    int status, const FtpPhaseTimes* times, const TransferStats* stats);
+
+#endif // FTP_STATS_H
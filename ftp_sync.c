@@ -0,0 +1,378 @@
+#include "ftp_sync.h"
+#include "ftp_session.h"
+#include "ftp_utils.h"
+#include "ftp_stats.h"
+#include "ftp_batch.h"  // For ftp_same_login
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>     // For close()
+#include <sys/stat.h>   // For stat
+
+#define MANIFEST_HEADER "# ftp-sync manifest v1: size mtime digest key"
+#define MANIFEST_DIGEST_LEN (TRANSFER_HASH_HEX_MAX + 16) // "SHA-256:<hex>"
+
+struct FtpManifestEntry {
+    char* key;               // "user@host:port/path"
+    long long size;
+    long long mtime;
+    char digest[MANIFEST_DIGEST_LEN]; // "<alg>:<hex>" of the local copy, "-" if none
+    int next;                // Next entry in the same bucket, -1 at the end
+};
+
+static unsigned manifest_hash(const char* key) {
+    unsigned h = 2166136261u; // FNV-1a
+    for (const unsigned char* p = (const unsigned char*) key; *p; p++) {
+        h = (h ^ *p) * 16777619u;
+    }
+    return h;
+}
+
+static void manifest_key(const ParsedUrl* url, const char* remote_path, char* key, size_t key_len) {
+    snprintf(key, key_len, "%s@%s:%d%s%s", url->user, url->host, url->port, remote_path[0] == '/' ? "" : "/",
+             remote_path);
+}
+
+static int manifest_rehash(FtpManifest* m, int num_buckets) {
+    int* buckets = malloc(num_buckets * sizeof(int));
+    if (!buckets) {
+        perror("malloc manifest buckets");
+        return -1;
+    }
+    for (int i = 0; i < num_buckets; i++) buckets[i] = -1;
+    for (int i = 0; i < m->count; i++) {
+        unsigned b = manifest_hash(m->entries[i].key) & (num_buckets - 1);
+        m->entries[i].next = buckets[b];
+        buckets[b] = i;
+    }
+    free(m->buckets);
+    m->buckets = buckets;
+    m->num_buckets = num_buckets;
+    return 0;
+}
+
+static FtpManifestEntry* manifest_find(FtpManifest* m, const char* key) {
+    if (m->num_buckets == 0) return NULL;
+    for (int i = m->buckets[manifest_hash(key) & (m->num_buckets - 1)]; i >= 0; i = m->entries[i].next) {
+        if (strcmp(m->entries[i].key, key) == 0) return &m->entries[i];
+    }
+    return NULL;
+}
+
+// Returns the entry for key, adding an empty one if needed (NULL on failure).
+static FtpManifestEntry* manifest_insert(FtpManifest* m, const char* key) {
+    FtpManifestEntry* entry = manifest_find(m, key);
+    if (entry) return entry;
+
+    if (m->count == m->capacity) {
+        int capacity = m->capacity ? m->capacity * 2 : 256;
+        FtpManifestEntry* grown = realloc(m->entries, capacity * sizeof(FtpManifestEntry));
+        if (!grown) {
+            perror("realloc manifest");
+            return NULL;
+        }
+        m->entries = grown;
+        m->capacity = capacity;
+    }
+    entry = &m->entries[m->count];
+    memset(entry, 0, sizeof(*entry));
+    entry->key = strdup(key);
+    if (!entry->key) {
+        perror("strdup manifest key");
+        return NULL;
+    }
+    entry->size = -1;
+    entry->mtime = -1;
+    strcpy(entry->digest, "-");
+    m->count++;
+    // Keep the load factor at or below one
+    if (m->count > m->num_buckets) {
+        if (manifest_rehash(m, m->num_buckets ? m->num_buckets * 2 : 256) < 0) {
+            free(entry->key);
+            m->count--;
+            return NULL;
+        }
+    } else {
+        unsigned b = manifest_hash(key) & (m->num_buckets - 1);
+        entry->next = m->buckets[b];
+        m->buckets[b] = m->count - 1;
+    }
+    return entry;
+}
+
+int ftp_manifest_load(FtpManifest* m, const char* path) {
+    char line[FTP_SYNC_KEY_LEN + MANIFEST_DIGEST_LEN + 64];
+    int line_no = 0;
+
+    memset(m, 0, sizeof(*m));
+    pthread_mutex_init(&m->lock, NULL);
+    if (strlen(path) >= sizeof(m->path)) {
+        fprintf(stderr, "Error: manifest path too long.\n");
+        return -1;
+    }
+    strcpy(m->path, path);
+
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        if (errno == ENOENT) return 0; // First run
+        perror("fopen manifest");
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        long long size, mtime;
+        char digest[MANIFEST_DIGEST_LEN];
+        int key_at = 0;
+
+        line_no++;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '#' || line[0] == '\0') continue;
+        if (sscanf(line, "%lld %lld %143s %n", &size, &mtime, digest, &key_at) != 3 || line[key_at] == '\0') {
+            fprintf(stderr, "Manifest '%s': ignoring malformed line %d.\n", path, line_no);
+            continue;
+        }
+        FtpManifestEntry* entry = manifest_insert(m, line + key_at);
+        if (!entry) {
+            fclose(file);
+            return -1;
+        }
+        entry->size = size;
+        entry->mtime = mtime;
+        snprintf(entry->digest, sizeof(entry->digest), "%s", digest);
+    }
+    fclose(file);
+    printf("Manifest '%s': %d file(s).\n", path, m->count);
+    return 0;
+}
+
+int ftp_manifest_unchanged(FtpManifest* m, const ParsedUrl* url, const char* remote_path,
+                           long long size, time_t mtime, const char* local_name) {
+    char key[FTP_SYNC_KEY_LEN];
+    struct stat st;
+    int unchanged = 0;
+
+    if (size < 0 || mtime < 0) return 0;
+    manifest_key(url, remote_path, key, sizeof(key));
+    pthread_mutex_lock(&m->lock);
+    FtpManifestEntry* entry = manifest_find(m, key);
+    if (entry && entry->size == size && entry->mtime == (long long) mtime) {
+        // The local copy must still be there and whole
+        unchanged = stat(local_name, &st) == 0 && S_ISREG(st.st_mode) && st.st_size == size;
+    }
+    pthread_mutex_unlock(&m->lock);
+    return unchanged;
+}
+
+void ftp_manifest_record(FtpManifest* m, const ParsedUrl* url, const char* remote_path,
+                         long long size, time_t mtime, const TransferStats* stats) {
+    char key[FTP_SYNC_KEY_LEN];
+
+    manifest_key(url, remote_path, key, sizeof(key));
+    pthread_mutex_lock(&m->lock);
+    FtpManifestEntry* entry = manifest_insert(m, key);
+    if (entry) {
+        entry->size = size;
+        entry->mtime = (long long) mtime;
+        if (stats && stats->hash_alg != TRANSFER_HASH_NONE) {
+            snprintf(entry->digest, sizeof(entry->digest), "%s:%s", transfer_hash_name(stats->hash_alg),
+                     stats->digest);
+        } else {
+            strcpy(entry->digest, "-");
+        }
+        m->dirty = 1;
+    }
+    pthread_mutex_unlock(&m->lock);
+}
+
+int ftp_manifest_save(FtpManifest* m) {
+    char tmp[MAX_PATH_LEN + 8];
+
+    if (!m->dirty) return 0;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", m->path);
+    FILE* file = fopen(tmp, "w");
+    if (!file) {
+        perror("fopen manifest for writing");
+        return -1;
+    }
+    fprintf(file, "%s\n", MANIFEST_HEADER);
+    for (int i = 0; i < m->count; i++) {
+        const FtpManifestEntry* e = &m->entries[i];
+        if (e->mtime < 0) continue; // Nothing to compare against next time
+        fprintf(file, "%lld %lld %s %s\n", e->size, e->mtime, e->digest, e->key);
+    }
+    if (fclose(file) != 0 || rename(tmp, m->path) < 0) {
+        perror("write manifest");
+        unlink(tmp);
+        return -1;
+    }
+    m->dirty = 0;
+    return 0;
+}
+
+void ftp_manifest_free(FtpManifest* m) {
+    for (int i = 0; i < m->count; i++) free(m->entries[i].key);
+    free(m->entries);
+    free(m->buckets);
+    pthread_mutex_destroy(&m->lock);
+    memset(m, 0, sizeof(*m));
+}
+
+// Sends the probe commands for the n files listed in idx, in as few writes as
+// the command buffer allows, then reads the replies in order into facts.
+// Returns 0 on success, -1 if the control connection failed.
+static int sync_probe(FtpConn* control, const ParsedUrl* urls, const int* idx, int n, int use_mlst,
+                      FtpFacts* facts) {
+    const char* commands[2 * FTP_SYNC_PROBE_WINDOW];
+    const char* args[2 * FTP_SYNC_PROBE_WINDOW];
+    char response_buf[FTP_RESPONSE_BUF_SIZE];
+    int count = 0;
+
+    for (int i = 0; i < n; i++) {
+        const char* path = urls[idx[i]].path;
+        if (use_mlst) {
+            commands[count] = "MLST";
+            args[count++] = path;
+        } else {
+            commands[count] = "SIZE";
+            args[count++] = path;
+            commands[count] = "MDTM";
+            args[count++] = path;
+        }
+    }
+    // send_ftp_commands() packs into a fixed buffer: split the window to fit
+    for (int sent = 0; sent < count;) {
+        size_t bytes = 0;
+        int batch = 0;
+        while (sent + batch < count) {
+            size_t len = strlen(commands[sent + batch]) + strlen(args[sent + batch]) + 3;
+            if (batch > 0 && bytes + len >= FTP_PIPELINE_BUF_SIZE) break;
+            bytes += len;
+            batch++;
+        }
+        if (send_ftp_commands(control, commands + sent, args + sent, batch) < 0) return -1;
+        sent += batch;
+    }
+
+    for (int i = 0; i < n; i++) {
+        int ftp_code;
+        facts[i].type = FTP_ENTRY_OTHER;
+        facts[i].size = -1;
+        facts[i].mtime = -1;
+        if (read_ftp_response(control, response_buf, sizeof(response_buf), &ftp_code) < 0) return -1;
+        if (use_mlst) {
+            if (ftp_code == 250) ftp_parse_mlst_reply(response_buf, &facts[i]);
+            continue;
+        }
+        if (ftp_code == 213) sscanf(response_buf, "%*d %lld", &facts[i].size);
+        if (read_ftp_response(control, response_buf, sizeof(response_buf), &ftp_code) < 0) return -1;
+        time_t mtime;
+        if (ftp_code == 213 && strlen(response_buf) > 4 && ftp_parse_time(response_buf + 4, &mtime) == 0) {
+            facts[i].mtime = mtime;
+        }
+    }
+    return 0;
+}
+
+int ftp_sync_download(const ParsedUrl* urls, int count, FtpManifest* manifest, const TransferOptions* opts) {
+    int* idx = malloc(count * sizeof(int));
+    char* done = calloc(count, 1);
+    FtpFacts facts[FTP_SYNC_PROBE_WINDOW];
+    TransferOptions synced = {0};
+    int skipped = 0, fetched = 0, failed = 0;
+    long long total_bytes = 0;
+
+    if (!idx || !done) {
+        perror("malloc sync state");
+        free(idx);
+        free(done);
+        return -1;
+    }
+    if (opts) synced = *opts;
+    if (synced.hash_alg == TRANSFER_HASH_NONE) synced.hash_alg = TRANSFER_HASH_CRC32C; // For the manifest
+
+    double start = monotonic_seconds();
+    for (int first = 0; first < count; first++) {
+        if (done[first]) continue;
+
+        // One session per login, like the batch mode
+        int n = 0;
+        for (int i = first; i < count; i++) {
+            if (!done[i] && ftp_same_login(&urls[first], &urls[i])) {
+                idx[n++] = i;
+                done[i] = 1;
+            }
+        }
+        const ParsedUrl* login = &urls[first];
+        FtpConn* control = ftp_session_open(login);
+        FtpFeatures features;
+        if (!control || ftp_get_features(control, &features) < 0) {
+            fprintf(stderr, "Sync: cannot open session for '%s'.\n", login->host);
+            if (control) ftp_session_close(control);
+            failed += n;
+            continue;
+        }
+        int use_mlst = (features.flags & FTP_FEAT_MLST) != 0;
+
+        for (int w = 0; w < n; w += FTP_SYNC_PROBE_WINDOW) {
+            int window = n - w < FTP_SYNC_PROBE_WINDOW ? n - w : FTP_SYNC_PROBE_WINDOW;
+            if (!control) {
+                failed += window;
+                continue;
+            }
+            if (sync_probe(control, urls, idx + w, window, use_mlst, facts) < 0) {
+                fprintf(stderr, "Sync: lost the control connection while probing.\n");
+                ftp_session_close(control);
+                control = NULL;
+                failed += window;
+                continue;
+            }
+            for (int k = 0; k < window; k++) {
+                const ParsedUrl* url = &urls[idx[w + k]];
+                const char* local_name = ftp_local_name(url->path);
+                if (ftp_manifest_unchanged(manifest, url, url->path, facts[k].size, facts[k].mtime, local_name)) {
+                    printf("Sync: '%s' unchanged.\n", url->path);
+                    skipped++;
+                    continue;
+                }
+                if (!control) {
+                    failed++;
+                    continue;
+                }
+
+                int status = -1;
+                TransferStats stats = {0};
+                FtpPhaseTimes times;
+                stats.ttfb = -1;
+                int data_sockfd = ftp_open_data_connection(control);
+                if (data_sockfd >= 0) {
+                    status = ftp_retrieve_file(control, data_sockfd, url->path, local_name, &synced, &stats);
+                    close(data_sockfd);
+                }
+                ftp_phase_take(&times);
+                ftp_stats_emit("sync", url, url->path, local_name, status, &times, &stats);
+                if (status == 0) {
+                    fetched++;
+                    total_bytes += stats.bytes;
+                    ftp_manifest_record(manifest, url, url->path, facts[k].size >= 0 ? facts[k].size : stats.bytes,
+                                        facts[k].mtime, &stats);
+                } else {
+                    failed++;
+                    fprintf(stderr, "Sync: download failed for '%s'.\n", url->path);
+                    if (ftp_noop(control) < 0) {
+                        ftp_session_close(control);
+                        control = NULL; // The rest of the window counts as failed
+                    }
+                }
+            }
+        }
+        if (control) ftp_session_close(control);
+    }
+    double elapsed = monotonic_seconds() - start;
+
+    printf("Sync summary: %d unchanged, %d downloaded (%lld bytes), %d failed, in %.3f s.\n",
+           skipped, fetched, total_bytes, failed, elapsed);
+    free(idx);
+    free(done);
+    return failed == 0 ? 0 : -1;
+}
@@ -0,0 +1,83 @@
+#ifndef FTP_SYNC_H
+#define FTP_SYNC_H
+
+#include <pthread.h>
+#include <time.h>   // For time_t
+#include "data_transfer.h"
+#include "url_parser.h"
+
+#define FTP_SYNC_DEFAULT_MANIFEST ".ftp-sync" // Manifest used by a bare --sync
+#define FTP_SYNC_PROBE_WINDOW 64              // Files whose MLST (or SIZE + MDTM) go out back to back
+#define FTP_SYNC_KEY_LEN (MAX_USER_LEN + MAX_HOST_LEN + MAX_PATH_LEN + 16)
+
+typedef struct FtpManifestEntry FtpManifestEntry;
+
+// Remote file -> what was downloaded last time. Shared by mirror workers, so
+// every access takes the lock.
+typedef struct {
+    char path[MAX_PATH_LEN];
+    FtpManifestEntry* entries;
+    int count;
+    int capacity;
+    int* buckets;            // Hash table over entries (index or -1)
+    int num_buckets;
+    int dirty;               // Changed since loaded
+    pthread_mutex_t lock;
+} FtpManifest;
+
+/**
+ * Loads a manifest (one line per file: size, mtime, digest, key). A missing
+ * file gives an empty manifest.
+ * @param manifest The manifest to initialise.
+ * @param path The manifest file.
+ * @return 0 on success, -1 on failure.
+ */
+int ftp_manifest_load(FtpManifest* manifest, const char* path);
+
+/**
+ * Checks a remote file against the manifest. It is unchanged if the entry has
+ * the same size and modification time and the local copy still has that size.
+ * A file without a known mtime is always treated as changed.
+ * @param manifest The manifest.
+ * @param url The URL the file belongs to (host, port and user form the key).
+ * @param remote_path The path of the file on the server.
+ * @param size Size reported by the server (-1 if unknown).
+ * @param mtime Modification time reported by the server (-1 if unknown).
+ * @param local_name The local copy.
+ * @return 1 if the file can be skipped, 0 if it has to be downloaded.
+ */
+int ftp_manifest_unchanged(FtpManifest* manifest, const ParsedUrl* url, const char* remote_path,
+                           long long size, time_t mtime, const char* local_name);
+
+/**
+ * Records a finished download (its size, mtime and the digest in stats, if any).
+ */
+void ftp_manifest_record(FtpManifest* manifest, const ParsedUrl* url, const char* remote_path,
+                         long long size, time_t mtime, const TransferStats* stats);
+
+/**
+ * Writes the manifest back if it changed (to a temporary file renamed over the old one).
+ * @return 0 on success, -1 on failure.
+ */
+int ftp_manifest_save(FtpManifest* manifest);
+
+/**
+ * Releases a manifest.
+ */
+void ftp_manifest_free(FtpManifest* manifest);
+
+/**
+ * Downloads the files of a URL list that changed since the manifest was
+ * written. URLs are grouped by login like ftp_batch_download(); each group's
+ * files are probed FTP_SYNC_PROBE_WINDOW at a time, with MLST (or SIZE and
+ * MDTM) pipelined, and only files that differ are retrieved. Downloads are
+ * hashed inline (CRC32C unless opts->hash_alg says otherwise) for the manifest.
+ * @param urls The URLs to sync.
+ * @param count Number of URLs.
+ * @param manifest The loaded manifest; updated, the caller saves it.
+ * @param opts How to drain each data connection (may be NULL).
+ * @return 0 if every file is up to date, -1 otherwise.
+ */
+int ftp_sync_download(const ParsedUrl* urls, int count, FtpManifest* manifest, const TransferOptions* opts);
+
+#endif // FTP_SYNC_H
@@ -0,0 +1,266 @@
+#include "ftp_tls.h"
+#include "ftp_log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>        // For INT_MAX
+#include <signal.h>        // For pthread_sigmask, sigtimedwait
+#include <unistd.h>        // For read
+#include <sys/socket.h>    // For send
+#include <arpa/inet.h>     // For inet_pton
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h> // For X509_VERIFY_PARAM_set1_ip_asc
+
+struct FtpDataTls {
+    SSL* ssl;
+    int mode; // FTP_TLS_USER or FTP_TLS_KTLS
+};
+
+static SSL_CTX* tls_ctx;
+static BIO_METHOD* nosignal_method; // BIO_s_socket() writing with MSG_NOSIGNAL
+static int (*socket_write)(BIO*, const char*, int);
+
+static void print_tls_errors(const char* what) {
+    unsigned long err = ERR_get_error();
+    if (!err) {
+        ftp_log_error("%s failed.\n", what);
+        return;
+    }
+    for (; err; err = ERR_get_error()) {
+        char text[256];
+        ERR_error_string_n(err, text, sizeof(text));
+        ftp_log_error("%s: %s\n", what, text);
+    }
+}
+
+// Runs a stock socket write with SIGPIPE blocked in this thread, discarding
+// the one it raised (kTLS control records are sent with sendmsg() by OpenSSL).
+static int write_blocking_sigpipe(BIO* b, const char* in, int inl) {
+    sigset_t pipe_set, old_set, pending;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_set, &old_set);
+    sigpending(&pending);
+    int was_pending = sigismember(&pending, SIGPIPE);
+    int saved_errno, ret = socket_write(b, in, inl);
+    saved_errno = errno;
+    if (ret < 0 && errno == EPIPE && !was_pending) {
+        const struct timespec now = {0, 0};
+        sigtimedwait(&pipe_set, NULL, &now);
+    }
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+    errno = saved_errno;
+    return ret;
+}
+
+// A peer that vanished mid-write gives EPIPE instead of killing the host process
+static int nosignal_write(BIO* b, const char* in, int inl) {
+    int fd;
+#ifndef OPENSSL_NO_KTLS
+    if (BIO_get_ktls_send(b)) return write_blocking_sigpipe(b, in, inl);
+#endif
+    if (BIO_get_fd(b, &fd) < 0) return -1;
+    errno = 0;
+    int ret = (int) send(fd, in, (size_t) inl, MSG_NOSIGNAL);
+    BIO_clear_retry_flags(b);
+    if (ret <= 0 && BIO_sock_should_retry(ret)) BIO_set_retry_write(b);
+    return ret;
+}
+
+static BIO_METHOD* nosignal_socket_method(void) {
+    const BIO_METHOD* stock = BIO_s_socket();
+    if (nosignal_method) return nosignal_method;
+    nosignal_method = BIO_meth_new(BIO_TYPE_SOCKET, "socket (MSG_NOSIGNAL)");
+    if (!nosignal_method) return NULL;
+    socket_write = BIO_meth_get_write(stock);
+    BIO_meth_set_write(nosignal_method, nosignal_write);
+    BIO_meth_set_read(nosignal_method, BIO_meth_get_read(stock));
+    BIO_meth_set_puts(nosignal_method, BIO_meth_get_puts(stock));
+    BIO_meth_set_ctrl(nosignal_method, BIO_meth_get_ctrl(stock));
+    BIO_meth_set_create(nosignal_method, BIO_meth_get_create(stock));
+    BIO_meth_set_destroy(nosignal_method, BIO_meth_get_destroy(stock));
+    return nosignal_method;
+}
+
+int ftp_tls_init(const char* ca_file, int verify, int offload) {
+    tls_ctx = SSL_CTX_new(TLS_client_method());
+    if (!tls_ctx) {
+        print_tls_errors("SSL_CTX_new");
+        return -1;
+    }
+    SSL_CTX_set_min_proto_version(tls_ctx, TLS1_2_VERSION);
+    // Data connections may end without close_notify; the 226 reply confirms them
+    SSL_CTX_set_options(tls_ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#ifdef SSL_OP_ENABLE_KTLS
+    if (offload) {
+        SSL_CTX_set_options(tls_ctx, SSL_OP_ENABLE_KTLS);
+#if OPENSSL_VERSION_NUMBER < 0x30200000L
+        // Receive offload for TLS 1.3 arrived in OpenSSL 3.2
+        SSL_CTX_set_max_proto_version(tls_ctx, TLS1_2_VERSION);
+#endif
+    }
+#else
+    if (offload) ftp_log_error("This OpenSSL has no kTLS support; decrypting in user space.\n");
+#endif
+    if (verify) {
+        SSL_CTX_set_verify(tls_ctx, SSL_VERIFY_PEER, NULL);
+        int loaded = ca_file ? SSL_CTX_load_verify_locations(tls_ctx, ca_file, NULL)
+                             : SSL_CTX_set_default_verify_paths(tls_ctx);
+        if (loaded != 1) {
+            print_tls_errors(ca_file ? ca_file : "default CA store");
+            SSL_CTX_free(tls_ctx);
+            tls_ctx = NULL;
+            return -1;
+        }
+    }
+    if (!nosignal_socket_method()) {
+        print_tls_errors("BIO_meth_new");
+        SSL_CTX_free(tls_ctx);
+        tls_ctx = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void* ftp_tls_connect(int sockfd, const char* host, void* reuse) {
+    unsigned char addr[sizeof(struct in6_addr)];
+
+    if (!tls_ctx) {
+        ftp_log_error("TLS is not initialised.\n");
+        return NULL;
+    }
+    SSL* ssl = SSL_new(tls_ctx);
+    BIO* bio = ssl ? BIO_new(nosignal_method) : NULL;
+    if (!bio) {
+        print_tls_errors("SSL_new");
+        SSL_free(ssl);
+        return NULL;
+    }
+    BIO_set_fd(bio, sockfd, BIO_NOCLOSE);
+    SSL_set_bio(ssl, bio, bio);
+    if (host) {
+        if (inet_pton(AF_INET, host, addr) == 1 || inet_pton(AF_INET6, host, addr) == 1) {
+            X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host);
+        } else {
+            SSL_set_tlsext_host_name(ssl, host);
+            SSL_set1_host(ssl, host);
+        }
+    }
+    if (reuse) {
+        SSL_SESSION* session = SSL_get1_session((SSL*) reuse);
+        if (session) {
+            SSL_set_session(ssl, session);
+            SSL_SESSION_free(session);
+        }
+    }
+    if (SSL_connect(ssl) != 1) {
+        long verify = SSL_get_verify_result(ssl);
+        print_tls_errors("TLS handshake");
+        if (verify != X509_V_OK) {
+            ftp_log_error("Certificate check: %s\n", X509_verify_cert_error_string(verify));
+        }
+        SSL_free(ssl);
+        return NULL;
+    }
+    return ssl;
+}
+
+ssize_t ftp_tls_read(void* tls, void* buf, size_t len) {
+    SSL* ssl = tls;
+    errno = 0;
+    int n = SSL_read(ssl, buf, len > INT_MAX ? INT_MAX : (int) len);
+    if (n > 0) return n;
+
+    switch (SSL_get_error(ssl, n)) {
+    case SSL_ERROR_ZERO_RETURN: // close_notify
+        return 0;
+    case SSL_ERROR_SYSCALL:
+        if (errno == 0) return 0; // Plain EOF (allowed by SSL_OP_IGNORE_UNEXPECTED_EOF)
+        return -1;                // errno tells why (EINTR is retried by the callers)
+    case SSL_ERROR_WANT_READ:     // SO_RCVTIMEO expired mid-record (stall watchdog); retrying resumes it
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    default:
+        print_tls_errors("SSL_read");
+        errno = EIO;
+        return -1;
+    }
+}
+
+ssize_t ftp_tls_write(void* tls, const void* buf, size_t len) {
+    SSL* ssl = tls;
+    size_t written = 0;
+
+    // Blocking socket: SSL_write only returns once the whole record went out
+    while (written < len) {
+        size_t chunk = len - written > INT_MAX ? INT_MAX : len - written;
+        int n = SSL_write(ssl, (const char*) buf + written, (int) chunk);
+        if (n <= 0) {
+            if (SSL_get_error(ssl, n) != SSL_ERROR_SYSCALL) {
+                print_tls_errors("SSL_write");
+                errno = EIO;
+            }
+            return -1;
+        }
+        written += n;
+    }
+    return (ssize_t) written;
+}
+
+int ftp_tls_pending(void* tls) {
+    return tls && SSL_pending((SSL*) tls) > 0;
+}
+
+void ftp_tls_close(void* tls) {
+    SSL* ssl = tls;
+    if (!ssl) return;
+    SSL_shutdown(ssl); // Our close_notify; the peer's is not waited for
+    SSL_free(ssl);
+}
+
+FtpDataTls* ftp_tls_secure_data(int data_sockfd, void* control_tls, const char* host) {
+    FtpDataTls* t = malloc(sizeof(FtpDataTls));
+    if (!t) {
+        ftp_log_perror("malloc data TLS");
+        return NULL;
+    }
+    SSL* ssl = ftp_tls_connect(data_sockfd, host, control_tls);
+    if (!ssl) {
+        free(t);
+        return NULL;
+    }
+    int mode = FTP_TLS_USER;
+#ifndef OPENSSL_NO_KTLS
+    if (BIO_get_ktls_recv(SSL_get_rbio(ssl))) mode = FTP_TLS_KTLS;
+#endif
+    ftp_log("Data connection secured: %s, %s, %s session, %s.\n", SSL_get_version(ssl), SSL_get_cipher_name(ssl),
+           SSL_session_reused(ssl) ? "resumed" : "new",
+           mode == FTP_TLS_KTLS ? "kTLS receive" : "user-space decryption");
+    t->ssl = ssl;
+    t->mode = mode;
+    return t;
+}
+
+void ftp_tls_end_data(FtpDataTls* tls) {
+    if (!tls) return;
+    ftp_tls_close(tls->ssl);
+    free(tls);
+}
+
+int ftp_tls_data_mode(const FtpDataTls* tls) {
+    return tls ? tls->mode : FTP_TLS_NONE;
+}
+
+ssize_t ftp_tls_recv(FtpDataTls* tls, int data_sockfd, void* buf, size_t len) {
+    if (!tls) return read(data_sockfd, buf, len);
+    if (tls->mode == FTP_TLS_KTLS) {
+        ssize_t n = read(data_sockfd, buf, len);
+        // EIO: the next record is not data (close_notify); OpenSSL reads it with its record type
+        if (n >= 0 || errno != EIO) return n;
+    }
+    return ftp_tls_read(tls->ssl, buf, len);
+}
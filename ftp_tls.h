@@ -0,0 +1,86 @@
+#ifndef FTP_TLS_H
+#define FTP_TLS_H
+
+#include <stddef.h>    // For size_t
+#include <sys/types.h> // For ssize_t
+
+// How a data connection's payload is decrypted (TransferStats.tls)
+#define FTP_TLS_NONE 0
+#define FTP_TLS_USER 1 // SSL_read in user space: the copy loops read through ftp_tls_recv()
+#define FTP_TLS_KTLS 2 // Kernel TLS: plain read(), splice() and large buffers keep working
+
+/**
+ * Sets up the client TLS context used by every FTPS connection. Call once,
+ * before any thread starts. TLS writes never raise SIGPIPE, so the process's
+ * signal dispositions are left alone.
+ * @param ca_file PEM file of trusted certificates (NULL for the system store).
+ * @param verify Non-zero to check the server certificate and host name.
+ * @param offload Non-zero to move data-connection decryption into the kernel
+ *                (kTLS) where the kernel and OpenSSL allow it. OpenSSL before
+ *                3.2 only offloads TLS 1.2 receive, so TLS is capped at 1.2 then.
+ * @return 0 on success, -1 on failure.
+ */
+int ftp_tls_init(const char* ca_file, int verify, int offload);
+
+/**
+ * Runs a client handshake on a connected socket.
+ * @param sockfd The socket.
+ * @param host Name to check the certificate against (NULL to skip).
+ * @param reuse Connection whose session to resume (the control connection's,
+ *              for a data connection), or NULL.
+ * @return The TLS connection (an SSL*), or NULL on failure.
+ */
+void* ftp_tls_connect(int sockfd, const char* host, void* reuse);
+
+/**
+ * SSL_read/SSL_write for the control connection.
+ * @return Bytes transferred, 0 at EOF (read), -1 on failure.
+ */
+ssize_t ftp_tls_read(void* tls, void* buf, size_t len);
+ssize_t ftp_tls_write(void* tls, const void* buf, size_t len);
+
+/**
+ * Returns non-zero if decrypted bytes are buffered (a poll() would miss them).
+ */
+int ftp_tls_pending(void* tls);
+
+/**
+ * Sends close_notify and frees a TLS connection (NULL is ignored).
+ */
+void ftp_tls_close(void* tls);
+
+// A secured data connection (opaque); owned by whoever secured it
+typedef struct FtpDataTls FtpDataTls;
+
+/**
+ * Secures a data connection after the server accepted it (150/125): the
+ * handshake resumes the control connection's session, as servers that
+ * require session reuse expect, then receive decryption moves to kTLS if
+ * possible. A handshake that is not resumed checks the certificate against
+ * `host`, as the control connection's did.
+ * @param data_sockfd The data connection socket.
+ * @param control_tls The control connection's TLS.
+ * @param host The control connection's host name or address (NULL to skip).
+ * @return The secured connection, to pass to ftp_tls_recv(), or NULL on failure.
+ */
+FtpDataTls* ftp_tls_secure_data(int data_sockfd, void* control_tls, const char* host);
+
+/**
+ * Sends close_notify on a secured data connection and frees it (NULL is
+ * ignored). Call before closing the socket.
+ */
+void ftp_tls_end_data(FtpDataTls* tls);
+
+/**
+ * How a data connection is protected (FTP_TLS_USER or _KTLS; FTP_TLS_NONE for NULL).
+ */
+int ftp_tls_data_mode(const FtpDataTls* tls);
+
+/**
+ * Reads payload from a data connection: read() for plain (tls NULL) and kTLS
+ * connections (a kTLS close_notify reads as EOF), SSL_read otherwise.
+ * @return Bytes read, 0 at EOF, -1 on failure (errno set).
+ */
+ssize_t ftp_tls_recv(FtpDataTls* tls, int data_sockfd, void* buf, size_t len);
+
+#endif // FTP_TLS_H
@@ -1,11 +1,23 @@
 #include "ftp_utils.h"
+#include "transfer_rate.h"
+#include "ftp_tls.h"
+#include "ftp_log.h"
+#include "ftp_progress.h"
+#include "url_parser.h"   // For MAX_HOST_LEN
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>    // For strcasecmp
 #include <unistd.h>     // For read, write, close
 #include <ctype.h>      // For isdigit
+#include <sys/socket.h> // For shutdown, send
+#include <fcntl.h>      // For open
+#include <poll.h>
+#include <zlib.h>       // For MODE Z listings
 
-int send_ftp_command(int sockfd, const char* command, const char* arg) {
+static ssize_t ftp_control_write(FtpConn* conn, const char* buf, size_t len);
+
+int send_ftp_command(FtpConn* conn, const char* command, const char* arg) {
     char cmd_buffer[512]; // Max command length with arg
     int len;
 
@@ -15,242 +27,1186 @@ int send_ftp_command(int sockfd, const char* command, const char* arg) {
         len = snprintf(cmd_buffer, sizeof(cmd_buffer), "%s\r\n", command);
     }
     if (len < 0 || len >= (int)sizeof(cmd_buffer)) {
-        fprintf(stderr, "Error: FTP command too long.\n");
+        ftp_log_error("Error: FTP command too long.\n");
         return -1;
     }
 
-    printf("C: %s", cmd_buffer); // Log client command
-    if (write(sockfd, cmd_buffer, len) < 0) {
-        perror("write ftp command");
+    ftp_log("C: %s", cmd_buffer); // Log client command
+    if (ftp_control_write(conn, cmd_buffer, len) < 0) {
+        ftp_log_perror("write ftp command");
         return -1;
     }
     return 0;
 }
 
-// Simplified read_ftp_response. A robust version needs to handle
-// multi-line responses where intermediate lines are "<code>-<text>"
-// and the final line is "<code> <text>".
-// In ftp_utils.c
-int read_ftp_response(int sockfd, char* response_buffer, size_t buffer_size, int* ftp_code) {
-    ssize_t bytes_read_chunk;
-    size_t total_bytes_read = 0;
-    response_buffer[0] = '\0'; // Clear buffer
+int send_ftp_commands(FtpConn* conn, const char* const* commands, const char* const* args, int count) {
+    char cmd_buffer[FTP_PIPELINE_BUF_SIZE];
+    int len = 0;
 
-    char line_buffer[1024]; // Buffer for a single line from the server
-    int is_final_line = 0;
+    for (int i = 0; i < count; i++) {
+        int n;
+        if (args[i] && strlen(args[i]) > 0) {
+            n = snprintf(cmd_buffer + len, sizeof(cmd_buffer) - len, "%s %s\r\n", commands[i], args[i]);
+        } else {
+            n = snprintf(cmd_buffer + len, sizeof(cmd_buffer) - len, "%s\r\n", commands[i]);
+        }
+        if (n < 0 || n >= (int)sizeof(cmd_buffer) - len) {
+            ftp_log_error("Error: pipelined FTP commands too long.\n");
+            return -1;
+        }
+        ftp_log("C: %s", cmd_buffer + len); // Log client command
+        len += n;
+    }
+    if (ftp_control_write(conn, cmd_buffer, len) < 0) {
+        ftp_log_perror("write ftp commands");
+        return -1;
+    }
+    return 0;
+}
+
+FtpConn* ftp_conn_new(int sockfd) {
+    FtpConn* conn = calloc(1, sizeof(FtpConn));
+    if (!conn) {
+        ftp_log_perror("calloc control connection");
+        close(sockfd);
+        return NULL;
+    }
+    conn->sockfd = sockfd;
+    return conn;
+}
+
+void ftp_conn_close(FtpConn* conn) {
+    if (!conn) return;
+    ftp_end_data_connection(conn);
+    ftp_tls_close(conn->tls);
+    close(conn->sockfd);
+    free(conn);
+}
+
+// Commands go through TLS once AUTH TLS succeeded. MSG_NOSIGNAL: a server that
+// closed after a 421 gives EPIPE instead of killing the process with SIGPIPE.
+static ssize_t ftp_control_write(FtpConn* conn, const char* buf, size_t len) {
+    if (conn->tls) return ftp_tls_write(conn->tls, buf, len);
+    return send(conn->sockfd, buf, len, MSG_NOSIGNAL);
+}
+
+// Returns the next line (up to and including '\n') in *line/*line_len, pointing
+// into the reader's buffer. A line longer than the buffer is returned in pieces;
+// *continued is set for every piece but the first.
+// Returns 0 on success, 1 for a final partial line at EOF, -1 on read error or
+// EOF with nothing buffered.
+static int ftp_reader_next_line(FtpConn* reader, const char** line, size_t* line_len, int* continued) {
+    for (;;) {
+        size_t avail = reader->end - reader->start;
+        char* nl = avail ? memchr(reader->data + reader->start, '\n', avail) : NULL;
 
-    // printf("S: "); // Moved the "S: " to be inside the loop for each line if preferred
-                      // or print once before the loop and then just the content.
-                      // For now, printing char-by-char includes the prompt implicitly.
-
-    while (total_bytes_read < buffer_size -1 && !is_final_line) {
-        // Read character by character to build a line
-        int line_idx = 0;
-        char c;
-        printf("S: "); // Print S: for each line attempt (can be noisy)
-        while(line_idx < (int)sizeof(line_buffer) - 1) {
-            bytes_read_chunk = read(sockfd, &c, 1);
-            if (bytes_read_chunk <= 0) {
-                if (bytes_read_chunk == 0 && line_idx > 0) { // EOF but had partial line
-                    line_buffer[line_idx] = '\0';
-                    printf("%s\n(Partial line before EOF)\n", line_buffer);
-                    goto process_response_label;
-                } else if (bytes_read_chunk == 0) {
-                    fprintf(stderr, "\nServer closed connection prematurely.\n");
-                } else {
-                    perror("\nread char from ftp response");
-                }
+        if (nl || avail == sizeof(reader->data)) {
+            size_t len = nl ? (size_t)(nl - (reader->data + reader->start)) + 1 : avail;
+            *line = reader->data + reader->start;
+            *line_len = len;
+            *continued = reader->mid_line;
+            reader->mid_line = (nl == NULL);
+            reader->start += len;
+            return 0;
+        }
+
+        // Compact the unconsumed tail to the front before reading more
+        if (reader->start > 0) {
+            memmove(reader->data, reader->data + reader->start, avail);
+            reader->start = 0;
+            reader->end = avail;
+        }
+        ssize_t n = reader->tls ? ftp_tls_read(reader->tls, reader->data + reader->end, sizeof(reader->data) - reader->end)
+                                : read(reader->sockfd, reader->data + reader->end, sizeof(reader->data) - reader->end);
+        if (n < 0) {
+            ftp_log_perror("read ftp response");
+            return -1;
+        }
+        if (n == 0) {
+            if (avail == 0) {
+                ftp_log_error("Server closed connection prematurely.\n");
                 return -1;
             }
-            printf("%c", c); // Log character by character
-            line_buffer[line_idx++] = c;
-            if (c == '\n') {
-                break; // End of line
-            }
+            // EOF after a partial line: hand out what we have
+            *line = reader->data + reader->start;
+            *line_len = avail;
+            *continued = reader->mid_line;
+            reader->mid_line = 0;
+            reader->start = reader->end;
+            return 1;
         }
-        line_buffer[line_idx] = '\0'; // Null-terminate the read line
+        reader->end += n;
+    }
+}
+
+int ftp_response_ready(FtpConn* reader, int timeout_ms) {
+    struct pollfd pfd;
 
-        // Append line_buffer to the main response_buffer
-        if (total_bytes_read + strlen(line_buffer) < buffer_size) {
-            strcat(response_buffer, line_buffer);
-            total_bytes_read += strlen(line_buffer);
+    if (reader->end > reader->start &&
+        memchr(reader->data + reader->start, '\n', reader->end - reader->start)) {
+        return 1;
+    }
+    if (ftp_tls_pending(reader->tls)) return 1; // Decrypted already, the socket may be drained
+    pfd.fd = reader->sockfd;
+    pfd.events = POLLIN;
+    int n = poll(&pfd, 1, timeout_ms);
+    if (n < 0) {
+        ftp_log_perror("poll control connection");
+        return -1;
+    }
+    return n > 0;
+}
+
+static int ftp_line_code(const char* line, size_t len, char* separator) {
+    if (len < 4 || !isdigit((unsigned char)line[0]) || !isdigit((unsigned char)line[1]) ||
+        !isdigit((unsigned char)line[2]) || (line[3] != ' ' && line[3] != '-')) {
+        // "NNN" alone on a line is a valid final line too
+        if (len >= 3 && isdigit((unsigned char)line[0]) && isdigit((unsigned char)line[1]) &&
+            isdigit((unsigned char)line[2]) && (len == 3 || line[3] == '\r' || line[3] == '\n')) {
+            *separator = ' ';
+            return (line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0');
+        }
+        return -1;
+    }
+    *separator = line[3];
+    return (line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0');
+}
+
+// Reads one complete reply. A multi-line reply starts with "NNN-" and ends with
+// the first line that starts with the same code followed by a space ("NNN ").
+int read_ftp_response(FtpConn* reader, char* response_buffer, size_t buffer_size, int* ftp_code) {
+    size_t total_bytes_read = 0;
+    int reply_code = -1;
+    int is_final_line = 0;
+    int truncated = 0;
+
+    response_buffer[0] = '\0'; // Clear buffer
+
+    while (!is_final_line) {
+        const char* line;
+        size_t line_len;
+        int continued;
+        int status = ftp_reader_next_line(reader, &line, &line_len, &continued);
+
+        if (status < 0) {
+            return -1;
+        }
+        ftp_log("%s%.*s", continued ? "" : "S: ", (int)line_len, line); // Log the whole line at once
+
+        // Keep consuming after the caller's buffer fills, so the next reply starts in sync
+        if (total_bytes_read + line_len < buffer_size) {
+            memcpy(response_buffer + total_bytes_read, line, line_len);
+            total_bytes_read += line_len;
+            response_buffer[total_bytes_read] = '\0';
         } else {
-            fprintf(stderr, "\nResponse buffer too small for full multi-line response.\n");
-            // Attempt to parse what we have
-            goto process_response_label;
+            truncated = 1;
         }
 
-        // Check if this line is the final line of the response
-        // A line starting with 3 digits followed by a SPACE is the final line.
-        if (strlen(line_buffer) >= 4 &&
-            isdigit(line_buffer[0]) &&
-            isdigit(line_buffer[1]) &&
-            isdigit(line_buffer[2]) &&
-            line_buffer[3] == ' ') {
-            is_final_line = 1;
-            // The ftp_code will be parsed from the *start* of the whole response_buffer later
+        if (!continued) {
+            char separator;
+            int code = ftp_line_code(line, line_len, &separator);
+            if (code >= 0 && reply_code < 0) {
+                reply_code = code; // First line sets the code (single-line "NNN " or "NNN-")
+            }
+            if (code >= 0 && code == reply_code && separator == ' ') {
+                is_final_line = 1;
+            }
+            // Lines without a code are text inside a multi-line reply
+        }
+        if (status == 1) {
+            ftp_log("\n(Partial line before EOF)\n");
+            break;
         }
-        // If it's "NNN-" or not a code line starting with 3 digits, loop continues
     }
-    // No need for extra \n if char-by-char printf was used and line ended with \n
-    // printf("\n"); // End logging for this response block if not char-by-char
 
-process_response_label: // Label for goto
-    // Try to parse the code from the *first line* of the potentially multi-line response
-    if (sscanf(response_buffer, "%d", ftp_code) != 1) {
-        fprintf(stderr, "Could not parse FTP code from the beginning of response: %s\n", response_buffer);
-        // As a fallback, try the last parsed line if different logic was used to find it
-        // For this version, the first line should contain the primary code.
+    if (reply_code < 0) {
+        ftp_log_error("Could not parse FTP code from response: %s\n", response_buffer);
         return -1;
     }
-    
-    if (!is_final_line && total_bytes_read >= buffer_size -1) {
-        fprintf(stderr, "Warning: Response buffer filled; response might be truncated or not fully parsed as final.\n");
-    } else if (!is_final_line && total_bytes_read < buffer_size -1) {
-        // This case might happen if read returned 0 (EOF) before a final line was seen.
-        // The ftp_code from the first line is still attempted.
+    if (!is_final_line) {
+        ftp_log_error("Warning: connection closed before the final line of the %d reply.\n", reply_code);
+    }
+    if (truncated) {
+        ftp_log_error("Warning: Response buffer filled; reply %d was truncated.\n", reply_code);
     }
+    // A 1xx reply (150 before a transfer) promises a final one; keepalive NOOPs get 200s meanwhile
+    if (reply_code < 200) reader->reply_owed = 1;
+    else if (reply_code != 200) reader->reply_owed = 0;
+    reader->last_code = reply_code;
+    snprintf(reader->last_reply, sizeof(reader->last_reply), "%.*s", (int) strcspn(response_buffer, "\r\n"),
+             response_buffer);
+    *ftp_code = reply_code;
+    return 0;
+}
+
+int ftp_last_reply(FtpConn* reader, char* text, size_t text_len) {
+    if (!reader || reader->last_code == 0) {
+        if (text_len > 0) text[0] = '\0';
+        return 0;
+    }
+    if (text_len > 0) snprintf(text, text_len, "%s", reader->last_reply);
+    return reader->last_code;
+}
 
+int ftp_parse_reply(const char* buf, size_t len, int* ftp_code, size_t* reply_len) {
+    size_t pos = 0;
+    int reply_code = -1;
 
+    while (pos < len) {
+        const char* line = buf + pos;
+        const char* nl = memchr(line, '\n', len - pos);
+        if (!nl) {
+            return 0; // Line not complete yet
+        }
+        size_t line_len = (size_t)(nl - line) + 1;
+        char separator;
+        int code = ftp_line_code(line, line_len, &separator);
+        pos += line_len;
+        if (code >= 0 && reply_code < 0) {
+            reply_code = code;
+        }
+        if (code >= 0 && code == reply_code && separator == ' ') {
+            *ftp_code = reply_code;
+            *reply_len = pos;
+            return 1;
+        }
+    }
     return 0;
 }
 
 
-int ftp_login(int control_sockfd, const char* user, const char* pass) {
+int ftp_login(FtpConn* control, const char* user, const char* pass) {
     char response_buf[FTP_RESPONSE_BUF_SIZE];
     int ftp_code;
 
     // Server should send a 220 welcome first. This is usually handled after connect.
     // Assuming welcome message already processed.
 
-    if (send_ftp_command(control_sockfd, "USER", user) < 0) return -1;
-    if (read_ftp_response(control_sockfd, response_buf, sizeof(response_buf), &ftp_code) < 0) return -1;
+    if (send_ftp_command(control, "USER", user) < 0) return -1;
+    if (read_ftp_response(control, response_buf, sizeof(response_buf), &ftp_code) < 0) return -1;
 
     if (ftp_code == 331) { // Password required
-        if (send_ftp_command(control_sockfd, "PASS", pass) < 0) return -1;
-        if (read_ftp_response(control_sockfd, response_buf, sizeof(response_buf), &ftp_code) < 0) return -1;
+        if (send_ftp_command(control, "PASS", pass) < 0) return -1;
+        if (read_ftp_response(control, response_buf, sizeof(response_buf), &ftp_code) < 0) return -1;
         if (ftp_code != 230) {
-            fprintf(stderr, "Login failed after PASS. Server response %d: %s\n", ftp_code, response_buf);
+            ftp_log_error("Login failed after PASS. Server response %d: %s\n", ftp_code, response_buf);
             return -1;
         }
     } else if (ftp_code != 230) { // 230 User logged in, proceed (e.g., for some anonymous setups)
-        fprintf(stderr, "USER command failed. Server response %d: %s\n", ftp_code, response_buf);
+        ftp_log_error("USER command failed. Server response %d: %s\n", ftp_code, response_buf);
         return -1;
     }
-    printf("Logged in successfully.\n");
+    ftp_log("Logged in successfully.\n");
     return 0;
 }
 
-int ftp_set_type_image(int control_sockfd) {
+// Reads the reply owed to a pipelined command. Returns 0, -1 on error, or
+// FTP_PIPELINE_DROPPED if none came within FTP_LOGIN_REPLY_TIMEOUT_MS.
+static int read_pipelined_reply(FtpConn* control, const char* command, char* response_buf, size_t buffer_size,
+                                int* ftp_code) {
+    int ready = ftp_response_ready(control, FTP_LOGIN_REPLY_TIMEOUT_MS);
+    if (ready < 0) return -1;
+    if (ready == 0) {
+        ftp_log_error("No reply to pipelined %s within %d ms.\n", command, FTP_LOGIN_REPLY_TIMEOUT_MS);
+        return FTP_PIPELINE_DROPPED;
+    }
+    return read_ftp_response(control, response_buf, buffer_size, ftp_code) < 0 ? -1 : 0;
+}
+
+// Keeps the data port of the EPSV/PASV the pipelined login sent, for the first
+// transfer. A refused EPSV is remembered, as ftp_open_data_connection() does.
+static void ftp_keep_passive_reply(FtpConn* control, const char* passive, const char* reply, int ftp_code) {
+    control->passive_port = 0;
+    control->passive_ip[0] = '\0';
+    if (ftp_code == 229 && ftp_parse_epsv_reply(reply, &control->passive_port) == 0) {
+        ftp_log("Extended passive mode: data port %d\n", control->passive_port);
+    } else if (ftp_code == 227 &&
+               ftp_parse_pasv_reply(reply, control->passive_ip, sizeof(control->passive_ip), &control->passive_port) == 0) {
+        ftp_log("Passive mode: Data connection to %s:%d\n", control->passive_ip, control->passive_port);
+    } else {
+        control->passive_port = 0;
+        if (strcmp(passive, "EPSV") == 0) {
+            control->epsv_refused = 1;
+            ftp_log("Falling back to PASV.\n");
+        }
+    }
+}
+
+int ftp_login_pipelined(FtpConn* control, const char* user, const char* pass) {
+    const char* passive = control->epsv_refused ? "PASV" : "EPSV";
+    const char* const commands[] = {"USER", "PASS", "TYPE", passive};
+    const char* args[] = {user, pass, "I", NULL};
     char response_buf[FTP_RESPONSE_BUF_SIZE];
     int ftp_code;
-    if (send_ftp_command(control_sockfd, "TYPE", "I") < 0) return -1;
-    if (read_ftp_response(control_sockfd, response_buf, sizeof(response_buf), &ftp_code) < 0) return -1;
+    int need_pass, logged_in = 0, type_set = 0, status;
+
+    control->passive_port = 0;
+    if (send_ftp_commands(control, commands, args, 4) < 0) return -1;
+
+    // USER reply
+    if (read_ftp_response(control, response_buf, sizeof(response_buf), &ftp_code) < 0) return -1;
+    if (ftp_code != 331 && ftp_code != 230) {
+        ftp_log_error("USER command failed. Server response %d: %s\n", ftp_code, response_buf);
+        return -1;
+    }
+    need_pass = (ftp_code == 331);
+    logged_in = !need_pass;
+
+    // PASS reply; after a 230 to USER it is only consumed. PASS and TYPE I were
+    // sent whatever USER got, so their replies come before any later one.
+    status = read_pipelined_reply(control, "PASS", response_buf, sizeof(response_buf), &ftp_code);
+    if (status < 0) return status;
+    if (need_pass) {
+        if (ftp_code == 230 || ftp_code == 202) {
+            logged_in = 1;
+        } else if (ftp_code == 503) {
+            ftp_log("Server rejected pipelined PASS, falling back to lock-step.\n");
+        } else {
+            ftp_log_error("Login failed after PASS. Server response %d: %s\n", ftp_code, response_buf);
+            return -1;
+        }
+    }
+
+    // TYPE I reply
+    status = read_pipelined_reply(control, "TYPE I", response_buf, sizeof(response_buf), &ftp_code);
+    if (status < 0) return status;
+    type_set = logged_in && ftp_code == 200; // Before login completes TYPE gets 530/503
+
+    // EPSV/PASV reply: the first transfer's data port, unless login was not done yet
+    status = read_pipelined_reply(control, passive, response_buf, sizeof(response_buf), &ftp_code);
+    if (status < 0) return status;
+    if (logged_in) ftp_keep_passive_reply(control, passive, response_buf, ftp_code);
+
+    // Every reply is in; what was refused out of sequence is sent again
+    if (!logged_in) {
+        if (send_ftp_command(control, "PASS", pass) < 0) return -1;
+        if (read_ftp_response(control, response_buf, sizeof(response_buf), &ftp_code) < 0) return -1;
+        if (ftp_code != 230 && ftp_code != 202) {
+            ftp_log_error("Login failed after PASS. Server response %d: %s\n", ftp_code, response_buf);
+            return -1;
+        }
+    }
+    ftp_log("Logged in successfully.\n");
+    if (!type_set && ftp_set_type_image(control) < 0) {
+        ftp_log_error("Warning: Could not set TYPE I. File transfer might be corrupted.\n");
+        return 0;
+    }
+    if (type_set) ftp_log("Transfer type set to Binary (Image).\n");
+    return 0;
+}
+
+int ftp_set_type_image(FtpConn* control) {
+    char response_buf[FTP_RESPONSE_BUF_SIZE];
+    int ftp_code;
+    if (send_ftp_command(control, "TYPE", "I") < 0) return -1;
+    if (read_ftp_response(control, response_buf, sizeof(response_buf), &ftp_code) < 0) return -1;
     if (ftp_code != 200) {
-        fprintf(stderr, "TYPE I command failed. Server response %d: %s\n", ftp_code, response_buf);
+        ftp_log_error("TYPE I command failed. Server response %d: %s\n", ftp_code, response_buf);
         return -1; // Or just a warning
     }
-    printf("Transfer type set to Binary (Image).\n");
+    ftp_log("Transfer type set to Binary (Image).\n");
     return 0;
 }
 
-int ftp_enter_passive_mode(int control_sockfd, char* data_ip_str, size_t data_ip_len, int* data_port) {
+int ftp_auth_tls(FtpConn* control, const char* host) {
     char response_buf[FTP_RESPONSE_BUF_SIZE];
     int ftp_code;
 
-    if (send_ftp_command(control_sockfd, "PASV", NULL) < 0) return -1;
-    if (read_ftp_response(control_sockfd, response_buf, sizeof(response_buf), &ftp_code) < 0) return -1;
+    if (send_ftp_command(control, "AUTH", "TLS") < 0) return -1;
+    if (read_ftp_response(control, response_buf, sizeof(response_buf), &ftp_code) < 0) return -1;
+    if (ftp_code != 234) { // 234 Security data exchange complete (proceed with the handshake)
+        ftp_log_error("AUTH TLS refused. Server response %d: %s\n", ftp_code, response_buf);
+        return -1;
+    }
+    if (control->end > control->start) {
+        // Plaintext after 234 would be read as if it had been protected
+        ftp_log_error("Server sent data after 234; refusing to start TLS.\n");
+        return -1;
+    }
+    control->tls = ftp_tls_connect(control->sockfd, host, NULL);
+    if (!control->tls) return -1;
+    snprintf(control->tls_host, sizeof(control->tls_host), "%s", host ? host : "");
+    ftp_log("Control connection secured with TLS.\n");
+    return 0;
+}
 
-    if (ftp_code != 227) { // 227 Entering Passive Mode
-        fprintf(stderr, "PASV command failed. Server response %d: %s\n", ftp_code, response_buf);
+int ftp_protect_data(FtpConn* control) {
+    char response_buf[FTP_RESPONSE_BUF_SIZE];
+    int ftp_code;
+
+    if (!control->tls) return -1;
+    // RFC 4217: PBSZ 0 (TLS does its own framing) must come before PROT
+    if (send_ftp_command(control, "PBSZ", "0") < 0) return -1;
+    if (read_ftp_response(control, response_buf, sizeof(response_buf), &ftp_code) < 0) return -1;
+    if (ftp_code != 200) {
+        ftp_log_error("PBSZ 0 failed. Server response %d: %s\n", ftp_code, response_buf);
         return -1;
     }
+    if (send_ftp_command(control, "PROT", "P") < 0) return -1;
+    if (read_ftp_response(control, response_buf, sizeof(response_buf), &ftp_code) < 0) return -1;
+    if (ftp_code != 200) {
+        ftp_log_error("PROT P refused. Server response %d: %s\n", ftp_code, response_buf);
+        return -1;
+    }
+    control->prot_private = 1;
+    return 0;
+}
+
+int ftp_secure_data_connection(FtpConn* control, int data_sockfd) {
+    ftp_end_data_connection(control); // A data connection whose TLS was not ended (error path)
+    if (!control->prot_private) return FTP_TLS_NONE;
+    control->data_tls = ftp_tls_secure_data(data_sockfd, control->tls, control->tls_host[0] ? control->tls_host : NULL);
+    return control->data_tls ? ftp_tls_data_mode(control->data_tls) : -1;
+}
+
+void ftp_end_data_connection(FtpConn* control) {
+    ftp_tls_end_data(control->data_tls);
+    control->data_tls = NULL;
+}
+
+int ftp_select_mode_z(FtpConn* control, int compressed) {
+    char response_buf[FTP_RESPONSE_BUF_SIZE];
+    int ftp_code;
+    FtpFeatures features;
+
+    compressed = compressed != 0;
+    if (control->mode_z == compressed) return compressed;
+    if (compressed && (ftp_get_features(control, &features) < 0 || !(features.flags & FTP_FEAT_MODE_Z))) {
+        return 0;
+    }
+    if (send_ftp_command(control, "MODE", compressed ? "Z" : "S") < 0) return -1;
+    if (read_ftp_response(control, response_buf, sizeof(response_buf), &ftp_code) < 0) return -1;
+    if (ftp_code != 200) {
+        if (!compressed) {
+            ftp_log_error("MODE S command failed. Server response %d: %s\n", ftp_code, response_buf);
+            return -1;
+        }
+        // Advertised but refused (e.g. disabled for this user): stay in stream mode
+        ftp_log("MODE Z refused (%d), using stream mode.\n", ftp_code);
+        control->features.flags &= ~FTP_FEAT_MODE_Z;
+        return 0;
+    }
+    control->mode_z = compressed;
+    return compressed;
+}
+
+int ftp_mode_z_worthwhile(const char* remote_path, long long size) {
+    // Formats that are compressed already: deflating them again only costs CPU
+    static const char* const packed[] = {
+        "gz", "tgz", "bz2", "tbz", "xz", "txz", "zst", "lz4", "lzma", "z", "zip", "7z", "rar", "jar",
+        "apk", "deb", "rpm", "iso", "jpg", "jpeg", "png", "gif", "webp", "mp3", "mp4", "mkv", "avi",
+        "mov", "ogg", "flac", "pdf",
+    };
+    const char* base = strrchr(remote_path, '/');
+    base = base ? base + 1 : remote_path;
+    const char* ext = strrchr(base, '.');
+
+    if (size >= 0 && size < FTP_MODE_Z_MIN_SIZE) return 0;
+    if (!ext || ext == base) return 1;
+    for (size_t i = 0; i < sizeof(packed) / sizeof(packed[0]); i++) {
+        if (strcasecmp(ext + 1, packed[i]) == 0) return 0;
+    }
+    return 1;
+}
 
+int ftp_parse_pasv_reply(const char* reply, char* data_ip_str, size_t data_ip_len, int* data_port) {
     // Parse "227 Entering Passive Mode (h1,h2,h3,h4,p1,p2)."
     int h1, h2, h3, h4, p1, p2;
-    char *ptr_open_paren = strchr(response_buf, '(');
+    const char *ptr_open_paren = strchr(reply, '(');
     if (!ptr_open_paren || sscanf(ptr_open_paren, "(%d,%d,%d,%d,%d,%d)", &h1, &h2, &h3, &h4, &p1, &p2) != 6) {
-        fprintf(stderr, "Could not parse PASV response IP/Port: %s\n", response_buf);
         return -1;
     }
     snprintf(data_ip_str, data_ip_len, "%d.%d.%d.%d", h1, h2, h3, h4);
     *data_port = (p1 << 8) + p2; // p1*256 + p2
-    printf("Passive mode: Data connection to %s:%d\n", data_ip_str, *data_port);
     return 0;
 }
 
-int ftp_retrieve_file(int control_sockfd, int data_sockfd, const char* remote_path, const char* local_filename) {
+int ftp_parse_epsv_reply(const char* reply, int* data_port) {
+    // Parse "229 Entering Extended Passive Mode (|||port|)"; '|' may be any delimiter
+    const char* p = strchr(reply, '(');
+    char delim;
+    int port;
+    if (!p || !p[1]) return -1;
+    delim = p[1];
+    if (p[2] != delim || p[3] != delim) return -1;
+    if (sscanf(p + 4, "%d", &port) != 1 || port <= 0 || port > 65535) return -1;
+    *data_port = port;
+    return 0;
+}
+
+int ftp_enter_extended_passive_mode(FtpConn* control, int* data_port) {
     char response_buf[FTP_RESPONSE_BUF_SIZE];
     int ftp_code;
 
-    if (send_ftp_command(control_sockfd, "RETR", remote_path) < 0) return -1;
-    if (read_ftp_response(control_sockfd, response_buf, sizeof(response_buf), &ftp_code) < 0) return -1;
+    if (send_ftp_command(control, "EPSV", NULL) < 0) return -1;
+    if (read_ftp_response(control, response_buf, sizeof(response_buf), &ftp_code) < 0) return -1;
+
+    if (ftp_code != 229) { // 229 Entering Extended Passive Mode
+        ftp_log_error("EPSV command failed. Server response %d: %s\n", ftp_code, response_buf);
+        return -1;
+    }
+    if (ftp_parse_epsv_reply(response_buf, data_port) < 0) {
+        ftp_log_error("Could not parse EPSV response port: %s\n", response_buf);
+        return -1;
+    }
+    ftp_log("Extended passive mode: data port %d\n", *data_port);
+    return 0;
+}
+
+int ftp_enter_passive_mode(FtpConn* control, char* data_ip_str, size_t data_ip_len, int* data_port) {
+    char response_buf[FTP_RESPONSE_BUF_SIZE];
+    int ftp_code;
+
+    if (send_ftp_command(control, "PASV", NULL) < 0) return -1;
+    if (read_ftp_response(control, response_buf, sizeof(response_buf), &ftp_code) < 0) return -1;
+
+    if (ftp_code != 227) { // 227 Entering Passive Mode
+        ftp_log_error("PASV command failed. Server response %d: %s\n", ftp_code, response_buf);
+        return -1;
+    }
+
+    if (ftp_parse_pasv_reply(response_buf, data_ip_str, data_ip_len, data_port) < 0) {
+        ftp_log_error("Could not parse PASV response IP/Port: %s\n", response_buf);
+        return -1;
+    }
+    ftp_log("Passive mode: Data connection to %s:%d\n", data_ip_str, *data_port);
+    return 0;
+}
+
+// Size announced in a 150 reply ("... (12345 bytes)"), or -1.
+static long long ftp_announced_size(const char* reply) {
+    const char* open = strrchr(reply, '(');
+    long long size;
+    if (!open || sscanf(open, "(%lld bytes", &size) != 1 || size < 0) return -1;
+    return size;
+}
+
+// For adaptive transfers: a copy of opts carrying the control connection's RTT
+// (the kernel's estimate, or the RETR round trip if TCP_INFO has none). Under
+// rate caps or live progress the copy also carries the size the 150 reply
+// announced, so the scheduler can weight the transfer and the progress line
+// show how far it is. With keepalives it names the control connection the
+// NOOPs go out on, and under PROT P it carries the data connection's TLS.
+static const TransferOptions* ftp_tune_options(FtpConn* control, const TransferOptions* opts,
+                                               double retr_round_trip, const char* retr_reply,
+                                               TransferOptions* tuned) {
+    long long announced = transfer_rate_enabled() || ftp_progress_enabled() ? ftp_announced_size(retr_reply) : -1;
+    if (!opts) {
+        if (!control->data_tls) return opts;
+        memset(tuned, 0, sizeof(*tuned));
+        tuned->data_tls = control->data_tls;
+        return tuned;
+    }
+    if (!opts->adaptive && announced < 0 && opts->keepalive <= 0 && !control->data_tls) return opts;
+    *tuned = *opts;
+    tuned->data_tls = control->data_tls;
+    if (announced >= 0) tuned->size_hint = announced;
+    if (opts->keepalive > 0) tuned->control = control;
+    if (!opts->adaptive) return tuned;
+    tuned->rtt = transfer_socket_rtt(control->sockfd);
+    if (tuned->rtt <= 0) tuned->rtt = retr_round_trip;
+    return tuned;
+}
+
+// Reads the reply that ends a transfer, skipping the 200s that answer keepalive
+// NOOPs (*noops of them are owed; servers answer them before or after the 226).
+static int ftp_read_transfer_reply(FtpConn* control, char* response_buf, size_t buffer_size, int* ftp_code,
+                                   int* noops) {
+    for (;;) {
+        if (read_ftp_response(control, response_buf, buffer_size, ftp_code) < 0) return -1;
+        if (*ftp_code != 200 || *noops <= 0) return 0;
+        (*noops)--;
+    }
+}
+
+// Consumes NOOP replies still owed after the transfer reply, so the next
+// command starts in sync; a server that dropped them is given up on after a while.
+static void ftp_drain_keepalives(FtpConn* control, int noops) {
+    char response_buf[FTP_RESPONSE_BUF_SIZE];
+    int ftp_code;
+    while (noops > 0 && ftp_response_ready(control, FTP_PIPELINE_TIMEOUT_MS) > 0 &&
+           read_ftp_response(control, response_buf, sizeof(response_buf), &ftp_code) == 0 && ftp_code == 200) {
+        noops--;
+    }
+}
+
+int ftp_retrieve_file(FtpConn* control, int data_sockfd, const char* remote_path, const char* local_filename,
+                      const TransferOptions* opts, TransferStats* stats) {
+    char response_buf[FTP_RESPONSE_BUF_SIZE];
+    int ftp_code;
+    long long expected_size = -1;
+    TransferHashAlg verify_alg = TRANSFER_HASH_NONE;
+    TransferOptions hashed;
+
+    if (opts && opts->verify_hash) {
+        FtpFeatures features;
+        if (ftp_get_features(control, &features) == 0) {
+            verify_alg = ftp_digest_choice(&features, opts->hash_alg);
+        }
+        if (verify_alg == TRANSFER_HASH_NONE) {
+            ftp_log_error("Server offers no file digest (HASH/XCRC/XMD5); '%s' will not be verified.\n",
+                          remote_path);
+        } else if (verify_alg != opts->hash_alg) {
+            hashed = *opts;
+            hashed.hash_alg = verify_alg; // Hash what the server can check
+            opts = &hashed;
+        }
+    }
+
+    // The block writer reserves the whole file before the first byte arrives
+    if (opts && opts->block_writer && ftp_get_size(control, remote_path, &expected_size) < 0) {
+        expected_size = -1;
+    }
+
+    // MODE Z per file; a gzip payload is left alone (one inflate per stream)
+    TransferOptions compressed;
+    if (opts && opts->mode_z && !opts->gunzip) {
+        long long size = opts->size_hint > 0 ? opts->size_hint : expected_size;
+        FtpFeatures features;
+        if (size < 0 && ftp_get_features(control, &features) == 0 && (features.flags & FTP_FEAT_MODE_Z) &&
+            (features.flags & FTP_FEAT_SIZE) && ftp_get_size(control, remote_path, &size) < 0) {
+            size = -1;
+        }
+        int mode = ftp_select_mode_z(control, ftp_mode_z_worthwhile(remote_path, size));
+        if (mode < 0) return -1;
+        if (mode == 1) {
+            compressed = *opts;
+            compressed.inflate_zlib = 1;
+            opts = &compressed;
+        }
+    }
+
+    double retr_sent = monotonic_seconds();
+    if (send_ftp_command(control, "RETR", remote_path) < 0) return -1;
+    if (read_ftp_response(control, response_buf, sizeof(response_buf), &ftp_code) < 0) return -1;
 
     // 150: File status okay; about to open data connection.
     // 125: Data connection already open; transfer starting.
     if (ftp_code != 150 && ftp_code != 125) {
-        fprintf(stderr, "RETR command failed. Server response %d: %s\n", ftp_code, response_buf);
+        ftp_log_error("RETR command failed. Server response %d: %s\n", ftp_code, response_buf);
         return -1;
     }
-    printf("Server ready to send file. Code: %d\n", ftp_code);
+    ftp_log("Server ready to send file. Code: %d\n", ftp_code);
+    if (ftp_secure_data_connection(control, data_sockfd) < 0) return -1;
+    TransferOptions tuned;
+    opts = ftp_tune_options(control, opts, monotonic_seconds() - retr_sent, response_buf, &tuned);
 
-    FILE* local_file = fopen(local_filename, "wb");
-    if (!local_file) {
-        perror("fopen local file for writing");
+    int local_fd = transfer_open_output(local_filename, expected_size, opts);
+    if (local_fd < 0) {
+        ftp_end_data_connection(control);
         return -1;
     }
-    printf("Downloading '%s' to '%s'...\n", remote_path, local_filename);
+    ftp_log("Downloading '%s' to '%s'...\n", remote_path, local_filename);
 
-    char file_buffer[FTP_FILE_BUF_SIZE];
-    ssize_t bytes_received;
-    long total_bytes_downloaded = 0;
+    TransferStats transfer_stats;
+    int transfer_status = transfer_stream(data_sockfd, local_fd, -1, -1, opts, &transfer_stats);
+    ftp_end_data_connection(control);
+    close(local_fd);
 
-    while ((bytes_received = read(data_sockfd, file_buffer, sizeof(file_buffer))) > 0) {
-        if (fwrite(file_buffer, 1, bytes_received, local_file) != (size_t)bytes_received) {
-            perror("fwrite to local file");
-            fclose(local_file);
-            return -1; // Indicate write error
-        }
-        total_bytes_downloaded += bytes_received;
+    if (transfer_stats.first_byte_at > 0) {
+        transfer_stats.ttfb = transfer_stats.first_byte_at - retr_sent;
+        ftp_progress_phase(FTP_PHASE_TTFB, transfer_stats.ttfb);
+        ftp_progress_phase(FTP_PHASE_TRANSFER, transfer_stats.finished_at - transfer_stats.first_byte_at);
     }
-    fclose(local_file);
-
-    if (bytes_received < 0) {
-        perror("read from data socket");
+    if (stats) *stats = transfer_stats; // On failure too: the byte count says where to resume
+    if (transfer_status < 0) {
         // File might be partially downloaded. Server might not send 226.
-        return -1; // Indicate read error
+        return -1; // Indicate read or write error
     }
-    printf("Downloaded %ld bytes.\n", total_bytes_downloaded);
+    transfer_print_stats(&transfer_stats);
 
     // After data transfer, data_sockfd is usually closed by the server, then the client.
-    // Then, client expects a 226 Transfer complete on control_sockfd.
-    if (read_ftp_response(control_sockfd, response_buf, sizeof(response_buf), &ftp_code) < 0) {
-        fprintf(stderr, "Error reading final response after RETR.\n");
+    // Then, client expects a 226 Transfer complete on control.
+    int noops = transfer_stats.keepalives;
+    if (ftp_read_transfer_reply(control, response_buf, sizeof(response_buf), &ftp_code, &noops) < 0) {
+        ftp_log_error("Error reading final response after RETR.\n");
         return -1; // Or treat as warning if file seems complete
     }
     if (ftp_code != 226 && ftp_code != 250) { // 226 Transfer complete, 250 Requested file action okay
-        fprintf(stderr, "File transfer may not have completed successfully on server. Response %d: %s\n", ftp_code, response_buf);
+        ftp_log_error("File transfer may not have completed successfully on server. Response %d: %s\n", ftp_code, response_buf);
         return -1; // Indicate potential server-side issue
     }
-    printf("Transfer confirmed by server (Code %d).\n", ftp_code);
+    ftp_drain_keepalives(control, noops);
+    ftp_log("Transfer confirmed by server (Code %d).\n", ftp_code);
+
+    if (verify_alg != TRANSFER_HASH_NONE && transfer_stats.hash_alg == verify_alg) {
+        char server_digest[TRANSFER_HASH_HEX_MAX];
+        if (ftp_get_server_digest(control, remote_path, verify_alg, server_digest, sizeof(server_digest)) < 0) {
+            ftp_log_error("Could not get the server's %s digest; '%s' is not verified.\n",
+                          transfer_hash_name(verify_alg), remote_path);
+        } else if (strcmp(server_digest, transfer_stats.digest) != 0) {
+            ftp_log_error("%s mismatch for '%s': server %s, received %s.\n", transfer_hash_name(verify_alg),
+                          remote_path, server_digest, transfer_stats.digest);
+            return -1;
+        } else {
+            ftp_log("%s matches the server's digest.\n", transfer_hash_name(verify_alg));
+            if (stats) stats->digest_verified = 1;
+        }
+    }
+    return 0;
+}
+
+// Replaces a MODE Z listing (a zlib stream) by its inflated text. Returns 0 on
+// success, -1 on failure (the buffer is freed then).
+static int ftp_inflate_listing(char** buffer, size_t* len) {
+    size_t capacity = *len * 4 + FTP_FILE_BUF_SIZE, out_len = 0;
+    char* out = malloc(capacity);
+    z_stream zs;
+    int ret = Z_OK;
+
+    if (*len == 0) {
+        free(out);
+        return 0; // Nothing was sent at all
+    }
+    memset(&zs, 0, sizeof(zs));
+    if (!out || inflateInit(&zs) != Z_OK) {
+        ftp_log_error("MODE Z: cannot set up zlib.\n");
+        free(out);
+        free(*buffer);
+        return -1;
+    }
+    zs.next_in = (Bytef*) *buffer;
+    zs.avail_in = (uInt) *len;
+    while (ret == Z_OK) {
+        if (out_len + 1 >= capacity) {
+            char* grown = realloc(out, capacity * 2);
+            if (!grown) break;
+            out = grown;
+            capacity *= 2;
+        }
+        zs.next_out = (Bytef*) out + out_len;
+        zs.avail_out = (uInt) (capacity - 1 - out_len);
+        ret = inflate(&zs, Z_NO_FLUSH);
+        out_len = capacity - 1 - zs.avail_out;
+    }
+    inflateEnd(&zs);
+    free(*buffer);
+    if (ret != Z_STREAM_END) {
+        ftp_log_error("MODE Z: corrupt or truncated listing.\n");
+        free(out);
+        return -1;
+    }
+    ftp_log("MODE Z listing: %zu -> %zu bytes.\n", *len, out_len);
+    out[out_len] = '\0';
+    *buffer = out;
+    *len = out_len;
+    return 0;
+}
+
+int ftp_list_directory(FtpConn* control, int data_sockfd, const char* command, const char* path,
+                       char** listing, size_t* listing_len, int* ftp_code) {
+    char response_buf[FTP_RESPONSE_BUF_SIZE];
+    size_t capacity = FTP_FILE_BUF_SIZE, len = 0;
+    char* buffer;
+    ssize_t n;
+
+    *listing = NULL;
+    *listing_len = 0;
+    if (send_ftp_command(control, command, path) < 0) return -1;
+    if (read_ftp_response(control, response_buf, sizeof(response_buf), ftp_code) < 0) return -1;
+    if (*ftp_code != 150 && *ftp_code != 125) {
+        ftp_log_error("%s command failed. Server response %d: %s\n", command, *ftp_code, response_buf);
+        return -1;
+    }
+    if (ftp_secure_data_connection(control, data_sockfd) < 0) return -1;
+
+    buffer = malloc(capacity);
+    if (!buffer) {
+        ftp_log_perror("malloc listing");
+        ftp_end_data_connection(control);
+        return -1;
+    }
+    for (;;) {
+        if (len + 1 >= capacity) {
+            char* grown = realloc(buffer, capacity * 2);
+            if (!grown) {
+                ftp_log_perror("realloc listing");
+                free(buffer);
+                ftp_end_data_connection(control);
+                return -1;
+            }
+            buffer = grown;
+            capacity *= 2;
+        }
+        n = ftp_tls_recv(control->data_tls, data_sockfd, buffer + len, capacity - 1 - len);
+        if (n <= 0) break;
+        len += n;
+    }
+    ftp_end_data_connection(control);
+    buffer[len] = '\0';
+    if (n < 0) {
+        ftp_log_perror("read listing from data socket");
+        free(buffer);
+        return -1;
+    }
+
+    int final_code;
+    if (read_ftp_response(control, response_buf, sizeof(response_buf), &final_code) < 0 ||
+        (final_code != 226 && final_code != 250)) {
+        ftp_log_error("%s of '%s' not confirmed by server.\n", command, path);
+        free(buffer);
+        return -1;
+    }
+    if (control->mode_z && ftp_inflate_listing(&buffer, &len) < 0) return -1;
+    *listing = buffer;
+    *listing_len = len;
+    return 0;
+}
+
+int ftp_get_size(FtpConn* control, const char* remote_path, long long* size) {
+    char response_buf[FTP_RESPONSE_BUF_SIZE];
+    int ftp_code;
+
+    if (send_ftp_command(control, "SIZE", remote_path) < 0) return -1;
+    if (read_ftp_response(control, response_buf, sizeof(response_buf), &ftp_code) < 0) return -1;
+    // 213 <size>
+    if (ftp_code != 213 || sscanf(response_buf, "%*d %lld", size) != 1) {
+        ftp_log_error("SIZE command failed. Server response %d: %s\n", ftp_code, response_buf);
+        return -1;
+    }
+    return 0;
+}
+
+int ftp_parse_time(const char* text, time_t* mtime) {
+    struct tm tm;
+
+    // YYYYMMDDhhmmss[.sss], always in UTC
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(text, "%4d%2d%2d%2d%2d%2d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min,
+               &tm.tm_sec) != 6) {
+        return -1;
+    }
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    *mtime = timegm(&tm);
+    return 0;
+}
+
+int ftp_get_mdtm(FtpConn* control, const char* remote_path, time_t* mtime) {
+    char response_buf[FTP_RESPONSE_BUF_SIZE];
+    int ftp_code;
+
+    if (send_ftp_command(control, "MDTM", remote_path) < 0) return -1;
+    if (read_ftp_response(control, response_buf, sizeof(response_buf), &ftp_code) < 0) return -1;
+    if (ftp_code != 213 || strlen(response_buf) < 4 || ftp_parse_time(response_buf + 4, mtime) < 0) {
+        ftp_log_error("MDTM command failed. Server response %d: %s\n", ftp_code, response_buf);
+        return -1;
+    }
+    return 0;
+}
+
+void ftp_parse_facts(char* facts, FtpFacts* out) {
+    char* save = NULL;
+
+    out->type = FTP_ENTRY_OTHER;
+    out->size = -1;
+    out->mtime = -1;
+    for (char* fact = strtok_r(facts, ";", &save); fact; fact = strtok_r(NULL, ";", &save)) {
+        if (strncasecmp(fact, "type=", 5) == 0) {
+            if (strcasecmp(fact + 5, "file") == 0) out->type = FTP_ENTRY_FILE;
+            else if (strcasecmp(fact + 5, "dir") == 0) out->type = FTP_ENTRY_DIR;
+            // cdir, pdir, OS.unix=slink, ... stay FTP_ENTRY_OTHER
+        } else if (strncasecmp(fact, "size=", 5) == 0) {
+            out->size = atoll(fact + 5);
+        } else if (strncasecmp(fact, "modify=", 7) == 0) {
+            time_t mtime;
+            if (ftp_parse_time(fact + 7, &mtime) == 0) out->mtime = mtime;
+        }
+    }
+}
+
+int ftp_parse_mlst_reply(char* reply, FtpFacts* out) {
+    // "250-Listing path\r\n type=file;size=12;modify=...; path\r\n250 End"
+    for (char* line = strchr(reply, '\n'); line; line = strchr(line, '\n')) {
+        line++;
+        if (*line != ' ') continue;
+        line++;
+        char* end = strpbrk(line, " \r\n"); // The facts end at the space before the path
+        if (!end || *end != ' ') return -1;
+        *end = '\0';
+        ftp_parse_facts(line, out);
+        return 0;
+    }
+    return -1;
+}
+
+// FEAT lines are " NAME [facts]"; names are case-insensitive
+static void ftp_parse_feature_line(const char* line, size_t len, FtpFeatures* features) {
+    static const struct {
+        const char* name;
+        unsigned flag;
+    } known[] = {
+        {"SIZE", FTP_FEAT_SIZE}, {"MDTM", FTP_FEAT_MDTM}, {"MLST", FTP_FEAT_MLST}, {"HASH", FTP_FEAT_HASH},
+        {"XCRC", FTP_FEAT_XCRC}, {"XMD5", FTP_FEAT_XMD5}, {"XSHA1", FTP_FEAT_XSHA1}, {"XSHA256", FTP_FEAT_XSHA256},
+    };
+    char name[16], facts[256];
+    size_t i = 0, n = 0;
+
+    if (len == 0 || line[0] != ' ') return; // Not a feature line ("211-..." / "211 End")
+    while (i < len && line[i] == ' ') i++;
+    while (i < len && line[i] != ' ' && line[i] != '\r' && line[i] != '\n' && n < sizeof(name) - 1) {
+        name[n++] = line[i++];
+    }
+    name[n] = '\0';
+    while (i < len && line[i] == ' ') i++;
+    n = 0;
+    while (i < len && line[i] != '\r' && line[i] != '\n' && n < sizeof(facts) - 1) facts[n++] = line[i++];
+    facts[n] = '\0';
+
+    for (size_t k = 0; k < sizeof(known) / sizeof(known[0]); k++) {
+        if (strcasecmp(name, known[k].name) == 0) features->flags |= known[k].flag;
+    }
+    if (strcasecmp(name, "MODE") == 0 && strchr(facts, 'Z')) features->flags |= FTP_FEAT_MODE_Z;
+    if (strcasecmp(name, "HASH") == 0) {
+        // "SHA-256*;SHA-1;MD5" - the star marks the algorithm in use
+        char* save = NULL;
+        for (char* alg = strtok_r(facts, ";", &save); alg; alg = strtok_r(NULL, ";", &save)) {
+            size_t alen = strlen(alg);
+            int selected = alen > 0 && alg[alen - 1] == '*';
+            if (selected) alg[alen - 1] = '\0';
+            TransferHashAlg parsed = transfer_hash_parse(alg);
+            if (parsed == TRANSFER_HASH_NONE) continue;
+            features->hash_algs |= 1u << parsed;
+            if (selected) features->hash_selected = parsed;
+        }
+    }
+}
+
+int ftp_get_features(FtpConn* control, FtpFeatures* features) {
+    char response_buf[FTP_RESPONSE_BUF_SIZE];
+    int ftp_code;
+
+    if (!control->have_features) {
+        memset(&control->features, 0, sizeof(control->features));
+        if (send_ftp_command(control, "FEAT", NULL) < 0) return -1;
+        if (read_ftp_response(control, response_buf, sizeof(response_buf), &ftp_code) < 0) return -1;
+        if (ftp_code == 211) {
+            for (char* line = response_buf; *line;) {
+                char* end = strchr(line, '\n');
+                size_t len = end ? (size_t)(end - line) : strlen(line);
+                ftp_parse_feature_line(line, len, &control->features);
+                line += len + (end ? 1 : 0);
+            }
+        }
+        // Anything else (500, 502): no extensions to rely on
+        control->have_features = 1;
+    }
+    *features = control->features;
+    return 0;
+}
+
+// Whether the server can report `alg`, through HASH or an X command
+static int ftp_digest_offered(const FtpFeatures* features, TransferHashAlg alg) {
+    if ((features->flags & FTP_FEAT_HASH) && (features->hash_algs & (1u << alg))) return 1;
+    switch (alg) {
+    case TRANSFER_HASH_CRC32: return (features->flags & FTP_FEAT_XCRC) != 0;
+    case TRANSFER_HASH_MD5: return (features->flags & FTP_FEAT_XMD5) != 0;
+    case TRANSFER_HASH_SHA1: return (features->flags & FTP_FEAT_XSHA1) != 0;
+    case TRANSFER_HASH_SHA256: return (features->flags & FTP_FEAT_XSHA256) != 0;
+    default: return 0;
+    }
+}
+
+TransferHashAlg ftp_digest_choice(const FtpFeatures* features, TransferHashAlg wanted) {
+    static const TransferHashAlg preference[] = {
+        TRANSFER_HASH_SHA256, TRANSFER_HASH_SHA1, TRANSFER_HASH_MD5, TRANSFER_HASH_CRC32,
+    };
+    if (wanted != TRANSFER_HASH_NONE && ftp_digest_offered(features, wanted)) return wanted;
+    for (size_t i = 0; i < sizeof(preference) / sizeof(preference[0]); i++) {
+        if (ftp_digest_offered(features, preference[i])) return preference[i];
+    }
+    return TRANSFER_HASH_NONE;
+}
+
+// Finds the digest in a reply: the first token after the code made of hex
+// digits only, `digits` long (CRC32 servers sometimes drop leading zeros).
+static int ftp_find_hex_token(const char* reply, TransferHashAlg alg, char* hex, size_t hex_len) {
+    size_t digits = alg == TRANSFER_HASH_MD5 ? 32 : alg == TRANSFER_HASH_SHA1 ? 40 : alg == TRANSFER_HASH_SHA256 ? 64 : 8;
+    const char* p = reply + 3; // Skip the code
+
+    while (*p) {
+        while (*p == ' ' || *p == '-' || *p == '\r' || *p == '\n') p++;
+        size_t len = strcspn(p, " \r\n");
+        size_t hex_digits = 0;
+        while (hex_digits < len && isxdigit((unsigned char) p[hex_digits])) hex_digits++;
+        if (len > 0 && hex_digits == len && (len == digits || (alg == TRANSFER_HASH_CRC32 && len < digits)) &&
+            digits < hex_len) {
+            size_t pad = digits - len;
+            memset(hex, '0', pad);
+            for (size_t i = 0; i < len; i++) hex[pad + i] = (char) tolower((unsigned char) p[i]);
+            hex[digits] = '\0';
+            return 0;
+        }
+        p += len;
+    }
+    return -1;
+}
+
+int ftp_get_server_digest(FtpConn* control, const char* remote_path, TransferHashAlg alg,
+                          char* hex, size_t hex_len) {
+    char response_buf[FTP_RESPONSE_BUF_SIZE];
+    FtpFeatures features;
+    int ftp_code;
+
+    if (ftp_get_features(control, &features) < 0) return -1;
+    int use_hash = (features.flags & FTP_FEAT_HASH) && (features.hash_algs & (1u << alg));
+    if (use_hash && features.hash_selected != alg) {
+        char opts_arg[32];
+        snprintf(opts_arg, sizeof(opts_arg), "HASH %s", transfer_hash_name(alg));
+        if (send_ftp_command(control, "OPTS", opts_arg) < 0) return -1;
+        if (read_ftp_response(control, response_buf, sizeof(response_buf), &ftp_code) < 0) return -1;
+        if (ftp_code == 200) {
+            control->features.hash_selected = alg;
+        } else {
+            use_hash = 0; // Try the X command instead, on this file and the next ones
+            control->features.hash_algs &= ~(1u << alg);
+            features.hash_algs &= ~(1u << alg);
+            if (!ftp_digest_offered(&features, alg)) {
+                ftp_log_error("OPTS HASH failed. Server response %d: %s\n", ftp_code, response_buf);
+                return -1;
+            }
+        }
+    }
+    if (use_hash) {
+        if (send_ftp_command(control, "HASH", remote_path) < 0) return -1;
+    } else {
+        const char* command = alg == TRANSFER_HASH_CRC32 ? "XCRC" : alg == TRANSFER_HASH_MD5 ? "XMD5"
+                            : alg == TRANSFER_HASH_SHA1 ? "XSHA1" : "XSHA256";
+        if (send_ftp_command(control, command, remote_path) < 0) return -1;
+    }
+    if (read_ftp_response(control, response_buf, sizeof(response_buf), &ftp_code) < 0) return -1;
+    // 213 for HASH; 250 or 251 for the X commands depending on the server
+    if (ftp_code / 100 != 2 || ftp_find_hex_token(response_buf, alg, hex, hex_len) < 0) {
+        ftp_log_error("Digest request failed. Server response %d: %s\n", ftp_code, response_buf);
+        return -1;
+    }
+    return 0;
+}
+
+int ftp_restart(FtpConn* control, long long offset) {
+    char response_buf[FTP_RESPONSE_BUF_SIZE];
+    char offset_str[32];
+    int ftp_code;
+
+    snprintf(offset_str, sizeof(offset_str), "%lld", offset);
+    if (send_ftp_command(control, "REST", offset_str) < 0) return -1;
+    if (read_ftp_response(control, response_buf, sizeof(response_buf), &ftp_code) < 0) return -1;
+    if (ftp_code != 350) { // 350 Requested file action pending further information
+        ftp_log_error("REST command failed. Server response %d: %s\n", ftp_code, response_buf);
+        return -1;
+    }
     return 0;
 }
 
-int ftp_quit(int control_sockfd) {
+int ftp_retrieve_range(FtpConn* control, int data_sockfd, const char* remote_path,
+                       int out_fd, long long offset, long long length, int to_eof,
+                       const TransferOptions* opts, TransferStats* stats) {
     char response_buf[FTP_RESPONSE_BUF_SIZE];
     int ftp_code;
-    if (send_ftp_command(control_sockfd, "QUIT", NULL) < 0) {
+
+    // REST offsets count stream-mode bytes; a connection a batch left in MODE Z goes back
+    if (ftp_select_mode_z(control, 0) < 0) return -1;
+    if (offset > 0 && ftp_restart(control, offset) < 0) return -1;
+    double retr_sent = monotonic_seconds();
+    if (send_ftp_command(control, "RETR", remote_path) < 0) return -1;
+    if (read_ftp_response(control, response_buf, sizeof(response_buf), &ftp_code) < 0) return -1;
+    if (ftp_code != 150 && ftp_code != 125) {
+        ftp_log_error("RETR command failed. Server response %d: %s\n", ftp_code, response_buf);
+        return -1;
+    }
+    if (ftp_secure_data_connection(control, data_sockfd) < 0) return -1;
+    TransferOptions tuned;
+    opts = ftp_tune_options(control, opts, monotonic_seconds() - retr_sent, response_buf, &tuned);
+
+    TransferStats transfer_stats;
+    int transfer_status = transfer_stream(data_sockfd, out_fd, offset, length, opts, &transfer_stats);
+    ftp_end_data_connection(control);
+    if (transfer_stats.first_byte_at > 0) {
+        transfer_stats.ttfb = transfer_stats.first_byte_at - retr_sent;
+        ftp_progress_phase(FTP_PHASE_TTFB, transfer_stats.ttfb);
+        ftp_progress_phase(FTP_PHASE_TRANSFER, transfer_stats.finished_at - transfer_stats.first_byte_at);
+    }
+    if (stats) *stats = transfer_stats; // On failure too: the byte count says where to resume
+    if (transfer_status < 0) {
+        return -1;
+    }
+    long long received = transfer_stats.bytes;
+    if (length >= 0 && received < length) {
+        ftp_log_error("Range %lld+%lld: data connection closed after %lld bytes.\n",
+                      offset, length, received);
+        return -1;
+    }
+
+    int noops = transfer_stats.keepalives;
+    if (!to_eof) {
+        // The server is still sending the rest of the file: stop it.
+        shutdown(data_sockfd, SHUT_RDWR);
+        if (send_ftp_command(control, "ABOR", NULL) < 0) return -1;
+        if (ftp_read_transfer_reply(control, response_buf, sizeof(response_buf), &ftp_code, &noops) < 0) {
+            return -1;
+        }
+        // 426 (transfer aborted) is followed by the 226 answering ABOR. If the transfer
+        // had already completed, its 226 comes first and ABOR gets its own 225/226.
+        if (ftp_code != 225) {
+            int first_code = ftp_code;
+            if (ftp_read_transfer_reply(control, response_buf, sizeof(response_buf), &ftp_code, &noops) < 0) {
+                return -1;
+            }
+            if (first_code == 226 || first_code == 250) {
+                ftp_code = first_code;
+            }
+        }
+    } else {
+        if (ftp_read_transfer_reply(control, response_buf, sizeof(response_buf), &ftp_code, &noops) < 0) {
+            ftp_log_error("Error reading final response after RETR.\n");
+            return -1;
+        }
+    }
+    if (ftp_code != 226 && ftp_code != 225 && ftp_code != 250) {
+        ftp_log_error("Range %lld+%lld not confirmed by server. Response %d: %s\n",
+                      offset, length, ftp_code, response_buf);
+        return -1;
+    }
+    ftp_drain_keepalives(control, noops);
+    ftp_log("Range %lld+%lld confirmed by server (Code %d). ", offset, length, ftp_code);
+    transfer_print_stats(&transfer_stats);
+    return 0;
+}
+
+int ftp_noop(FtpConn* control) {
+    char response_buf[FTP_RESPONSE_BUF_SIZE];
+    int ftp_code;
+    if (control->reply_owed) return -1; // Its 200 would queue behind the cut-short transfer's reply
+    if (send_ftp_command(control, "NOOP", NULL) < 0) return -1;
+    if (ftp_response_ready(control, FTP_REPLY_TIMEOUT_MS) <= 0) {
+        ftp_log_error("No reply to NOOP within %d s.\n", FTP_REPLY_TIMEOUT_MS / 1000);
+        return -1;
+    }
+    if (read_ftp_response(control, response_buf, sizeof(response_buf), &ftp_code) < 0) return -1;
+    return ftp_code == 200 ? 0 : -1;
+}
+
+int ftp_quit(FtpConn* control) {
+    char response_buf[FTP_RESPONSE_BUF_SIZE];
+    int ftp_code;
+    if (control->reply_owed) {
+        // The server may never answer the transfer, let alone QUIT behind it
+        ftp_log("Transfer reply outstanding; closing without QUIT.\n");
+        return -1;
+    }
+    if (send_ftp_command(control, "QUIT", NULL) < 0) {
         // Still try to close the socket
     }
     // Try to read response, but don't fail hard if it doesn't come
-    if (read_ftp_response(control_sockfd, response_buf, sizeof(response_buf), &ftp_code) == 0) {
+    if (ftp_response_ready(control, FTP_REPLY_TIMEOUT_MS) > 0 &&
+        read_ftp_response(control, response_buf, sizeof(response_buf), &ftp_code) == 0) {
         if (ftp_code != 221) { // 221 Service closing control connection
-            printf("QUIT command acknowledged with code %d: %s\n", ftp_code, response_buf);
+            ftp_log("QUIT command acknowledged with code %d: %s\n", ftp_code, response_buf);
         } else {
-            printf("QUIT successful (Code %d).\n", ftp_code);
+            ftp_log("QUIT successful (Code %d).\n", ftp_code);
         }
     } else {
-        printf("No clear response to QUIT, or error reading. Closing connection.\n");
+        ftp_log("No clear response to QUIT, or error reading. Closing connection.\n");
     }
-    return 0; // Always returns 0 for quit, as we'll close socket anyway
+    return 0; // The socket is closed anyway, reply or not
 }
\ No newline at end of file
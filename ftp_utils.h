@@ -3,72 +3,438 @@
 
 #include <stdio.h>  // For FILE*
 #include <stddef.h> // For size_t
+#include <time.h>   // For time_t
+#include "data_transfer.h"
+#include "url_parser.h" // For MAX_HOST_LEN
+#include <netinet/in.h> // For INET6_ADDRSTRLEN
 
 #define FTP_RESPONSE_BUF_SIZE 4096
 #define FTP_FILE_BUF_SIZE 4096
+#define FTP_READER_BUF_SIZE 8192   // Per-connection control read buffer
+#define FTP_PIPELINE_BUF_SIZE 2048 // Commands send_ftp_commands() packs into one write, CRLFs included
+#define FTP_PIPELINE_TIMEOUT_MS 3000 // Wait for a pipelined reply before assuming it was dropped
+#define FTP_LOGIN_REPLY_TIMEOUT_MS 30000 // Same for pipelined PASS/TYPE, whose replies must all be read
+#define FTP_REPLY_TIMEOUT_MS 10000   // NOOP/QUIT reply wait before the connection is taken for dead
+#define FTP_PIPELINE_DROPPED (-2)   // ftp_login_pipelined: the server dropped a command; reconnect without pipelining
+#define FTP_LAST_REPLY_SIZE 256    // First line of the last reply kept per connection (ftp_last_reply)
+
+// Extensions advertised in the FEAT reply (RFC 2389)
+#define FTP_FEAT_SIZE    0x0001
+#define FTP_FEAT_MDTM    0x0002
+#define FTP_FEAT_MLST    0x0004
+#define FTP_FEAT_HASH    0x0008 // draft-bryan-ftpext-hash; algorithms in FtpFeatures.hash_algs
+#define FTP_FEAT_XCRC    0x0010
+#define FTP_FEAT_XMD5    0x0020
+#define FTP_FEAT_XSHA1   0x0040
+#define FTP_FEAT_XSHA256 0x0080
+#define FTP_FEAT_MODE_Z  0x0100 // "MODE Z": deflate-compressed data connections
+
+// MODE Z is only asked for files that are likely to shrink
+#define FTP_MODE_Z_MIN_SIZE (16 * 1024) // Smaller files gain less than the MODE round trip costs
+
+// What an MLSD line or MLST reply says about one entry (RFC 3659 facts)
+typedef enum {
+    FTP_ENTRY_OTHER = 0, // cdir, pdir, links, or no type fact
+    FTP_ENTRY_FILE,
+    FTP_ENTRY_DIR,
+} FtpEntryType;
+
+typedef struct {
+    FtpEntryType type;
+    long long size;     // -1 if not reported
+    time_t mtime;       // UTC, -1 if not reported
+} FtpFacts;
+
+typedef struct {
+    unsigned flags;                 // FTP_FEAT_* bits
+    unsigned hash_algs;             // HASH algorithms, bit (1 << TransferHashAlg) each
+    TransferHashAlg hash_selected;  // The one HASH currently uses (marked '*' in FEAT, changed by OPTS HASH)
+} FtpFeatures;
+
+// One control connection: its socket, the buffered reader its replies go
+// through, and what is known or in effect on it. Every helper below takes one;
+// it is created by ftp_conn_new() (ftp_session_open() does that) and owned by
+// whoever opened it, so nothing is kept per descriptor.
+typedef struct FtpConn {
+    int sockfd;        // The control socket
+    char data[FTP_READER_BUF_SIZE]; // Bytes pulled from the socket in bulk, kept between replies
+    size_t start;      // First unconsumed byte
+    size_t end;        // One past the last buffered byte
+    int mid_line;      // Last piece returned had no line ending yet
+    int have_features; // FEAT was asked on this connection
+    FtpFeatures features;
+    int mode_z;        // MODE Z is in effect
+    void* tls;         // TLS after AUTH TLS (NULL: plain)
+    char tls_host[MAX_HOST_LEN]; // Name its certificate was checked against; data connections are too
+    int prot_private;  // PROT P accepted: data connections are secured too
+    struct FtpDataTls* data_tls; // The open data connection's TLS (ftp_secure_data_connection())
+    int epsv_refused;  // Server does not do EPSV: use PASV (see ftp_open_data_connection())
+    int passive_port;  // Data port the pipelined login's EPSV/PASV opened, for the next transfer (0: none)
+    char passive_ip[INET6_ADDRSTRLEN]; // Its address after PASV ("" after EPSV: the control peer's)
+    int reply_owed;    // A 1xx came and its final reply has not been read (transfer cut short)
+    int last_code;     // Code of the most recent reply (0 before the first)
+    char last_reply[FTP_LAST_REPLY_SIZE]; // Its first line, without CRLF
+} FtpConn;
+
+/**
+ * Wraps a connected control socket, which the connection then owns.
+ * @param sockfd The socket.
+ * @return The connection, or NULL if it cannot be allocated (the socket is closed then).
+ */
+FtpConn* ftp_conn_new(int sockfd);
+
+/**
+ * Ends TLS on the connection (and on a data connection still secured through
+ * it), closes the socket and frees the connection. Sends nothing; see
+ * ftp_quit(). Accepts NULL.
+ * @param conn The control connection.
+ */
+void ftp_conn_close(FtpConn* conn);
 
 /**
  * Sends an FTP command to the server.
- * @param sockfd The control connection socket.
+ * @param conn The control connection.
  * @param command The FTP command (e.g., "USER", "PASV").
  * @param arg The argument for the command (can be NULL).
  * @return 0 on success, -1 on failure.
  */
-int send_ftp_command(int sockfd, const char* command, const char* arg);
+int send_ftp_command(FtpConn* conn, const char* command, const char* arg);
+
+/**
+ * Sends several FTP commands in a single write (pipelining). Together they
+ * must fit in FTP_PIPELINE_BUF_SIZE bytes, CRLFs and a terminating NUL included.
+ * @param conn The control connection.
+ * @param commands The FTP commands.
+ * @param args Their arguments (entries can be NULL).
+ * @param count Number of commands.
+ * @return 0 on success, -1 on failure.
+ */
+int send_ftp_commands(FtpConn* conn, const char* const* commands, const char* const* args, int count);
+
+/**
+ * Waits until a reply line is buffered or the socket is readable.
+ * @param conn The control connection.
+ * @param timeout_ms How long to wait, in milliseconds.
+ * @return 1 if a reply can be read, 0 on timeout, -1 on failure.
+ */
+int ftp_response_ready(FtpConn* conn, int timeout_ms);
 
 /**
  * Reads a response from the FTP server and extracts the status code.
- * NOTE: This version is simplified for multi-line responses.
- * @param sockfd The control connection socket.
+ * Goes through the connection's buffered reader; bytes read past the end of
+ * this reply are kept for the next call. Multi-line replies ("NNN-" ... "NNN ")
+ * are read up to the final line carrying the same code.
+ * @param conn The control connection.
  * @param response_buffer Buffer to store the full server response.
  * @param buffer_size Size of the response_buffer.
  * @param ftp_code Pointer to store the extracted 3-digit FTP status code.
  * @return 0 on success, -1 on failure.
  */
-int read_ftp_response(int sockfd, char* response_buffer, size_t buffer_size, int* ftp_code);
+int read_ftp_response(FtpConn* conn, char* response_buffer, size_t buffer_size, int* ftp_code);
+
+/**
+ * Returns the most recent reply read on a control connection, for reporting
+ * why a helper failed without parsing its stderr output.
+ * @param conn The control connection.
+ * @param text Buffer for the reply's first line (without CRLF).
+ * @param text_len Size of text.
+ * @return The reply code, or 0 if no reply was read yet.
+ */
+int ftp_last_reply(FtpConn* conn, char* text, size_t text_len);
+
+/**
+ * Looks for one complete (possibly multi-line) reply at the start of a buffer.
+ * Does no I/O; used by callers that manage their own non-blocking input.
+ * @param buf Buffered control connection bytes.
+ * @param len Number of bytes in buf.
+ * @param ftp_code Pointer to store the reply code.
+ * @param reply_len Pointer to store the length of the reply, including its final CRLF.
+ * @return 1 if a complete reply was found, 0 if more bytes are needed.
+ */
+int ftp_parse_reply(const char* buf, size_t len, int* ftp_code, size_t* reply_len);
 
 /**
  * Logs into the FTP server.
- * @param control_sockfd The control connection socket.
+ * @param control The control connection.
  * @param user Username.
  * @param pass Password.
  * @return 0 on success, -1 on failure.
  */
-int ftp_login(int control_sockfd, const char* user, const char* pass);
+int ftp_login(FtpConn* control, const char* user, const char* pass);
+
+/**
+ * Logs in, sets TYPE I and enters passive mode for the first transfer with the
+ * commands pipelined: USER, PASS, TYPE I and EPSV (PASV if control->epsv_refused)
+ * go out in one write and the replies are matched in order. The data port is
+ * kept in control->passive_port for ftp_open_data_connection(); a refused EPSV
+ * sets control->epsv_refused. All four replies are read before anything else
+ * is sent; PASS or TYPE I is repeated in lock-step only if the server answered
+ * it out of sequence (503/530), and passive mode is then left to the first
+ * transfer. A server
+ * that leaves a pipelined command unanswered for FTP_LOGIN_REPLY_TIMEOUT_MS
+ * has dropped it, and the connection can no longer be kept in step.
+ * @param control The control connection.
+ * @param user Username.
+ * @param pass Password.
+ * @return 0 on success, FTP_PIPELINE_DROPPED if a reply never came (close the
+ *         connection and log in again without pipelining), -1 on failure.
+ */
+int ftp_login_pipelined(FtpConn* control, const char* user, const char* pass);
 
 /**
  * Enters passive mode for data transfer.
- * @param control_sockfd The control connection socket.
+ * @param control The control connection.
  * @param data_ip_str Buffer to store the data connection IP address.
  * @param data_ip_len Length of the data_ip_str buffer.
  * @param data_port Pointer to store the data connection port.
  * @return 0 on success, -1 on failure.
  */
-int ftp_enter_passive_mode(int control_sockfd, char* data_ip_str, size_t data_ip_len, int* data_port);
+int ftp_enter_passive_mode(FtpConn* control, char* data_ip_str, size_t data_ip_len, int* data_port);
+
+
+/**
+ * Enters extended passive mode (EPSV, RFC 2428). The data connection goes to
+ * the same address as the control connection, so this works over IPv6 and
+ * through NAT without trusting an address sent by the server.
+ * @param control The control connection.
+ * @param data_port Pointer to store the data connection port.
+ * @return 0 on success, -1 on failure (e.g. EPSV not supported).
+ */
+int ftp_enter_extended_passive_mode(FtpConn* control, int* data_port);
 
+/**
+ * Extracts the port from a 229 reply ("... (|||port|)").
+ * @param reply The EPSV reply text.
+ * @param data_port Pointer to store the data connection port.
+ * @return 0 on success, -1 if the reply cannot be parsed.
+ */
+int ftp_parse_epsv_reply(const char* reply, int* data_port);
+
+/**
+ * Extracts the data address from a 227 reply ("... (h1,h2,h3,h4,p1,p2)").
+ * @param reply The PASV reply text.
+ * @param data_ip_str Buffer to store the data connection IP address.
+ * @param data_ip_len Length of the data_ip_str buffer.
+ * @param data_port Pointer to store the data connection port.
+ * @return 0 on success, -1 if the reply cannot be parsed.
+ */
+int ftp_parse_pasv_reply(const char* reply, char* data_ip_str, size_t data_ip_len, int* data_port);
 
 /**
  * Sets the transfer type to binary (Image).
- * @param control_sockfd The control connection socket.
+ * @param control The control connection.
+ * @return 0 on success, -1 on failure.
+ */
+int ftp_set_type_image(FtpConn* control);
+
+/**
+ * Upgrades the control connection to TLS (AUTH TLS, RFC 4217). Every later
+ * command and reply on it is encrypted.
+ * @param control The control connection (after the 220 banner).
+ * @param host Name or address the server certificate must match.
+ * @return 0 on success, -1 on failure.
+ */
+int ftp_auth_tls(FtpConn* control, const char* host);
+
+/**
+ * Asks for protected data connections (PBSZ 0, PROT P) after login, so that
+ * the RETR helpers and ftp_list_directory() secure each data connection with
+ * ftp_secure_data_connection().
+ * @param control A control connection secured by ftp_auth_tls().
  * @return 0 on success, -1 on failure.
  */
-int ftp_set_type_image(int control_sockfd);
+int ftp_protect_data(FtpConn* control);
+
+/**
+ * Runs the TLS handshake on a data connection if PROT P is in effect, resuming
+ * the control connection's session (see ftp_tls_secure_data()). Call after
+ * the 150/125 reply, since the server only accepts the connection then. The
+ * data connection's TLS is kept in control->data_tls until
+ * ftp_end_data_connection().
+ * @return FTP_TLS_NONE, FTP_TLS_USER or FTP_TLS_KTLS, or -1 on failure.
+ */
+int ftp_secure_data_connection(FtpConn* control, int data_sockfd);
+
+/**
+ * Ends TLS on the data connection secured by ftp_secure_data_connection(), if
+ * any. The socket itself is left to the caller.
+ * @param control The control connection.
+ */
+void ftp_end_data_connection(FtpConn* control);
+
+/**
+ * Puts the connection in MODE Z (compressed) or MODE S (stream), sending MODE
+ * only if it is not in that mode already. MODE Z is only requested if FEAT
+ * lists it; a server that refuses it is not asked again.
+ * @param control The control connection.
+ * @param compressed Non-zero for MODE Z, zero for MODE S.
+ * @return 1 if MODE Z is in effect afterwards, 0 for MODE S, -1 on failure.
+ */
+int ftp_select_mode_z(FtpConn* control, int compressed);
+
+/**
+ * Whether a file is worth compressing on the wire: not already compressed
+ * (judged by its extension) and not smaller than FTP_MODE_Z_MIN_SIZE.
+ * @param remote_path The path of the file on the server.
+ * @param size Its size, or -1 if unknown.
+ * @return 1 if MODE Z should be used, 0 otherwise.
+ */
+int ftp_mode_z_worthwhile(const char* remote_path, long long size);
 
 /**
  * Retrieves a file from the FTP server.
- * @param control_sockfd The control connection socket.
+ * With opts->verify_hash the server's FEAT decides the digest computed while the
+ * file streams (opts->hash_alg if offered), and after the 226 the server's own
+ * digest is requested and compared; a mismatch fails the download.
+ * With opts->mode_z, files that ftp_mode_z_worthwhile() picks (size from
+ * opts->size_hint or SIZE) are sent in MODE Z and inflated as they arrive;
+ * other files switch the connection back to MODE S.
+ * @param control The control connection.
  * @param data_sockfd The data connection socket.
  * @param remote_path The path of the file on the server.
  * @param local_filename The name to save the file as locally.
+ * @param opts How to drain the data connection (NULL for the default read/write loop).
+ * @param stats Filled with the transfer's byte count and duration (may be NULL).
  * @return 0 on success, -1 on failure.
  */
-int ftp_retrieve_file(int control_sockfd, int data_sockfd, const char* remote_path, const char* local_filename);
+int ftp_retrieve_file(FtpConn* control, int data_sockfd, const char* remote_path, const char* local_filename,
+                      const TransferOptions* opts, TransferStats* stats);
 
 /**
- * Sends the QUIT command and closes the control connection.
- * @param control_sockfd The control connection socket.
+ * Lists a directory over a data connection and collects the listing in memory.
+ * If the connection is in MODE Z (ftp_select_mode_z()), the listing is inflated.
+ * @param control The control connection.
+ * @param data_sockfd The data connection socket.
+ * @param command The listing command ("MLSD" or "LIST").
+ * @param path The directory on the server.
+ * @param listing Pointer to store the malloc'ed, NUL-terminated listing.
+ * @param listing_len Pointer to store the listing length.
+ * @param ftp_code Pointer to store the reply code of the listing command itself
+ *                 (lets the caller tell "command not supported" from other failures).
  * @return 0 on success, -1 on failure.
  */
-int ftp_quit(int control_sockfd);
+int ftp_list_directory(FtpConn* control, int data_sockfd, const char* command, const char* path,
+                       char** listing, size_t* listing_len, int* ftp_code);
+
+/**
+ * Asks the server for the size of a file (SIZE command).
+ * @param control The control connection.
+ * @param remote_path The path of the file on the server.
+ * @param size Pointer to store the file size in bytes.
+ * @return 0 on success, -1 on failure (or if SIZE is not supported).
+ */
+int ftp_get_size(FtpConn* control, const char* remote_path, long long* size);
+
+/**
+ * Asks the server for the last modification time of a file (MDTM command).
+ * @param control The control connection.
+ * @param remote_path The path of the file on the server.
+ * @param mtime Pointer to store the modification time (UTC, as time_t).
+ * @return 0 on success, -1 on failure (or if MDTM is not supported).
+ */
+int ftp_get_mdtm(FtpConn* control, const char* remote_path, time_t* mtime);
+
+/**
+ * Parses an FTP timestamp (YYYYMMDDhhmmss[.sss], UTC) as used by MDTM and the
+ * MLST "modify" fact.
+ * @param text The timestamp.
+ * @param mtime Pointer to store the time.
+ * @return 0 on success, -1 if it cannot be parsed.
+ */
+int ftp_parse_time(const char* text, time_t* mtime);
+
+/**
+ * Parses a fact list ("type=file;size=12;modify=20240101000000;"). Modifies facts.
+ * @param facts The facts, without the entry name.
+ * @param out Filled with type, size and mtime (unknown ones as FTP_ENTRY_OTHER / -1).
+ */
+void ftp_parse_facts(char* facts, FtpFacts* out);
+
+/**
+ * Parses the facts of an MLST reply (the indented line of the 250 reply). Modifies reply.
+ * @param reply The full reply text.
+ * @param out Filled with type, size and mtime.
+ * @return 0 on success, -1 if the reply has no fact line.
+ */
+int ftp_parse_mlst_reply(char* reply, FtpFacts* out);
+
+/**
+ * Returns the server's FEAT extensions. The reply is asked for once per control
+ * connection and cached with its reader; a server without FEAT has no flags set.
+ * @param control The control connection.
+ * @param features Filled with the advertised extensions.
+ * @return 0 on success, -1 on failure.
+ */
+int ftp_get_features(FtpConn* control, FtpFeatures* features);
+
+/**
+ * Picks the digest to verify a download with: `wanted` if the server can report
+ * it, otherwise the strongest one it offers (SHA-256, SHA-1, MD5, CRC32).
+ * @param features The server's extensions.
+ * @param wanted Preferred algorithm (TRANSFER_HASH_NONE for no preference).
+ * @return The algorithm, or TRANSFER_HASH_NONE if the server offers none.
+ */
+TransferHashAlg ftp_digest_choice(const FtpFeatures* features, TransferHashAlg wanted);
+
+/**
+ * Asks the server for a file's digest: HASH (after OPTS HASH if another
+ * algorithm is selected) where advertised, else XCRC/XMD5/XSHA1/XSHA256.
+ * @param control The control connection.
+ * @param remote_path The path of the file on the server.
+ * @param alg The algorithm (see ftp_digest_choice()).
+ * @param hex Buffer for the lowercase hex digest.
+ * @param hex_len Size of hex (TRANSFER_HASH_HEX_MAX is enough).
+ * @return 0 on success, -1 if the server did not produce one.
+ */
+int ftp_get_server_digest(FtpConn* control, const char* remote_path, TransferHashAlg alg,
+                          char* hex, size_t hex_len);
+
+/**
+ * Sets the restart offset for the next transfer (REST command).
+ * @param control The control connection.
+ * @param offset Byte offset the next RETR should start from.
+ * @return 0 on success, -1 on failure.
+ */
+int ftp_restart(FtpConn* control, long long offset);
+
+/**
+ * Retrieves one byte range of a file and writes it at the same offset of an open file.
+ * Sends REST (if offset > 0) and RETR, then reads at most `length` bytes.
+ * If the range ends before the end of the file, the transfer is aborted with ABOR
+ * once the range is complete; in both cases the server's 226 reply is awaited.
+ * @param control The control connection.
+ * @param data_sockfd The data connection socket.
+ * @param remote_path The path of the file on the server.
+ * @param out_fd File descriptor of the (preallocated) local file.
+ * @param offset First byte of the range.
+ * @param length Number of bytes in the range, or -1 to read until the server closes.
+ * @param to_eof Non-zero if the range runs to the end of the file.
+ * @param opts How to drain the data connection (NULL for the default read/write loop).
+ * @param stats Filled with the range's byte count and duration (may be NULL).
+ * @return 0 on success, -1 on failure.
+ */
+int ftp_retrieve_range(FtpConn* control, int data_sockfd, const char* remote_path,
+                       int out_fd, long long offset, long long length, int to_eof,
+                       const TransferOptions* opts, TransferStats* stats);
+
+/**
+ * Sends NOOP and expects a 200 reply; a cheap check that the control connection is usable.
+ * Fails without sending anything while a transfer's final reply is still owed
+ * (the transfer failed before it was read), and if no reply comes within
+ * FTP_REPLY_TIMEOUT_MS.
+ * @param control The control connection.
+ * @return 0 on success, -1 on failure.
+ */
+int ftp_noop(FtpConn* control);
+
+/**
+ * Sends QUIT and reads its reply, waiting at most FTP_REPLY_TIMEOUT_MS; the
+ * caller then closes the connection (ftp_session_close() does both). Nothing
+ * is sent while a transfer's final reply is still owed: the server may be
+ * stuck on that transfer and never get to the QUIT.
+ * @param control The control connection.
+ * @return 0 if QUIT was sent, -1 if it was skipped.
+ */
+int ftp_quit(FtpConn* control);
 
 #endif // FTP_UTILS_H
\ No newline at end of file
@@ -0,0 +1,636 @@
+// Minimal FTP server stand-in for reproducible benchmarks (make bench).
+//
+// Every path is a generated file whose size is encoded in its name: the basename
+// starts with a byte count and an optional K/M/G suffix, e.g. "4K.bin",
+// "4K-17.bin" or "/big/256M.bin". The content is a fixed byte pattern, so a
+// REST offset always yields the same bytes as a full download.
+//
+// Usage: mock_ftpd [-a ADDR] [-p PORT] [-l MS] [-b RATE] [-n LINES] [-t PEM] [-d] [-v]
+//   -l MS     delay every control reply and the first data segment by MS (a simulated RTT)
+//   -b RATE   cap each data connection at RATE bytes/s (K/M/G suffixes, 0 = unlimited)
+//   -n LINES  number of lines in the multi-line 220 banner
+//   -t PEM    offer explicit FTPS (AUTH TLS, PBSZ, PROT) with the certificate and key in PEM
+//   -d        answer XCRC with a wrong digest (exercises the client's --verify failure path)
+//
+// MODE Z is supported: after "MODE Z" every RETR is sent as one zlib stream.
+//
+// With -t, a PROT P data connection must resume the control connection's TLS
+// session, as vsftpd's require_ssl_reuse and most hardened servers demand;
+// otherwise RETR fails with 522.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <strings.h>    // For strcasecmp
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h> // For TCP_NODELAY
+#include <arpa/inet.h>
+#include <zlib.h>        // For crc32 (XCRC) and deflate (MODE Z)
+#include <openssl/ssl.h> // For AUTH TLS
+#include <openssl/err.h>
+
+#define MOCK_DEFAULT_PORT 2121
+#define MOCK_LINE_LEN 1024
+#define MOCK_CHUNK_SIZE (64 * 1024)
+#define MOCK_PATTERN_PERIOD 251        // Prime, so the pattern does not line up with block sizes
+#define MOCK_ACCEPT_TIMEOUT_MS 10000
+#define MOCK_MDTM "20240101000000"     // Every generated file has the same modification time
+
+static int reply_delay_ms;
+static long long rate_limit;           // Bytes/s per data connection, 0 = unlimited
+static int banner_lines = 3;
+static int verbose;
+static int corrupt_digests;
+static unsigned char pattern[MOCK_CHUNK_SIZE + MOCK_PATTERN_PERIOD];
+static SSL_CTX* tls_ctx;               // Set by -t; NULL means AUTH TLS is refused
+
+typedef struct {
+    int fd;
+    char inbuf[MOCK_LINE_LEN];
+    size_t inlen;
+    int passive_fd;                    // Listening socket after PASV/EPSV, -1 if none
+    long long rest;                    // Offset set by REST for the next RETR
+    double received_at;                // When the bytes of the current command arrived
+    int mode_z;                        // MODE Z: deflate the data connection
+    SSL* tls;                          // Control connection TLS after AUTH TLS, NULL if plain
+    int prot_private;                  // PROT P: data connections use TLS too
+} MockClient;
+
+static void sleep_ms(long ms) {
+    struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+    }
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int send_all(int fd, SSL* tls, const char* buf, size_t len) {
+    if (tls) return len == 0 || SSL_write(tls, buf, (int) len) > 0 ? 0 : -1;
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Sends one reply line. Only the first line of a reply waits for the simulated
+// RTT, counted from when its command arrived, so commands pipelined in one
+// segment are answered after one RTT rather than one each; continuation lines
+// of a multi-line reply follow immediately.
+static int send_reply_line(MockClient* c, int delay, const char* fmt, va_list ap) {
+    char line[MOCK_LINE_LEN];
+    int len = vsnprintf(line, sizeof(line) - 2, fmt, ap);
+
+    if (len < 0) return -1;
+    if (len > (int) sizeof(line) - 3) len = sizeof(line) - 3;
+    if (verbose) printf("[%d] S: %s\n", c->fd, line);
+    memcpy(line + len, "\r\n", 2);
+    if (delay && reply_delay_ms > 0) {
+        long wait_ms = (long) ((c->received_at + reply_delay_ms / 1000.0 - now_seconds()) * 1000);
+        if (wait_ms > 0) sleep_ms(wait_ms);
+    }
+    return send_all(c->fd, c->tls, line, len + 2);
+}
+
+static int reply(MockClient* c, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+static int reply_more(MockClient* c, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static int reply(MockClient* c, const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int status = send_reply_line(c, 1, fmt, ap);
+    va_end(ap);
+    return status;
+}
+
+static int reply_more(MockClient* c, const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int status = send_reply_line(c, 0, fmt, ap);
+    va_end(ap);
+    return status;
+}
+
+// Reads one command line into `line` (CRLF stripped). Returns 0, or -1 on EOF/error.
+static int read_command(MockClient* c, char* line, size_t line_size) {
+    for (;;) {
+        char* eol = memchr(c->inbuf, '\n', c->inlen);
+        if (eol) {
+            size_t len = eol - c->inbuf;
+            size_t copy = len < line_size - 1 ? len : line_size - 1;
+            memcpy(line, c->inbuf, copy);
+            line[copy] = '\0';
+            if (copy > 0 && line[copy - 1] == '\r') line[copy - 1] = '\0';
+            c->inlen -= len + 1;
+            memmove(c->inbuf, eol + 1, c->inlen);
+            return 0;
+        }
+        if (c->inlen == sizeof(c->inbuf)) {
+            c->inlen = 0; // Over-long line: drop it
+        }
+        ssize_t n = c->tls ? SSL_read(c->tls, c->inbuf + c->inlen, (int) (sizeof(c->inbuf) - c->inlen))
+                           : recv(c->fd, c->inbuf + c->inlen, sizeof(c->inbuf) - c->inlen, 0);
+        if (n < 0 && errno == EINTR && !c->tls) continue;
+        if (n <= 0) return -1;
+        c->inlen += n;
+        c->received_at = now_seconds();
+    }
+}
+
+// Called when the control connection turns readable during a transfer: reads
+// what arrived and answers any NOOP (a client keepalive) right away. Returns 0
+// to go on, or -1 to abort on EOF or any other command (ABOR), which is left
+// in the buffer for the command loop.
+static int answer_noops(MockClient* c) {
+    ssize_t n = c->tls ? SSL_read(c->tls, c->inbuf + c->inlen, (int) (sizeof(c->inbuf) - c->inlen))
+                       : recv(c->fd, c->inbuf + c->inlen, sizeof(c->inbuf) - c->inlen, 0);
+    if (n < 0 && errno == EINTR && !c->tls) return 0;
+    if (n <= 0) return -1;
+    c->inlen += n;
+    c->received_at = now_seconds();
+    char* eol;
+    while ((eol = memchr(c->inbuf, '\n', c->inlen)) != NULL) {
+        if (strncasecmp(c->inbuf, "NOOP", 4) != 0 || (eol - c->inbuf > 5)) return -1;
+        if (verbose) printf("[%d] C: NOOP\n", c->fd);
+        c->inlen -= eol + 1 - c->inbuf;
+        memmove(c->inbuf, eol + 1, c->inlen);
+        if (reply(c, "200 NOOP ok.") < 0) return -1;
+    }
+    if (c->inlen == sizeof(c->inbuf)) return -1;
+    return 0;
+}
+
+// Size encoded in the basename: "<digits>[K|M|G]...". Returns -1 if there is none.
+static long long generated_size(const char* path) {
+    const char* base = strrchr(path, '/');
+    char* end;
+    base = base ? base + 1 : path;
+    if (*base < '0' || *base > '9') return -1;
+    long long size = strtoll(base, &end, 10);
+    switch (*end) {
+    case 'K': case 'k': size <<= 10; break;
+    case 'M': case 'm': size <<= 20; break;
+    case 'G': case 'g': size <<= 30; break;
+    default: break;
+    }
+    return size;
+}
+
+static long long parse_rate(const char* arg) {
+    char* end;
+    long long rate = strtoll(arg, &end, 10);
+    switch (*end) {
+    case 'K': case 'k': return rate << 10;
+    case 'M': case 'm': return rate << 20;
+    case 'G': case 'g': return rate << 30;
+    default: return rate;
+    }
+}
+
+static void close_passive(MockClient* c) {
+    if (c->passive_fd >= 0) {
+        close(c->passive_fd);
+        c->passive_fd = -1;
+    }
+}
+
+// Opens a listening socket on the control connection's local address.
+static int open_passive(MockClient* c, int* port) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+
+    close_passive(c);
+    if (getsockname(c->fd, (struct sockaddr *) &addr, &len) < 0) return -1;
+    if (addr.ss_family == AF_INET6) ((struct sockaddr_in6 *) &addr)->sin6_port = 0;
+    else ((struct sockaddr_in *) &addr)->sin_port = 0;
+
+    int fd = socket(addr.ss_family, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (bind(fd, (struct sockaddr *) &addr, len) < 0 || listen(fd, 1) < 0 ||
+        getsockname(fd, (struct sockaddr *) &addr, &len) < 0) {
+        close(fd);
+        return -1;
+    }
+    *port = ntohs(addr.ss_family == AF_INET6 ? ((struct sockaddr_in6 *) &addr)->sin6_port
+                                             : ((struct sockaddr_in *) &addr)->sin_port);
+    c->passive_fd = fd;
+    return 0;
+}
+
+static int accept_data(MockClient* c) {
+    struct pollfd pfd = {c->passive_fd, POLLIN, 0};
+    int fd = -1;
+    if (poll(&pfd, 1, MOCK_ACCEPT_TIMEOUT_MS) > 0) {
+        fd = accept(c->passive_fd, NULL, NULL);
+    }
+    close_passive(c);
+    return fd;
+}
+
+// Runs the server side of a TLS handshake on `fd`. Returns the connection, or NULL.
+static SSL* accept_tls(int fd) {
+    struct timeval timeout = {MOCK_ACCEPT_TIMEOUT_MS / 1000, 0};
+    struct timeval none = {0, 0};
+    SSL* tls = SSL_new(tls_ctx);
+
+    // A client that never starts the handshake must not hold the thread forever
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (!tls || SSL_set_fd(tls, fd) != 1 || SSL_accept(tls) != 1) {
+        if (verbose) ERR_print_errors_fp(stdout);
+        ERR_clear_error();
+        SSL_free(tls);
+        return NULL;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &none, sizeof(none));
+    return tls;
+}
+
+static void close_tls(SSL* tls) {
+    if (!tls) return;
+    SSL_shutdown(tls);
+    SSL_free(tls);
+}
+
+// Sends bytes [offset, size) of the pattern, paced to rate_limit (and deflated
+// into one zlib stream with `compress`, encrypted with `data_tls` if set). Like
+// a real server it watches the control connection meanwhile: NOOP is answered,
+// any other command (ABOR) stops the transfer. Returns 0, or -1 if the transfer
+// was aborted or the client closed the data connection early.
+static int send_generated(MockClient* c, int data_fd, SSL* data_tls, long long offset, long long size, int compress) {
+    size_t chunk = MOCK_CHUNK_SIZE;
+    double start = now_seconds();
+    long long sent = 0;
+    const unsigned char* pending = NULL;
+    size_t pending_len = 0;
+    unsigned char* zbuf = NULL;
+    int finished = !compress; // The zlib stream has been flushed completely
+    int status = 0;
+    z_stream zs;
+
+    if (compress) {
+        memset(&zs, 0, sizeof(zs));
+        zbuf = malloc(MOCK_CHUNK_SIZE);
+        if (!zbuf || deflateInit(&zs, Z_DEFAULT_COMPRESSION) != Z_OK) {
+            free(zbuf);
+            return -1;
+        }
+    }
+    if (rate_limit > 0 && rate_limit / 20 < (long long) chunk) {
+        chunk = rate_limit / 20 > 0 ? rate_limit / 20 : 1; // ~50 ms worth per send
+    }
+    if (reply_delay_ms > 0) sleep_ms(reply_delay_ms);
+    while (offset < size || pending_len > 0 || !finished) {
+        if (pending_len == 0) {
+            size_t len = size - offset < (long long) chunk ? (size_t) (size - offset) : chunk;
+            const unsigned char* src = pattern + offset % MOCK_PATTERN_PERIOD;
+            if (!compress) {
+                pending = src;
+                pending_len = len;
+                offset += len;
+            } else {
+                zs.next_in = (Bytef*) src;
+                zs.avail_in = (uInt) len;
+                zs.next_out = zbuf;
+                zs.avail_out = MOCK_CHUNK_SIZE;
+                if (deflate(&zs, offset + (long long) len >= size ? Z_FINISH : Z_NO_FLUSH) == Z_STREAM_END) {
+                    finished = 1;
+                }
+                offset += len - zs.avail_in;
+                pending = zbuf;
+                pending_len = MOCK_CHUNK_SIZE - zs.avail_out;
+                if (pending_len == 0) continue;
+            }
+        }
+
+        struct pollfd pfds[2] = {{data_fd, POLLOUT, 0}, {c->fd, POLLIN, 0}};
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            status = -1;
+            break;
+        }
+        if ((pfds[1].revents && answer_noops(c) < 0) || (pfds[0].revents & (POLLERR | POLLHUP))) {
+            status = -1;
+            break;
+        }
+        if (!(pfds[0].revents & POLLOUT)) continue;
+        // SSL_write blocks until its record is out, so TLS sends one chunk at a time
+        ssize_t n = data_tls ? SSL_write(data_tls, pending, (int) pending_len)
+                             : send(data_fd, (const char*) pending, pending_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n <= 0 && data_tls) {
+            status = -1;
+            break;
+        }
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) continue;
+            status = -1;
+            break;
+        }
+        pending += n;
+        pending_len -= n;
+        sent += n;
+        if (rate_limit > 0) {
+            double ahead = (double) sent / rate_limit - (now_seconds() - start);
+            if (ahead > 0) sleep_ms((long) (ahead * 1000));
+        }
+    }
+    if (compress) {
+        deflateEnd(&zs);
+        free(zbuf);
+    }
+    return status;
+}
+
+static void handle_retr(MockClient* c, const char* path) {
+    long long size = generated_size(path);
+    long long offset = c->rest;
+
+    c->rest = 0;
+    if (size < 0) {
+        reply(c, "550 %s: No such file.", path);
+        return;
+    }
+    if (c->passive_fd < 0) {
+        reply(c, "425 Use PASV or EPSV first.");
+        return;
+    }
+    if (offset > size) offset = size;
+    reply(c, "150 Opening BINARY mode data connection for %s (%lld bytes).", path, size - offset);
+    int data_fd = accept_data(c);
+    if (data_fd < 0) {
+        reply(c, "425 Can't open data connection.");
+        return;
+    }
+    SSL* data_tls = NULL;
+    if (c->prot_private) {
+        data_tls = accept_tls(data_fd);
+        if (!data_tls || !SSL_session_reused(data_tls)) {
+            close_tls(data_tls);
+            close(data_fd);
+            reply(c, "522 SSL connection failed: session reuse required.");
+            return;
+        }
+    }
+    int status = send_generated(c, data_fd, data_tls, offset, size, c->mode_z);
+    close_tls(data_tls);
+    close(data_fd);
+    if (status < 0) {
+        reply(c, "426 Connection closed; transfer aborted.");
+        return; // The 226 answers the client's ABOR
+    }
+    reply(c, "226 Transfer complete.");
+}
+
+// CRC-32 of a whole generated file, as XCRC reports it
+static unsigned long generated_crc32(long long size) {
+    unsigned long crc = crc32(0L, Z_NULL, 0);
+    for (long long off = 0; off < size; off += MOCK_CHUNK_SIZE) {
+        long long len = size - off < MOCK_CHUNK_SIZE ? size - off : MOCK_CHUNK_SIZE;
+        crc = crc32(crc, pattern + off % MOCK_PATTERN_PERIOD, (uInt) len);
+    }
+    return corrupt_digests ? crc ^ 1 : crc;
+}
+
+static void* client_main(void* arg) {
+    MockClient* c = (MockClient*) arg;
+    char line[MOCK_LINE_LEN];
+    int one = 1;
+
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    c->received_at = now_seconds(); // The banner answers the connect
+    for (int i = 1; i < banner_lines; i++) {
+        int status = i == 1 ? reply(c, "220-mock_ftpd banner line %d of %d", i, banner_lines)
+                            : reply_more(c, "220-mock_ftpd banner line %d of %d", i, banner_lines);
+        if (status < 0) goto out;
+    }
+    if ((banner_lines > 1 ? reply_more(c, "220 mock_ftpd ready.") : reply(c, "220 mock_ftpd ready.")) < 0) goto out;
+
+    while (read_command(c, line, sizeof(line)) == 0) {
+        char* arg = strchr(line, ' ');
+        int port;
+        if (arg) *arg++ = '\0';
+        else arg = "";
+        if (verbose) printf("[%d] C: %s %s\n", c->fd, line, strcasecmp(line, "PASS") == 0 ? "********" : arg);
+
+        if (strcasecmp(line, "USER") == 0) reply(c, "331 Password required.");
+        else if (strcasecmp(line, "PASS") == 0) reply(c, "230 Logged in.");
+        else if (strcasecmp(line, "TYPE") == 0) reply(c, "200 Type set to %s.", arg);
+        else if (strcasecmp(line, "SYST") == 0) reply(c, "215 UNIX Type: L8");
+        else if (strcasecmp(line, "NOOP") == 0) reply(c, "200 NOOP ok.");
+        else if (strcasecmp(line, "PWD") == 0) reply(c, "257 \"/\" is the current directory.");
+        else if (strcasecmp(line, "CWD") == 0) reply(c, "250 Directory changed.");
+        else if (strcasecmp(line, "FEAT") == 0) {
+            reply(c, "211-Features:");
+            reply_more(c, " SIZE");
+            reply_more(c, " MDTM");
+            reply_more(c, " REST STREAM");
+            reply_more(c, " EPSV");
+            reply_more(c, " XCRC");
+            reply_more(c, " MLST type*;size*;modify*;");
+            reply_more(c, " MODE Z");
+            if (tls_ctx) {
+                reply_more(c, " AUTH TLS");
+                reply_more(c, " PBSZ");
+                reply_more(c, " PROT");
+            }
+            reply_more(c, "211 End");
+        } else if (strcasecmp(line, "SIZE") == 0) {
+            long long size = generated_size(arg);
+            if (size < 0) reply(c, "550 %s: No such file.", arg);
+            else reply(c, "213 %lld", size);
+        } else if (strcasecmp(line, "MDTM") == 0) {
+            if (generated_size(arg) < 0) reply(c, "550 %s: No such file.", arg);
+            else reply(c, "213 %s", MOCK_MDTM);
+        } else if (strcasecmp(line, "MLST") == 0) {
+            long long size = generated_size(arg);
+            if (size < 0) {
+                reply(c, "550 %s: No such file.", arg);
+            } else {
+                reply(c, "250-Listing %s", arg);
+                reply_more(c, " type=file;size=%lld;modify=%s; %s", size, MOCK_MDTM, arg);
+                reply_more(c, "250 End");
+            }
+        } else if (strcasecmp(line, "XCRC") == 0) {
+            long long size = generated_size(arg);
+            if (size < 0) reply(c, "550 %s: No such file.", arg);
+            else reply(c, "250 %08lX", generated_crc32(size));
+        } else if (strcasecmp(line, "MODE") == 0) {
+            if (strcasecmp(arg, "S") == 0 || strcasecmp(arg, "Z") == 0) {
+                c->mode_z = strcasecmp(arg, "Z") == 0;
+                reply(c, "200 Mode set to %s.", c->mode_z ? "Z" : "S");
+            } else {
+                reply(c, "504 Mode %s not supported.", arg);
+            }
+        } else if (strcasecmp(line, "AUTH") == 0) {
+            if (!tls_ctx || strcasecmp(arg, "TLS") != 0) {
+                reply(c, "504 AUTH %s not supported.", arg);
+            } else if (c->tls) {
+                reply(c, "503 Already using TLS.");
+            } else {
+                reply(c, "234 Proceed with negotiation.");
+                c->inlen = 0; // Plaintext sent after AUTH is not trusted
+                if (!(c->tls = accept_tls(c->fd))) break;
+            }
+        } else if (strcasecmp(line, "PBSZ") == 0) {
+            if (!c->tls) reply(c, "503 PBSZ needs AUTH TLS first.");
+            else reply(c, "200 PBSZ=0");
+        } else if (strcasecmp(line, "PROT") == 0) {
+            if (!c->tls) {
+                reply(c, "503 PROT needs AUTH TLS first.");
+            } else if (strcasecmp(arg, "P") == 0 || strcasecmp(arg, "C") == 0) {
+                c->prot_private = strcasecmp(arg, "P") == 0;
+                reply(c, "200 Protection level set to %s.", c->prot_private ? "Private" : "Clear");
+            } else {
+                reply(c, "536 PROT %s not supported.", arg);
+            }
+        } else if (strcasecmp(line, "REST") == 0) {
+            c->rest = atoll(arg);
+            reply(c, "350 Restarting at %lld.", c->rest);
+        } else if (strcasecmp(line, "PASV") == 0) {
+            struct sockaddr_in addr;
+            socklen_t len = sizeof(addr);
+            if (getsockname(c->fd, (struct sockaddr *) &addr, &len) < 0 || addr.sin_family != AF_INET ||
+                open_passive(c, &port) < 0) {
+                reply(c, "425 Can't open passive connection.");
+                continue;
+            }
+            unsigned char* ip = (unsigned char*) &addr.sin_addr;
+            reply(c, "227 Entering Passive Mode (%d,%d,%d,%d,%d,%d).", ip[0], ip[1], ip[2], ip[3], port >> 8, port & 0xff);
+        } else if (strcasecmp(line, "EPSV") == 0) {
+            if (open_passive(c, &port) < 0) reply(c, "425 Can't open passive connection.");
+            else reply(c, "229 Entering Extended Passive Mode (|||%d|)", port);
+        } else if (strcasecmp(line, "RETR") == 0) {
+            handle_retr(c, arg);
+        } else if (strcasecmp(line, "ABOR") == 0) {
+            close_passive(c);
+            reply(c, "226 ABOR command successful.");
+        } else if (strcasecmp(line, "QUIT") == 0) {
+            reply(c, "221 Goodbye.");
+            break;
+        } else {
+            reply(c, "502 %s not implemented.", line);
+        }
+    }
+out:
+    close_passive(c);
+    close_tls(c->tls);
+    close(c->fd);
+    free(c);
+    return NULL;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [-a ADDR] [-p PORT] [-l MS] [-b RATE] [-n LINES] [-t PEM] [-d] [-v]\n", prog);
+}
+
+int main(int argc, char** argv) {
+    const char* bind_addr = "127.0.0.1";
+    int port = MOCK_DEFAULT_PORT;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    const char* cert_file = NULL;
+    int listen_fd, opt, one = 1;
+
+    while ((opt = getopt(argc, argv, "a:p:l:b:n:t:dvh")) != -1) {
+        switch (opt) {
+        case 'a': bind_addr = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'l': reply_delay_ms = atoi(optarg); break;
+        case 'b': rate_limit = parse_rate(optarg); break;
+        case 'n': banner_lines = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+        case 't': cert_file = optarg; break;
+        case 'd': corrupt_digests = 1; break;
+        case 'v': verbose = 1; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    for (size_t i = 0; i < sizeof(pattern); i++) {
+        pattern[i] = (unsigned char) (i % MOCK_PATTERN_PERIOD);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    if (cert_file) {
+        static const unsigned char session_context[] = "mock_ftpd";
+        tls_ctx = SSL_CTX_new(TLS_server_method());
+        if (!tls_ctx || SSL_CTX_use_certificate_chain_file(tls_ctx, cert_file) != 1 ||
+            SSL_CTX_use_PrivateKey_file(tls_ctx, cert_file, SSL_FILETYPE_PEM) != 1) {
+            ERR_print_errors_fp(stderr);
+            return 1;
+        }
+        // Data connections resume the control connection's session from this cache
+        SSL_CTX_set_session_id_context(tls_ctx, session_context, sizeof(session_context) - 1);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    if (strchr(bind_addr, ':')) {
+        struct sockaddr_in6* a6 = (struct sockaddr_in6*) &addr;
+        a6->sin6_family = AF_INET6;
+        a6->sin6_port = htons(port);
+        addr_len = sizeof(*a6);
+        if (inet_pton(AF_INET6, bind_addr, &a6->sin6_addr) <= 0) {
+            fprintf(stderr, "Invalid address '%s'.\n", bind_addr);
+            return 1;
+        }
+    } else {
+        struct sockaddr_in* a4 = (struct sockaddr_in*) &addr;
+        a4->sin_family = AF_INET;
+        a4->sin_port = htons(port);
+        addr_len = sizeof(*a4);
+        if (inet_pton(AF_INET, bind_addr, &a4->sin_addr) <= 0) {
+            fprintf(stderr, "Invalid address '%s'.\n", bind_addr);
+            return 1;
+        }
+    }
+    if ((listen_fd = socket(addr.ss_family, SOCK_STREAM, 0)) < 0) {
+        perror("socket");
+        return 1;
+    }
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(listen_fd, (struct sockaddr *) &addr, addr_len) < 0 || listen(listen_fd, 128) < 0) {
+        perror("bind/listen");
+        return 1;
+    }
+    printf("mock_ftpd listening on %s:%d (latency %d ms, rate %lld B/s, %d banner lines%s).\n",
+           bind_addr, port, reply_delay_ms, rate_limit, banner_lines, tls_ctx ? ", FTPS" : "");
+    fflush(stdout);
+
+    for (;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("accept");
+            return 1;
+        }
+        MockClient* c = calloc(1, sizeof(MockClient));
+        pthread_t thread;
+        if (!c) {
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->passive_fd = -1;
+        if (pthread_create(&thread, NULL, client_main, c) != 0) {
+            close(fd);
+            free(c);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
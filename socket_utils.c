@@ -1,55 +1,284 @@
 #include "socket_utils.h"
+#include "ftp_log.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
-#include <netdb.h>      // For gethostbyname, herror
+#include <netdb.h>      // For getaddrinfo, gai_strerror
+#include <fcntl.h>      // For fcntl, O_NONBLOCK
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>     // For close
 
 int resolve_hostname(const char* hostname, char* ip_address_str, size_t ip_str_len) {
-    struct hostent *h;
-    if ((h = gethostbyname(hostname)) == NULL) {
-        herror("gethostbyname");
+    struct addrinfo hints, *res;
+    int err;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;     // IPv4 or IPv6
+    hints.ai_socktype = SOCK_STREAM;
+    if ((err = getaddrinfo(hostname, NULL, &hints, &res)) != 0) {
+        ftp_log_error("getaddrinfo: %s\n", gai_strerror(err));
         return -1;
     }
-
-    if (h->h_addrtype == AF_INET) { // Check if it's an IPv4 address
-        if (inet_ntop(AF_INET, h->h_addr_list[0], ip_address_str, ip_str_len) == NULL) {
-            perror("inet_ntop");
-            return -1;
-        }
-        return 0;
-    } else {
-        fprintf(stderr, "Error: Hostname resolved to non-IPv4 address type: %d\n", h->h_addrtype);
+    err = getnameinfo(res->ai_addr, res->ai_addrlen, ip_address_str, ip_str_len, NULL, 0, NI_NUMERICHOST);
+    freeaddrinfo(res);
+    if (err != 0) {
+        ftp_log_error("getnameinfo: %s\n", gai_strerror(err));
         return -1;
     }
+    return 0;
 }
 
 int create_tcp_socket() {
     int sockfd;
     if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("socket creation");
+        ftp_log_perror("socket creation");
         return -1;
     }
     return sockfd;
 }
 
+int create_tcp_socket_for(const char* ip_address) {
+    int sockfd;
+    int family = strchr(ip_address, ':') ? AF_INET6 : AF_INET;
+    if ((sockfd = socket(family, SOCK_STREAM, 0)) < 0) {
+        ftp_log_perror("socket creation");
+        return -1;
+    }
+    return sockfd;
+}
+
+// Fills a sockaddr for a numeric IPv4 or IPv6 address. Returns 0 on success, -1 on failure.
+static int fill_server_addr(const char* ip_address, int port, struct sockaddr_storage* addr, socklen_t* addr_len) {
+    memset(addr, 0, sizeof(*addr));
+    if (strchr(ip_address, ':')) {
+        struct sockaddr_in6* a6 = (struct sockaddr_in6*) addr;
+        a6->sin6_family = AF_INET6;
+        a6->sin6_port = htons(port);
+        if (inet_pton(AF_INET6, ip_address, &a6->sin6_addr) <= 0) {
+            ftp_log_perror("inet_pton for server IP");
+            return -1;
+        }
+        *addr_len = sizeof(*a6);
+    } else {
+        struct sockaddr_in* a4 = (struct sockaddr_in*) addr;
+        a4->sin_family = AF_INET;
+        a4->sin_port = htons(port);
+        if (inet_pton(AF_INET, ip_address, &a4->sin_addr) <= 0) {
+            ftp_log_perror("inet_pton for server IP");
+            return -1;
+        }
+        *addr_len = sizeof(*a4);
+    }
+    return 0;
+}
+
 int connect_to_server(int sockfd, const char* ip_address, int port) {
-    struct sockaddr_in server_addr;
+    struct sockaddr_storage server_addr;
+    socklen_t addr_len;
+
+    if (fill_server_addr(ip_address, port, &server_addr, &addr_len) < 0) {
+        return -1;
+    }
+
+    if (connect(sockfd, (struct sockaddr *) &server_addr, addr_len) < 0) {
+        ftp_log_perror("connect to server");
+        return -1;
+    }
+    return 0;
+}
+
+int set_nonblocking(int sockfd) {
+    int flags = fcntl(sockfd, F_GETFL, 0);
+    if (flags < 0 || fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        ftp_log_perror("fcntl O_NONBLOCK");
+        return -1;
+    }
+    return 0;
+}
+
+static int set_blocking(int sockfd) {
+    int flags = fcntl(sockfd, F_GETFL, 0);
+    if (flags < 0 || fcntl(sockfd, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+        ftp_log_perror("fcntl ~O_NONBLOCK");
+        return -1;
+    }
+    return 0;
+}
+
+int connect_to_server_nonblocking(int sockfd, const char* ip_address, int port) {
+    struct sockaddr_storage server_addr;
+    socklen_t addr_len;
+
+    if (fill_server_addr(ip_address, port, &server_addr, &addr_len) < 0) {
+        return -1;
+    }
 
-    bzero((char *) &server_addr, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
+    if (connect(sockfd, (struct sockaddr *) &server_addr, addr_len) < 0) {
+        if (errno == EINPROGRESS) {
+            return 1;
+        }
+        ftp_log_perror("connect to server");
+        return -1;
+    }
+    return 0;
+}
 
-    if (inet_pton(AF_INET, ip_address, &server_addr.sin_addr) <= 0) {
-        perror("inet_pton for server IP");
+int connect_result(int sockfd) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+        ftp_log_perror("getsockopt SO_ERROR");
+        return -1;
+    }
+    if (err != 0) {
+        errno = err;
+        ftp_log_perror("connect to server");
         return -1;
     }
+    return 0;
+}
 
-    if (connect(sockfd, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0) {
-        perror("connect to server");
+int get_peer_address(int sockfd, char* ip_address_str, size_t ip_str_len) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    int err;
+
+    if (getpeername(sockfd, (struct sockaddr *) &addr, &addr_len) < 0) {
+        ftp_log_perror("getpeername");
+        return -1;
+    }
+    err = getnameinfo((struct sockaddr *) &addr, addr_len, ip_address_str, ip_str_len, NULL, 0, NI_NUMERICHOST);
+    if (err != 0) {
+        ftp_log_error("getnameinfo: %s\n", gai_strerror(err));
         return -1;
     }
     return 0;
-}
\ No newline at end of file
+}
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int connect_to_host(const char* hostname, int port, char* ip_address_str, size_t ip_str_len,
+                    double* dns_seconds) {
+    struct addrinfo hints, *res, *ai;
+    struct addrinfo* v6[HE_MAX_ADDRESSES];
+    struct addrinfo* v4[HE_MAX_ADDRESSES];
+    struct addrinfo* order[2 * HE_MAX_ADDRESSES];
+    struct pollfd attempts[2 * HE_MAX_ADDRESSES];
+    int attempt_addr[2 * HE_MAX_ADDRESSES]; // Index into order[] per attempt
+    int n6 = 0, n4 = 0, n = 0, in_flight = 0, next = 0, winner = -1;
+    char port_str[8];
+    int err;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port_str, sizeof(port_str), "%d", port);
+    double resolve_start = now_seconds();
+    err = getaddrinfo(hostname, port_str, &hints, &res);
+    if (dns_seconds) *dns_seconds = now_seconds() - resolve_start;
+    if (err != 0) {
+        ftp_log_error("getaddrinfo: %s\n", gai_strerror(err));
+        return -1;
+    }
+
+    // RFC 8305 ordering: alternate families, starting with IPv6
+    for (ai = res; ai; ai = ai->ai_next) {
+        if (ai->ai_family == AF_INET6 && n6 < HE_MAX_ADDRESSES) v6[n6++] = ai;
+        else if (ai->ai_family == AF_INET && n4 < HE_MAX_ADDRESSES) v4[n4++] = ai;
+    }
+    for (int i = 0; i < n6 || i < n4; i++) {
+        if (i < n6) order[n++] = v6[i];
+        if (i < n4) order[n++] = v4[i];
+    }
+
+    long long deadline = now_ms() + HE_CONNECT_TIMEOUT_MS;
+    long long next_start = 0;
+    while (winner < 0) {
+        long long now = now_ms();
+        if (now >= deadline) {
+            ftp_log_error("connect to %s:%d: timed out\n", hostname, port);
+            break;
+        }
+        // Start the next attempt when the previous one has had its head start
+        if (next < n && (in_flight == 0 || now >= next_start)) {
+            int fd = socket(order[next]->ai_family, SOCK_STREAM, 0);
+            if (fd >= 0 && set_nonblocking(fd) == 0) {
+                if (connect(fd, order[next]->ai_addr, order[next]->ai_addrlen) == 0 || errno == EINPROGRESS) {
+                    attempts[in_flight].fd = fd;
+                    attempts[in_flight].events = POLLOUT;
+                    attempt_addr[in_flight] = next;
+                    in_flight++;
+                    next_start = now + HE_ATTEMPT_DELAY_MS;
+                } else {
+                    close(fd);
+                }
+            } else if (fd >= 0) {
+                close(fd);
+            }
+            next++;
+            continue;
+        }
+        if (in_flight == 0) {
+            ftp_log_error("connect to %s:%d: no address reachable\n", hostname, port);
+            break;
+        }
+
+        long long wait = deadline - now;
+        if (next < n && next_start - now < wait) wait = next_start - now;
+        if (wait < 0) wait = 0;
+        if (poll(attempts, in_flight, (int) wait) < 0) {
+            if (errno == EINTR) continue;
+            ftp_log_perror("poll connect attempts");
+            break;
+        }
+        for (int i = 0; i < in_flight; i++) {
+            if (!attempts[i].revents) continue;
+            int so_error = 0;
+            socklen_t len = sizeof(so_error);
+            getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &so_error, &len);
+            if (so_error == 0) {
+                winner = i;
+                break;
+            }
+            // Failed attempt: drop it and let the next address start right away
+            close(attempts[i].fd);
+            attempts[i] = attempts[in_flight - 1];
+            attempt_addr[i] = attempt_addr[in_flight - 1];
+            in_flight--;
+            i--;
+            next_start = 0;
+        }
+    }
+
+    int sockfd = -1;
+    for (int i = 0; i < in_flight; i++) {
+        if (i == winner) {
+            sockfd = attempts[i].fd;
+            struct addrinfo* won = order[attempt_addr[i]];
+            getnameinfo(won->ai_addr, won->ai_addrlen, ip_address_str, ip_str_len, NULL, 0, NI_NUMERICHOST);
+        } else {
+            close(attempts[i].fd);
+        }
+    }
+    freeaddrinfo(res);
+    if (sockfd >= 0 && set_blocking(sockfd) < 0) {
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
@@ -7,9 +7,16 @@
 #ifndef INET_ADDRSTRLEN
 #define INET_ADDRSTRLEN 16 // For IPv4 "ddd.ddd.ddd.ddd\0"
 #endif
+#ifndef INET6_ADDRSTRLEN
+#define INET6_ADDRSTRLEN 46 // For the longest IPv6 text form
+#endif
+
+#define HE_MAX_ADDRESSES 16        // Per address family
+#define HE_ATTEMPT_DELAY_MS 250    // RFC 8305 "Connection Attempt Delay"
+#define HE_CONNECT_TIMEOUT_MS 30000
 
 /**
- * Resolves a hostname to an IPv4 address string.
+ * Resolves a hostname to an IPv4 or IPv6 address string (the first getaddrinfo result).
  * @param hostname The hostname to resolve.
  * @param ip_address_str Buffer to store the resulting IP address string.
  * @param ip_str_len Size of the ip_address_str buffer.
@@ -23,13 +30,69 @@ int resolve_hostname(const char* hostname, char* ip_address_str, size_t ip_str_l
  */
 int create_tcp_socket();
 
+/**
+ * Creates a TCP socket of the family matching an address string (IPv6 if it contains ':').
+ * @param ip_address Numeric IPv4 or IPv6 address.
+ * @return Socket file descriptor on success, -1 on failure.
+ */
+int create_tcp_socket_for(const char* ip_address);
+
 /**
  * Connects a TCP socket to a server.
+ * @param sockfd The socket file descriptor (of the address's family).
+ * @param ip_address The server's IPv4 or IPv6 address string.
+ * @param port The server's port number.
+ * @return 0 on success, -1 on failure.
+ */
+int connect_to_server(int sockfd, const char* ip_address, int port);
+
+/**
+ * Puts a socket in non-blocking mode.
  * @param sockfd The socket file descriptor.
+ * @return 0 on success, -1 on failure.
+ */
+int set_nonblocking(int sockfd);
+
+/**
+ * Starts connecting a non-blocking TCP socket to a server.
+ * Completion is signalled by the socket becoming writable; check it with
+ * connect_result().
+ * @param sockfd The (non-blocking) socket file descriptor.
  * @param ip_address The server's IP address string.
  * @param port The server's port number.
+ * @return 0 if connected at once, 1 if the connection is in progress, -1 on failure.
+ */
+int connect_to_server_nonblocking(int sockfd, const char* ip_address, int port);
+
+/**
+ * Reports the outcome of a non-blocking connect once the socket is writable.
+ * @param sockfd The socket file descriptor.
+ * @return 0 if connected, -1 if the connection failed.
+ */
+int connect_result(int sockfd);
+
+/**
+ * Gets the numeric address of the remote end of a connected socket.
+ * @param sockfd The connected socket.
+ * @param ip_address_str Buffer to store the address string.
+ * @param ip_str_len Size of the buffer (INET6_ADDRSTRLEN is enough).
  * @return 0 on success, -1 on failure.
  */
-int connect_to_server(int sockfd, const char* ip_address, int port);
+int get_peer_address(int sockfd, char* ip_address_str, size_t ip_str_len);
+
+/**
+ * Resolves a hostname to all its addresses and races TCP connections to them
+ * ("Happy Eyeballs", RFC 8305): addresses alternate between IPv6 and IPv4, a
+ * new attempt starts every HE_ATTEMPT_DELAY_MS (or as soon as one fails), and
+ * the first connection to complete wins while the others are closed.
+ * @param hostname The hostname or numeric address.
+ * @param port The server's port number.
+ * @param ip_address_str Buffer to store the address that won.
+ * @param ip_str_len Size of the buffer (INET6_ADDRSTRLEN is enough).
+ * @param dns_seconds If non-NULL, receives the time spent resolving the name.
+ * @return A connected (blocking) socket on success, -1 on failure.
+ */
+int connect_to_host(const char* hostname, int port, char* ip_address_str, size_t ip_str_len,
+                    double* dns_seconds);
 
 #endif // SOCKET_UTILS_H
\ No newline at end of file
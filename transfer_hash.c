@@ -0,0 +1,188 @@
+#include "transfer_hash.h"
+#include "ftp_log.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>     // For strcasecmp
+#include <pthread.h>     // For pthread_once
+#include <zlib.h>        // For crc32
+#include <openssl/evp.h> // For MD5, SHA-1, SHA-256
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>   // For _mm_crc32_*
+#endif
+
+#define CRC32C_POLY 0x82F63B78u // Castagnoli, reflected
+
+static uint32_t crc32c_table[256];
+static int crc32c_use_hw;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_setup(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        crc32c_table[i] = c;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    crc32c_use_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char* p, size_t len) {
+    while (len--) crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+// Eight bytes per instruction; only called once the CPU is known to have SSE4.2
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char* p, size_t len) {
+    uint64_t c = crc;
+    while (len > 0 && ((uintptr_t) p & 7) != 0) {
+        c = _mm_crc32_u8((uint32_t) c, *p++);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        c = _mm_crc32_u64(c, word);
+        p += 8;
+        len -= 8;
+    }
+    while (len--) c = _mm_crc32_u8((uint32_t) c, *p++);
+    return (uint32_t) c;
+}
+#endif
+
+static const EVP_MD* hash_md(TransferHashAlg alg) {
+    switch (alg) {
+    case TRANSFER_HASH_MD5: return EVP_md5();
+    case TRANSFER_HASH_SHA1: return EVP_sha1();
+    case TRANSFER_HASH_SHA256: return EVP_sha256();
+    default: return NULL;
+    }
+}
+
+int transfer_hash_init(TransferHash* hash, TransferHashAlg alg) {
+    memset(hash, 0, sizeof(*hash));
+    hash->alg = alg;
+    switch (alg) {
+    case TRANSFER_HASH_NONE:
+        return 0;
+    case TRANSFER_HASH_CRC32C:
+        pthread_once(&crc32c_once, crc32c_setup);
+        hash->crc = 0xFFFFFFFFu;
+        return 0;
+    case TRANSFER_HASH_CRC32:
+        hash->crc = (uint32_t) crc32(0L, Z_NULL, 0);
+        return 0;
+    default:
+        break;
+    }
+    EVP_MD_CTX* md = EVP_MD_CTX_new();
+    if (!md || EVP_DigestInit_ex(md, hash_md(alg), NULL) != 1) {
+        ftp_log_error("Cannot start a %s digest.\n", transfer_hash_name(alg));
+        EVP_MD_CTX_free(md);
+        hash->alg = TRANSFER_HASH_NONE;
+        return -1;
+    }
+    hash->md = md;
+    return 0;
+}
+
+void transfer_hash_update(TransferHash* hash, const void* data, size_t len) {
+    if (!hash || len == 0) return;
+    switch (hash->alg) {
+    case TRANSFER_HASH_NONE:
+        break;
+    case TRANSFER_HASH_CRC32C:
+#if defined(__x86_64__)
+        if (crc32c_use_hw) {
+            hash->crc = crc32c_hw(hash->crc, data, len);
+            break;
+        }
+#endif
+        hash->crc = crc32c_sw(hash->crc, data, len);
+        break;
+    case TRANSFER_HASH_CRC32:
+        // zlib takes uInt lengths
+        for (const unsigned char* p = data; len > 0;) {
+            uInt n = len > 0x40000000 ? 0x40000000 : (uInt) len;
+            hash->crc = (uint32_t) crc32(hash->crc, p, n);
+            p += n;
+            len -= n;
+        }
+        break;
+    default:
+        EVP_DigestUpdate(hash->md, data, len);
+        break;
+    }
+}
+
+int transfer_hash_final(TransferHash* hash, char* hex, size_t hex_len) {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_len = 0;
+
+    if (hex_len > 0) hex[0] = '\0';
+    switch (hash->alg) {
+    case TRANSFER_HASH_NONE:
+        return -1;
+    case TRANSFER_HASH_CRC32C:
+        snprintf(hex, hex_len, "%08x", hash->crc ^ 0xFFFFFFFFu);
+        return 0;
+    case TRANSFER_HASH_CRC32:
+        snprintf(hex, hex_len, "%08x", hash->crc);
+        return 0;
+    default:
+        break;
+    }
+    int ok = EVP_DigestFinal_ex(hash->md, digest, &digest_len) == 1 && hex_len > 2 * digest_len;
+    transfer_hash_free(hash);
+    if (!ok) return -1;
+    for (unsigned int i = 0; i < digest_len; i++) {
+        snprintf(hex + 2 * i, 3, "%02x", digest[i]);
+    }
+    return 0;
+}
+
+void transfer_hash_free(TransferHash* hash) {
+    if (hash->md) {
+        EVP_MD_CTX_free(hash->md);
+        hash->md = NULL;
+    }
+}
+
+static const char* const hash_names[] = {
+    [TRANSFER_HASH_NONE] = "none",
+    [TRANSFER_HASH_CRC32C] = "CRC32C",
+    [TRANSFER_HASH_CRC32] = "CRC32",
+    [TRANSFER_HASH_MD5] = "MD5",
+    [TRANSFER_HASH_SHA1] = "SHA-1",
+    [TRANSFER_HASH_SHA256] = "SHA-256",
+};
+
+const char* transfer_hash_name(TransferHashAlg alg) {
+    if ((int) alg < 0 || alg > TRANSFER_HASH_SHA256) return "none";
+    return hash_names[alg];
+}
+
+TransferHashAlg transfer_hash_parse(const char* name) {
+    char compact[16];
+    size_t len = 0;
+
+    // "SHA-256" and "sha256" are the same thing
+    for (const char* p = name; *p && len < sizeof(compact) - 1; p++) {
+        if (*p != '-') compact[len++] = *p;
+    }
+    compact[len] = '\0';
+    for (int alg = TRANSFER_HASH_CRC32C; alg <= TRANSFER_HASH_SHA256; alg++) {
+        char known[16];
+        size_t k = 0;
+        for (const char* p = hash_names[alg]; *p; p++) {
+            if (*p != '-') known[k++] = *p;
+        }
+        known[k] = '\0';
+        if (strcasecmp(compact, known) == 0) return (TransferHashAlg) alg;
+    }
+    return TRANSFER_HASH_NONE;
+}
@@ -0,0 +1,64 @@
+#ifndef TRANSFER_HASH_H
+#define TRANSFER_HASH_H
+
+#include <stddef.h> // For size_t
+#include <stdint.h> // For uint32_t
+
+#define TRANSFER_HASH_HEX_MAX 129 // Hex digest of the longest algorithm plus '\0'
+
+// Digest computed while the payload streams (TransferOptions.hash_alg)
+typedef enum {
+    TRANSFER_HASH_NONE = 0,
+    TRANSFER_HASH_CRC32C,  // Castagnoli, SSE4.2 crc32 instruction when the CPU has it
+    TRANSFER_HASH_CRC32,   // zlib CRC-32, what XCRC and HASH CRC32 report
+    TRANSFER_HASH_MD5,
+    TRANSFER_HASH_SHA1,
+    TRANSFER_HASH_SHA256,  // libcrypto, which uses the SHA extensions when the CPU has them
+} TransferHashAlg;
+
+typedef struct {
+    TransferHashAlg alg;
+    uint32_t crc;
+    void* md;              // EVP_MD_CTX for the message digests
+} TransferHash;
+
+/**
+ * Starts a digest.
+ * @param hash The state to initialise.
+ * @param alg The algorithm (TRANSFER_HASH_NONE makes updates no-ops).
+ * @return 0 on success, -1 on failure.
+ */
+int transfer_hash_init(TransferHash* hash, TransferHashAlg alg);
+
+/**
+ * Feeds bytes into a digest. Does nothing for a NULL or TRANSFER_HASH_NONE state.
+ */
+void transfer_hash_update(TransferHash* hash, const void* data, size_t len);
+
+/**
+ * Finishes a digest as lowercase hex and releases the state.
+ * @param hash The digest state.
+ * @param hex Buffer for the digest (TRANSFER_HASH_HEX_MAX bytes is always enough).
+ * @param hex_len Size of hex.
+ * @return 0 on success, -1 on failure.
+ */
+int transfer_hash_final(TransferHash* hash, char* hex, size_t hex_len);
+
+/**
+ * Releases a digest without finishing it.
+ */
+void transfer_hash_free(TransferHash* hash);
+
+/**
+ * Returns the name of an algorithm as FTP HASH spells it ("SHA-256", "CRC32", ...).
+ */
+const char* transfer_hash_name(TransferHashAlg alg);
+
+/**
+ * Parses an algorithm name, case-insensitively and with or without the dash
+ * ("sha256", "SHA-256", "crc32c").
+ * @return The algorithm, or TRANSFER_HASH_NONE if it is not known.
+ */
+TransferHashAlg transfer_hash_parse(const char* name);
+
+#endif // TRANSFER_HASH_H
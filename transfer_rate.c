@@ -0,0 +1,275 @@
+#include "transfer_rate.h"
+#include "data_transfer.h" // For monotonic_seconds
+#include "ftp_log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netdb.h>         // For getnameinfo
+
+#define RATE_HOST_KEY_LEN NI_MAXHOST
+
+typedef struct {
+    double rate;   // Bytes/s (0 = no cap)
+    double burst;  // Most tokens the bucket holds
+    double tokens;
+    double last;   // monotonic_seconds() of the last refill
+} RateBucket;
+
+// Per server address: its bucket and what it carried
+typedef struct RateHost {
+    char key[RATE_HOST_KEY_LEN];
+    RateBucket bucket;
+    long long bytes;
+    double first;  // First and last byte, for the average in the summary
+    double last;
+    struct RateHost* next;
+} RateHost;
+
+struct TransferFlow {
+    RateHost* host;
+    long long expected;   // -1 if unknown
+    long long received;
+    double vtime;         // Start-time fair queueing tag: bytes / weight so far
+    size_t want;          // Grant it is waiting for (0 = not waiting)
+    double throttled;     // Seconds spent waiting
+    struct TransferFlow* next;
+};
+
+static pthread_mutex_t rate_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rate_cond = PTHREAD_COND_INITIALIZER;
+static RateBucket global_bucket;
+static long long host_cap;
+static RateHost* hosts;
+static TransferFlow* flows;
+static double vclock;           // Virtual time of the last flow to leave, for an idle scheduler
+static long long global_bytes;
+static double global_first, global_last;
+
+static void bucket_init(RateBucket* b, long long rate) {
+    b->rate = (double) rate;
+    b->burst = b->rate * TRANSFER_RATE_BURST_SECONDS;
+    if (b->burst < TRANSFER_RATE_QUANTUM) b->burst = TRANSFER_RATE_QUANTUM;
+    b->tokens = b->burst;
+    b->last = monotonic_seconds();
+}
+
+static void bucket_refill(RateBucket* b, double now) {
+    if (b->rate <= 0) return;
+    b->tokens += (now - b->last) * b->rate;
+    if (b->tokens > b->burst) b->tokens = b->burst;
+    b->last = now;
+}
+
+// Seconds until `b` holds `want` tokens (0 if it does or has no cap)
+static double bucket_wait(const RateBucket* b, size_t want) {
+    if (b->rate <= 0 || b->tokens >= (double) want) return 0;
+    return ((double) want - b->tokens) / b->rate;
+}
+
+static double flow_weight(const TransferFlow* f) {
+    if (f->expected < 0) return 1.0;
+    long long remaining = f->expected - f->received;
+    if (remaining <= 0) return TRANSFER_RATE_MAX_WEIGHT;
+    double w = (double) TRANSFER_RATE_FAIR_BYTES / (double) remaining;
+    if (w < 1.0) return 1.0;
+    return w > TRANSFER_RATE_MAX_WEIGHT ? TRANSFER_RATE_MAX_WEIGHT : w;
+}
+
+// Caller holds rate_lock
+static double flow_wait(const TransferFlow* f, size_t want) {
+    double global_wait = bucket_wait(&global_bucket, want);
+    double host_wait = f->host ? bucket_wait(&f->host->bucket, want) : 0;
+    return global_wait > host_wait ? global_wait : host_wait;
+}
+
+// Caller holds rate_lock
+static RateHost* host_lookup(const char* key) {
+    for (RateHost* h = hosts; h; h = h->next) {
+        if (strcmp(h->key, key) == 0) return h;
+    }
+    RateHost* h = calloc(1, sizeof(*h));
+    if (!h) return NULL;
+    snprintf(h->key, sizeof(h->key), "%s", key);
+    bucket_init(&h->bucket, host_cap);
+    h->next = hosts;
+    hosts = h;
+    return h;
+}
+
+static void add_seconds(struct timespec* ts, double seconds) {
+    long long ns = (long long) (seconds * 1e9);
+    ts->tv_sec += ns / 1000000000LL;
+    ts->tv_nsec += ns % 1000000000LL;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+void transfer_rate_configure(long long global_rate, long long host_rate) {
+    pthread_mutex_lock(&rate_lock);
+    bucket_init(&global_bucket, global_rate > 0 ? global_rate : 0);
+    host_cap = host_rate > 0 ? host_rate : 0;
+    pthread_mutex_unlock(&rate_lock);
+}
+
+int transfer_rate_enabled(void) {
+    return global_bucket.rate > 0 || host_cap > 0;
+}
+
+TransferFlow* transfer_rate_join(int data_sockfd, long long expected_bytes) {
+    struct sockaddr_storage peer;
+    socklen_t peer_len = sizeof(peer);
+    char key[RATE_HOST_KEY_LEN] = "?";
+
+    if (!transfer_rate_enabled()) return NULL;
+    if (getpeername(data_sockfd, (struct sockaddr *) &peer, &peer_len) == 0) {
+        getnameinfo((struct sockaddr *) &peer, peer_len, key, sizeof(key), NULL, 0, NI_NUMERICHOST);
+    }
+
+    TransferFlow* flow = calloc(1, sizeof(*flow));
+    if (!flow) {
+        ftp_log_perror("calloc failed");
+        return NULL;
+    }
+    flow->expected = expected_bytes;
+
+    pthread_mutex_lock(&rate_lock);
+    flow->host = host_lookup(key);
+    // Start level with the flows already running, so a newcomer gets no back credit
+    flow->vtime = vclock;
+    for (TransferFlow* f = flows; f; f = f->next) {
+        if (f == flows || f->vtime < flow->vtime) flow->vtime = f->vtime;
+    }
+    flow->next = flows;
+    flows = flow;
+    pthread_mutex_unlock(&rate_lock);
+    return flow;
+}
+
+size_t transfer_rate_acquire(TransferFlow* flow, size_t want) {
+    if (!flow || want == 0) return want;
+    if (want > TRANSFER_RATE_QUANTUM) want = TRANSFER_RATE_QUANTUM;
+
+    pthread_mutex_lock(&rate_lock);
+    double started = monotonic_seconds();
+    flow->want = want;
+    for (;;) {
+        double now = monotonic_seconds();
+        bucket_refill(&global_bucket, now);
+        if (flow->host) bucket_refill(&flow->host->bucket, now);
+
+        double wait = flow_wait(flow, want);
+        if (wait == 0) {
+            // Tokens are there; take them only if no waiter that could also go
+            // now is further behind in virtual time
+            int first = 1;
+            for (TransferFlow* f = flows; f; f = f->next) {
+                if (f == flow || f->want == 0 || f->vtime >= flow->vtime) continue;
+                if (f->host) bucket_refill(&f->host->bucket, now);
+                if (flow_wait(f, f->want) == 0) {
+                    first = 0;
+                    break;
+                }
+            }
+            if (first) break;
+            wait = 0.001; // The other waiter goes first; look again after it took its share
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        add_seconds(&deadline, wait < 0.001 ? 0.001 : wait);
+        int rc = pthread_cond_timedwait(&rate_cond, &rate_lock, &deadline);
+        if (rc != 0 && rc != ETIMEDOUT) break;
+    }
+    if (global_bucket.rate > 0) global_bucket.tokens -= (double) want;
+    if (flow->host && flow->host->bucket.rate > 0) flow->host->bucket.tokens -= (double) want;
+    flow->want = 0;
+    flow->throttled += monotonic_seconds() - started;
+    pthread_mutex_unlock(&rate_lock);
+    return want;
+}
+
+void transfer_rate_charge(TransferFlow* flow, size_t granted, size_t used) {
+    if (!flow) return;
+    double unused = used < granted ? (double) (granted - used) : 0;
+
+    pthread_mutex_lock(&rate_lock);
+    if (global_bucket.rate > 0) global_bucket.tokens += unused;
+    if (flow->host && flow->host->bucket.rate > 0) flow->host->bucket.tokens += unused;
+    if (used > 0) {
+        double now = monotonic_seconds();
+        flow->vtime += (double) used / flow_weight(flow);
+        flow->received += (long long) used;
+        if (flow->host) {
+            if (flow->host->bytes == 0) flow->host->first = now;
+            flow->host->bytes += (long long) used;
+            flow->host->last = now;
+        }
+        if (global_bytes == 0) global_first = now;
+        global_bytes += (long long) used;
+        global_last = now;
+    }
+    pthread_cond_broadcast(&rate_cond);
+    pthread_mutex_unlock(&rate_lock);
+}
+
+void transfer_rate_leave(TransferFlow* flow, double* throttled_seconds) {
+    if (throttled_seconds) *throttled_seconds = flow ? flow->throttled : 0;
+    if (!flow) return;
+
+    pthread_mutex_lock(&rate_lock);
+    for (TransferFlow** p = &flows; *p; p = &(*p)->next) {
+        if (*p == flow) {
+            *p = flow->next;
+            break;
+        }
+    }
+    if (flow->vtime > vclock) vclock = flow->vtime;
+    pthread_cond_broadcast(&rate_cond);
+    pthread_mutex_unlock(&rate_lock);
+    free(flow);
+}
+
+static double average_rate(long long bytes, double first, double last) {
+    return last > first ? (double) bytes / (last - first) : 0;
+}
+
+void transfer_rate_print_summary(void) {
+    if (!transfer_rate_enabled()) return;
+
+    pthread_mutex_lock(&rate_lock);
+    printf("Rate caps: global ");
+    if (global_bucket.rate > 0) printf("%.2f MB/s", global_bucket.rate / (1024.0 * 1024.0));
+    else printf("none");
+    printf(", per host ");
+    if (host_cap > 0) printf("%.2f MB/s\n", host_cap / (1024.0 * 1024.0));
+    else printf("none\n");
+    printf("  all hosts: %lld bytes at %.2f MB/s\n", global_bytes,
+           average_rate(global_bytes, global_first, global_last) / (1024.0 * 1024.0));
+    for (RateHost* h = hosts; h; h = h->next) {
+        printf("  %s: %lld bytes at %.2f MB/s\n", h->key, h->bytes,
+               average_rate(h->bytes, h->first, h->last) / (1024.0 * 1024.0));
+    }
+    pthread_mutex_unlock(&rate_lock);
+}
+
+long long transfer_parse_rate(const char* text) {
+    char* end;
+    errno = 0;
+    double rate = strtod(text, &end);
+    if (errno != 0 || end == text || rate < 0) return -1;
+    switch (*end) {
+    case 'K': case 'k': rate *= 1024.0; end++; break;
+    case 'M': case 'm': rate *= 1024.0 * 1024.0; end++; break;
+    case 'G': case 'g': rate *= 1024.0 * 1024.0 * 1024.0; end++; break;
+    default: break;
+    }
+    if (*end != '\0') return -1;
+    return (long long) rate;
+}
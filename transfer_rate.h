@@ -0,0 +1,72 @@
+#ifndef TRANSFER_RATE_H
+#define TRANSFER_RATE_H
+
+#include <stddef.h> // For size_t
+
+#define TRANSFER_RATE_QUANTUM (64 * 1024)   // Most bytes one grant lets a transfer read
+#define TRANSFER_RATE_BURST_SECONDS 0.05    // Bucket depth, in seconds of its rate (at least one quantum)
+#define TRANSFER_RATE_FAIR_BYTES (16LL * 1024 * 1024) // Transfers with less left than this get a bigger share
+#define TRANSFER_RATE_MAX_WEIGHT 16.0
+
+// One transfer registered with the scheduler
+typedef struct TransferFlow TransferFlow;
+
+/**
+ * Sets the bandwidth caps: a token bucket for all transfers together and one
+ * per server address. Call before any transfer starts.
+ * @param global_rate Bytes/s for everything (0 = no cap).
+ * @param host_rate Bytes/s per server address (0 = no cap).
+ */
+void transfer_rate_configure(long long global_rate, long long host_rate);
+
+/**
+ * Returns non-zero if a cap is configured.
+ */
+int transfer_rate_enabled(void);
+
+/**
+ * Registers a transfer. Its share of a constrained bucket is weighted by what
+ * it still has to receive: a transfer with less than TRANSFER_RATE_FAIR_BYTES
+ * left gets up to TRANSFER_RATE_MAX_WEIGHT times the share of a large one
+ * (start-time fair queueing on bytes / weight), so small files finish quickly
+ * and large ones use what is left over.
+ * @param data_sockfd The data connection (its peer address selects the host bucket).
+ * @param expected_bytes Bytes the transfer will receive, or -1 if unknown.
+ * @return The flow, or NULL if no cap is configured (all calls accept NULL).
+ */
+TransferFlow* transfer_rate_join(int data_sockfd, long long expected_bytes);
+
+/**
+ * Waits until the flow may read and reserves up to TRANSFER_RATE_QUANTUM bytes.
+ * @param flow The flow (NULL returns `want` at once).
+ * @param want Bytes the caller would like to read.
+ * @return Bytes it may read now (at least 1 if want > 0).
+ */
+size_t transfer_rate_acquire(TransferFlow* flow, size_t want);
+
+/**
+ * Settles a grant: `used` bytes were received out of `granted`; the rest is
+ * returned to the buckets.
+ */
+void transfer_rate_charge(TransferFlow* flow, size_t granted, size_t used);
+
+/**
+ * Unregisters a flow.
+ * @param flow The flow (may be NULL).
+ * @param throttled_seconds Set to the time the flow spent waiting for tokens (may be NULL).
+ */
+void transfer_rate_leave(TransferFlow* flow, double* throttled_seconds);
+
+/**
+ * Prints the configured caps and the average rate each host and the whole
+ * process got while transfers were running.
+ */
+void transfer_rate_print_summary(void);
+
+/**
+ * Parses a rate such as "500K", "12.5M" or "1G" (bytes/s, binary multiples).
+ * @return The rate, or -1 if it cannot be parsed.
+ */
+long long transfer_parse_rate(const char* text);
+
+#endif // TRANSFER_RATE_H
@@ -0,0 +1,303 @@
+#define _GNU_SOURCE
+#include "transfer_uring.h"
+#include "data_transfer.h" // For monotonic_seconds
+#include "ftp_progress.h"
+#include "ftp_log.h"
+
+#include <stdint.h>         // For uintptr_t
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>        // For struct iovec
+#include <sys/socket.h>     // For MSG_WAITALL
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES 32    // SQ size; at most TRANSFER_URING_BUFFERS requests are ever queued
+
+// Minimal ring: just the fields the copy loop needs
+typedef struct {
+    int fd;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned pending;       // SQEs queued but not yet submitted
+} Uring;
+
+typedef enum {
+    BUF_FREE,
+    BUF_RECV,
+    BUF_WRITE
+} BufState;
+
+typedef struct {
+    BufState state;
+    size_t len;             // Bytes received into the buffer
+    size_t written;         // Bytes of it already on disk
+    long long file_off;     // Where the buffer's bytes go
+} UringBuf;
+
+static int uring_setup(Uring* ring) {
+    struct io_uring_params params;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int) syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring->fd < 0) return -1;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) goto fail;
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) goto fail;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) goto fail;
+
+    char* sq = ring->sq_ring;
+    char* cq = ring->cq_ring;
+    ring->sq_head = (unsigned*) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*) (sq + params.sq_off.array);
+    ring->cq_head = (unsigned*) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+    return 0;
+
+fail:
+    if (ring->sqes && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring && ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    return -1;
+}
+
+static void uring_teardown(Uring* ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+// Queues one receive or fixed-buffer write; op_flags are the opcode's own
+// (msg_flags for a receive). Returns 0, or -1 if the SQ is full.
+static int uring_queue(Uring* ring, int opcode, int fd, void* addr, unsigned len, long long off,
+                       int buf_index, unsigned char flags, unsigned op_flags, unsigned long long user_data) {
+    unsigned tail = *ring->sq_tail;
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head >= URING_ENTRIES) return -1;
+
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (unsigned char) opcode;
+    sqe->flags = flags;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long long) (uintptr_t) addr;
+    sqe->len = len;
+    sqe->off = (unsigned long long) off;
+    sqe->rw_flags = op_flags;
+    sqe->buf_index = (unsigned short) buf_index;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->pending++;
+    return 0;
+}
+
+// Submits what is queued and waits for at least one completion.
+static int uring_submit_and_wait(Uring* ring) {
+    for (;;) {
+        int ret = (int) syscall(__NR_io_uring_enter, ring->fd, ring->pending, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret >= 0) {
+            ring->pending -= (unsigned) ret < ring->pending ? (unsigned) ret : ring->pending;
+            return 0;
+        }
+        if (errno != EINTR) {
+            ftp_log_perror("io_uring_enter");
+            return -1;
+        }
+    }
+}
+
+// Encodes the buffer and operation in user_data
+#define URING_TAG(buf, is_write) (((unsigned long long) (buf) << 1) | (is_write))
+
+int transfer_uring_copy(int data_sockfd, int out_fd, long long* offset, long long length,
+                        long long* total, double* first_byte_at,
+                        void (*on_bytes)(void* ctx, const char* data, long long bytes), void* ctx) {
+    Uring ring;
+    UringBuf bufs[TRANSFER_URING_BUFFERS];
+    struct iovec iov[TRANSFER_URING_BUFFERS];
+    char* memory;
+    long long received = 0;      // Bytes received by this call
+    long long next_off = *offset;
+    int recv_inflight = 0, write_inflight = 0;
+    int eof = 0, status = 0, unsupported = 0;
+
+    if (uring_setup(&ring) < 0) {
+        return 1;
+    }
+    memory = aligned_alloc(4096, (size_t) TRANSFER_URING_BUFFERS * TRANSFER_URING_BUF_SIZE);
+    if (!memory) {
+        ftp_log_perror("aligned_alloc io_uring buffers");
+        uring_teardown(&ring);
+        return 1;
+    }
+    for (int i = 0; i < TRANSFER_URING_BUFFERS; i++) {
+        iov[i].iov_base = memory + (size_t) i * TRANSFER_URING_BUF_SIZE;
+        iov[i].iov_len = TRANSFER_URING_BUF_SIZE;
+        bufs[i].state = BUF_FREE;
+    }
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, iov, TRANSFER_URING_BUFFERS) < 0) {
+        ftp_log_perror("io_uring_register buffers");
+        free(memory);
+        uring_teardown(&ring);
+        return 1;
+    }
+
+    for (;;) {
+        // Start a new chain of receives once the previous one has fully completed:
+        // the links keep them in order, and data only ever lands in chain order.
+        // MSG_WAITALL fills each buffer before the next receive starts, so only
+        // the end of the stream completes one short (which cancels the rest).
+        if (!eof && recv_inflight == 0 && status == 0 && (length < 0 || received < length)) {
+            int chain[TRANSFER_URING_RECV_DEPTH];
+            int n = 0;
+            long long remaining = length < 0 ? -1 : length - received;
+            for (int i = 0; i < TRANSFER_URING_BUFFERS && n < TRANSFER_URING_RECV_DEPTH; i++) {
+                if (bufs[i].state != BUF_FREE) continue;
+                if (remaining == 0) break;
+                size_t len = TRANSFER_URING_BUF_SIZE;
+                if (remaining > 0 && (long long) len > remaining) len = (size_t) remaining;
+                if (remaining > 0) remaining -= len;
+                bufs[i].len = len; // Requested for now, replaced by the received count
+                chain[n++] = i;
+            }
+            for (int k = 0; k < n; k++) {
+                int i = chain[k];
+                unsigned char flags = (k < n - 1) ? IOSQE_IO_LINK : 0;
+                if (uring_queue(&ring, IORING_OP_RECV, data_sockfd, iov[i].iov_base, (unsigned) bufs[i].len,
+                                0, 0, flags, MSG_WAITALL, URING_TAG(i, 0)) < 0) {
+                    break; // Cannot happen with URING_ENTRIES > TRANSFER_URING_BUFFERS
+                }
+                bufs[i].state = BUF_RECV;
+                recv_inflight++;
+            }
+        }
+        if (recv_inflight == 0 && write_inflight == 0) break;
+
+        if (uring_submit_and_wait(&ring) < 0) {
+            status = -1;
+            break;
+        }
+
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe* cqe = &ring.cqes[head & *ring.cq_mask];
+            int i = (int) (cqe->user_data >> 1);
+            int is_write = (int) (cqe->user_data & 1);
+            int res = cqe->res;
+            UringBuf* b = &bufs[i];
+
+            if (!is_write) {
+                recv_inflight--;
+                if (res == -ECANCELED || (res < 0 && eof)) {
+                    b->state = BUF_FREE; // Chain broken by a short read or EOF before it
+                    continue;
+                }
+                if (res == -EINVAL && received == 0) {
+                    unsupported = 1; // Kernel without IORING_OP_RECV (before 5.6)
+                    b->state = BUF_FREE;
+                    status = -1;
+                    continue;
+                }
+                if (res < 0) {
+                    errno = -res;
+                    ftp_log_perror("io_uring receive from data socket");
+                    b->state = BUF_FREE;
+                    status = -1;
+                    continue;
+                }
+                if (res == 0) {
+                    eof = 1;
+                    b->state = BUF_FREE;
+                    continue;
+                }
+                if (*first_byte_at == 0) *first_byte_at = monotonic_seconds();
+                b->len = (size_t) res;
+                b->written = 0;
+                b->file_off = next_off;
+                next_off += res;
+                received += res;
+                *total += res;
+                ftp_progress_add(res);
+                if (on_bytes) on_bytes(ctx, iov[i].iov_base, res);
+                if (length >= 0 && received >= length) eof = 1;
+            } else {
+                write_inflight--;
+                if (res <= 0) {
+                    if (res < 0) errno = -res;
+                    ftp_log_perror("io_uring write to local file");
+                    b->state = BUF_FREE;
+                    status = -1;
+                    continue;
+                }
+                b->written += (size_t) res;
+                if (b->written == b->len) {
+                    b->state = BUF_FREE;
+                    continue;
+                }
+            }
+            // Received (or partly written): queue the rest of the buffer to disk
+            if (status == 0 &&
+                uring_queue(&ring, IORING_OP_WRITE_FIXED, out_fd, (char*) iov[i].iov_base + b->written,
+                            (unsigned) (b->len - b->written), b->file_off + (long long) b->written, i, 0, 0,
+                            URING_TAG(i, 1)) == 0) {
+                b->state = BUF_WRITE;
+                write_inflight++;
+            } else {
+                b->state = BUF_FREE;
+            }
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+        if (status < 0 && recv_inflight == 0 && write_inflight == 0) break;
+    }
+
+    syscall(__NR_io_uring_register, ring.fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+    free(memory);
+    uring_teardown(&ring);
+    *offset = next_off;
+    return unsupported ? 1 : status;
+}
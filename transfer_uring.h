@@ -0,0 +1,30 @@
+#ifndef TRANSFER_URING_H
+#define TRANSFER_URING_H
+
+#define TRANSFER_URING_BUFFERS 16             // Registered buffers (receives + writes in flight)
+#define TRANSFER_URING_BUF_SIZE (256 * 1024)  // Bytes per registered buffer
+#define TRANSFER_URING_RECV_DEPTH 4           // Linked receives queued back to back on the socket
+
+/**
+ * Copies a data connection into a file with io_uring, using raw syscalls (no
+ * liburing). A chain of TRANSFER_URING_RECV_DEPTH linked MSG_WAITALL receives
+ * keeps the socket busy (each fills its buffer, so the chain only breaks at
+ * the end of the stream) while earlier buffers are written to the file at
+ * explicit offsets with fixed-buffer writes, all from TRANSFER_URING_BUFFERS
+ * registered buffers, so network and disk overlap on one thread.
+ * @param data_sockfd The data connection socket.
+ * @param out_fd The output file descriptor (must be seekable).
+ * @param offset In: file offset to start at; out: offset after the last byte.
+ * @param length Number of bytes to copy, or -1 to copy until the server closes.
+ * @param total Incremented by the number of bytes copied.
+ * @param first_byte_at Set to monotonic_seconds() of the first byte if still 0.
+ * @param on_bytes Called with each received buffer, in stream order (may be NULL).
+ * @param ctx Passed to on_bytes.
+ * @return 0 on success, 1 if io_uring is not available before any byte was
+ *         read (the caller should use another copy loop), -1 on failure.
+ */
+int transfer_uring_copy(int data_sockfd, int out_fd, long long* offset, long long length,
+                        long long* total, double* first_byte_at,
+                        void (*on_bytes)(void* ctx, const char* data, long long bytes), void* ctx);
+
+#endif // TRANSFER_URING_H
@@ -1,4 +1,5 @@
 #include "url_parser.h"
+#include "ftp_log.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h> // For atoi
@@ -22,7 +23,7 @@ int parse_ftp_url(const char* url_string, ParsedUrl* parsed_url) {
     if (strncmp(current_pos, "ftp://", 6) == 0) {
         current_pos += 6;
     } else {
-        fprintf(stderr, "Error: URL must start with ftp://\n");
+        ftp_log_error("Error: URL must start with ftp://\n");
         return -1;
     }
 
@@ -36,7 +37,7 @@ int parse_ftp_url(const char* url_string, ParsedUrl* parsed_url) {
         size_t user_pass_part_len = at_symbol - current_pos;
 
         if (user_pass_part_len >= sizeof(user_pass_part)) {
-            fprintf(stderr, "Error: User/password string part too long.\n");
+            ftp_log_error("Error: User/password string part too long.\n");
             return -1;
         }
         strncpy(user_pass_part, current_pos, user_pass_part_len);
@@ -48,21 +49,21 @@ int parse_ftp_url(const char* url_string, ParsedUrl* parsed_url) {
         if (colon_symbol) { // Found user:pass
             size_t user_len = colon_symbol - user_pass_part;
             if (user_len >= MAX_USER_LEN) {
-                 fprintf(stderr, "Error: Username too long.\n"); return -1;
+                 ftp_log_error("Error: Username too long.\n"); return -1;
             }
             strncpy(parsed_url->user, user_pass_part, user_len);
             parsed_url->user[user_len] = '\0';
 
             // The rest is password
             if (strlen(colon_symbol + 1) >= MAX_PASS_LEN) {
-                fprintf(stderr, "Error: Password too long.\n"); return -1;
+                ftp_log_error("Error: Password too long.\n"); return -1;
             }
             strncpy(parsed_url->pass, colon_symbol + 1, MAX_PASS_LEN -1);
             parsed_url->pass[MAX_PASS_LEN -1] = '\0';
 
         } else { // Only username provided
             if (strlen(user_pass_part) >= MAX_USER_LEN) {
-                 fprintf(stderr, "Error: Username too long.\n"); return -1;
+                 ftp_log_error("Error: Username too long.\n"); return -1;
             }
             strncpy(parsed_url->user, user_pass_part, MAX_USER_LEN -1);
             parsed_url->user[MAX_USER_LEN -1] = '\0';
@@ -78,13 +79,13 @@ int parse_ftp_url(const char* url_string, ParsedUrl* parsed_url) {
     if (path_slash) { // Path is present
         size_t host_port_part_len = path_slash - host_start;
         if (host_port_part_len >= sizeof(host_port_part)) {
-            fprintf(stderr, "Error: Host/port string part too long.\n"); return -1;
+            ftp_log_error("Error: Host/port string part too long.\n"); return -1;
         }
         strncpy(host_port_part, host_start, host_port_part_len);
         host_port_part[host_port_part_len] = '\0';
 
         if (strlen(path_slash + 1) >= MAX_PATH_LEN) { // +1 to skip the slash itself
-            fprintf(stderr, "Error: Path too long.\n"); return -1;
+            ftp_log_error("Error: Path too long.\n"); return -1;
         }
         strncpy(parsed_url->path, path_slash + 1, MAX_PATH_LEN -1);
         parsed_url->path[MAX_PATH_LEN -1] = '\0';
@@ -94,7 +95,7 @@ int parse_ftp_url(const char* url_string, ParsedUrl* parsed_url) {
         }
     } else { // No path component after host (e.g., ftp://host or ftp://host:port)
         if (strlen(host_start) >= sizeof(host_port_part)) {
-            fprintf(stderr, "Error: Host/port string part too long.\n"); return -1;
+            ftp_log_error("Error: Host/port string part too long.\n"); return -1;
         }
         strcpy(host_port_part, host_start);
         // Default path or error? For a download, a path is usually needed.
@@ -106,22 +107,40 @@ int parse_ftp_url(const char* url_string, ParsedUrl* parsed_url) {
 
     // Now, from host_port_part, extract host and optional port
     char* colon_in_host = strrchr(host_port_part, ':');
+    if (host_port_part[0] == '[') { // IPv6 literal: [addr] or [addr]:port
+        char* close_bracket = strchr(host_port_part, ']');
+        if (!close_bracket || (close_bracket[1] != '\0' && close_bracket[1] != ':')) {
+            ftp_log_error("Error: Malformed IPv6 address in URL.\n"); return -1;
+        }
+        size_t host_len = close_bracket - host_port_part - 1;
+        if (host_len >= MAX_HOST_LEN) {
+             ftp_log_error("Error: Hostname too long.\n"); return -1;
+        }
+        memmove(host_port_part, host_port_part + 1, host_len);
+        host_port_part[host_len] = '\0';
+        colon_in_host = close_bracket[1] == ':' ? close_bracket + 1 : NULL;
+        if (colon_in_host) {
+            // Shift ":port" right behind the host so the code below sees "host:port"
+            memmove(host_port_part + host_len, colon_in_host, strlen(colon_in_host) + 1);
+            colon_in_host = host_port_part + host_len;
+        }
+    }
     if (colon_in_host) { // Port is specified
         size_t host_len = colon_in_host - host_port_part;
         if (host_len >= MAX_HOST_LEN) {
-             fprintf(stderr, "Error: Hostname too long.\n"); return -1;
+             ftp_log_error("Error: Hostname too long.\n"); return -1;
         }
         strncpy(parsed_url->host, host_port_part, host_len);
         parsed_url->host[host_len] = '\0';
 
         parsed_url->port = atoi(colon_in_host + 1);
         if (parsed_url->port <= 0 || parsed_url->port > 65535) {
-            fprintf(stderr, "Error: Invalid port number '%s'\n", colon_in_host + 1);
+            ftp_log_error("Error: Invalid port number '%s'\n", colon_in_host + 1);
             return -1;
         }
     } else { // No port specified, use default
         if (strlen(host_port_part) >= MAX_HOST_LEN) {
-             fprintf(stderr, "Error: Hostname too long.\n"); return -1;
+             ftp_log_error("Error: Hostname too long.\n"); return -1;
         }
         strncpy(parsed_url->host, host_port_part, MAX_HOST_LEN -1);
         parsed_url->host[MAX_HOST_LEN -1] = '\0';
@@ -129,7 +148,7 @@ int parse_ftp_url(const char* url_string, ParsedUrl* parsed_url) {
     }
 
     if (strlen(parsed_url->host) == 0) {
-        fprintf(stderr, "Error: Hostname cannot be empty.\n");
+        ftp_log_error("Error: Hostname cannot be empty.\n");
         return -1;
     }
 